@@ -31,8 +31,13 @@
  * @brief   Provides an interface to pthread or windows (native pmutex or CRITICAL_SECTION) mutexes.
  */
 
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* pthread_rwlockattr_setkind_np() */
+#endif
+
 #include <errno.h>
 #include <assert.h>
+#include <stdlib.h>
 #include "mutex.h"
 
 /*
@@ -42,10 +47,32 @@
 	waiting for a pmutex that it already owns. The thread enters the protected section each time
 	mutex_lock is called. A thread must call mutex_unlock once for each time that it entered
 	the protected section.	
+
+	The reader/writer locks are not recursive. They are meant for read-mostly data like
+	the handle tables, where many threads look up entries concurrently and only a few
+	threads add or remove entries. A thread must never acquire a lock it already holds.
+	Locks initialized with rwlock_init_writer let a waiting writer block new readers,
+	so a steady stream of readers can not starve a writer.
+
+	A monitor is a non-recursive lock with a condition. A thread owning the monitor can
+	wait until another thread changes the protected state and calls monitor_broadcast.
+	Waiting releases the monitor and reacquires it before monitor_wait returns.
+
+	Threads are started with thread_create and must be joined with thread_join, which
+	releases all resources of the thread.
 */
 
 #ifndef DUMMY_MUTEX
 
+struct threadStart {
+	void (*func)(void *);
+	void *arg;
+};
+
+#endif
+
+#ifndef DUMMY_MUTEX
+
 #ifndef _WIN32
 
 int mutex_init(MUTEX *pmutex)
@@ -98,6 +125,151 @@ int mutex_unlock(MUTEX *pmutex)
 	return pthread_mutex_unlock(&pmutex->mutex);
 }
 
+int rwlock_init(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return ENOMEM;
+	return pthread_rwlock_init(plock, NULL);
+}
+
+int rwlock_init_writer(RWLOCK *plock)
+{
+#ifdef __GLIBC__
+	int rc;
+	pthread_rwlockattr_t lockAttr;
+	if (plock == NULL)
+		return ENOMEM;
+	rc = pthread_rwlockattr_init(&lockAttr);
+	if (rc)
+		return rc;
+	rc = pthread_rwlockattr_setkind_np(&lockAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	if (rc == 0)
+		rc = pthread_rwlock_init(plock, &lockAttr);
+	pthread_rwlockattr_destroy(&lockAttr);
+	return rc;
+#else
+	/* most other implementations prefer writers by default */
+	return rwlock_init(plock);
+#endif
+}
+
+int rwlock_destroy(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_destroy(plock);
+}
+
+int rwlock_rdlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_rdlock(plock);
+}
+
+int rwlock_wrlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_wrlock(plock);
+}
+
+int rwlock_rdunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_unlock(plock);
+}
+
+int rwlock_wrunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return EINVAL;
+	return pthread_rwlock_unlock(plock);
+}
+
+int monitor_init(MONITOR *pmon)
+{
+	int rc;
+	if (pmon == NULL)
+		return ENOMEM;
+	rc = pthread_mutex_init(&pmon->lock, NULL);
+	if (rc)
+		return rc;
+	rc = pthread_cond_init(&pmon->cond, NULL);
+	if (rc)
+		pthread_mutex_destroy(&pmon->lock);
+	return rc;
+}
+
+int monitor_destroy(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return EINVAL;
+	pthread_cond_destroy(&pmon->cond);
+	return pthread_mutex_destroy(&pmon->lock);
+}
+
+int monitor_enter(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return EINVAL;
+	return pthread_mutex_lock(&pmon->lock);
+}
+
+int monitor_exit(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return EINVAL;
+	return pthread_mutex_unlock(&pmon->lock);
+}
+
+int monitor_wait(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return EINVAL;
+	return pthread_cond_wait(&pmon->cond, &pmon->lock);
+}
+
+int monitor_broadcast(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return EINVAL;
+	return pthread_cond_broadcast(&pmon->cond);
+}
+
+static void *threadStart(void *p)
+{
+	struct threadStart start = *(struct threadStart *)p;
+	free(p);
+	start.func(start.arg);
+	return NULL;
+}
+
+int thread_create(THREAD *pthread, void (*func)(void *), void *arg)
+{
+	struct threadStart *start;
+	int rc;
+	if (pthread == NULL || func == NULL)
+		return EINVAL;
+	start = (struct threadStart *)malloc(sizeof(struct threadStart));
+	if (start == NULL)
+		return ENOMEM;
+	start->func = func;
+	start->arg = arg;
+	rc = pthread_create(pthread, NULL, threadStart, start);
+	if (rc)
+		free(start);
+	return rc;
+}
+
+int thread_join(THREAD *pthread)
+{
+	if (pthread == NULL)
+		return EINVAL;
+	return pthread_join(*pthread, NULL);
+}
+
 #else /* _WIN32 */
 #include <windows.h>
 
@@ -151,6 +323,145 @@ int mutex_unlock(MUTEX *pmutex)
 	return 0;
 }
 
+int rwlock_init(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	InitializeSRWLock(plock);
+	return 0;
+}
+
+int rwlock_init_writer(RWLOCK *plock)
+{
+	/* slim reader/writer locks do not let readers overtake a waiting writer */
+	return rwlock_init(plock);
+}
+
+int rwlock_destroy(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	return 0; /* slim reader/writer locks need no cleanup */
+}
+
+int rwlock_rdlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	AcquireSRWLockShared(plock);
+	return 0;
+}
+
+int rwlock_wrlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	AcquireSRWLockExclusive(plock);
+	return 0;
+}
+
+int rwlock_rdunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	ReleaseSRWLockShared(plock);
+	return 0;
+}
+
+int rwlock_wrunlock(RWLOCK *plock)
+{
+	if (plock == NULL)
+		return E_POINTER;
+	ReleaseSRWLockExclusive(plock);
+	return 0;
+}
+
+int monitor_init(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	InitializeSRWLock(&pmon->lock);
+	InitializeConditionVariable(&pmon->cond);
+	return 0;
+}
+
+int monitor_destroy(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	return 0; /* neither slim reader/writer locks nor condition variables need cleanup */
+}
+
+int monitor_enter(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	AcquireSRWLockExclusive(&pmon->lock);
+	return 0;
+}
+
+int monitor_exit(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	ReleaseSRWLockExclusive(&pmon->lock);
+	return 0;
+}
+
+int monitor_wait(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	if (!SleepConditionVariableSRW(&pmon->cond, &pmon->lock, INFINITE, 0))
+		return GetLastError();
+	return 0;
+}
+
+int monitor_broadcast(MONITOR *pmon)
+{
+	if (pmon == NULL)
+		return E_POINTER;
+	WakeAllConditionVariable(&pmon->cond);
+	return 0;
+}
+
+static DWORD WINAPI threadStart(LPVOID p)
+{
+	struct threadStart start = *(struct threadStart *)p;
+	free(p);
+	start.func(start.arg);
+	return 0;
+}
+
+int thread_create(THREAD *pthread, void (*func)(void *), void *arg)
+{
+	struct threadStart *start;
+	if (pthread == NULL || func == NULL)
+		return E_POINTER;
+	start = (struct threadStart *)malloc(sizeof(struct threadStart));
+	if (start == NULL)
+		return E_OUTOFMEMORY;
+	start->func = func;
+	start->arg = arg;
+	*pthread = CreateThread(NULL, 0, threadStart, start, 0, NULL);
+	if (*pthread == NULL) {
+		free(start);
+		return GetLastError();
+	}
+	return 0;
+}
+
+int thread_join(THREAD *pthread)
+{
+	if (pthread == NULL)
+		return E_POINTER;
+	if (WaitForSingleObject(*pthread, INFINITE) == WAIT_FAILED)
+		return GetLastError();
+	if (!CloseHandle(*pthread))
+		return GetLastError();
+	return 0;
+}
+
 #endif /* _WIN32 */
 #else /* DUMMY_MUTEX */
 
@@ -160,4 +471,23 @@ int mutex_destroy(MUTEX *pmutex) { return !pmutex; }
 int mutex_lock(MUTEX *pmutex)    { return !pmutex; }
 int mutex_unlock(MUTEX *pmutex)  { return !pmutex; }
 
+int rwlock_init(RWLOCK *plock)      { return !plock; }
+int rwlock_init_writer(RWLOCK *plock) { return !plock; }
+int rwlock_destroy(RWLOCK *plock)   { return !plock; }
+int rwlock_rdlock(RWLOCK *plock)    { return !plock; }
+int rwlock_wrlock(RWLOCK *plock)    { return !plock; }
+int rwlock_rdunlock(RWLOCK *plock)  { return !plock; }
+int rwlock_wrunlock(RWLOCK *plock)  { return !plock; }
+
+int monitor_init(MONITOR *pmon)     { return !pmon; }
+int monitor_destroy(MONITOR *pmon)  { return !pmon; }
+int monitor_enter(MONITOR *pmon)    { return !pmon; }
+int monitor_exit(MONITOR *pmon)     { return !pmon; }
+int monitor_wait(MONITOR *pmon)     { return !pmon; }
+int monitor_broadcast(MONITOR *pmon) { return !pmon; }
+
+/* without threads the function runs in the calling thread */
+int thread_create(THREAD *pthread, void (*func)(void *), void *arg) { func(arg); return !pthread; }
+int thread_join(THREAD *pthread)    { return !pthread; }
+
 #endif /* DUMMY_MUTEX */
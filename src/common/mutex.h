@@ -48,9 +48,16 @@
 			pthread_t owner;
 			unsigned refcnt;
 		} MUTEX;
+		typedef pthread_rwlock_t RWLOCK;
+		typedef struct {
+			pthread_mutex_t lock;
+			pthread_cond_t cond;
+		} MONITOR;
+		typedef pthread_t THREAD;
 		#ifdef HAVE_SYNC_ADD_AND_FETCH
 			#define InterlockedIncrement(ptr) __sync_add_and_fetch((ptr), 1)
 			#define InterlockedDecrement(ptr) __sync_add_and_fetch((ptr), -1)
+			#define InterlockedAdd64(ptr, val) __sync_add_and_fetch((ptr), (val))
 		#else /* not thread-safe */
 			#error "Must implement InterlockedXXcrement macros"
 /*
@@ -59,6 +66,7 @@
 */
 			#define InterlockedIncrement(ptr) (++*(ptr))
 			#define InterlockedDecrement(ptr) (--*(ptr))
+			#define InterlockedAdd64(ptr, val) (*(ptr) += (val))
 		#endif
 		#define GetCurrentThreadId() pthread_self()
 	#else /* _WIN32 */
@@ -68,9 +76,18 @@
 			DWORD owner;
 			unsigned refcnt;
 		} MUTEX;
+		typedef SRWLOCK RWLOCK;
+		typedef struct {
+			SRWLOCK lock;
+			CONDITION_VARIABLE cond;
+		} MONITOR;
+		typedef HANDLE THREAD;
 	#endif
 #else
 	typedef int MUTEX;
+	typedef int RWLOCK;
+	typedef int MONITOR;
+	typedef int THREAD;
 #endif /* DUMMY_MUTEX */
 
 int mutex_init(MUTEX *pmutex);
@@ -79,4 +96,22 @@ int mutex_lock(MUTEX *pmutex);
 int mutex_unlock(MUTEX *pmutex);
 #define mutex_owner(pmutex) ((pmutex)->owner)
 
+int rwlock_init(RWLOCK *plock);
+int rwlock_init_writer(RWLOCK *plock);
+int rwlock_destroy(RWLOCK *plock);
+int rwlock_rdlock(RWLOCK *plock);
+int rwlock_wrlock(RWLOCK *plock);
+int rwlock_rdunlock(RWLOCK *plock);
+int rwlock_wrunlock(RWLOCK *plock);
+
+int monitor_init(MONITOR *pmon);
+int monitor_destroy(MONITOR *pmon);
+int monitor_enter(MONITOR *pmon);
+int monitor_exit(MONITOR *pmon);
+int monitor_wait(MONITOR *pmon);
+int monitor_broadcast(MONITOR *pmon);
+
+int thread_create(THREAD *pthread, void (*func)(void *), void *arg);
+int thread_join(THREAD *pthread);
+
 #endif /* ___MUTEX_H_INC___ */
@@ -46,7 +46,7 @@ static int mutexInitialized = 0;
 
 /* Handle up to 8 USB CCID readers */
 
-scr_t *readerTable[MAX_READER] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+scr_t *readerTable[MAX_READER] = { NULL };
 
 /*
  * Locate matching card terminal number in table of active readers.
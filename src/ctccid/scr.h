@@ -45,7 +45,7 @@
 /**
  * Maximum number of readers
  */
-#define MAX_READER  8
+#define MAX_READER  64
 
 /**
  * Maximum size of ATR
@@ -0,0 +1,182 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    cardqueue.c
+ * @brief   Fair per-slot queue for card operations
+ *
+ * Threads sharing a slot run host-side work concurrently, but the card executes one
+ * operation at a time. Without a queue the next operation is the one of whichever thread
+ * wins the card lock, so the wait time of a single request is unbounded while bulk jobs
+ * run on the same token.
+ *
+ * Operations are served in the order of arrival within each priority class. A thread
+ * draws a ticket of its class and waits until the class is selected and its ticket is
+ * the next one served in that class. High priority operations are selected first, but
+ * only CARD_QUEUE_HIGH_BURST times in a row while normal priority operations wait.
+ *
+ * The queue admits at most CARD_QUEUE_MAX_DEPTH waiting threads. Further operations
+ * are rejected rather than adding to the latency of all queued operations.
+ *
+ * The owner of the exclusive slot lock holds the card lock for the whole call and does
+ * not use the queue.
+ */
+
+#include <string.h>
+
+#include <pkcs11/cardqueue.h>
+#include <pkcs11/stats.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+
+
+/**
+ * Select the priority class served next
+ */
+static int nextClass(struct p11CardQueue_t *queue)
+{
+	if (queue->waiting[CARD_PRIORITY_HIGH] > 0) {
+		if ((queue->waiting[CARD_PRIORITY_NORMAL] == 0) || (queue->highInRow < CARD_QUEUE_HIGH_BURST)) {
+			return CARD_PRIORITY_HIGH;
+		}
+	}
+	return CARD_PRIORITY_NORMAL;
+}
+
+
+
+/**
+ * Initialize the card queue of a new slot
+ *
+ * @param slot      The slot
+ */
+void initCardQueue(struct p11Slot_t *slot)
+{
+	struct p11CardQueue_t *queue = &slot->cardQueue;
+
+	memset(queue, 0, sizeof(*queue));
+	MONITOR_INIT(&queue->monitor);
+}
+
+
+
+/**
+ * Release the resources of the card queue of a slot that is deleted
+ *
+ * @param slot      The slot
+ */
+void terminateCardQueue(struct p11Slot_t *slot)
+{
+	MONITOR_DESTROY(&slot->cardQueue.monitor);
+}
+
+
+
+/**
+ * Wait for the turn of the calling thread and acquire the card lock
+ *
+ * The caller must share the slot lock and must call endCardOperation() once the
+ * operation is complete, if this function returns CKR_OK.
+ *
+ * @param slot      The slot
+ * @param priority  CARD_PRIORITY_NORMAL or CARD_PRIORITY_HIGH
+ * @return          CKR_OK or CKR_FUNCTION_REJECTED if the queue is full
+ */
+int beginCardOperation(struct p11Slot_t *slot, int priority)
+{
+	struct p11CardQueue_t *queue = &slot->cardQueue;
+	unsigned long ticket;
+	long long start;
+
+	if (slot->exclusive) {
+		/* The exclusive owner holds the card lock already */
+		return CKR_OK;
+	}
+
+	start = statsClock();
+	MONITOR_ENTER(&queue->monitor);
+
+	if (queue->busy && (queue->waiting[CARD_PRIORITY_NORMAL] + queue->waiting[CARD_PRIORITY_HIGH] >= CARD_QUEUE_MAX_DEPTH)) {
+		MONITOR_EXIT(&queue->monitor);
+		InterlockedAdd64(&slot->stats.rejected, 1);
+#ifdef DEBUG
+		debug("Card queue of slot %lu is full\n", slot->id);
+#endif
+		return CKR_FUNCTION_REJECTED;
+	}
+
+	ticket = queue->nextTicket[priority]++;
+	queue->waiting[priority]++;
+
+	while (queue->busy || (nextClass(queue) != priority) || (queue->serving[priority] != ticket)) {
+		MONITOR_WAIT(&queue->monitor);
+	}
+
+	queue->waiting[priority]--;
+	queue->serving[priority]++;
+	queue->busy = TRUE;
+
+	if (priority == CARD_PRIORITY_HIGH) {
+		queue->highInRow++;
+	} else {
+		queue->highInRow = 0;
+	}
+
+	MONITOR_EXIT(&queue->monitor);
+
+	/* Only contended by short card accesses outside of the queue, e.g. presence checks */
+	MUTEX_LOCK(&slot->mutex);
+
+	InterlockedAdd64(&slot->stats.cardWaitTime, statsClock() - start);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Release the card lock and pass the turn to the next waiting thread
+ *
+ * @param slot      The slot
+ */
+void endCardOperation(struct p11Slot_t *slot)
+{
+	struct p11CardQueue_t *queue = &slot->cardQueue;
+
+	if (slot->exclusive) {
+		return;
+	}
+
+	MUTEX_UNLOCK(&slot->mutex);
+
+	MONITOR_ENTER(&queue->monitor);
+	queue->busy = FALSE;
+	MONITOR_BROADCAST(&queue->monitor);
+	MONITOR_EXIT(&queue->monitor);
+}
@@ -0,0 +1,61 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    cardqueue.h
+ * @brief   Fair per-slot queue for card operations
+ */
+
+#ifndef ___CARDQUEUE_H_INC___
+#define ___CARDQUEUE_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+/*
+ * Maximum number of threads waiting for the card in a slot. Further operations fail
+ * immediately with CKR_FUNCTION_REJECTED, so that callers can shed load.
+ */
+#ifndef CARD_QUEUE_MAX_DEPTH
+#define CARD_QUEUE_MAX_DEPTH    32
+#endif
+
+/*
+ * Number of high priority operations served in a row while normal priority operations
+ * are waiting. Afterwards one normal priority operation is served, so that bulk work
+ * makes progress even under a constant stream of interactive requests.
+ */
+#ifndef CARD_QUEUE_HIGH_BURST
+#define CARD_QUEUE_HIGH_BURST   4
+#endif
+
+void initCardQueue(struct p11Slot_t *slot);
+void terminateCardQueue(struct p11Slot_t *slot);
+int beginCardOperation(struct p11Slot_t *slot, int priority);
+void endCardOperation(struct p11Slot_t *slot);
+
+#endif /* ___CARDQUEUE_H_INC___ */
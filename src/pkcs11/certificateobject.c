@@ -413,3 +413,56 @@ int decodeECParamsFromSPKI(unsigned char *spki,
 
 	return 0;
 }
+
+
+
+/**
+ * Decode the public point of an EC key from the subject public key info
+ *
+ * The value is the plain point from the BIT STRING, not wrapped in an OCTET STRING as in CKA_EC_POINT.
+ *
+ * @param spki      the subject public key info
+ * @param ecpoint   the attribute pointing to the point within spki
+ * @return          0 or -1 if the encoding is invalid
+ */
+int decodeECPointFromSPKI(unsigned char *spki,
+                          CK_ATTRIBUTE_PTR ecpoint)
+{
+	int tag, length, buflen;
+	unsigned char *value, *cursor;
+
+	cursor = spki;				// spk is ASN.1 validated before, not need to check again
+
+	// subjectPublicKeyInfo
+	tag = asn1Tag(&cursor);
+
+	if (tag != ASN1_SEQUENCE) {
+		return -1;
+	}
+
+	buflen = asn1Length(&cursor);
+
+	// algorithm
+	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+		return -1;
+	}
+
+	if (tag != ASN1_SEQUENCE) {
+		return -1;
+	}
+
+	// subjectPublicKey
+	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+		return -1;
+	}
+
+	if ((tag != ASN1_BIT_STRING) || (length < 2) || (*value != 0)) {
+		return -1;
+	}
+
+	ecpoint->type = CKA_EC_POINT;
+	ecpoint->pValue = value + 1;
+	ecpoint->ulValueLen = length - 1;
+
+	return 0;
+}
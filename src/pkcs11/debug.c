@@ -31,25 +31,92 @@
  * @brief   Debug and logging functions
  */
 
-#ifdef DEBUG
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 
-#ifdef WIN32
+#ifdef _WIN32
 #include <io.h>
+#include <windows.h>
+#define usleep(us) Sleep((us) / 1000)
+#define MEMORY_BARRIER() MemoryBarrier()
+#else
+#include <unistd.h>
+#include <pthread.h>
+#define MEMORY_BARRIER() __sync_synchronize()
 #endif
 
+#include <pkcs11/p11generic.h>
 #include <pkcs11/debug.h>
 
-extern struct p11Context_t *context;
-
 #define bcddigit(x) ((x) >= 10 ? 'A' - 10 + (x) : '0' + (x))
 
+#define TRACE_APDU_BYTES	512		/* Maximum number of data bytes traced per APDU */
+
+#define LOG_LINE_SIZE		(64 + 2 * TRACE_APDU_BYTES + 64)	/* Maximum length of a log line */
+#define LOG_RECORD_TEXT		240		/* Characters per ring record, longer lines use consecutive records */
+#define LOG_RING_SIZE		1024		/* Records per ring, must be a power of 2 */
+#define LOG_MAX_RINGS		64		/* Threads with a ring, all others write through the log lock */
+#define LOG_FLUSH_INTERVAL	100		/* Milliseconds between two runs of the flusher */
+
+static const char defaultLogFile[] = "/var/tmp/sc-hsm-embedded/pkcs11.log";
+
+/*
+ * A log record as written by the logging thread and formatted by the flusher
+ */
+struct logRecord {
+	long long time;						/* Coarse time stamp in milliseconds */
+	char level;							/* Level of the record */
+	char more;							/* The line continues in the next record */
+	char text[LOG_RECORD_TEXT];
+};
+
+/*
+ * Single producer, single consumer ring of log records. Each ring is owned by one
+ * thread, which advances head. Only the flusher advances tail.
+ */
+struct logRing {
+	volatile unsigned long head;		/* Next record written by the owning thread */
+	volatile unsigned long tail;		/* Next record written to the file by the flusher */
+	volatile unsigned long dropped;		/* Lines lost because the ring was full */
+	unsigned long reported;				/* Lost lines already reported by the flusher */
+	volatile int owned;					/* A thread owns the ring */
+	int number;							/* Number of the ring shown in the log */
+	struct logRing *next;
+	struct logRecord record[LOG_RING_SIZE];
+};
+
+/*
+ * Current log level, LOG_LEVEL_OFF until initDebug has been called
+ */
+volatile int debugLevel = LOG_LEVEL_OFF;
+
+/*
+ * APDUs are traced at LOG_LEVEL_DEBUG, unless disabled with SC_HSM_TRACE_APDU=0
+ */
+int traceAPDUs = 0;
+
+static FILE *logFile = NULL;
+static MUTEX logLock;					/* Serializes writes to logFile and the ring list */
+static struct logRing *volatile rings = NULL;
+static int ringCount = 0;
+static volatile long long logClock;		/* Time stamp updated by the flusher */
+static int flusherRunning = 0;
+static volatile int flusherStop = 0;
+static THREAD flusherThread;
+
+#ifdef _WIN32
+static DWORD ringKey = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t ringKey;
+static int ringKeyValid = 0;
+#endif
+
 
 
 /*
@@ -67,60 +134,489 @@ void decodeBCDString(unsigned char *Inbuff, int len, char *Outbuff)
 }
 
 
-void initDebug(struct p11Context_t *context)
+
+/*
+ *  Return the wall clock time in milliseconds
+ *
+ */
+static long long currentTime(void)
 {
-	static const char debug_fn[] = "/var/tmp/sc-hsm-embedded/pkcs11.log";
+#ifdef _WIN32
+	FILETIME ft;
+	ULARGE_INTEGER t;
 
-	if (context->debugFileHandle != NULL) {
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	return (long long)((t.QuadPart - 116444736000000000ULL) / 10000);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+
+/*
+ *  Write a line with time stamp, level and ring number. The caller must hold logLock.
+ *
+ */
+static void writeLine(long long time, int level, int number, char *text)
+{
+	static const char levels[] = "-EIDT";
+	static time_t lastSecond = (time_t)-1;
+	static char stamp[64];
+	struct tm *loctim;
+	time_t second;
+
+	second = (time_t)(time / 1000);
+
+	if (second != lastSecond) {
+		loctim = localtime(&second);
+		snprintf(stamp, sizeof(stamp), "%02d.%02d.%04d %02d:%02d:%02d",
+				loctim->tm_mday,
+				loctim->tm_mon + 1,
+				loctim->tm_year + 1900,
+				loctim->tm_hour,
+				loctim->tm_min,
+				loctim->tm_sec);
+		lastSecond = second;
+	}
+
+	fprintf(logFile, "%s.%03d %c%02d %s", stamp, (int)(time % 1000), levels[level], number, text);
+}
+
+
+
+/*
+ *  Write all records queued in the rings to the log file
+ *
+ */
+static void flushRings(void)
+{
+	struct logRing *ring;
+	struct logRecord *rec;
+	unsigned long head, tail, dropped;
+	int cont;
+
+	MUTEX_LOCK(&logLock);
+
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		head = ring->head;
+		MEMORY_BARRIER();				// Read records only after head
+
+		cont = 0;
+		for (tail = ring->tail; tail != head; tail++) {
+			rec = &ring->record[tail & (LOG_RING_SIZE - 1)];
+			if (cont) {
+				fputs(rec->text, logFile);
+			} else {
+				writeLine(rec->time, rec->level, ring->number, rec->text);
+			}
+			cont = rec->more;
+		}
+
+		MEMORY_BARRIER();				// Records must be consumed before they are reused
+		ring->tail = tail;
+
+		dropped = ring->dropped;
+		if (dropped != ring->reported) {
+			writeLine(logClock, LOG_LEVEL_INFO, ring->number, "");
+			fprintf(logFile, "%lu log lines lost\n", dropped - ring->reported);
+			ring->reported = dropped;
+		}
+	}
+
+	fflush(logFile);
+	MUTEX_UNLOCK(&logLock);
+}
+
+
+
+/*
+ *  Background thread updating the coarse clock and writing the rings to the file
+ *
+ */
+static void flusher(void *arg)
+{
+	while (!flusherStop) {
+		logClock = currentTime();
+		flushRings();
+		usleep(LOG_FLUSH_INTERVAL * 1000);
+	}
+}
+
+
+
+/*
+ *  Release the ring of a terminating thread. The flusher still writes the
+ *  remaining records, before the ring is handed to a new thread.
+ *
+ */
+#ifdef _WIN32
+static VOID WINAPI releaseRing(PVOID p)
+#else
+static void releaseRing(void *p)
+#endif
+{
+	if (p != NULL) {
+		MEMORY_BARRIER();				// Last record published before the ring can be reused
+		((struct logRing *)p)->owned = 0;
+	}
+}
+
+
+
+/*
+ *  Return the ring of the calling thread, assigning a free or new ring on first use.
+ *  Returns NULL if no ring is available.
+ *
+ */
+static struct logRing *getRing(void)
+{
+	struct logRing *ring;
+
+#ifdef _WIN32
+	ring = (struct logRing *)FlsGetValue(ringKey);
+#else
+	ring = (struct logRing *)pthread_getspecific(ringKey);
+#endif
+
+	if (ring != NULL)
+		return ring;
+
+	MUTEX_LOCK(&logLock);
+
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		if (!ring->owned && (ring->head == ring->tail))
+			break;
+	}
+
+	if ((ring == NULL) && (ringCount < LOG_MAX_RINGS)) {
+		ring = (struct logRing *)calloc(1, sizeof(struct logRing));
+		if (ring != NULL) {
+			ring->number = ++ringCount;
+			ring->next = rings;
+			MEMORY_BARRIER();			// Ring complete before the flusher can see it
+			rings = ring;
+		}
+	}
+
+	if (ring != NULL) {
+		ring->owned = 1;
+#ifdef _WIN32
+		FlsSetValue(ringKey, ring);
+#else
+		pthread_setspecific(ringKey, ring);
+#endif
+	}
+
+	MUTEX_UNLOCK(&logLock);
+
+	return ring;
+}
+
+
+
+/*
+ *  Queue a line in the ring of the calling thread. The line is dropped if the ring
+ *  is full, as the caller must never wait for the file.
+ *
+ */
+static void queueLine(struct logRing *ring, int level, char *line, int len)
+{
+	struct logRecord *rec;
+	unsigned long head;
+	int records, i, chunk;
+
+	records = (len + LOG_RECORD_TEXT - 2) / (LOG_RECORD_TEXT - 1);	// Each record holds LOG_RECORD_TEXT - 1 characters
+	if (records < 1)
+		records = 1;
+
+	head = ring->head;
+
+	if (head - ring->tail + records > LOG_RING_SIZE) {
+		ring->dropped++;
 		return;
 	}
 
-	context->debugFileHandle = fopen(debug_fn, "a+");
+	for (i = 0; i < records; i++) {
+		rec = &ring->record[(head + i) & (LOG_RING_SIZE - 1)];
+		rec->time = logClock;
+		rec->level = (char)level;
+		rec->more = (i < records - 1);
+		chunk = len < LOG_RECORD_TEXT - 1 ? len : LOG_RECORD_TEXT - 1;
+		memcpy(rec->text, line, chunk);
+		rec->text[chunk] = '\0';
+		line += chunk;
+		len -= chunk;
+	}
+
+	MEMORY_BARRIER();					// Records complete before they are published
+	ring->head = head + records;
+}
 
-	if (context->debugFileHandle != NULL) {
-		fprintf(context->debugFileHandle, "Debugging initialized ...\n");
+
+
+/*
+ *  Write a line with the given level to the log
+ *
+ */
+static void logLine(int level, char *format, va_list argptr)
+{
+	struct logRing *ring = NULL;
+	char line[LOG_LINE_SIZE];
+	int len;
+
+	if (logFile == NULL) {
+		return;
+	}
+
+	len = vsnprintf(line, sizeof(line) - 1, format, argptr);
+
+	if ((len < 0) || (len > (int)sizeof(line) - 2)) {
+		len = (int)strlen(line);
+	}
+
+	if ((len == 0) || (line[len - 1] != '\n')) {
+		line[len++] = '\n';
+		line[len] = '\0';
+	}
+
+	if (flusherRunning) {
+		ring = getRing();
+	}
+
+	if (ring != NULL) {
+		queueLine(ring, level, line, len);
 	} else {
-		fprintf(stderr, "Can't create: '%s'.\n", debug_fn);
+		MUTEX_LOCK(&logLock);
+		writeLine(flusherRunning ? logClock : currentTime(), level, 0, line);
+		fflush(logFile);
+		MUTEX_UNLOCK(&logLock);
 	}
 }
 
 
-void debug(char *format, ...)
+
+/*
+ *  Decode the log level from SC_HSM_LOG_LEVEL, which can be a number or the name of the level
+ *
+ */
+static int getLogLevel(int defaultLevel)
+{
+	static const char *names[] = { "off", "error", "info", "debug", "trace" };
+	char *str;
+	int i;
+
+	str = getenv("SC_HSM_LOG_LEVEL");
+
+	if ((str == NULL) || (*str == '\0')) {
+		return defaultLevel;
+	}
+
+	if ((*str >= '0') && (*str <= '9')) {
+		i = atoi(str);
+		return i > LOG_LEVEL_TRACE ? LOG_LEVEL_TRACE : i;
+	}
+
+	for (i = 0; i <= LOG_LEVEL_TRACE; i++) {
+		if (!strcmp(str, names[i])) {
+			return i;
+		}
+	}
+
+	return defaultLevel;
+}
+
+
+
+void initDebug(struct p11Context_t *context)
+{
+	char *logFileName;
+	int level;
+
+	if (logFile != NULL) {
+		return;
+	}
+
+#ifdef DEBUG
+	level = getLogLevel(LOG_LEVEL_TRACE);
+#else
+	level = getLogLevel(LOG_LEVEL_OFF);
+#endif
+
+	if (level == LOG_LEVEL_OFF) {
+		return;
+	}
+
+	logFileName = getenv("SC_HSM_LOG_FILE");
+
+	if ((logFileName == NULL) || (*logFileName == '\0')) {
+		logFileName = (char *)defaultLogFile;
+	}
+
+	logFile = fopen(logFileName, "a+");
+
+	if (logFile == NULL) {
+		fprintf(stderr, "Can't create: '%s'.\n", logFileName);
+		return;
+	}
+
+	MUTEX_INIT(&logLock);
+	logClock = currentTime();
+
+	if (!context->noThreads) {
+#ifdef _WIN32
+		ringKey = FlsAlloc(releaseRing);
+		if (ringKey != FLS_OUT_OF_INDEXES) {
+#else
+		ringKeyValid = !pthread_key_create(&ringKey, releaseRing);
+		if (ringKeyValid) {
+#endif
+			flusherStop = 0;
+			flusherRunning = !thread_create(&flusherThread, flusher, NULL);
+		}
+	}
+
+	traceAPDUs = (level >= LOG_LEVEL_DEBUG) && ((getenv("SC_HSM_TRACE_APDU") == NULL) || strcmp(getenv("SC_HSM_TRACE_APDU"), "0"));
+	debugLevel = level;
+
+	debugLog(LOG_LEVEL_INFO, "Debugging initialized with level %d%s...\n", level, flusherRunning ? "" : " without flusher thread ");
+}
+
+
+
+/*
+ *  Write a line with the given level to the log. Callers should check DEBUG_ENABLED(level)
+ *  first, to avoid the cost of evaluating the arguments.
+ *
+ */
+void debugLog(int level, char *format, ...)
 {
-	struct tm *loctim;
-	time_t elapsed;
 	va_list argptr;
 
-	if (context == NULL || context->debugFileHandle == NULL) {
+	if (!DEBUG_ENABLED(level)) {
 		return;
 	}
 
-	time(&elapsed);
-	loctim = localtime(&elapsed);
+	va_start(argptr, format);
+	logLine(level, format, argptr);
+	va_end(argptr);
+}
+
+
+
+void debug(char *format, ...)
+{
+	va_list argptr;
 
-	fprintf(context->debugFileHandle, "%02d.%02d.%04d %02d:%02d:%02d ",
-			loctim->tm_mday,
-			loctim->tm_mon,
-			loctim->tm_year+1900,
-			loctim->tm_hour,
-			loctim->tm_min,
-			loctim->tm_sec);
+	if (!DEBUG_ENABLED(LOG_LEVEL_DEBUG)) {
+		return;
+	}
 
 	va_start(argptr, format);
-	vfprintf(context->debugFileHandle, format, argptr);
-	fflush(context->debugFileHandle);
+	logLine(LOG_LEVEL_DEBUG, format, argptr);
 	va_end(argptr);
 }
 
 
-void termDebug(struct p11Context_t *context)
+/*
+ *  Trace a command APDU. Only called if traceAPDUs is set.
+ *
+ */
+void traceCommandAPDU(unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2, int Nc, unsigned char *data, int Ne)
 {
-	if (context->debugFileHandle != NULL) {
-		fprintf(context->debugFileHandle, "Debugging terminated ...\n");
-		fflush(context->debugFileHandle);
-		fclose(context->debugFileHandle);
-		context->debugFileHandle = NULL;
+	char scr[64 + 2 * TRACE_APDU_BYTES], *po;
+
+	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
+	po = strchr(scr, '\0');
+
+	if (INS != 0x20 && Nc && data) {				// Never trace a PIN
+		sprintf(po, "Lc=%02X(%d) ", Nc, Nc);
+		po = strchr(po, '\0');
+		decodeBCDString(data, Nc > TRACE_APDU_BYTES ? TRACE_APDU_BYTES : Nc, po);
+		po = strchr(po, '\0');
+		strcpy(po, Nc > TRACE_APDU_BYTES ? ".. " : " ");
+		po = strchr(po, '\0');
 	}
+
+	if (Ne >= 0)
+		sprintf(po, "Le=%02X(%d)", Ne, Ne);
+
+	debug("%s\n", scr);
+}
+
+
+
+/*
+ *  Trace a response APDU. Only called if traceAPDUs is set.
+ *
+ */
+void traceResponseAPDU(int rc, unsigned char *data, unsigned short SW1SW2)
+{
+	char scr[64 + 2 * TRACE_APDU_BYTES], *po;
+
+	if (rc > 0) {
+		sprintf(scr, "R-APDU: Lr=%02X(%d) ", rc, rc);
+		po = strchr(scr, '\0');
+		if (data) {
+			decodeBCDString(data, rc > TRACE_APDU_BYTES ? TRACE_APDU_BYTES : rc, po);
+			if (rc > TRACE_APDU_BYTES)
+				strcat(po, "..");
+		}
+		po = strchr(po, '\0');
+		sprintf(po, " SW1/SW2=%04X", SW1SW2);
+	} else
+		sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, SW1SW2);
+
+	debug("%s\n", scr);
 }
 
-#endif /* DEBUG */
+
+
+void termDebug(struct p11Context_t *context)
+{
+	struct logRing *ring;
+
+	if (logFile == NULL) {
+		return;
+	}
+
+	debugLog(LOG_LEVEL_INFO, "Debugging terminated ...\n");
+
+	traceAPDUs = 0;
+	debugLevel = LOG_LEVEL_OFF;
+
+	if (flusherRunning) {
+		flusherStop = 1;
+		thread_join(&flusherThread);
+		flushRings();
+		flusherRunning = 0;
+	}
+
+#ifdef _WIN32
+	if (ringKey != FLS_OUT_OF_INDEXES) {
+		FlsFree(ringKey);
+		ringKey = FLS_OUT_OF_INDEXES;
+	}
+#else
+	if (ringKeyValid) {
+		pthread_key_delete(ringKey);
+		ringKeyValid = 0;
+	}
+#endif
+
+	while (rings != NULL) {
+		ring = rings;
+		rings = ring->next;
+		free(ring);
+	}
+	ringCount = 0;
+
+	fclose(logFile);
+	logFile = NULL;
+	MUTEX_DESTROY(&logLock);
+}
@@ -31,18 +31,31 @@
  * @brief   Debug and logging functions
  */
 
-#ifdef DEBUG
-
 #ifndef ___DEBUG_H_INC___
 #define ___DEBUG_H_INC___
 
-#include <pkcs11/p11generic.h>
+/*
+ * Log levels, selected at runtime with the environment variable SC_HSM_LOG_LEVEL
+ */
+#define LOG_LEVEL_OFF		0
+#define LOG_LEVEL_ERROR		1		/* Failing functions                          */
+#define LOG_LEVEL_INFO		2		/* Start and end of logging, lost records     */
+#define LOG_LEVEL_DEBUG		3		/* Diagnostic messages and APDUs              */
+#define LOG_LEVEL_TRACE		4		/* Entry and exit of every function           */
+
+extern volatile int debugLevel;
+extern int traceAPDUs;
+
+#define DEBUG_ENABLED(level) (debugLevel >= (level))
+
+struct p11Context_t;
 
 void decodeBCDString(unsigned char *Inbuff, int len, char *Outbuff);
 void initDebug(struct p11Context_t *context);
-void debug(char *log, ...);
+void debugLog(int level, char *format, ...);
+void debug(char *format, ...);
+void traceCommandAPDU(unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2, int Nc, unsigned char *data, int Ne);
+void traceResponseAPDU(int rc, unsigned char *data, unsigned short SW1SW2);
 void termDebug(struct p11Context_t *context);
 
 #endif /* ___DEBUG_H_INC___ */
-
-#endif /* DEBUG */
@@ -0,0 +1,550 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    digest.c
+ * @brief   Host side message digests
+ *
+ * Hashing large messages on the host keeps memory use constant for multi-part signing and
+ * only transfers the digest to the token.
+ */
+
+#include <string.h>
+
+#include <pkcs11/digest.h>
+
+#define ROTL32(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n)  (((x) >> (n)) | ((x) << (64 - (n))))
+
+static const unsigned int sha1IV[5] = {
+	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+static const unsigned int sha224IV[8] = {
+	0xC1059ED8, 0x367CD507, 0x3070DD17, 0xF70E5939, 0xFFC00B31, 0x68581511, 0x64F98FA7, 0xBEFA4FA4
+};
+
+static const unsigned int sha256IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned long long sha384IV[8] = {
+	0xCBBB9D5DC1059ED8ULL, 0x629A292A367CD507ULL, 0x9159015A3070DD17ULL, 0x152FECD8F70E5939ULL,
+	0x67332667FFC00B31ULL, 0x8EB44A8768581511ULL, 0xDB0C2E0D64F98FA7ULL, 0x47B5481DBEFA4FA4ULL
+};
+
+static const unsigned long long sha512IV[8] = {
+	0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+	0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const unsigned int sha256K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const unsigned long long sha512K[80] = {
+	0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+	0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+	0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+	0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+	0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+	0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+	0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+	0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+	0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+	0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+	0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+	0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+	0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+	0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+	0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+	0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+	0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+	0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+	0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+	0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+/* DER encoded AlgorithmIdentifier and OCTET STRING header preceding the hash in a DigestInfo */
+static const unsigned char sha1DigestInfo[] = {
+	0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14
+};
+
+static const unsigned char sha224DigestInfo[] = {
+	0x30, 0x2D, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1C
+};
+
+static const unsigned char sha256DigestInfo[] = {
+	0x30, 0x31, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+static const unsigned char sha384DigestInfo[] = {
+	0x30, 0x41, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30
+};
+
+static const unsigned char sha512DigestInfo[] = {
+	0x30, 0x51, 0x30, 0x0D, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40
+};
+
+
+
+static unsigned int getUInt32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+
+
+static void putUInt32(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+
+
+static unsigned long long getUInt64(const unsigned char *p)
+{
+	return ((unsigned long long)getUInt32(p) << 32) | getUInt32(p + 4);
+}
+
+
+
+static void putUInt64(unsigned char *p, unsigned long long v)
+{
+	putUInt32(p, (unsigned int)(v >> 32));
+	putUInt32(p + 4, (unsigned int)v);
+}
+
+
+
+static void sha1Block(unsigned int *h, const unsigned char *p)
+{
+	unsigned int w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = getUInt32(p + (i << 2));
+	}
+	for (; i < 80; i++) {
+		t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+		w[i] = ROTL32(t, 1);
+	}
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROTL32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROTL32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+
+
+static void sha256Block(unsigned int *h, const unsigned char *p)
+{
+	unsigned int w[64], s[8], s0, s1, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = getUInt32(p + (i << 2));
+	}
+	for (; i < 64; i++) {
+		s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, h, sizeof(s));
+
+	for (i = 0; i < 64; i++) {
+		s1 = ROTR32(s[4], 6) ^ ROTR32(s[4], 11) ^ ROTR32(s[4], 25);
+		t1 = s[7] + s1 + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+		s0 = ROTR32(s[0], 2) ^ ROTR32(s[0], 13) ^ ROTR32(s[0], 22);
+		t2 = s0 + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++) {
+		h[i] += s[i];
+	}
+}
+
+
+
+static void sha512Block(unsigned long long *h, const unsigned char *p)
+{
+	unsigned long long w[80], s[8], s0, s1, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = getUInt64(p + (i << 3));
+	}
+	for (; i < 80; i++) {
+		s0 = ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+		s1 = ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, h, sizeof(s));
+
+	for (i = 0; i < 80; i++) {
+		s1 = ROTR64(s[4], 14) ^ ROTR64(s[4], 18) ^ ROTR64(s[4], 41);
+		t1 = s[7] + s1 + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha512K[i] + w[i];
+		s0 = ROTR64(s[0], 28) ^ ROTR64(s[0], 34) ^ ROTR64(s[0], 39);
+		t2 = s0 + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++) {
+		h[i] += s[i];
+	}
+}
+
+
+
+static void processBlock(struct p11DigestContext_t *ctx, const unsigned char *p)
+{
+	switch(ctx->mechanism) {
+	case CKM_SHA_1:
+		sha1Block(ctx->state.w32, p);
+		break;
+	case CKM_SHA224:
+	case CKM_SHA256:
+		sha256Block(ctx->state.w32, p);
+		break;
+	default:
+		sha512Block(ctx->state.w64, p);
+		break;
+	}
+}
+
+
+
+/**
+ * Start a new message digest
+ *
+ * @param ctx       the digest context
+ * @param mech      the digest mechanism, one of CKM_SHA_1, CKM_SHA224, CKM_SHA256, CKM_SHA384 or CKM_SHA512
+ * @return          CKR_OK or CKR_MECHANISM_INVALID
+ */
+int digestInit(struct p11DigestContext_t *ctx, CK_MECHANISM_TYPE mech)
+{
+	memset(ctx, 0, sizeof(*ctx));
+
+	switch(mech) {
+	case CKM_SHA_1:
+		memcpy(ctx->state.w32, sha1IV, sizeof(sha1IV));
+		ctx->digestLength = 20;
+		ctx->blockSize = 64;
+		break;
+	case CKM_SHA224:
+		memcpy(ctx->state.w32, sha224IV, sizeof(sha224IV));
+		ctx->digestLength = 28;
+		ctx->blockSize = 64;
+		break;
+	case CKM_SHA256:
+		memcpy(ctx->state.w32, sha256IV, sizeof(sha256IV));
+		ctx->digestLength = 32;
+		ctx->blockSize = 64;
+		break;
+	case CKM_SHA384:
+		memcpy(ctx->state.w64, sha384IV, sizeof(sha384IV));
+		ctx->digestLength = 48;
+		ctx->blockSize = 128;
+		break;
+	case CKM_SHA512:
+		memcpy(ctx->state.w64, sha512IV, sizeof(sha512IV));
+		ctx->digestLength = 64;
+		ctx->blockSize = 128;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	ctx->mechanism = mech;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add data to the message digest
+ *
+ * @param ctx       the digest context
+ * @param data      the data to hash
+ * @param length    the length of the data
+ */
+void digestUpdate(struct p11DigestContext_t *ctx, CK_BYTE_PTR data, CK_ULONG length)
+{
+	CK_ULONG len;
+
+	ctx->length += length;
+
+	if (ctx->blockFill) {
+		len = ctx->blockSize - ctx->blockFill;
+		if (len > length) {
+			len = length;
+		}
+		memcpy(ctx->block + ctx->blockFill, data, len);
+		ctx->blockFill += len;
+		data += len;
+		length -= len;
+
+		if (ctx->blockFill < ctx->blockSize) {
+			return;
+		}
+		processBlock(ctx, ctx->block);
+		ctx->blockFill = 0;
+	}
+
+	/* Full blocks are hashed directly from the callers buffer */
+	while (length >= ctx->blockSize) {
+		processBlock(ctx, data);
+		data += ctx->blockSize;
+		length -= ctx->blockSize;
+	}
+
+	if (length) {
+		memcpy(ctx->block, data, length);
+		ctx->blockFill = length;
+	}
+}
+
+
+
+/**
+ * Complete the message digest and clear the context
+ *
+ * @param ctx       the digest context
+ * @param digest    the buffer receiving ctx->digestLength bytes
+ */
+void digestFinal(struct p11DigestContext_t *ctx, CK_BYTE_PTR digest)
+{
+	CK_ULONG i, lengthOffset;
+
+	/* Message length in bits as 64 bit or 128 bit big endian value at the end of the last block */
+	lengthOffset = ctx->blockSize - (ctx->blockSize >> 3);
+
+	ctx->block[ctx->blockFill++] = 0x80;
+
+	if (ctx->blockFill > lengthOffset) {
+		memset(ctx->block + ctx->blockFill, 0, ctx->blockSize - ctx->blockFill);
+		processBlock(ctx, ctx->block);
+		ctx->blockFill = 0;
+	}
+
+	memset(ctx->block + ctx->blockFill, 0, ctx->blockSize - ctx->blockFill);
+	if (ctx->blockSize == 128) {
+		putUInt64(ctx->block + ctx->blockSize - 16, ctx->length >> 61);
+	}
+	putUInt64(ctx->block + ctx->blockSize - 8, ctx->length << 3);
+	processBlock(ctx, ctx->block);
+
+	if (ctx->blockSize == 64) {
+		for (i = 0; i < ctx->digestLength; i += 4) {
+			putUInt32(digest + i, ctx->state.w32[i >> 2]);
+		}
+	} else {
+		for (i = 0; i < ctx->digestLength; i += 8) {
+			putUInt64(digest + i, ctx->state.w64[i >> 3]);
+		}
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+
+
+/**
+ * Split a hash-and-sign mechanism into the digest mechanism and the signature
+ * mechanism applied to the digest
+ *
+ * @param mech      the hash-and-sign mechanism, e.g. CKM_SHA256_RSA_PKCS
+ * @param hashMech  the digest mechanism, e.g. CKM_SHA256
+ * @param signMech  the mechanism signing the digest, e.g. CKM_RSA_PKCS
+ * @return          CKR_OK or CKR_MECHANISM_INVALID if mech does not include a hash
+ */
+int getHashAndSignMechanisms(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *hashMech, CK_MECHANISM_TYPE *signMech)
+{
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA1:
+		*hashMech = CKM_SHA_1;
+		break;
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA224:
+		*hashMech = CKM_SHA224;
+		break;
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA256:
+		*hashMech = CKM_SHA256;
+		break;
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA384:
+		*hashMech = CKM_SHA384;
+		break;
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA512:
+		*hashMech = CKM_SHA512;
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		*signMech = CKM_RSA_PKCS_PSS;
+		break;
+	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA224:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+		*signMech = CKM_ECDSA;
+		break;
+	default:
+		*signMech = CKM_RSA_PKCS;
+		break;
+	}
+	return CKR_OK;
+}
+
+
+
+/**
+ * Encode a digest as DigestInfo structure for PKCS#1 V1.5 signatures
+ *
+ * @param hashMech  the digest mechanism
+ * @param digest    the digest
+ * @param out       the buffer receiving the DigestInfo
+ * @param outlen    the size of the buffer
+ * @return          the length of the DigestInfo or -1 for an unknown mechanism or a too small buffer
+ */
+int encodeDigestInfo(CK_MECHANISM_TYPE hashMech, CK_BYTE_PTR digest, CK_BYTE_PTR out, CK_ULONG outlen)
+{
+	const unsigned char *prefix;
+	int prefixlen, digestlen;
+
+	switch(hashMech) {
+	case CKM_SHA_1:
+		prefix = sha1DigestInfo;
+		prefixlen = sizeof(sha1DigestInfo);
+		digestlen = 20;
+		break;
+	case CKM_SHA224:
+		prefix = sha224DigestInfo;
+		prefixlen = sizeof(sha224DigestInfo);
+		digestlen = 28;
+		break;
+	case CKM_SHA256:
+		prefix = sha256DigestInfo;
+		prefixlen = sizeof(sha256DigestInfo);
+		digestlen = 32;
+		break;
+	case CKM_SHA384:
+		prefix = sha384DigestInfo;
+		prefixlen = sizeof(sha384DigestInfo);
+		digestlen = 48;
+		break;
+	case CKM_SHA512:
+		prefix = sha512DigestInfo;
+		prefixlen = sizeof(sha512DigestInfo);
+		digestlen = 64;
+		break;
+	default:
+		return -1;
+	}
+
+	if ((CK_ULONG)(prefixlen + digestlen) > outlen) {
+		return -1;
+	}
+
+	memcpy(out, prefix, prefixlen);
+	memcpy(out + prefixlen, digest, digestlen);
+	return prefixlen + digestlen;
+}
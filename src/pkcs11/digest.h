@@ -0,0 +1,64 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    digest.h
+ * @brief   Host side message digests
+ */
+
+#ifndef ___DIGEST_H_INC___
+#define ___DIGEST_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+#define MAX_DIGEST_LENGTH       64     /* Largest digest produced by digestFinal() */
+#define MAX_DIGESTINFO_LENGTH   (MAX_DIGEST_LENGTH + 19)
+
+/**
+ * State of a running message digest
+ */
+struct p11DigestContext_t
+{
+	CK_MECHANISM_TYPE mechanism;        /**< The digest mechanism, e.g. CKM_SHA256     */
+	CK_ULONG digestLength;              /**< Length of the final digest in bytes       */
+	CK_ULONG blockSize;                 /**< 64 for SHA-1/224/256, 128 for SHA-384/512 */
+	union {
+		unsigned int w32[8];            /**< Intermediate hash value of SHA-1/224/256  */
+		unsigned long long w64[8];      /**< Intermediate hash value of SHA-384/512    */
+	} state;
+	unsigned char block[128];           /**< Input not yet processed                   */
+	CK_ULONG blockFill;                 /**< Number of bytes in block                  */
+	unsigned long long length;          /**< Total input length in bytes               */
+};
+
+int digestInit(struct p11DigestContext_t *ctx, CK_MECHANISM_TYPE mech);
+void digestUpdate(struct p11DigestContext_t *ctx, CK_BYTE_PTR data, CK_ULONG length);
+void digestFinal(struct p11DigestContext_t *ctx, CK_BYTE_PTR digest);
+int getHashAndSignMechanisms(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *hashMech, CK_MECHANISM_TYPE *signMech);
+int encodeDigestInfo(CK_MECHANISM_TYPE hashMech, CK_BYTE_PTR digest, CK_BYTE_PTR out, CK_ULONG outlen);
+
+#endif /* ___DIGEST_H_INC___ */
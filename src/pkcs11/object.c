@@ -61,6 +61,22 @@ static struct attributesForObject_t attributesKeyObject[NEEDED_ATTRIBUTES_KEYOBJ
 		{{CKA_KEY_GEN_MECHANISM, &ckMechType, sizeof(CK_MECHANISM_TYPE)}, TRUE}
 };
 
+#define ATTRIBUTE_LIST_SIZE                 16      /* Initial number of attributes per object */
+#define ATTRIBUTE_ARENA_SIZE               512      /* Minimum size of a block in the attribute arena */
+#define ATTRIBUTE_ARENA_ALIGN                8      /* Alignment of attribute values, must be a power of 2 */
+#define ATTRIBUTE_ARENA_HEADER  ((sizeof(struct p11AttributeArena_t) + ATTRIBUTE_ARENA_ALIGN - 1) & ~(size_t)(ATTRIBUTE_ARENA_ALIGN - 1))
+
+#define OBJECT_INDEX_SIZE                   16      /* Initial number of buckets, must be a power of 2 */
+
+#define OBJECT_BUCKET(index, handle)  ((index)->table[(handle) & ((index)->size - 1)])
+
+#define ATTRIBUTE_INDEX_SIZE                16      /* Initial number of buckets, must be a power of 2 */
+
+#define ATTRIBUTE_BUCKET(index, i, hash)  ((index)->table[i][(hash) & ((index)->size - 1)])
+
+/* The attributes of token objects indexed by value, see struct p11AttributeIndex_t */
+static const CK_ATTRIBUTE_TYPE indexedAttributes[ATTRIBUTE_INDEXES] = { CKA_CLASS, CKA_ID, CKA_LABEL };
+
 
 #ifdef DEBUG
 
@@ -572,56 +588,205 @@ int isValidPtr(void *ptr)
 
 
 
+/**
+ * Allocate memory for an attribute value from the arena of the object
+ *
+ * @param object the object owning the value
+ * @param len the number of bytes required
+ * @return pointer to the memory or NULL if out of memory
+ */
+static void *allocAttributeValue(struct p11Object_t *object, size_t len)
+{
+	struct p11AttributeArena_t *arena;
+	size_t size;
+	unsigned char *p;
+
+	/* Keep values aligned for CK_ULONG and CK_DATE access */
+	len = (len + ATTRIBUTE_ARENA_ALIGN - 1) & ~(size_t)(ATTRIBUTE_ARENA_ALIGN - 1);
+	if (len == 0) {
+		len = ATTRIBUTE_ARENA_ALIGN;
+	}
+
+	arena = object->attrArena;
+
+	if ((arena == NULL) || (arena->size - arena->used < len)) {
+		size = len > ATTRIBUTE_ARENA_SIZE ? len : ATTRIBUTE_ARENA_SIZE;
+
+		arena = (struct p11AttributeArena_t *)malloc(ATTRIBUTE_ARENA_HEADER + size);
+
+		if (arena == NULL) {
+			return NULL;
+		}
+
+		arena->size = size;
+		arena->used = 0;
+		arena->next = object->attrArena;
+		object->attrArena = arena;
+	}
+
+	p = (unsigned char *)arena + ATTRIBUTE_ARENA_HEADER + arena->used;
+	arena->used += len;
+	return p;
+}
+
+
+
+/**
+ * Locate an attribute in the sorted attribute array using a binary search
+ *
+ * @param object the object
+ * @param type the attribute type
+ * @param pos updated with the position of the attribute or the position to insert it
+ * @return TRUE if found, FALSE if not
+ */
+static int locateAttribute(struct p11Object_t *object, CK_ATTRIBUTE_TYPE type, CK_ULONG *pos)
+{
+	CK_ULONG lo, hi, mid;
+
+	lo = 0;
+	hi = object->attrCount;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+
+		if (object->attrList[mid].attrData.type < type) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*pos = lo;
+	return (lo < object->attrCount) && (object->attrList[lo].attrData.type == type);
+}
+
+
+
+/**
+ * Add an attribute to the object
+ *
+ * The value is copied into the attribute arena of the object. If the attribute is
+ * already present, the existing value is retained.
+ *
+ * @param object the object
+ * @param pTemplate the attribute to add
+ * @return CKR_OK or -1 if out of memory
+ */
 int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Attribute_t *attr, **ppAttr;
+	struct p11Attribute_t *list;
+	CK_ULONG pos, max;
+	void *value;
+
+	if (locateAttribute(object, pTemplate->type, &pos)) {
+		return CKR_OK;
+	}
+
+	if (object->attrCount == object->attrMax) {
+		max = object->attrMax ? object->attrMax << 1 : ATTRIBUTE_LIST_SIZE;
+		list = (struct p11Attribute_t *)realloc(object->attrList, max * sizeof(struct p11Attribute_t));
+
+		if (list == NULL) {
+			return -1;
+		}
+
+		object->attrList = list;
+		object->attrMax = max;
+	}
 
-	attr = (struct p11Attribute_t *)calloc (1, sizeof(struct p11Attribute_t));
+	value = allocAttributeValue(object, pTemplate->ulValueLen);
 
-	if (attr == NULL) {
+	if (value == NULL) {
 		return -1;
 	}
 
-	attr->attrData = *pTemplate;
+	memcpy(value, pTemplate->pValue, pTemplate->ulValueLen);
+
+	memmove(object->attrList + pos + 1, object->attrList + pos, (object->attrCount - pos) * sizeof(struct p11Attribute_t));
+
+	object->attrList[pos].attrData = *pTemplate;
+	object->attrList[pos].attrData.pValue = value;
+	object->attrCount++;
+
+	return CKR_OK;
+}
+
+
 
-	attr->attrData.pValue = calloc(attr->attrData.ulValueLen, 1);
+/**
+ * Find an attribute of the object
+ *
+ * The returned pointer is only valid until attributes are added to or removed from the object.
+ *
+ * @param object the object
+ * @param pTemplate the template whose type is searched
+ * @param ppAttr updated with the attribute or NULL
+ * @return the position of the attribute or -1 if not found
+ */
+int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct p11Attribute_t **ppAttr)
+{
+	CK_ULONG pos;
 
-	if (attr->attrData.pValue == NULL) {
-		free(attr);
+	if (!locateAttribute(object, pTemplate->type, &pos)) {
+		*ppAttr = NULL;
 		return -1;
 	}
 
-	memcpy(attr->attrData.pValue, pTemplate->pValue, attr->attrData.ulValueLen);
+	*ppAttr = &object->attrList[pos];
+	return (int)pos;
+}
+
+
+
+/**
+ * Let the token fetch the attributes it deferred when the object was created
+ *
+ * Token drivers may create objects with only the attributes that are cheap to obtain and
+ * set loadAttributes to a function adding the remaining attributes on first use.
+ *
+ * @param object the object
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int loadDeferredAttributes(struct p11Object_t *object)
+{
+	int rc;
 
-	FOR_EACH_REF(ppAttr, object->attrList) {
-		/* until points to the next field of the last element */
+	if (object->loadAttributes == NULL) {
+		return CKR_OK;
 	}
 
-	*ppAttr = attr;
+	rc = object->loadAttributes(object);
 
-	return CKR_OK;
+	if (rc == CKR_OK) {
+		object->loadAttributes = NULL;
+	}
+
+	return rc;
 }
 
 
 
-int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct p11Attribute_t **ppAttr)
+/**
+ * Find an attribute of the object, fetching deferred attributes if it is not yet present
+ *
+ * @param object the object
+ * @param pTemplate the template whose type is searched
+ * @param ppAttr updated with the attribute or NULL
+ * @return the position of the attribute or -1 if not found
+ */
+int findOrLoadAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct p11Attribute_t **ppAttr)
 {
-	struct p11Attribute_t *attr;
-	int pos;            /* remember the current position in the list */
+	int pos;
 
-	pos = 0;
-	FOR_EACH(attr, object->attrList) {
+	pos = findAttribute(object, pTemplate, ppAttr);
 
-		if (attr->attrData.type == pTemplate->type) {
-			*ppAttr = attr;
-			return pos;
+	if ((pos < 0) && (object->loadAttributes != NULL)) {
+		if (loadDeferredAttributes(object) == CKR_OK) {
+			pos = findAttribute(object, pTemplate, ppAttr);
 		}
-
-		pos++;
 	}
 
-	*ppAttr = NULL;
-	return -1;
+	return pos;
 }
 
 
@@ -644,37 +809,36 @@ int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pT
 
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 {
-	struct p11Attribute_t **ppAttr;
-	struct p11Attribute_t *attr;
-
-	FOR_EACH_REF(ppAttr, object->attrList) {
-
-		if ((*ppAttr)->attrData.type == pTemplate->type) {
-
-			attr = *ppAttr;
-			*ppAttr = attr->next;
-
-			free(attr->attrData.pValue);
-			free(attr);
-
-			return CKR_OK;
-		}
+	CK_ULONG pos;
 
+	if (!locateAttribute(object, pTemplate->type, &pos)) {
+		return CKR_ARGUMENTS_BAD;
 	}
 
-	return CKR_ARGUMENTS_BAD;
+	/* The value remains in the arena until all attributes are removed */
+	object->attrCount--;
+	memmove(object->attrList + pos, object->attrList + pos + 1, (object->attrCount - pos) * sizeof(struct p11Attribute_t));
 
+	return CKR_OK;
 }
 
 
 
 int removeAllAttributes(struct p11Object_t *object)
 {
-	while(object->attrList) {
-		if (removeAttribute(object, &object->attrList->attrData) != CKR_OK)
-			return CKR_GENERAL_ERROR;
+	struct p11AttributeArena_t *arena;
+
+	while (object->attrArena) {
+		arena = object->attrArena;
+		object->attrArena = arena->next;
+		free(arena);
 	}
 
+	free(object->attrList);
+	object->attrList = NULL;
+	object->attrCount = 0;
+	object->attrMax = 0;
+
 	return CKR_OK;
 }
 
@@ -741,17 +905,514 @@ void removeAllObjectsFromList(struct p11Object_t **ppList)
 
 
 
+/**
+ * Rehash all objects in the index into a table with the given number of buckets
+ *
+ * @param index the object index
+ * @param newSize the new number of buckets, must be a power of 2
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+static int resizeObjectIndex(struct p11ObjectIndex_t *index, CK_ULONG newSize)
+{
+	struct p11Object_t **newTable, *object, *next;
+	CK_ULONG i;
+
+	newTable = (struct p11Object_t **)calloc(newSize, sizeof(struct p11Object_t *));
+
+	if (newTable == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	for (i = 0; i < index->size; i++) {
+		for (object = index->table[i]; object != NULL; object = next) {
+			next = object->hashNext;
+			object->hashNext = newTable[object->handle & (newSize - 1)];
+			newTable[object->handle & (newSize - 1)] = object;
+		}
+	}
+
+	free(index->table);
+	index->table = newTable;
+	index->size = newSize;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add a PKCS11 object to a handle index
+ * The object handle must already be assigned and unique within the index
+ *
+ * @param index the object index
+ * @param object the object to be added
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int addObjectToIndex(struct p11ObjectIndex_t *index, struct p11Object_t *object)
+{
+	struct p11Object_t **ppBucket;
+	int rc;
+
+	/* Keep the load factor below 1, so buckets stay short */
+	if (index->count >= index->size) {
+		rc = resizeObjectIndex(index, index->size ? index->size << 1 : OBJECT_INDEX_SIZE);
+		if ((rc != CKR_OK) && (index->table == NULL)) {
+			return rc;
+		}
+		/* A failed resize only makes buckets longer */
+	}
+
+	ppBucket = &OBJECT_BUCKET(index, object->handle);
+	object->hashNext = *ppBucket;
+	*ppBucket = object;
+	index->count++;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Find a PKCS11 object by handle in a handle index
+ *
+ * @param index the object index
+ * @param handle the handle of the object
+ * @return the object or NULL if not found
+ */
+struct p11Object_t *findObjectInIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle)
+{
+	struct p11Object_t *object;
+
+	if (index->table == NULL) {
+		return NULL;
+	}
+
+	for (object = OBJECT_BUCKET(index, handle); object != NULL; object = object->hashNext) {
+		if (object->handle == handle) {
+			return object;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Remove a PKCS11 object from a handle index
+ * The object itself is not freed
+ *
+ * @param index the object index
+ * @param handle the handle of the object to be removed
+ * @return CKR_OK or CKR_OBJECT_HANDLE_INVALID
+ */
+int removeObjectFromIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle)
+{
+	struct p11Object_t **ppBucket;
+
+	if (index->table == NULL) {
+		return CKR_OBJECT_HANDLE_INVALID;
+	}
+
+	for (ppBucket = &OBJECT_BUCKET(index, handle); *ppBucket != NULL; ppBucket = &(*ppBucket)->hashNext) {
+		if ((*ppBucket)->handle == handle) {
+			*ppBucket = (*ppBucket)->hashNext;
+			index->count--;
+			return CKR_OK;
+		}
+	}
+
+	return CKR_OBJECT_HANDLE_INVALID;
+}
+
+
+
+/**
+ * Remove all objects from a handle index, keeping the bucket table for reuse
+ *
+ * @param index the object index
+ */
+void clearObjectIndex(struct p11ObjectIndex_t *index)
+{
+	if (index->table != NULL) {
+		memset(index->table, 0, index->size * sizeof(struct p11Object_t *));
+	}
+	index->count = 0;
+}
+
+
+
+/**
+ * Release the memory allocated for a handle index
+ *
+ * @param index the object index
+ */
+void freeObjectIndex(struct p11ObjectIndex_t *index)
+{
+	free(index->table);
+	index->table = NULL;
+	index->size = 0;
+	index->count = 0;
+}
+
+
+
+/**
+ * Calculate the hash of an attribute value using FNV-1a over type and value
+ *
+ * @param type the attribute type
+ * @param pValue the attribute value or NULL if the attribute is missing
+ * @param len the length of the attribute value
+ * @return the hash value
+ */
+static CK_ULONG hashAttribute(CK_ATTRIBUTE_TYPE type, CK_VOID_PTR pValue, CK_ULONG len)
+{
+	unsigned char *p;
+	CK_ULONG i;
+	unsigned long h = 2166136261UL;
+
+	for (i = 0; i < sizeof(type); i++) {
+		h = (h ^ ((type >> (i << 3)) & 0xFF)) * 16777619UL;
+	}
+
+	if (pValue == NULL) {
+		return (CK_ULONG)(h ^ 0xFF);
+	}
+
+	for (p = (unsigned char *)pValue, i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619UL;
+	}
+
+	return (CK_ULONG)h;
+}
+
+
+
+/**
+ * Calculate the hash of the i-th indexed attribute of an object
+ */
+static CK_ULONG hashIndexedAttribute(struct p11Object_t *object, int i)
+{
+	CK_ATTRIBUTE attr = { 0, NULL, 0 };
+	struct p11Attribute_t *pattr;
+
+	attr.type = indexedAttributes[i];
+
+	if (findAttribute(object, &attr, &pattr) < 0) {
+		return hashAttribute(attr.type, NULL, 0);
+	}
+
+	return hashAttribute(attr.type, pattr->attrData.pValue, pattr->attrData.ulValueLen);
+}
+
+
+
+static void linkAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object, int i)
+{
+	struct p11Object_t **ppBucket;
+
+	ppBucket = &ATTRIBUTE_BUCKET(index, i, object->attrHash[i]);
+	object->attrNext[i] = *ppBucket;
+	*ppBucket = object;
+}
+
+
+
+static void unlinkAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object, int i)
+{
+	struct p11Object_t **ppBucket;
+
+	for (ppBucket = &ATTRIBUTE_BUCKET(index, i, object->attrHash[i]); *ppBucket != NULL; ppBucket = &(*ppBucket)->attrNext[i]) {
+		if (*ppBucket == object) {
+			*ppBucket = object->attrNext[i];
+			object->attrNext[i] = NULL;
+			return;
+		}
+	}
+}
+
+
+
+/**
+ * Rehash all objects in the attribute index into tables with the given number of buckets
+ *
+ * @param index the attribute index
+ * @param newSize the new number of buckets, must be a power of 2
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+static int resizeAttributeIndex(struct p11AttributeIndex_t *index, CK_ULONG newSize)
+{
+	struct p11AttributeIndex_t newIndex;
+	struct p11Object_t *object, *next;
+	CK_ULONG b;
+	int i;
+
+	newIndex.count = index->count;
+	newIndex.size = newSize;
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		newIndex.table[i] = (struct p11Object_t **)calloc(newSize, sizeof(struct p11Object_t *));
+
+		if (newIndex.table[i] == NULL) {
+			while (--i >= 0) {
+				free(newIndex.table[i]);
+			}
+			return CKR_HOST_MEMORY;
+		}
+	}
+
+	/* Every object is linked into each table, so walking the first table visits all */
+	for (b = 0; b < index->size; b++) {
+		for (object = index->table[0][b]; object != NULL; object = next) {
+			next = object->attrNext[0];
+
+			for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+				linkAttributeIndex(&newIndex, object, i);
+			}
+		}
+	}
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		free(index->table[i]);
+	}
+
+	*index = newIndex;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add a PKCS11 object to an attribute index
+ *
+ * @param index the attribute index
+ * @param object the object to be added
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int addObjectToAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object)
+{
+	int i, rc;
+
+	/* Keep the load factor below 1, so buckets with distinct values stay short */
+	if (index->count >= index->size) {
+		rc = resizeAttributeIndex(index, index->size ? index->size << 1 : ATTRIBUTE_INDEX_SIZE);
+		if ((rc != CKR_OK) && (index->table[0] == NULL)) {
+			return rc;
+		}
+		/* A failed resize only makes buckets longer */
+	}
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		object->attrHash[i] = hashIndexedAttribute(object, i);
+		linkAttributeIndex(index, object, i);
+	}
+
+	object->attrIndex = index;
+	index->count++;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Remove a PKCS11 object from the attribute index it is contained in
+ * The object itself is not freed
+ *
+ * @param object the object to be removed
+ */
+void removeObjectFromAttributeIndex(struct p11Object_t *object)
+{
+	struct p11AttributeIndex_t *index = object->attrIndex;
+	int i;
+
+	if (index == NULL) {
+		return;
+	}
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		unlinkAttributeIndex(index, object, i);
+	}
+
+	object->attrIndex = NULL;
+	index->count--;
+}
+
+
+
+/**
+ * Remove all objects from an attribute index, keeping the bucket tables for reuse
+ *
+ * @param index the attribute index
+ */
+void clearAttributeIndex(struct p11AttributeIndex_t *index)
+{
+	int i;
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		if (index->table[i] != NULL) {
+			memset(index->table[i], 0, index->size * sizeof(struct p11Object_t *));
+		}
+	}
+	index->count = 0;
+}
+
+
+
+/**
+ * Release the memory allocated for an attribute index
+ *
+ * @param index the attribute index
+ */
+void freeAttributeIndex(struct p11AttributeIndex_t *index)
+{
+	int i;
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		free(index->table[i]);
+		index->table[i] = NULL;
+	}
+	index->size = 0;
+	index->count = 0;
+}
+
+
+
+/**
+ * Select the attribute index that best narrows a search with the given template
+ *
+ * CKA_ID and CKA_LABEL are usually unique, so they are preferred over CKA_CLASS.
+ *
+ * @param pTemplate the search template
+ * @param ulCount the number of attributes in the template
+ * @param hash updated with the hash of the template value for the selected index
+ * @return the number of the attribute index or -1 if the template contains no indexed attribute
+ */
+int selectAttributeIndex(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG *hash)
+{
+	static const int preference[ATTRIBUTE_INDEXES] = { 1, 2, 0 };
+	int i, pos;
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		pos = findAttributeInTemplate(indexedAttributes[preference[i]], pTemplate, ulCount);
+
+		if (pos >= 0) {
+			*hash = hashAttribute(pTemplate[pos].type, pTemplate[pos].pValue, pTemplate[pos].ulValueLen);
+			return preference[i];
+		}
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Return the first object in the attribute index with the given hash of the i-th indexed attribute
+ *
+ * The caller must still compare the attribute value, as different values may share a hash.
+ *
+ * @param index the attribute index
+ * @param i the number of the indexed attribute as returned by selectAttributeIndex()
+ * @param hash the hash as returned by selectAttributeIndex()
+ * @return the first object or NULL
+ */
+struct p11Object_t *firstInAttributeIndex(struct p11AttributeIndex_t *index, int i, CK_ULONG hash)
+{
+	struct p11Object_t *object;
+
+	if (index->table[i] == NULL) {
+		return NULL;
+	}
+
+	object = ATTRIBUTE_BUCKET(index, i, hash);
+
+	while (object && (object->attrHash[i] != hash)) {
+		object = object->attrNext[i];
+	}
+
+	return object;
+}
+
+
+
+/**
+ * Return the next object in the attribute index with the same hash of the i-th indexed attribute
+ *
+ * @param object the object returned by firstInAttributeIndex() or nextInAttributeIndex()
+ * @param i the number of the indexed attribute
+ * @param hash the hash as returned by selectAttributeIndex()
+ * @return the next object or NULL
+ */
+struct p11Object_t *nextInAttributeIndex(struct p11Object_t *object, int i, CK_ULONG hash)
+{
+	object = object->attrNext[i];
+
+	while (object && (object->attrHash[i] != hash)) {
+		object = object->attrNext[i];
+	}
+
+	return object;
+}
+
+
+
+/**
+ * Change the value of an attribute of the object
+ *
+ * The value is updated in place if it fits, otherwise new memory is taken from the arena.
+ *
+ * @param object the object owning the attribute
+ * @param attribute the attribute to update
+ * @param pTemplate the new value
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int setAttributeValue(struct p11Object_t *object, struct p11Attribute_t *attribute, CK_ATTRIBUTE_PTR pTemplate)
+{
+	void *value;
+	int i;
+
+	if (pTemplate->ulValueLen > attribute->attrData.ulValueLen) {
+		value = allocAttributeValue(object, pTemplate->ulValueLen);
+
+		if (value == NULL) {
+			return CKR_HOST_MEMORY;
+		}
+
+		attribute->attrData.pValue = value;
+	}
+
+	for (i = 0; i < ATTRIBUTE_INDEXES; i++) {
+		if ((object->attrIndex != NULL) && (indexedAttributes[i] == attribute->attrData.type)) {
+			unlinkAttributeIndex(object->attrIndex, object, i);
+			break;
+		}
+	}
+
+	attribute->attrData.ulValueLen = pTemplate->ulValueLen;
+	memcpy(attribute->attrData.pValue, pTemplate->pValue, pTemplate->ulValueLen);
+
+	/* Move the object to the bucket for the new value */
+	if (i < ATTRIBUTE_INDEXES) {
+		object->attrHash[i] = hashAttribute(attribute->attrData.type, attribute->attrData.pValue, attribute->attrData.ulValueLen);
+		linkAttributeIndex(object->attrIndex, object, i);
+	}
+
+	return CKR_OK;
+}
+
+
+
 #ifdef DEBUG
 
 int dumpAttributeList(struct p11Object_t *object)
 {
-	struct p11Attribute_t *attr;
+	CK_ULONG i;
 
 	debug("\n******** attribute list for object ********\n");
 
-	FOR_EACH(attr,  object->attrList) {
+	for (i = 0; i < object->attrCount; i++) {
 
-		dumpAttribute(&attr->attrData);
+		dumpAttribute(&object->attrList[i].attrData);
 
 	}
 
@@ -879,7 +1540,7 @@ int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigne
 
 	/* Determine the size of the object */
 	len = 0;
-	FOR_EACH(attr, object->attrList) {
+	for (attr = object->attrList; attr < object->attrList + object->attrCount; attr++) {
 
 		len += sizeof(CK_ATTRIBUTE);
 		len += attr->attrData.ulValueLen;
@@ -898,7 +1559,7 @@ int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigne
 
 	/* Fill the buffer */
 	i = 0;
-	FOR_EACH(attr, object->attrList) {
+	for (attr = object->attrList; attr < object->attrList + object->attrCount; attr++) {
 
 		memcpy(buf + i, &attr->attrData, sizeof(CK_ATTRIBUTE));
 		i += sizeof(CK_ATTRIBUTE);
@@ -909,3 +1570,46 @@ int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigne
 
 	return 0;
 }
+
+
+
+/**
+ * Restore the attributes of an object from a buffer created with serializeObject()
+ * The attribute values are copied, so the buffer can be released afterwards.
+ *
+ * @param object the object receiving the attributes
+ * @param buffer the serialized attributes
+ * @param length the length of the buffer
+ * @return 0 or -1 if the buffer is malformed or memory is exhausted
+ */
+int deserializeObject(struct p11Object_t *object, unsigned char *buffer, unsigned int length)
+{
+	CK_ATTRIBUTE attr;
+	unsigned int i;
+
+	i = 0;
+	while (i < length) {
+		if (length - i < sizeof(CK_ATTRIBUTE)) {
+			removeAllAttributes(object);
+			return -1;
+		}
+
+		memcpy(&attr, buffer + i, sizeof(CK_ATTRIBUTE));
+		i += sizeof(CK_ATTRIBUTE);
+
+		if (attr.ulValueLen > length - i) {
+			removeAllAttributes(object);
+			return -1;
+		}
+
+		attr.pValue = buffer + i;
+		i += attr.ulValueLen;
+
+		if (addAttribute(object, &attr) != CKR_OK) {
+			removeAllAttributes(object);
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -41,18 +41,35 @@
 /**
  * Internal structure to store information about an attribute.
  *
+ * The attributes of an object are kept in an array sorted by attribute type.
  */
 
 struct p11Attribute_t {
 
     CK_ATTRIBUTE attrData;          /**< The attribute data                   */
+};
+
+
 
-    struct p11Attribute_t *next;    /**< Pointer to next attribute            */
+/**
+ * Memory block from which attribute values are allocated.
+ *
+ * Values are never moved or released individually, so pointers into an attribute value
+ * remain valid until all attributes of the object are removed.
+ */
+
+struct p11AttributeArena_t {
+
+    struct p11AttributeArena_t *next; /**< Previously filled block          */
+    size_t size;                      /**< Usable size of this block        */
+    size_t used;                      /**< Bytes allocated from this block  */
 };
 
 
 
 struct p11Token_t;				// Forward declaration
+struct p11ObjectIndex_t;		// Forward declaration
+struct p11AttributeIndex_t;		// Forward declaration
 
 /**
  * Internal structure to store common attributes of an object.
@@ -89,8 +106,22 @@ struct p11Object_t {
     int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
     int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
-    struct p11Attribute_t *attrList; /**< The list of attributes              */
+    int (*C_VerifyInit)   (struct p11Object_t *, CK_MECHANISM_PTR);
+    int (*C_Verify)       (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG);
+    int (*C_VerifyRecover)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+
+    int (*loadAttributes) (struct p11Object_t *);   /**< Fetch deferred attributes, NULL if complete */
+
+    struct p11Attribute_t *attrList; /**< Attributes sorted by type           */
+    CK_ULONG attrCount;              /**< Number of attributes in attrList    */
+    CK_ULONG attrMax;                /**< Allocated size of attrList          */
+    struct p11AttributeArena_t *attrArena; /**< Storage for attribute values  */
     struct p11Object_t *next;        /**< Pointer to next object              */
+    struct p11Object_t *hashNext;    /**< Next object in the same index bucket */
+
+    CK_ULONG attrHash[ATTRIBUTE_INDEXES];            /**< Hash of the indexed attribute values  */
+    struct p11Object_t *attrNext[ATTRIBUTE_INDEXES]; /**< Next object in attribute index bucket */
+    struct p11AttributeIndex_t *attrIndex;           /**< Attribute index containing the object */
 
 };
 
@@ -115,13 +146,29 @@ int findAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate
 int findAttributeInTemplate(CK_ATTRIBUTE_TYPE attributeType, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTemplate);
 int removeAllAttributes(struct p11Object_t *object);
+int setAttributeValue(struct p11Object_t *object, struct p11Attribute_t *attribute, CK_ATTRIBUTE_PTR pTemplate);
+int loadDeferredAttributes(struct p11Object_t *object);
+int findOrLoadAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, struct p11Attribute_t **attribute);
 void addObjectToList(struct p11Object_t **ppObject, struct p11Object_t *object);
 int removeObjectFromList(struct p11Object_t **ppObject, CK_OBJECT_HANDLE handle);
 void removeAllObjectsFromList(struct p11Object_t **ppObject);
+int addObjectToIndex(struct p11ObjectIndex_t *index, struct p11Object_t *object);
+struct p11Object_t *findObjectInIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle);
+int removeObjectFromIndex(struct p11ObjectIndex_t *index, CK_OBJECT_HANDLE handle);
+void clearObjectIndex(struct p11ObjectIndex_t *index);
+void freeObjectIndex(struct p11ObjectIndex_t *index);
+int addObjectToAttributeIndex(struct p11AttributeIndex_t *index, struct p11Object_t *object);
+void removeObjectFromAttributeIndex(struct p11Object_t *object);
+void clearAttributeIndex(struct p11AttributeIndex_t *index);
+void freeAttributeIndex(struct p11AttributeIndex_t *index);
+int selectAttributeIndex(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_ULONG *hash);
+struct p11Object_t *firstInAttributeIndex(struct p11AttributeIndex_t *index, int i, CK_ULONG hash);
+struct p11Object_t *nextInAttributeIndex(struct p11Object_t *object, int i, CK_ULONG hash);
 int createObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createStorageObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int createKeyObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
 int serializeObject(struct p11Object_t *object, unsigned char **pBuffer, unsigned int *bufLength);
+int deserializeObject(struct p11Object_t *object, unsigned char *buffer, unsigned int length);
 void dumpAttribute(CK_ATTRIBUTE_PTR attr);
 
 #endif /* ___OBJECT_H_INC___ */
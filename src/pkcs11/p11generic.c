@@ -38,11 +38,12 @@
 #include <pkcs11/p11generic.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/slot.h>
 #include <pkcs11/strbpcpy.h>
+#include <pkcs11/stats.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
 
-#ifdef DEBUG
 #include <pkcs11/debug.h>
-#endif
 
 /*
  * Set up the global context structure.
@@ -130,6 +131,21 @@ CK_FUNCTION_LIST pkcs11_function_list = {
 
 
 
+/*
+ * Initialize the vendor specific function list.
+ *
+ */
+CK_SC_HSM_FUNCTION_LIST sc_hsm_function_list = {
+		{ SC_HSM_FUNCTION_LIST_VERSION_MAJOR, SC_HSM_FUNCTION_LIST_VERSION_MINOR },
+		C_SignBatch,
+		C_SetSessionPriority,
+		C_GetSlotStatistics,
+		C_GetMechanismStatistics,
+		C_InvalidateObjectCache
+};
+
+
+
 /**
  * C_Initialize initializes the Cryptoki library.
  *
@@ -172,9 +188,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 		return CKR_HOST_MEMORY;
 	}
 
-#ifdef DEBUG
+	if (pInitArgs) {
+		context->noThreads = (((CK_C_INITIALIZE_ARGS_PTR)pInitArgs)->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS) != 0;
+	}
+
 	initDebug(context);
-#endif
 
 	{
 		FUNC_CALLED();
@@ -183,6 +201,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 
 		initSlotPool(&context->slotPool);
 
+		initMechanismStatistics(context);
+
 		FUNC_RETURNS(CKR_OK);
 	}
 }
@@ -203,13 +223,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 
 	if (context != NULL) {
 
+		cancelSlotEvents(&context->slotPool);
+
 		terminateSessionPool(&context->sessionPool);
 
 		terminateSlotPool(&context->slotPool);
 
-#ifdef DEBUG
 		termDebug(context);
-#endif
 
 		free(context);
 		context = NULL;
@@ -289,3 +309,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetFunctionList)
 
 	FUNC_RETURNS(CKR_OK);
 }
+
+
+
+/**
+ * C_GetVendorFunctionList returns the list of vendor specific functions.
+ *
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_GetVendorFunctionList)
+(
+		CK_SC_HSM_FUNCTION_LIST_PTR_PTR ppFunctionList  /* receives pointer to
+		 * function list       */
+)
+{
+	FUNC_CALLED();
+
+	if (!isValidPtr(ppFunctionList)) {
+		FUNC_RETURNS(CKR_ARGUMENTS_BAD);
+	}
+
+	*ppFunctionList = &sc_hsm_function_list;
+
+	FUNC_RETURNS(CKR_OK);
+}
@@ -41,7 +41,11 @@
 #include <common/mutex.h>
 
 #include <pkcs11/cryptoki.h>
+
+#define ATTRIBUTE_INDEXES   3   /* Number of attributes indexed by value: CKA_CLASS, CKA_ID and CKA_LABEL */
+
 #include <pkcs11/object.h>
+#include <pkcs11/debug.h>
 
 #ifndef _MAX_PATH
 #define _MAX_PATH FILENAME_MAX
@@ -59,47 +63,36 @@
 #endif /* _WIN32 */
 #endif /* CTAPI */
 
-#ifdef DEBUG
-
-#define FUNC_CALLED() MUTEX *_pmutex_ = 0; \
+/*
+ * The FUNC_ macros log at runtime, depending on the level set with SC_HSM_LOG_LEVEL
+ */
+#define FUNC_CALLED() MUTEX *_pmutex_ = 0; struct p11Slot_t *_pslot_ = 0; \
 do { \
-	debug("Function %s called.\n", __FUNCTION__); \
+	(void)_pmutex_; (void)_pslot_; \
+	if (DEBUG_ENABLED(LOG_LEVEL_TRACE)) \
+		debugLog(LOG_LEVEL_TRACE, "Function %s called.\n", __FUNCTION__); \
 } while (0)
 
 
 #define FUNC_RETURNS(rc) do { \
 	CK_RV _rc_ = rc; \
-	debug("Function %s completes with rc=%d.\n", __FUNCTION__, _rc_); \
+	if (DEBUG_ENABLED(LOG_LEVEL_TRACE)) \
+		debugLog(LOG_LEVEL_TRACE, "Function %s completes with rc=%d.\n", __FUNCTION__, _rc_); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
+	if (_pslot_) unlockSlot(_pslot_); \
 	return _rc_; \
 } while (0)
 
 
 #define FUNC_FAILS(rc, msg) do { \
 	CK_RV _rc_ = rc; \
-	debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, _rc_, (msg)); \
+	if (DEBUG_ENABLED(LOG_LEVEL_ERROR)) \
+		debugLog(LOG_LEVEL_ERROR, "Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, _rc_, (msg)); \
 	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
+	if (_pslot_) unlockSlot(_pslot_); \
 	return _rc_; \
 } while (0)
 
-
-#else /* no debug */
-
-
-#define FUNC_CALLED() MUTEX *_pmutex_ = 0 
-
-#define FUNC_RETURNS(rc) do { \
-	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
-	return (rc); \
-} while (0)
-
-#define FUNC_FAILS(rc, msg) do { \
-	if (_pmutex_) MUTEX_UNLOCK(_pmutex_); \
-	return (rc); \
-} while (0)
-
-#endif
-
 /**
  * Gets ownership of the mutex *pmutex. Further it sets the stack variable
  * _pmutex_ (implicit defined with FUNC_CALLED) to pmutex. The purpose of this macro is
@@ -134,13 +127,37 @@ do { \
 	_pmutex_ = 0; \
 } while (0)
 
+/**
+ * Acquires the object lock of the slot exclusively and remembers the slot in the stack
+ * variable _pslot_, so that FUNC_RETURNS and FUNC_FAILS release it. Same rules as for FUNC_LOCK apply.
+ *
+ * @param slot         The slot.
+ */
+#define FUNC_LOCK_SLOT(slot) do { \
+	assert(!_pslot_); \
+	lockSlot(slot, TRUE); \
+	_pslot_ = slot; \
+} while (0)
+
+/**
+ * Releases the slot lock acquired with FUNC_LOCK_SLOT or one of the FUNC_FIND macros and sets
+ * the auto variable _pslot_ to NULL.
+ *
+ * @param slot         The slot.
+ */
+#define FUNC_UNLOCK_SLOT(slot) do { \
+	assert(_pslot_ && _pslot_ == slot); \
+	unlockSlot(slot); \
+	_pslot_ = 0; \
+} while (0)
+
 
 /**
  * Finds a session pointer for the provided session handle.
- * The slot mutex is aquired and remebered in _pmutex_ (= &session->slot->mutex).
+ * The object lock of the slot is aquired exclusively and the slot remembered in _pslot_.
  * Purpose of this macro: Each session function shall call the macro immediately after parameter checking.
  * Like all other FUNC_ macros the FUNC_RETURN and FUNC_FAILS handle the reverse operation
- * automatically, specifically releasing the slot mutex.
+ * automatically, specifically releasing the slot lock.
  * On call FUNC_CALLED must be called before, and later FUNC_RETURNS or FUNC_FAILS must be used instead
  * of return.
  *
@@ -149,19 +166,37 @@ do { \
  */
 #define FUNC_FIND_SESSION_AND_LOCK_SLOT(handle, ppSession, ppSlot) { \
 	int rc; \
-	assert(!_pmutex_); \
-	rc = safeFindSessionAndLockSlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot); \
+	assert(!_pslot_); \
+	rc = safeFindSessionAndLockSlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot, TRUE); \
+	if (rc) FUNC_RETURNS(rc); \
+	_pslot_ = *ppSlot; \
+} while (0);
+
+
+/**
+ * Same as FUNC_FIND_SESSION_AND_LOCK_SLOT, but the object lock of the slot is only shared.
+ * Use it for functions which neither add nor remove objects or sessions, so that they run
+ * concurrently with other functions and need not wait for a card transaction in another session.
+ * The card is still available, transmitAPDU() serializes all exchanges with the card.
+ *
+ * @param handle       The handle of the session.
+ * @param ppSession    Pointer the the session pointer which receives the found session.
+ */
+#define FUNC_FIND_SESSION_AND_SHARE_SLOT(handle, ppSession, ppSlot) { \
+	int rc; \
+	assert(!_pslot_); \
+	rc = safeFindSessionAndLockSlot(&context->sessionPool, &context->slotPool, handle, ppSession, ppSlot, FALSE); \
 	if (rc) FUNC_RETURNS(rc); \
-	_pmutex_ = &(*ppSlot)->mutex; \
+	_pslot_ = *ppSlot; \
 } while (0);
 	
 
 /**
  * Finds a slot pointer for the provided slot handle.
- * The slot mutex is aquired and remebered in _pmutex_ (= &slot->mutex).
+ * The object lock of the slot is aquired exclusively and the slot remembered in _pslot_.
  * Purpose of this macro: Each slot function shall call the macro immediately after parameter checking.
  * Like all other FUNC_ macros the FUNC_RETURN and FUNC_FAILS handle the reverse operation
- * automatically, specifically releasing the slot mutex.
+ * automatically, specifically releasing the slot lock.
  * On call FUNC_CALLED must be called before, and later FUNC_RETURNS or FUNC_FAILS must be used instead
  * of return.
  *
@@ -170,10 +205,25 @@ do { \
  */
 #define FUNC_FIND_AND_LOCK_SLOT(slotID, ppSlot) { \
 	int rc; \
-	assert(!_pmutex_); \
-	rc = safeFindAndLockSlot(&context->slotPool, slotID, ppSlot); \
+	assert(!_pslot_); \
+	rc = safeFindAndLockSlot(&context->slotPool, slotID, ppSlot, TRUE); \
+	if (rc) FUNC_RETURNS(rc); \
+	_pslot_ = *ppSlot; \
+} while (0);
+
+
+/**
+ * Same as FUNC_FIND_AND_LOCK_SLOT, but the object lock of the slot is only shared.
+ *
+ * @param slotID       self explaining
+ * @param ppSlot       Pointer the the slot pointer which receives the found slot.
+ */
+#define FUNC_FIND_AND_SHARE_SLOT(slotID, ppSlot) { \
+	int rc; \
+	assert(!_pslot_); \
+	rc = safeFindAndLockSlot(&context->slotPool, slotID, ppSlot, FALSE); \
 	if (rc) FUNC_RETURNS(rc); \
-	_pmutex_ = &(*ppSlot)->mutex; \
+	_pslot_ = *ppSlot; \
 } while (0);
 
 
@@ -188,6 +238,33 @@ do { \
 #define MUTEX_LOCK(pmutex) assert(!mutex_lock(pmutex))
 #define MUTEX_UNLOCK(pmutex) assert(!mutex_unlock(pmutex))
 
+/**
+ * Reader/writer lock macros. Same as for mutexes, all of them are protected by assert.
+ * Reader/writer locks are not recursive.
+ *
+ * @param plock     Pointer to a reader/writer lock structure.
+ */
+#define RWLOCK_INIT(plock) assert(!rwlock_init(plock))
+#define RWLOCK_INIT_WRITER(plock) assert(!rwlock_init_writer(plock))
+#define RWLOCK_DESTROY(plock) assert(!rwlock_destroy(plock))
+#define RWLOCK_RDLOCK(plock) assert(!rwlock_rdlock(plock))
+#define RWLOCK_WRLOCK(plock) assert(!rwlock_wrlock(plock))
+#define RWLOCK_RDUNLOCK(plock) assert(!rwlock_rdunlock(plock))
+#define RWLOCK_WRUNLOCK(plock) assert(!rwlock_wrunlock(plock))
+
+/**
+ * Monitor macros. Same as for mutexes, all of them are protected by assert.
+ * Monitors are not recursive.
+ *
+ * @param pmon      Pointer to a monitor structure.
+ */
+#define MONITOR_INIT(pmon) assert(!monitor_init(pmon))
+#define MONITOR_DESTROY(pmon) assert(!monitor_destroy(pmon))
+#define MONITOR_ENTER(pmon) assert(!monitor_enter(pmon))
+#define MONITOR_EXIT(pmon) assert(!monitor_exit(pmon))
+#define MONITOR_WAIT(pmon) assert(!monitor_wait(pmon))
+#define MONITOR_BROADCAST(pmon) assert(!monitor_broadcast(pmon))
+
 #ifdef mutex_owner
 #define VERIFY_MUTEXOWNER(pmutex) assert(mutex_owner(pmutex) == GetCurrentThreadId())
 #define VERIFY_NOT_MUTEXOWNER(pmutex) assert(mutex_owner(pmutex) != GetCurrentThreadId())
@@ -231,6 +308,42 @@ do { \
 		for ((pp) = &(list); *(pp); (pp) = &(*(pp))->next)
 
 
+#define CARD_PRIORITY_NORMAL    0       /* Bulk work, the default for new sessions         */
+#define CARD_PRIORITY_HIGH      1       /* Interactive requests, served before bulk work   */
+#define CARD_PRIORITIES         2
+
+/**
+ * Queue of threads waiting to use the card in a slot, see cardqueue.c
+ *
+ */
+struct p11CardQueue_t
+{
+	MONITOR monitor;                       /**< Protects the queue and signals a new turn    */
+	int busy;                              /**< An operation owns the card                   */
+	unsigned long nextTicket[CARD_PRIORITIES];  /**< Ticket for the next waiter per class    */
+	unsigned long serving[CARD_PRIORITIES];     /**< Ticket served next per class            */
+	int waiting[CARD_PRIORITIES];          /**< Number of waiting threads per class          */
+	int highInRow;                         /**< High priority turns since the last normal one*/
+};
+
+/**
+ * Counters of a slot, see stats.c. Times are in microseconds.
+ *
+ * All fields are updated with InterlockedAdd64() without holding a lock.
+ */
+struct p11SlotStatistics_t
+{
+	volatile long long operations;         /**< Cryptographic operations completed           */
+	volatile long long errors;             /**< Operations completed with an error           */
+	volatile long long rejected;           /**< Operations rejected by the card queue        */
+	volatile long long apdus;              /**< Command APDUs sent to the card               */
+	volatile long long bytesSent;          /**< Bytes sent to the card                       */
+	volatile long long bytesReceived;      /**< Bytes received from the card                 */
+	volatile long long lockWaitTime;       /**< Time spent waiting for the object lock       */
+	volatile long long cardWaitTime;       /**< Time spent waiting for the card              */
+	volatile long long cardTime;           /**< Time spent exchanging APDUs with the card    */
+};
+
 /**
  * Internal structure to store information about a slot.
  *
@@ -244,17 +357,59 @@ struct p11Slot_t
 	char readerName[MAX_READERNAME];       /**< The slot name                                */
 	SCARDCONTEXT context;                  /**< Card manager context for slot                */
 	SCARDHANDLE card;                      /**< Handle to card                               */
+	DWORD eventState;                      /**< Reader state last seen by C_WaitForSlotEvent */
+	volatile DWORD readerState;            /**< Reader state seen by the presence monitor    */
+	volatile int cardRemoved;              /**< The presence monitor saw the card go away    */
+#else
+	int eventPresence;                     /**< Card presence last seen by C_WaitForSlotEvent*/
 #endif
 	unsigned queuing;                      /**< Used to preventing slot deletion             */
-	MUTEX mutex;                           /**< mutex used for slot synchronisation          */
+	RWLOCK objectLock;                     /**< Shared to use, exclusive to change the token,
+	                                            its objects or the sessions of the slot      */
+	MUTEX mutex;                           /**< Card lock, owned for every card transaction  */
+	int exclusive;                         /**< The object lock is held exclusively          */
+	struct p11CardQueue_t cardQueue;       /**< Threads waiting to use the card              */
+	struct p11SlotStatistics_t stats;      /**< Counters for C_GetSlotStatistics             */
 	int sessionCount;                      /**< Number of sessions                           */
 	int readOnlySessionCount;              /**< Number of read only sessions                 */
 	int present;                           /**< Used in saveUpdateSlots                      */
 	int closed;                            /**< Slot ready for delete                        */
 	struct p11Token_t *token;              /**< Pointer to token in the slot                 */
+	struct p11RandomPool_t *random;        /**< Buffered random bytes from the token         */
+	struct p11Slot_t *hashNext;            /**< Next slot in the same hash bucket            */
 	struct p11Slot_t *next;                /**< Pointer to next slot, NULL if last           */
 };
 
+void lockSlot(struct p11Slot_t *slot, int exclusive);
+void unlockSlot(struct p11Slot_t *slot);
+
+/**
+ * Hash index mapping object handles to objects.
+ *
+ * Each bucket is a list linked through the hashNext field of the object. The index does not
+ * own the objects, these remain in the object list of the token or session.
+ */
+struct p11ObjectIndex_t
+{
+	CK_ULONG count;                        /**< Number of objects in the index               */
+	CK_ULONG size;                         /**< Number of buckets, always a power of 2       */
+	struct p11Object_t **table;            /**< Bucket table, NULL until first object added  */
+};
+
+/**
+ * Hash indexes mapping the values of CKA_CLASS, CKA_ID and CKA_LABEL to objects.
+ *
+ * Every object in the index is linked into one bucket of each table through the attrNext
+ * fields of the object, using the hash of the attribute value stored in attrHash. Objects
+ * without the attribute are linked into the bucket for the missing value.
+ */
+struct p11AttributeIndex_t
+{
+	CK_ULONG count;                        /**< Number of objects in the index               */
+	CK_ULONG size;                         /**< Number of buckets, always a power of 2       */
+	struct p11Object_t **table[ATTRIBUTE_INDEXES]; /**< Bucket table per indexed attribute   */
+};
+
 /**
  * Internal structure to store information about a token.
  *
@@ -270,32 +425,76 @@ struct p11Token_t
 	struct p11Object_t *pubObjectList;     /**< Pointer to first object in pool              */
 	CK_ULONG privObjectCount;              /**< The number of private objects in this token  */
 	struct p11Object_t *privObjectList;    /**< Pointer to the first object in pool          */
+	struct p11ObjectIndex_t pubObjectIndex;  /**< Public objects indexed by handle           */
+	struct p11ObjectIndex_t privObjectIndex; /**< Private objects indexed by handle          */
+	struct p11AttributeIndex_t pubAttributeIndex;  /**< Public objects indexed by value      */
+	struct p11AttributeIndex_t privAttributeIndex; /**< Private objects indexed by value     */
 };
 
 /**
- * Internal structure to store information for session management and a list
+ * Internal structure to store information for session management and a table
  * of all active sessions.
  *
+ * Sessions are stored in a hash table indexed by the session handle. Each bucket is a list
+ * linked through the next field of the session. Lookups take the read lock, so concurrent
+ * calls on different sessions do not serialize on the pool.
+ *
  */
 struct p11SessionPool_t
 {
 	CK_SESSION_HANDLE nextHandle;          /**< Value of next assigned session handle        */
-	MUTEX mutex;                           /**< mutex for thread safe access                 */
+	RWLOCK lock;                           /**< reader/writer lock for thread safe access    */
 	CK_ULONG count;                        /**< Number of active sessions                    */
-	struct p11Session_t *list;             /**< Pointer to first session in pool             */
+	CK_ULONG tableSize;                    /**< Number of buckets, always a power of 2       */
+	struct p11Session_t **table;           /**< Hash table of sessions                       */
 };
 
 
 /**
  * Internal structure to store information about all available slots.
  *
+ * The list keeps the slots in the order they were added and is protected by the mutex,
+ * which also serializes slot updates. Lookups by slot id use the hash table, which is
+ * protected by the reader/writer lock. The write lock is only held while a slot is linked
+ * into or unlinked from the table, so slot updates do not block lookups on other slots.
+ *
  */
 struct p11SlotPool_t
 {
 	CK_SLOT_ID nextID;                     /**< The next assigned slot ID value              */
-	MUTEX mutex;                           /**< mutex for thread safe access                 */
+	MUTEX mutex;                           /**< mutex for slot list and slot updates         */
+	RWLOCK lock;                           /**< reader/writer lock for the hash table        */
 	CK_ULONG count;                        /**< Number of slots in the pool                  */
+	CK_ULONG tableSize;                    /**< Number of buckets, always a power of 2       */
+	struct p11Slot_t **table;              /**< Hash table of slots indexed by slot id       */
 	struct p11Slot_t *list;                /**< Pointer to first slot in pool                */
+	struct p11Slot_t *last;                /**< Pointer to last slot in pool                 */
+#ifndef CTAPI
+	SCARDCONTEXT eventContext;             /**< Card manager context for slot events         */
+	DWORD eventReaders;                    /**< Reader list state seen by C_WaitForSlotEvent */
+	SCARDCONTEXT monitorContext;           /**< Card manager context of the presence monitor */
+	THREAD monitorThread;                  /**< Thread watching card and reader changes      */
+	volatile int monitorState;             /**< One of the MONITOR_xxx states in slot-pcsc.c */
+	volatile int monitorRebuild;           /**< The presence monitor must reread the slots   */
+	volatile int readersChanged;           /**< The list of readers must be updated          */
+	volatile int pnpUnsupported;           /**< Reader changes are not reported by PC/SC     */
+#endif
+	volatile int eventCancelled;           /**< C_Finalize cancelled waiting for slot events */
+};
+
+
+#define MECHANISM_STATISTICS   32      /* Number of mechanisms with counters            */
+
+/**
+ * Counters of a mechanism across all slots, see stats.c. Times are in microseconds.
+ *
+ */
+struct p11MechanismStatistics_t
+{
+	CK_MECHANISM_TYPE mechanism;           /**< The mechanism, set once in C_Initialize      */
+	volatile long long operations;         /**< Operations completed                         */
+	volatile long long errors;             /**< Operations completed with an error           */
+	volatile long long time;               /**< Time spent in the completing call            */
 };
 
 
@@ -310,9 +509,9 @@ struct p11Context_t
 	CK_HW_FEATURE_TYPE HardwareFeatures;   /**< Hardware feature type of device              */
 	struct p11SessionPool_t sessionPool;   /**< open sessions                                */
 	struct p11SlotPool_t slotPool;         /**< available slots                              */
-#ifdef DEBUG
-	FILE *debugFileHandle;
-#endif
+	int noThreads;                         /**< The library must not create threads          */
+	CK_ULONG mechanismCount;               /**< Number of entries in mechanismStats          */
+	struct p11MechanismStatistics_t mechanismStats[MECHANISM_STATISTICS];
 };
 
 #endif /* ___P11GENERIC_H_INC___ */
@@ -31,11 +31,19 @@
  * @brief   Crypto mechanisms at the PKCS#11 interface
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <pkcs11/p11generic.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/token.h>
+#include <pkcs11/digest.h>
+#include <pkcs11/random.h>
+#include <pkcs11/cardqueue.h>
+#include <pkcs11/stats.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
 #include <pkcs11/debug.h>
 
 
@@ -61,6 +69,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	/* The public key may be taken from a certificate not loaded yet, which changes the token objects */
 	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
@@ -81,6 +90,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 
 	if (!rv) {
 		session->activeObjectHandle = object->handle;
+		session->activeMechanism = pMechanism->mechanism;
 		rv = CKR_OK;
 	}
 
@@ -102,6 +112,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -109,7 +120,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -123,6 +134,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 
 	if (object->C_Encrypt != NULL) {
 		rv = object->C_Encrypt(object, session->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		if (pEncryptedData != NULL) {
+			countOperation(slot, session->activeMechanism, rv, start);
+			// The operation completes, unless the caller is asked for a larger buffer
+			if (rv != CKR_BUFFER_TOO_SMALL) {
+				session->activeObjectHandle = CK_INVALID_HANDLE;
+			}
+		}
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
@@ -153,7 +171,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -194,7 +212,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -240,7 +258,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
@@ -282,6 +300,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	long long start = 0;
 
 	FUNC_CALLED();
 
@@ -289,7 +308,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -302,13 +321,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	}
 
 	if (pData != NULL) {
+		// A rejected operation remains active, so that the caller can try again later
+		rv = beginCardOperation(slot, session->priority);
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Card queue is full");
+		}
+
 		session->activeObjectHandle = CK_INVALID_HANDLE;
+		start = statsClock();
 	}
 
 	if (object->C_Decrypt != NULL) {
 		rv = object->C_Decrypt(object, session->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
 	} else {
-		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	if (pData != NULL) {
+		endCardOperation(slot);
+		countOperation(slot, session->activeMechanism, rv, start);
 	}
 
 	FUNC_RETURNS(rv);
@@ -337,7 +369,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -378,7 +410,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -406,13 +438,31 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 
 
 
+/**
+ * Release the digest context of a C_Digest operation
+ *
+ * @param session   the session
+ */
+static void releaseDigest(struct p11Session_t *session)
+{
+	if (session->digest) {
+		memset(session->digest, 0, sizeof(*session->digest));
+		free(session->digest);
+		session->digest = NULL;
+	}
+}
+
+
+
 /*  C_DigestInit initializes a message-digesting operation. */
 CK_DECLARE_FUNCTION(CK_RV, C_DigestInit)(
 		CK_SESSION_HANDLE hSession,
 		CK_MECHANISM_PTR pMechanism
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -420,6 +470,28 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pMechanism == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pMechanism must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->digest != NULL) {
+		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
+	}
+
+	// Digests are computed in software and never involve the token
+	session->digest = (struct p11DigestContext_t *)malloc(sizeof(struct p11DigestContext_t));
+	if (session->digest == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rv = digestInit(session->digest, pMechanism->mechanism);
+
+	if (rv != CKR_OK) {
+		releaseDigest(session);
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -434,7 +506,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_Digest)(
 		CK_ULONG_PTR pulDigestLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_ULONG digestLength;
+	CK_MECHANISM_TYPE mechanism;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -442,7 +518,37 @@ CK_DECLARE_FUNCTION(CK_RV, C_Digest)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_RETURNS(rv);
+	if (pulDigestLen == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pulDigestLen must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->digest == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	digestLength = session->digest->digestLength;
+	mechanism = session->digest->mechanism;		// digestFinal() clears the context
+
+	if (pDigest == NULL) {
+		*pulDigestLen = digestLength;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulDigestLen < digestLength) {
+		*pulDigestLen = digestLength;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer provided by caller too small");
+	}
+
+	digestUpdate(session->digest, pData, ulDataLen);
+	digestFinal(session->digest, pDigest);
+	*pulDigestLen = digestLength;
+
+	countOperation(slot, mechanism, CKR_OK, start);
+	releaseDigest(session);
+
+	FUNC_RETURNS(CKR_OK);
 }
 
 
@@ -455,7 +561,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestUpdate)(
 		CK_ULONG ulPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -463,7 +570,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_RETURNS(rv);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->digest == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	digestUpdate(session->digest, pPart, ulPartLen);
+
+	FUNC_RETURNS(CKR_OK);
 }
 
 
@@ -495,7 +610,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestFinal)(
 		CK_ULONG_PTR pulDigestLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_ULONG digestLength;
+	CK_MECHANISM_TYPE mechanism;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -503,7 +622,124 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_RETURNS(rv);
+	if (pulDigestLen == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pulDigestLen must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->digest == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	digestLength = session->digest->digestLength;
+	mechanism = session->digest->mechanism;		// digestFinal() clears the context
+
+	if (pDigest == NULL) {
+		*pulDigestLen = digestLength;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulDigestLen < digestLength) {
+		*pulDigestLen = digestLength;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer provided by caller too small");
+	}
+
+	digestFinal(session->digest, pDigest);
+	*pulDigestLen = digestLength;
+
+	countOperation(slot, mechanism, CKR_OK, start);
+	releaseDigest(session);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Release the host side digest of a hash-and-sign operation
+ *
+ * @param session   the session
+ */
+static void releaseSignDigest(struct p11Session_t *session)
+{
+	if (session->signDigest) {
+		memset(session->signDigest, 0, sizeof(*session->signDigest));
+		free(session->signDigest);
+		session->signDigest = NULL;
+	}
+}
+
+
+
+/**
+ * Complete the host side digest of a hash-and-sign operation and encode it as input for the
+ * raw signature mechanism, i.e. as DigestInfo for PKCS#1 V1.5 or as plain hash for PSS and ECDSA.
+ *
+ * @param mech              the hash-and-sign mechanism
+ * @param digestCtx         the running digest of the input
+ * @param signMech          the raw signature mechanism
+ * @param data              the buffer receiving at least MAX_DIGESTINFO_LENGTH bytes
+ * @return                  the length of the encoded digest or -1 for an invalid mechanism
+ */
+static int finishHostDigest(CK_MECHANISM_TYPE mech, struct p11DigestContext_t *digestCtx, CK_MECHANISM_TYPE *signMech, CK_BYTE_PTR data)
+{
+	CK_MECHANISM_TYPE hashMech;
+	CK_BYTE digest[MAX_DIGEST_LENGTH];
+	int len;
+
+	if (getHashAndSignMechanisms(mech, &hashMech, signMech) != CKR_OK) {
+		return -1;
+	}
+
+	len = digestCtx->digestLength;
+	digestFinal(digestCtx, digest);
+
+	if (*signMech == CKM_RSA_PKCS) {
+		len = encodeDigestInfo(hashMech, digest, data, MAX_DIGESTINFO_LENGTH);
+	} else {
+		memcpy(data, digest, len);
+	}
+
+	memset(digest, 0, sizeof(digest));
+	return len;
+}
+
+
+
+/**
+ * Complete a hash-and-sign operation for which the input was hashed on the host.
+ *
+ * The encoded digest is passed to the token using the corresponding raw signature mechanism.
+ *
+ * @param object            the private key
+ * @param session           the session with the active signature operation
+ * @param pSignature        the buffer receiving the signature or NULL to query the length
+ * @param pulSignatureLen   the size of the buffer and length of the signature
+ * @return                  CKR_OK or any error returned by the token
+ */
+static int signHostDigest(struct p11Object_t *object, struct p11Session_t *session, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	CK_MECHANISM_TYPE hashMech, signMech;
+	CK_BYTE data[MAX_DIGESTINFO_LENGTH];
+	int rv, len;
+
+	if (pSignature == NULL) {
+		if (getHashAndSignMechanisms(session->activeMechanism, &hashMech, &signMech) != CKR_OK) {
+			return CKR_MECHANISM_INVALID;
+		}
+		return object->C_Sign(object, signMech, NULL, 0, NULL, pulSignatureLen);
+	}
+
+	len = finishHostDigest(session->activeMechanism, session->signDigest, &signMech, data);
+	if (len < 0) {
+		return CKR_MECHANISM_INVALID;
+	}
+
+	rv = object->C_Sign(object, signMech, data, len, pSignature, pulSignatureLen);
+
+	memset(data, 0, sizeof(data));
+	return rv;
 }
 
 
@@ -517,6 +753,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 )
 {
 	int rv;
+	CK_MECHANISM_TYPE hashMech, signMech;
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
@@ -527,7 +764,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
@@ -546,6 +783,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	}
 
 	if (!rv) {
+		releaseSignDigest(session);
+
+		// Hash the input on the host, so that neither memory use nor the APDU size limit the message size
+		if (getHashAndSignMechanisms(pMechanism->mechanism, &hashMech, &signMech) == CKR_OK) {
+			session->signDigest = (struct p11DigestContext_t *)malloc(sizeof(struct p11DigestContext_t));
+			if (session->signDigest == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+			digestInit(session->signDigest, hashMech);
+		}
+
 		session->activeObjectHandle = object->handle;
 		session->activeMechanism = pMechanism->mechanism;
 		rv = CKR_OK;
@@ -569,6 +817,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	long long start = 0;
 
 	FUNC_CALLED();
 
@@ -576,7 +825,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -589,13 +838,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	}
 
 	if (pSignature != NULL) {
+		// A rejected operation remains active, so that the caller can try again later
+		rv = beginCardOperation(slot, session->priority);
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Card queue is full");
+		}
+
 		session->activeObjectHandle = CK_INVALID_HANDLE;
+		start = statsClock();
 	}
 
-	if (object->C_Sign != NULL) {
+	if ((session->signDigest != NULL) && (object->C_Sign != NULL)) {
+		if (pSignature != NULL) {
+			digestUpdate(session->signDigest, pData, ulDataLen);
+		}
+		rv = signHostDigest(object, session, pSignature, pulSignatureLen);
+	} else if (object->C_Sign != NULL) {
 		rv = object->C_Sign(object, session->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
 	} else {
-		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+	}
+
+	if (pSignature != NULL) {
+		endCardOperation(slot);
+		countOperation(slot, session->activeMechanism, rv, start);
+		releaseSignDigest(session);
 	}
 
 	FUNC_RETURNS(rv);
@@ -622,7 +890,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -634,7 +902,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (object->C_SignUpdate != NULL) {
+	if (session->signDigest != NULL) {
+		digestUpdate(session->signDigest, pPart, ulPartLen);
+		rv = CKR_OK;
+	} else if (object->C_SignUpdate != NULL) {
 		rv = object->C_SignUpdate(object, session->activeMechanism, pPart, ulPartLen);
 	} else {
 		rv = appendToCryptoBuffer(session, pPart, ulPartLen);
@@ -656,6 +927,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	long long start = 0;
 
 	FUNC_CALLED();
 
@@ -663,7 +935,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
@@ -676,19 +948,184 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	}
 
 	if (pSignature != NULL) {
+		rv = beginCardOperation(slot, session->priority);
+
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Card queue is full");
+		}
+
 		session->activeObjectHandle = CK_INVALID_HANDLE;
+		start = statsClock();
 	}
 
-	if (object->C_SignFinal != NULL) {
+	if ((session->signDigest != NULL) && (object->C_Sign != NULL)) {
+		rv = signHostDigest(object, session, pSignature, pulSignatureLen);
+	} else if (object->C_SignFinal != NULL) {
 		rv = object->C_SignFinal(object, session->activeMechanism, pSignature, pulSignatureLen);
 	} else if (object->C_Sign != NULL) {
 		rv = object->C_Sign(object, session->activeMechanism, session->cryptoBuffer, session->cryptoBufferSize, pSignature, pulSignatureLen);
 	} else {
-		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
 	}
 
 	if (pSignature != NULL) {
+		endCardOperation(slot);
+		countOperation(slot, session->activeMechanism, rv, start);
 		clearCryptoBuffer(session);
+		releaseSignDigest(session);
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Set the result of all items of a batch starting at the given index
+ */
+static void setBatchResult(CK_SIGN_BATCH_ITEM_PTR pItems, CK_ULONG from, CK_ULONG ulCount, CK_RV rv)
+{
+	for (; from < ulCount; from++) {
+		pItems[from].rv = rv;
+	}
+}
+
+
+
+/**
+ * Sign a single item of a batch with the key and mechanism validated by C_SignBatch
+ */
+static CK_RV signBatchItem(struct p11Object_t *object, CK_MECHANISM_TYPE mech, int hostDigest, CK_ULONG sigLen, CK_SIGN_BATCH_ITEM_PTR item)
+{
+	struct p11DigestContext_t digestCtx;
+	CK_MECHANISM_TYPE hashMech, signMech;
+	CK_BYTE data[MAX_DIGESTINFO_LENGTH];
+	int rv, len;
+
+	if (item->pSignature == NULL) {
+		item->ulSignatureLen = sigLen;
+		return CKR_OK;
+	}
+
+	if (item->ulSignatureLen < sigLen) {
+		item->ulSignatureLen = sigLen;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	if ((item->pData == NULL) && (item->ulDataLen > 0)) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	if (!hostDigest) {
+		rv = object->C_Sign(object, mech, item->pData, item->ulDataLen, item->pSignature, &item->ulSignatureLen);
+	} else {
+		getHashAndSignMechanisms(mech, &hashMech, &signMech);
+		digestInit(&digestCtx, hashMech);
+		digestUpdate(&digestCtx, item->pData, item->ulDataLen);
+
+		len = finishHostDigest(mech, &digestCtx, &signMech, data);
+		if (len < 0) {
+			return CKR_MECHANISM_INVALID;
+		}
+
+		rv = object->C_Sign(object, signMech, data, len, item->pSignature, &item->ulSignatureLen);
+		memset(data, 0, sizeof(data));
+	}
+
+	// The token layer reports failed APDUs with negative values
+	return rv < 0 ? CKR_FUNCTION_FAILED : rv;
+}
+
+
+
+/*  C_SignBatch is a vendor extension that signs a list of inputs with the same key and
+    mechanism. The slot is locked and the key is resolved only once for the whole batch,
+    so the SIGN commands are sent to the token back to back. The result of each signature
+    is returned in the rv field of the item. The function returns CKR_OK if all items were
+    signed or the result of the first item that failed. */
+CK_DECLARE_FUNCTION(CK_RV, C_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_SIGN_BATCH_ITEM_PTR pItems,
+		CK_ULONG ulCount
+)
+{
+	CK_RV rv, itemrv;
+	CK_MECHANISM_TYPE hashMech, signMech, mech;
+	CK_ULONG i, sigLen;
+	int hostDigest;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if ((pMechanism == NULL) || ((pItems == NULL) && (ulCount > 0))) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pMechanism and pItems must not be NULL");
+	}
+
+	setBatchResult(pItems, 0, ulCount, CKR_FUNCTION_FAILED);
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	rv = findSlotObject(slot, hKey, &object, FALSE);
+
+	if (rv != CKR_OK) {
+		setBatchResult(pItems, 0, ulCount, rv);
+		FUNC_RETURNS(rv);
+	}
+
+	if ((object->C_SignInit == NULL) || (object->C_Sign == NULL)) {
+		setBatchResult(pItems, 0, ulCount, CKR_FUNCTION_NOT_SUPPORTED);
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	rv = object->C_SignInit(object, pMechanism);
+
+	if (rv != CKR_OK) {
+		setBatchResult(pItems, 0, ulCount, rv);
+		FUNC_RETURNS(rv);
+	}
+
+	mech = pMechanism->mechanism;
+	hostDigest = getHashAndSignMechanisms(mech, &hashMech, &signMech) == CKR_OK;
+
+	// All items use the same key and mechanism, so the signature size is the same for all
+	rv = object->C_Sign(object, hostDigest ? signMech : mech, NULL, 0, NULL, &sigLen);
+
+	if (rv != CKR_OK) {
+		setBatchResult(pItems, 0, ulCount, rv);
+		FUNC_RETURNS(rv);
+	}
+
+	for (i = 0; i < ulCount; i++) {
+		// Queue for each item, so that other sessions get the card between items
+		itemrv = beginCardOperation(slot, session->priority);
+
+		if (itemrv == CKR_OK) {
+			start = statsClock();
+			itemrv = signBatchItem(object, mech, hostDigest, sigLen, &pItems[i]);
+			endCardOperation(slot);
+			countOperation(slot, mech, itemrv, start);
+		}
+
+		pItems[i].rv = itemrv;
+
+		if ((itemrv != CKR_OK) && (rv == CKR_OK)) {
+			rv = itemrv;
+		}
+
+		// Do not try the remaining items if the token is gone or busy
+		if ((itemrv == CKR_DEVICE_REMOVED) || (itemrv == CKR_TOKEN_NOT_PRESENT) || (itemrv == CKR_FUNCTION_REJECTED)) {
+			setBatchResult(pItems, i + 1, ulCount, itemrv);
+			break;
+		}
 	}
 
 	FUNC_RETURNS(rv);
@@ -748,7 +1185,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 		CK_OBJECT_HANDLE hKey
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	CK_MECHANISM_TYPE hashMech, signMech;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -756,11 +1197,76 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pMechanism == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pMechanism must not be NULL");
+	}
+
+	/* Exclusive, see C_EncryptInit */
+	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
+	}
+
+	rv = findSlotObject(slot, hKey, &object, FALSE);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (object->C_VerifyInit != NULL) {
+		rv = object->C_VerifyInit(object, pMechanism);
+	} else {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	if (!rv) {
+		releaseSignDigest(session);
+
+		if (getHashAndSignMechanisms(pMechanism->mechanism, &hashMech, &signMech) == CKR_OK) {
+			session->signDigest = (struct p11DigestContext_t *)malloc(sizeof(struct p11DigestContext_t));
+			if (session->signDigest == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+			digestInit(session->signDigest, hashMech);
+		}
+
+		session->activeObjectHandle = object->handle;
+		session->activeMechanism = pMechanism->mechanism;
+		rv = CKR_OK;
+	}
+
 	FUNC_RETURNS(rv);
 }
 
 
 
+/**
+ * Complete a verification with the data collected in the session
+ */
+static int verifySessionData(struct p11Object_t *object, struct p11Session_t *session, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	CK_MECHANISM_TYPE signMech;
+	CK_BYTE data[MAX_DIGESTINFO_LENGTH];
+	int rv, len;
+
+	if (session->signDigest == NULL) {
+		return object->C_Verify(object, session->activeMechanism, session->cryptoBuffer, session->cryptoBufferSize, pSignature, ulSignatureLen);
+	}
+
+	len = finishHostDigest(session->activeMechanism, session->signDigest, &signMech, data);
+	if (len < 0) {
+		return CKR_MECHANISM_INVALID;
+	}
+
+	rv = object->C_Verify(object, signMech, data, len, pSignature, ulSignatureLen);
+
+	memset(data, 0, sizeof(data));
+	return rv;
+}
+
+
+
 /*  C_Verify verifies a signature in a single-part operation, where the signature
     is an appendix to the data. */
 CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
@@ -771,7 +1277,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		CK_ULONG ulSignatureLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -779,6 +1289,36 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = findSlotObject(slot, session->activeObjectHandle, &object, FALSE);
+
+	session->activeObjectHandle = CK_INVALID_HANDLE;
+
+	if (rv != CKR_OK) {
+		releaseSignDigest(session);
+		FUNC_RETURNS(rv);
+	}
+
+	if (object->C_Verify == NULL) {
+		releaseSignDigest(session);
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	if (session->signDigest != NULL) {
+		digestUpdate(session->signDigest, pData, ulDataLen);
+		rv = verifySessionData(object, session, pSignature, ulSignatureLen);
+	} else {
+		rv = object->C_Verify(object, session->activeMechanism, pData, ulDataLen, pSignature, ulSignatureLen);
+	}
+
+	countOperation(slot, session->activeMechanism, rv, start);
+	releaseSignDigest(session);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -792,7 +1332,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 		CK_ULONG ulPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -800,6 +1342,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	if (session->signDigest != NULL) {
+		digestUpdate(session->signDigest, pPart, ulPartLen);
+		rv = CKR_OK;
+	} else {
+		rv = appendToCryptoBuffer(session, pPart, ulPartLen);
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -813,7 +1368,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		CK_ULONG ulSignatureLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -821,6 +1380,28 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = findSlotObject(slot, session->activeObjectHandle, &object, FALSE);
+
+	session->activeObjectHandle = CK_INVALID_HANDLE;
+
+	if (rv == CKR_OK) {
+		if (object->C_Verify != NULL) {
+			rv = verifySessionData(object, session, pSignature, ulSignatureLen);
+		} else {
+			rv = CKR_FUNCTION_NOT_SUPPORTED;
+		}
+		countOperation(slot, session->activeMechanism, rv, start);
+	}
+
+	clearCryptoBuffer(session);
+	releaseSignDigest(session);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -834,7 +1415,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
 		CK_OBJECT_HANDLE hKey
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
@@ -842,6 +1426,40 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pMechanism == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pMechanism must not be NULL");
+	}
+
+	// Only mechanisms which encode the data in the signature support recovery
+	if ((pMechanism->mechanism != CKM_RSA_X_509) && (pMechanism->mechanism != CKM_RSA_PKCS)) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism does not support recovery");
+	}
+
+	/* Exclusive, see C_VerifyInit */
+	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle != CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_ACTIVE, "Operation is already active");
+	}
+
+	rv = findSlotObject(slot, hKey, &object, FALSE);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if ((object->C_VerifyInit != NULL) && (object->C_VerifyRecover != NULL)) {
+		rv = object->C_VerifyInit(object, pMechanism);
+	} else {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	if (!rv) {
+		session->activeObjectHandle = object->handle;
+		session->activeMechanism = pMechanism->mechanism;
+		rv = CKR_OK;
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -857,7 +1475,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecover)(
 		CK_ULONG_PTR pulDataLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Object_t *object;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	long long start = statsClock();
 
 	FUNC_CALLED();
 
@@ -865,6 +1487,34 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecover)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pulDataLen == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pulDataLen must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	if (session->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = findSlotObject(slot, session->activeObjectHandle, &object, FALSE);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (object->C_VerifyRecover != NULL) {
+		rv = object->C_VerifyRecover(object, session->activeMechanism, pSignature, ulSignatureLen, pData, pulDataLen);
+	} else {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	/* The operation remains active to allow a retry after a length query or CKR_BUFFER_TOO_SMALL */
+	if ((pData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
+		session->activeObjectHandle = CK_INVALID_HANDLE;
+		countOperation(slot, session->activeMechanism, rv, start);
+	}
+
 	FUNC_RETURNS(rv);
 }
 
@@ -1089,7 +1739,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 		CK_ULONG ulSeedLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
 
 	FUNC_CALLED();
 
@@ -1097,6 +1750,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if ((pSeed == NULL) && (ulSeedLen > 0)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pSeed must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	rv = getToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = seedRandom(slot, pSeed, ulSeedLen);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -1109,7 +1776,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		CK_ULONG ulRandomLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
 
 	FUNC_CALLED();
 
@@ -1117,6 +1787,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if ((pRandomData == NULL) && (ulRandomLen > 0)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pRandomData must not be NULL");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	rv = getToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	// Small requests are served from the slot's pool without a round trip to the token
+	rv = generateRandom(slot, pRandomData, ulRandomLen);
+
 	FUNC_RETURNS(rv);
 }
 
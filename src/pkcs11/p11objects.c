@@ -45,6 +45,42 @@
 
 extern struct p11Context_t *context;
 
+/* Internal return code: An object with deferred attributes was met while sharing the slot */
+#define DEFERRED_ATTRIBUTES		-1
+
+
+
+/**
+ * Find a session object or a token object visible to the session
+ *
+ * @param session  the session
+ * @param slot     the slot, locked or shared by the caller
+ * @param hObject  the object handle
+ * @param ppObject updated with the object
+ * @return CKR_OK or CKR_OBJECT_HANDLE_INVALID
+ */
+static int findObject(struct p11Session_t *session, struct p11Slot_t *slot, CK_OBJECT_HANDLE hObject, struct p11Object_t **ppObject)
+{
+	CK_STATE state;
+
+	if (findSessionObject(session, hObject, ppObject) >= 0) {
+		return CKR_OK;
+	}
+
+	if (findTokenObject(slot->token, hObject, ppObject, TRUE) >= 0) {
+		return CKR_OK;
+	}
+
+	state = getSessionState(session, slot);
+	if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
+		if (findTokenObject(slot->token, hObject, ppObject, FALSE) >= 0) {
+			return CKR_OK;
+		}
+	}
+
+	return CKR_OBJECT_HANDLE_INVALID;
+}
+
 
 
 /*  C_CreateObject creates a new object. */
@@ -112,8 +148,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 
 	/* Check if this is a session or a token object */
 
-	FUNC_LOCK(&slot->mutex);
-
 	if (slot->token == NULL) {
 		free(object);
 		FUNC_FAILS(CKR_DEVICE_REMOVED, "device removed");
@@ -121,7 +155,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 
 	/* Token object */
 	if (getSessionState(session, slot) == CKS_RW_USER_FUNCTIONS && object->tokenObj) {
-		addTokenObject(slot->token, object, object->publicObj);
+		rv = addTokenObject(slot->token, object, object->publicObj);
+
+		if (rv != CKR_OK) {
+			removeAllAttributes(object);
+			free(object);
+			FUNC_FAILS(rv, "Could not add token object");
+		}
 
 		rv = synchronizeToken(slot);
 
@@ -136,7 +176,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 			FUNC_FAILS(CKR_SESSION_READ_ONLY, "Can not create token objects in read only session");
 		}
 
-		addSessionObject(session, object);
+		rv = addSessionObject(session, object);
+
+		if (rv != CKR_OK) {
+			removeAllAttributes(object);
+			free(object);
+			FUNC_FAILS(rv, "Could not add session object");
+		}
 	}
 
 	*phObject = object->handle;
@@ -241,7 +287,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 	struct p11Slot_t *slot;
 	unsigned int size;
 	unsigned char *tmp;
-	CK_STATE state;
 
 	FUNC_CALLED();
 
@@ -253,31 +298,36 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (slot->token == NULL) {
 		FUNC_FAILS(CKR_DEVICE_REMOVED, "device removed");
 	}
 
-	rv = findSessionObject(session, hObject, &object);
+	rv = findObject(session, slot, hObject, &object);
 
-	if (rv < 0) {
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
 
-		rv = findTokenObject(slot->token, hObject, &object, TRUE);
-		
-		if (rv < 0) {
-			state = getSessionState(session, slot);
-			if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
-				rv = findTokenObject(slot->token, hObject, &object, FALSE);
-				if (rv < 0) {
-					FUNC_RETURNS(CKR_OBJECT_HANDLE_INVALID);
-				}
-			} else {
-				FUNC_RETURNS(CKR_OBJECT_HANDLE_INVALID);
-			}
+	if (object->loadAttributes != NULL) {
+		/* Loading attributes changes the object, which requires the exclusive slot lock */
+		FUNC_UNLOCK_SLOT(slot);
+		FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+
+		rv = findObject(session, slot, hObject, &object);
+
+		if (rv != CKR_OK) {
+			FUNC_RETURNS(rv);
 		}
 	}
 
+	rv = loadDeferredAttributes(object);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Could not load object attributes");
+	}
+
 	serializeObject(object, &tmp, &size);
 	free(tmp);
 
@@ -302,7 +352,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	struct p11Attribute_t *attribute;
-	CK_STATE state;
 
 	FUNC_CALLED();
 
@@ -314,28 +363,30 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (slot->token == NULL) {
 		FUNC_FAILS(CKR_DEVICE_REMOVED, "device removed");
 	}
 
-	rv = findSessionObject(session, hObject, &object);
+	rv = findObject(session, slot, hObject, &object);
 
-	if (rv < 0) {
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Object not found with handle");
+	}
 
-		rv = findTokenObject(slot->token, hObject, &object, TRUE);
+	if (object->loadAttributes != NULL) {
+		for (i = 0; (i < ulCount) && (findAttribute(object, pTemplate + i, &attribute) >= 0); i++);
 
-		if (rv < 0) {
-			state = getSessionState(session, slot);
-			if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
-				rv = findTokenObject(slot->token, hObject, &object, FALSE);
+		if (i < ulCount) {
+			/* Loading attributes changes the object, which requires the exclusive slot lock */
+			FUNC_UNLOCK_SLOT(slot);
+			FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
 
-				if (rv < 0) {
-					FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Private token object not found with handle");
-				}
-			} else {
-				FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Public token object not found with handle");
+			rv = findObject(session, slot, hObject, &object);
+
+			if (rv != CKR_OK) {
+				FUNC_FAILS(rv, "Object not found with handle");
 			}
 		}
 	}
@@ -348,10 +399,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 
 	for (i = 0; i < ulCount; i++) {
 
-		FOR_EACH(attribute, object->attrList) {
-			if (attribute->attrData.type == pTemplate[i].type)
-				break;
-		}
+		findOrLoadAttribute(object, pTemplate + i, &attribute);
 
 		if (!attribute) {
 			pTemplate[i].ulValueLen = (CK_LONG) -1;
@@ -439,10 +487,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 
 	for (i = 0; i < ulCount; i++) {
 
-		FOR_EACH(attribute, object->attrList) {
-			if (attribute->attrData.type == pTemplate[i].type)
-				break;
-		}
+		findOrLoadAttribute(object, pTemplate + i, &attribute);
 
 		if (!attribute) {
 			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "We do not allow manufacturer specific attributes");
@@ -476,7 +521,16 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				removeTokenObjectLeavingAttributes(slot->token, object->handle, TRUE);
 
 				/* insert new private object */
-				addTokenObject(slot->token, newobject, FALSE);
+				rv = addTokenObject(slot->token, newobject, FALSE);
+
+				if (rv != CKR_OK) {
+					removeAllAttributes(newobject);
+					free(newobject);
+					FUNC_FAILS(rv, "Could not add token object");
+				}
+
+				/* the new object owns the attributes from now on */
+				object = newobject;
 
 				rv = synchronizeToken(slot);
 
@@ -485,13 +539,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				}
 			}
 		} else {
-			if (pTemplate[i].ulValueLen > attribute->attrData.ulValueLen) {
-				free(attribute->attrData.pValue);
-				attribute->attrData.pValue = malloc(pTemplate[i].ulValueLen);
-			}
+			rv = setAttributeValue(object, attribute, pTemplate + i);
 
-			attribute->attrData.ulValueLen = pTemplate[i].ulValueLen;
-			memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+			if (rv != CKR_OK) {
+				FUNC_FAILS(rv, "Out of memory");
+			}
 
 			object->dirtyFlag = 1;
 
@@ -508,13 +560,30 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 
 
 
-static int isMatchingObject(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+/**
+ * Compare the object with the template
+ *
+ * @param object    the object
+ * @param pTemplate the template
+ * @param ulCount   the number of attributes in the template
+ * @param mayLoad   load deferred attributes if required, which needs the exclusive slot lock
+ * @return CK_TRUE, CK_FALSE or DEFERRED_ATTRIBUTES if mayLoad is FALSE and attributes must be loaded
+ */
+static int isMatchingObject(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int mayLoad)
 {
 	struct p11Attribute_t *attribute;
 	int i, rv;
 
 	for (i = 0; i < ulCount; i++) {
-		rv = findAttribute(object, pTemplate + i, &attribute);
+		if (mayLoad) {
+			rv = findOrLoadAttribute(object, pTemplate + i, &attribute);
+		} else {
+			rv = findAttribute(object, pTemplate + i, &attribute);
+
+			if ((rv < 0) && (object->loadAttributes != NULL)) {
+				return DEFERRED_ATTRIBUTES;
+			}
+		}
 
 		if (rv < 0) {
 			return CK_FALSE;
@@ -531,6 +600,112 @@ static int isMatchingObject(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTempla
 
 
 
+/**
+ * Add all token objects matching the template to the search results
+ *
+ * If the template contains CKA_ID, CKA_LABEL or CKA_CLASS, only the objects in the
+ * matching bucket of the attribute index are compared with the template.
+ */
+static int addMatchingTokenObjects(struct p11Session_t *session, struct p11Object_t *list, struct p11AttributeIndex_t *index, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int mayLoad)
+{
+	struct p11Object_t *object;
+	CK_ULONG hash;
+	int i, rv;
+
+	i = selectAttributeIndex(pTemplate, ulCount, &hash);
+
+	if (i >= 0) {
+		for (object = firstInAttributeIndex(index, i, hash); object != NULL; object = nextInAttributeIndex(object, i, hash)) {
+			rv = isMatchingObject(object, pTemplate, ulCount, mayLoad);
+			if (rv == DEFERRED_ATTRIBUTES) {
+				return rv;
+			}
+			if (rv) {
+				if (addObjectToSearchList(session, object) != CKR_OK) {
+					return CKR_HOST_MEMORY;
+				}
+			}
+		}
+	} else {
+		FOR_EACH(object, list) {
+			rv = isMatchingObject(object, pTemplate, ulCount, mayLoad);
+			if (rv == DEFERRED_ATTRIBUTES) {
+				return rv;
+			}
+			if (rv) {
+				if (addObjectToSearchList(session, object) != CKR_OK) {
+					return CKR_HOST_MEMORY;
+				}
+			}
+		}
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Fill the search list of the session with all objects matching the template
+ *
+ * @param session   the session
+ * @param slot      the slot, locked or shared by the caller
+ * @param pTemplate the template
+ * @param ulCount   the number of attributes in the template
+ * @param mayLoad   load deferred attributes if required, which needs the exclusive slot lock
+ * @return CKR_OK, DEFERRED_ATTRIBUTES or any other Cryptoki error code
+ */
+static int collectMatchingObjects(struct p11Session_t *session, struct p11Slot_t *slot, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, int mayLoad)
+{
+	struct p11Object_t *object;
+	CK_STATE state;
+	int rv;
+
+	clearSearchList(session);
+
+	if (slot->token == NULL) {
+		return CKR_DEVICE_REMOVED;
+	}
+
+	/* session objects */
+	FOR_EACH(object, session->objectList) {
+		rv = isMatchingObject(object, pTemplate, ulCount, mayLoad);
+		if (rv == DEFERRED_ATTRIBUTES) {
+			clearSearchList(session);
+			return rv;
+		}
+		if (rv) {
+			if (addObjectToSearchList(session, object) != CKR_OK) {
+				clearSearchList(session);
+				return CKR_HOST_MEMORY;
+			}
+		}
+	}
+
+	/* public token objects */
+	rv = addMatchingTokenObjects(session, slot->token->pubObjectList, &slot->token->pubAttributeIndex, pTemplate, ulCount, mayLoad);
+
+	if (rv != CKR_OK) {
+		clearSearchList(session);
+		return rv;
+	}
+
+	/* private token objects */
+	state = getSessionState(session, slot);
+	if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
+		rv = addMatchingTokenObjects(session, slot->token->privObjectList, &slot->token->privAttributeIndex, pTemplate, ulCount, mayLoad);
+
+		if (rv != CKR_OK) {
+			clearSearchList(session);
+			return rv;
+		}
+	}
+
+	return CKR_OK;
+}
+
+
+
 /*  C_FindObjectsInit initializes a search for token and session objects
     that match a template. */
 CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
@@ -539,10 +714,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		CK_ULONG ulCount
 )
 {
-	struct p11Object_t *object;
+	int rv;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
-	CK_STATE state;
 
 	FUNC_CALLED();
 
@@ -554,38 +728,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
-
-	if (session->searchObj.searchList != NULL) {
-		C_FindObjectsFinal(hSession);
-	}
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
-	if (slot->token == NULL) {
-		FUNC_FAILS(CKR_DEVICE_REMOVED, "device removed");
-	}
+	rv = collectMatchingObjects(session, slot, pTemplate, ulCount, FALSE);
 
-	/* session objects */
-	FOR_EACH(object, session->objectList) {
-		if (isMatchingObject(object, pTemplate, ulCount)) {
-			addObjectToSearchList(session, object);
-		}
-	}
+	if (rv == DEFERRED_ATTRIBUTES) {
+		/* Loading attributes changes the token objects, which requires the exclusive slot lock */
+		FUNC_UNLOCK_SLOT(slot);
+		FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
 
-	/* public token objects */
-	FOR_EACH(object, slot->token->pubObjectList) {
-		if (isMatchingObject(object, pTemplate, ulCount)) {
-			addObjectToSearchList(session, object);
-		}
+		rv = collectMatchingObjects(session, slot, pTemplate, ulCount, TRUE);
 	}
 
-	/* private token objects */
-	state = getSessionState(session, slot);
-	if (state == CKS_RW_USER_FUNCTIONS || state == CKS_RO_USER_FUNCTIONS) {
-		FOR_EACH(object, slot->token->privObjectList) {
-			if (isMatchingObject(object, pTemplate, ulCount)) {
-				addObjectToSearchList(session, object);
-			}
-		}
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Collecting matching objects failed");
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -601,10 +757,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		CK_ULONG_PTR pulObjectCount
 )
 {
-	struct p11Object_t *object;
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
-	int i = 0, cnt;
+	CK_ULONG cnt;
 
 	FUNC_CALLED();
 
@@ -620,30 +775,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	if (session->searchObj.objectCollected == session->searchObj.objectCount) {
 		*pulObjectCount = 0;
 		FUNC_RETURNS(CKR_OK);
 	}
 
-	/* Move object to the first uncollected element */
-	object = session->searchObj.searchList;
-	/* canonical reverse loop */
-	for (i = session->searchObj.objectCollected; --i >= 0; ) {
-		object = object->next;
-		assert(object);
-	}
-
 	cnt = session->searchObj.objectCount - session->searchObj.objectCollected;
 	if (cnt > ulMaxObjectCount) {
 		cnt = ulMaxObjectCount;
 	}
 
-	for (i = 0; i < cnt; i++) {
-		*phObject++ = object->handle;
-		object = object->next;
-	}
+	memcpy(phObject, session->searchObj.searchList + session->searchObj.objectCollected, cnt * sizeof(CK_OBJECT_HANDLE));
 
 	*pulObjectCount = cnt;
 	session->searchObj.objectCollected += cnt;
@@ -667,7 +811,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsFinal)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	clearSearchList(session);
 
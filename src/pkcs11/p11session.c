@@ -38,6 +38,7 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
 #include <pkcs11/debug.h>
 
 extern struct p11Context_t *context;
@@ -104,9 +105,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
 		slot->readOnlySessionCount++;
 	}
 
-	FUNC_UNLOCK(&slot->mutex);
+	FUNC_UNLOCK_SLOT(slot);
+
+	rv = safeAddSession(&context->sessionPool, session);
+
+	if (rv != CKR_OK) {
+		FUNC_LOCK_SLOT(slot);
+		slot->sessionCount--;
+		if (!(flags & CKF_RW_SESSION)) {
+			slot->readOnlySessionCount--;
+		}
+		free(session);
+		FUNC_FAILS(rv, "Adding session to pool failed");
+	}
 
-	safeAddSession(&context->sessionPool, session);
 	*phSession = session->handle; /* we got a valid handle by calling addSession() */
 
 	FUNC_RETURNS(CKR_OK);
@@ -119,8 +131,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		CK_SESSION_HANDLE hSession
 )
 {
-	struct p11Session_t **ppSession, *session;
+	struct p11Session_t *session;
 	struct p11Slot_t *slot;
+	int rv;
 
 	FUNC_CALLED();
 
@@ -128,45 +141,29 @@ CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
-	FUNC_LOCK(&context->sessionPool.mutex);
-
-	session = NULL;
-	FOR_EACH_REF(ppSession, context->sessionPool.list) {
-		if ((*ppSession)->handle == hSession) {
-			session = *ppSession;
-			break;
-		}
-	}
+	RWLOCK_WRLOCK(&context->sessionPool.lock);
 
-	if (session == NULL) {
-		FUNC_RETURNS(CKR_SESSION_HANDLE_INVALID);
-	}
+	/* remove session from session pool */
+	rv = removeSession(&context->sessionPool, hSession, &session);
 
-	if (session->queuing) {
-		/* another thread using this seesion is waiting for the slot mutex */
-		FUNC_RETURNS(CKR_FUNCTION_FAILED);
+	if (rv != CKR_OK) {
+		RWLOCK_WRUNLOCK(&context->sessionPool.lock);
+		FUNC_RETURNS(rv);
 	}
 
-	/* remove seesion from session pool */
-	*ppSession = session->next; /* unlink */
-	context->sessionPool.count--;
+	slot = safeFindAndQueueSlot(&context->slotPool, session->slotID);
 
-	MUTEX_LOCK(&context->slotPool.mutex);
-	FOR_EACH(slot, context->slotPool.list) {
-		if (slot->id == session->slotID)
-			break;
-	}
-	MUTEX_UNLOCK(&context->slotPool.mutex);
-
-	/* Now we have exclusive access to the session and can give up the session pool mutex. */
-	FUNC_UNLOCK(&context->sessionPool.mutex);
+	/* Now we have exclusive access to the session and can give up the session pool lock. */
+	RWLOCK_WRUNLOCK(&context->sessionPool.lock);
 
 	if (slot == NULL) {
+		freeSession(session);
 		FUNC_RETURNS(CKR_OK);
 	}
-	/* Wait for the owning thread and all already queued threads. We must hold the slot mutex
+	/* Wait for the owning thread and all already queued threads. We must hold the slot lock
 	   because we will update some slot data. */
-	FUNC_LOCK(&slot->mutex);
+	FUNC_LOCK_SLOT(slot);
+	InterlockedDecrement(&slot->queuing);
 
 	slot->sessionCount--;
 	if (!(session->flags & CKF_RW_SESSION)) {
@@ -232,7 +229,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
 	}
 
-	FUNC_FIND_SESSION_AND_LOCK_SLOT(hSession, &session, &slot);
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
 
 	rv = getToken(slot, &token);
 
@@ -250,6 +247,35 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
 
 
 
+/*  C_SetSessionPriority sets the priority with which card operations of the session are queued.
+    Vendor extension, see sc-hsm-pkcs11.h */
+CK_DECLARE_FUNCTION(CK_RV, C_SetSessionPriority)(
+		CK_SESSION_HANDLE hSession,
+		CK_ULONG ulPriority
+)
+{
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if ((ulPriority != SC_HSM_PRIORITY_NORMAL) && (ulPriority != SC_HSM_PRIORITY_HIGH)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid priority");
+	}
+
+	FUNC_FIND_SESSION_AND_SHARE_SLOT(hSession, &session, &slot);
+
+	session->priority = (ulPriority == SC_HSM_PRIORITY_HIGH) ? CARD_PRIORITY_HIGH : CARD_PRIORITY_NORMAL;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /*  C_GetOperationState obtains a copy of the cryptographic operations state of a session. */
 CK_DECLARE_FUNCTION(CK_RV, C_GetOperationState)(
 		CK_SESSION_HANDLE hSession,
@@ -37,22 +37,43 @@
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
+#include <pkcs11/token.h>
+#include <pkcs11/stats.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
 #include <pkcs11/debug.h>
 
 extern struct p11Context_t *context;
 
 
-static const CK_MECHANISM_TYPE p11MechanismList[] = {
+const CK_MECHANISM_TYPE p11MechanismList[] = {
 		CKM_RSA_X_509,
 		CKM_RSA_PKCS,
+		CKM_RSA_PKCS_PSS,
 		CKM_SHA1_RSA_PKCS,
+		CKM_SHA224_RSA_PKCS,
 		CKM_SHA256_RSA_PKCS,
+		CKM_SHA384_RSA_PKCS,
+		CKM_SHA512_RSA_PKCS,
 		CKM_SHA1_RSA_PKCS_PSS,
+		CKM_SHA224_RSA_PKCS_PSS,
 		CKM_SHA256_RSA_PKCS_PSS,
+		CKM_SHA384_RSA_PKCS_PSS,
+		CKM_SHA512_RSA_PKCS_PSS,
 		CKM_ECDSA,
-		CKM_ECDSA_SHA1
+		CKM_ECDSA_SHA1,
+		CKM_ECDSA_SHA224,
+		CKM_ECDSA_SHA256,
+		CKM_ECDSA_SHA384,
+		CKM_ECDSA_SHA512,
+		CKM_SHA_1,
+		CKM_SHA224,
+		CKM_SHA256,
+		CKM_SHA384,
+		CKM_SHA512
 };
 
+const CK_ULONG p11MechanismCount = sizeof(p11MechanismList) / sizeof(p11MechanismList[0]);
+
 
 
 /*  C_GetSlotList obtains a list of slots in the system. */
@@ -92,17 +113,22 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 
 	MUTEX_LOCK(&context->slotPool.mutex);
 
+	/* Load new tokens concurrently, the loop below only checks for removal */
+	if (tokenPresent) {
+		detectTokens(&context->slotPool);
+	}
+
 	cnt = 0;
 	FOR_EACH(slot, context->slotPool.list) {
 		if (tokenPresent) {
-			MUTEX_LOCK(&slot->mutex);
-			if (getToken(slot, &token) == CKR_OK) {
+			lockSlot(slot, TRUE);
+			if (slot->token && (getToken(slot, &token) == CKR_OK)) {
 				if (pSlotList && cnt < *pulCount) {
 					pSlotList[cnt] = slot->id;
 				}
 				cnt++;
 			}
-			MUTEX_UNLOCK(&slot->mutex);
+			unlockSlot(slot);
 		} else {
 			/* do not offser slots ready for delete */
 			if (pSlotList && !slot->closed && cnt < *pulCount) {
@@ -212,7 +238,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 		CK_VOID_PTR pReserved
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
 
 	FUNC_CALLED();
 
@@ -220,6 +246,16 @@ CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pReserved != NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "pReserved must be NULL");
+	}
+
+	if (!isValidPtr(slot)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = waitForSlotEvent(&context->slotPool, (flags & CKF_DONT_BLOCK) != 0, slot);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -259,7 +295,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismList)(
 		FUNC_RETURNS(rv);
 	}
 
-	mechanismCount = sizeof(p11MechanismList) / sizeof(p11MechanismList[0]);
+	mechanismCount = p11MechanismCount;
 
 	if (pMechanismList == NULL) {
 		*pulCount = mechanismCount;
@@ -312,11 +348,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 	switch (type) {
 	case CKM_RSA_X_509:
 	case CKM_RSA_PKCS:
+	case CKM_RSA_PKCS_PSS:
 	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS:
 	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
 	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA224_RSA_PKCS_PSS:
 	case CKM_SHA256_RSA_PKCS_PSS:
-		pInfo->flags = CKF_SIGN;
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		pInfo->flags = CKF_SIGN|CKF_VERIFY;
 		pInfo->flags |= CKF_HW|CKF_ENCRYPT|CKF_DECRYPT|CKF_GENERATE_KEY_PAIR;	// Quick fix for Peter Gutmann's cryptlib
 		pInfo->ulMinKeySize = 1024;
 		pInfo->ulMaxKeySize = 2048;
@@ -324,12 +367,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 
 	case CKM_ECDSA:
 	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA224:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
 		pInfo->flags = CKF_SIGN;
 		pInfo->flags |= CKF_HW|CKF_VERIFY|CKF_GENERATE_KEY_PAIR; // Quick fix for Peter Gutmann's cryptlib
 		pInfo->ulMinKeySize = 192;
 		pInfo->ulMaxKeySize = 320;
 		break;
 
+	case CKM_SHA_1:
+	case CKM_SHA224:
+	case CKM_SHA256:
+	case CKM_SHA384:
+	case CKM_SHA512:
+		pInfo->flags = CKF_DIGEST;
+		pInfo->ulMinKeySize = 0;
+		pInfo->ulMaxKeySize = 0;
+		break;
+
 	case CKM_RSA_PKCS_KEY_PAIR_GEN:
 		pInfo->flags = CKF_GENERATE_KEY_PAIR;
 		pInfo->flags |= CKF_HW;
@@ -354,6 +411,110 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
 
 
 
+/*  C_GetSlotStatistics obtains the counters of a slot.
+    Vendor extension, see sc-hsm-pkcs11.h */
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics
+)
+{
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pStatistics)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	// Sharing the slot does not delay card operations and is enough to read the counts
+	FUNC_FIND_AND_SHARE_SLOT(slotID, &slot);
+
+	getSlotStatistics(slot, pStatistics);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/*  C_GetMechanismStatistics obtains the counters of all supported mechanisms.
+    Vendor extension, see sc-hsm-pkcs11.h */
+CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismStatistics)(
+		CK_SC_HSM_MECHANISM_STATISTICS_PTR pStatistics,
+		CK_ULONG_PTR pulCount
+)
+{
+	CK_ULONG i;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (pStatistics && !isValidPtr(pStatistics)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulCount)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pStatistics == NULL) {
+		*pulCount = context->mechanismCount;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulCount < context->mechanismCount) {
+		*pulCount = context->mechanismCount;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer provided by caller too small");
+	}
+
+	for (i = 0; i < context->mechanismCount; i++) {
+		getMechanismStatistics(&context->mechanismStats[i], &pStatistics[i]);
+	}
+
+	*pulCount = context->mechanismCount;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/*  C_InvalidateObjectCache discards the cached public objects of the token in the slot
+    and reads them again from the token. Vendor extension, see sc-hsm-pkcs11.h */
+CK_DECLARE_FUNCTION(CK_RV, C_InvalidateObjectCache)(
+		CK_SLOT_ID slotID
+)
+{
+	int rv;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	FUNC_FIND_AND_LOCK_SLOT(slotID, &slot);
+
+	rv = getToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = invalidateObjectCache(slot);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
 /*  C_InitToken initializes a token. */
 CK_DECLARE_FUNCTION(CK_RV, C_InitToken)(
 		CK_SLOT_ID slotID,
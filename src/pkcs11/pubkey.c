@@ -0,0 +1,1280 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    pubkey.c
+ * @brief   Host side public key operations for verification and encryption
+ *
+ * Public key operations need no secret and are performed with the public key from the
+ * certificate, avoiding the round trip to the token. The arithmetic uses Montgomery
+ * multiplication on 32 bit words and supports RSA keys up to 4096 bit and ECDSA on the
+ * NIST and Brainpool curves supported by the SmartCard-HSM.
+ */
+
+#ifdef _WIN32
+#define _CRT_RAND_S
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/pubkey.h>
+#include <pkcs11/digest.h>
+
+#define BN_MAX_WORDS        128         /* 4096 bit RSA modulus */
+#define EC_MAX_WORDS        10          /* 320 bit curves       */
+
+/**
+ * Montgomery representation of a modulus
+ */
+struct montContext_t {
+	int words;                          /**< Number of 32 bit words in all operands     */
+	unsigned int m[BN_MAX_WORDS];       /**< The odd modulus                            */
+	unsigned int m0inv;                 /**< -m^-1 mod 2^32                             */
+	unsigned int one[BN_MAX_WORDS];     /**< R mod m, which is 1 in Montgomery form     */
+	unsigned int rr[BN_MAX_WORDS];      /**< R^2 mod m, used to convert into Montgomery form */
+};
+
+/**
+ * Domain parameter of a prime curve, big endian with the length of the field
+ */
+struct ecCurve_t {
+	const unsigned char *oid;           /**< DER encoded OBJECT IDENTIFIER from CKA_EC_PARAMS */
+	size_t oidLen;
+	size_t size;                        /**< Length of field elements in bytes          */
+	const unsigned char *p;
+	const unsigned char *a;
+	const unsigned char *b;
+	const unsigned char *g;             /**< Base point as x || y                       */
+	const unsigned char *n;
+};
+
+/**
+ * Point in Jacobian coordinates with components in Montgomery form. Z = 0 is the point at infinity
+ */
+struct ecPoint_t {
+	unsigned int x[EC_MAX_WORDS];
+	unsigned int y[EC_MAX_WORDS];
+	unsigned int z[EC_MAX_WORDS];
+};
+
+/**
+ * A curve prepared for computation
+ */
+struct ecContext_t {
+	struct montContext_t p;             /**< The field prime                            */
+	struct montContext_t n;             /**< The order of the base point                */
+	unsigned int a[EC_MAX_WORDS];       /**< Coefficient a in Montgomery form           */
+	unsigned int b[EC_MAX_WORDS];       /**< Coefficient b in Montgomery form           */
+	struct ecPoint_t g;                 /**< The base point                             */
+};
+
+/* secp192r1 */
+static const unsigned char secp192r1_oid[] = {
+	0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x01
+};
+
+static const unsigned char secp192r1_p[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char secp192r1_a[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFC
+};
+
+static const unsigned char secp192r1_b[] = {
+	0x64, 0x21, 0x05, 0x19, 0xE5, 0x9C, 0x80, 0xE7, 0x0F, 0xA7, 0xE9, 0xAB, 0x72, 0x24, 0x30, 0x49,
+	0xFE, 0xB8, 0xDE, 0xEC, 0xC1, 0x46, 0xB9, 0xB1
+};
+
+static const unsigned char secp192r1_g[] = {
+	0x18, 0x8D, 0xA8, 0x0E, 0xB0, 0x30, 0x90, 0xF6, 0x7C, 0xBF, 0x20, 0xEB, 0x43, 0xA1, 0x88, 0x00,
+	0xF4, 0xFF, 0x0A, 0xFD, 0x82, 0xFF, 0x10, 0x12, 0x07, 0x19, 0x2B, 0x95, 0xFF, 0xC8, 0xDA, 0x78,
+	0x63, 0x10, 0x11, 0xED, 0x6B, 0x24, 0xCD, 0xD5, 0x73, 0xF9, 0x77, 0xA1, 0x1E, 0x79, 0x48, 0x11
+};
+
+static const unsigned char secp192r1_n[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x99, 0xDE, 0xF8, 0x36,
+	0x14, 0x6B, 0xC9, 0xB1, 0xB4, 0xD2, 0x28, 0x31
+};
+
+
+/* secp224r1 */
+static const unsigned char secp224r1_oid[] = {
+	0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x21
+};
+
+static const unsigned char secp224r1_p[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01
+};
+
+static const unsigned char secp224r1_a[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE
+};
+
+static const unsigned char secp224r1_b[] = {
+	0xB4, 0x05, 0x0A, 0x85, 0x0C, 0x04, 0xB3, 0xAB, 0xF5, 0x41, 0x32, 0x56, 0x50, 0x44, 0xB0, 0xB7,
+	0xD7, 0xBF, 0xD8, 0xBA, 0x27, 0x0B, 0x39, 0x43, 0x23, 0x55, 0xFF, 0xB4
+};
+
+static const unsigned char secp224r1_g[] = {
+	0xB7, 0x0E, 0x0C, 0xBD, 0x6B, 0xB4, 0xBF, 0x7F, 0x32, 0x13, 0x90, 0xB9, 0x4A, 0x03, 0xC1, 0xD3,
+	0x56, 0xC2, 0x11, 0x22, 0x34, 0x32, 0x80, 0xD6, 0x11, 0x5C, 0x1D, 0x21, 0xBD, 0x37, 0x63, 0x88,
+	0xB5, 0xF7, 0x23, 0xFB, 0x4C, 0x22, 0xDF, 0xE6, 0xCD, 0x43, 0x75, 0xA0, 0x5A, 0x07, 0x47, 0x64,
+	0x44, 0xD5, 0x81, 0x99, 0x85, 0x00, 0x7E, 0x34
+};
+
+static const unsigned char secp224r1_n[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x16, 0xA2,
+	0xE0, 0xB8, 0xF0, 0x3E, 0x13, 0xDD, 0x29, 0x45, 0x5C, 0x5C, 0x2A, 0x3D
+};
+
+
+/* secp256r1 */
+static const unsigned char secp256r1_oid[] = {
+	0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07
+};
+
+static const unsigned char secp256r1_p[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char secp256r1_a[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFC
+};
+
+static const unsigned char secp256r1_b[] = {
+	0x5A, 0xC6, 0x35, 0xD8, 0xAA, 0x3A, 0x93, 0xE7, 0xB3, 0xEB, 0xBD, 0x55, 0x76, 0x98, 0x86, 0xBC,
+	0x65, 0x1D, 0x06, 0xB0, 0xCC, 0x53, 0xB0, 0xF6, 0x3B, 0xCE, 0x3C, 0x3E, 0x27, 0xD2, 0x60, 0x4B
+};
+
+static const unsigned char secp256r1_g[] = {
+	0x6B, 0x17, 0xD1, 0xF2, 0xE1, 0x2C, 0x42, 0x47, 0xF8, 0xBC, 0xE6, 0xE5, 0x63, 0xA4, 0x40, 0xF2,
+	0x77, 0x03, 0x7D, 0x81, 0x2D, 0xEB, 0x33, 0xA0, 0xF4, 0xA1, 0x39, 0x45, 0xD8, 0x98, 0xC2, 0x96,
+	0x4F, 0xE3, 0x42, 0xE2, 0xFE, 0x1A, 0x7F, 0x9B, 0x8E, 0xE7, 0xEB, 0x4A, 0x7C, 0x0F, 0x9E, 0x16,
+	0x2B, 0xCE, 0x33, 0x57, 0x6B, 0x31, 0x5E, 0xCE, 0xCB, 0xB6, 0x40, 0x68, 0x37, 0xBF, 0x51, 0xF5
+};
+
+static const unsigned char secp256r1_n[] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xBC, 0xE6, 0xFA, 0xAD, 0xA7, 0x17, 0x9E, 0x84, 0xF3, 0xB9, 0xCA, 0xC2, 0xFC, 0x63, 0x25, 0x51
+};
+
+
+/* brainpoolP192r1 */
+static const unsigned char brainpoolP192r1_oid[] = {
+	0x06, 0x09, 0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x03
+};
+
+static const unsigned char brainpoolP192r1_p[] = {
+	0xC3, 0x02, 0xF4, 0x1D, 0x93, 0x2A, 0x36, 0xCD, 0xA7, 0xA3, 0x46, 0x30, 0x93, 0xD1, 0x8D, 0xB7,
+	0x8F, 0xCE, 0x47, 0x6D, 0xE1, 0xA8, 0x62, 0x97
+};
+
+static const unsigned char brainpoolP192r1_a[] = {
+	0x6A, 0x91, 0x17, 0x40, 0x76, 0xB1, 0xE0, 0xE1, 0x9C, 0x39, 0xC0, 0x31, 0xFE, 0x86, 0x85, 0xC1,
+	0xCA, 0xE0, 0x40, 0xE5, 0xC6, 0x9A, 0x28, 0xEF
+};
+
+static const unsigned char brainpoolP192r1_b[] = {
+	0x46, 0x9A, 0x28, 0xEF, 0x7C, 0x28, 0xCC, 0xA3, 0xDC, 0x72, 0x1D, 0x04, 0x4F, 0x44, 0x96, 0xBC,
+	0xCA, 0x7E, 0xF4, 0x14, 0x6F, 0xBF, 0x25, 0xC9
+};
+
+static const unsigned char brainpoolP192r1_g[] = {
+	0xC0, 0xA0, 0x64, 0x7E, 0xAA, 0xB6, 0xA4, 0x87, 0x53, 0xB0, 0x33, 0xC5, 0x6C, 0xB0, 0xF0, 0x90,
+	0x0A, 0x2F, 0x5C, 0x48, 0x53, 0x37, 0x5F, 0xD6, 0x14, 0xB6, 0x90, 0x86, 0x6A, 0xBD, 0x5B, 0xB8,
+	0x8B, 0x5F, 0x48, 0x28, 0xC1, 0x49, 0x00, 0x02, 0xE6, 0x77, 0x3F, 0xA2, 0xFA, 0x29, 0x9B, 0x8F
+};
+
+static const unsigned char brainpoolP192r1_n[] = {
+	0xC3, 0x02, 0xF4, 0x1D, 0x93, 0x2A, 0x36, 0xCD, 0xA7, 0xA3, 0x46, 0x2F, 0x9E, 0x9E, 0x91, 0x6B,
+	0x5B, 0xE8, 0xF1, 0x02, 0x9A, 0xC4, 0xAC, 0xC1
+};
+
+
+/* brainpoolP224r1 */
+static const unsigned char brainpoolP224r1_oid[] = {
+	0x06, 0x09, 0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x05
+};
+
+static const unsigned char brainpoolP224r1_p[] = {
+	0xD7, 0xC1, 0x34, 0xAA, 0x26, 0x43, 0x66, 0x86, 0x2A, 0x18, 0x30, 0x25, 0x75, 0xD1, 0xD7, 0x87,
+	0xB0, 0x9F, 0x07, 0x57, 0x97, 0xDA, 0x89, 0xF5, 0x7E, 0xC8, 0xC0, 0xFF
+};
+
+static const unsigned char brainpoolP224r1_a[] = {
+	0x68, 0xA5, 0xE6, 0x2C, 0xA9, 0xCE, 0x6C, 0x1C, 0x29, 0x98, 0x03, 0xA6, 0xC1, 0x53, 0x0B, 0x51,
+	0x4E, 0x18, 0x2A, 0xD8, 0xB0, 0x04, 0x2A, 0x59, 0xCA, 0xD2, 0x9F, 0x43
+};
+
+static const unsigned char brainpoolP224r1_b[] = {
+	0x25, 0x80, 0xF6, 0x3C, 0xCF, 0xE4, 0x41, 0x38, 0x87, 0x07, 0x13, 0xB1, 0xA9, 0x23, 0x69, 0xE3,
+	0x3E, 0x21, 0x35, 0xD2, 0x66, 0xDB, 0xB3, 0x72, 0x38, 0x6C, 0x40, 0x0B
+};
+
+static const unsigned char brainpoolP224r1_g[] = {
+	0x0D, 0x90, 0x29, 0xAD, 0x2C, 0x7E, 0x5C, 0xF4, 0x34, 0x08, 0x23, 0xB2, 0xA8, 0x7D, 0xC6, 0x8C,
+	0x9E, 0x4C, 0xE3, 0x17, 0x4C, 0x1E, 0x6E, 0xFD, 0xEE, 0x12, 0xC0, 0x7D, 0x58, 0xAA, 0x56, 0xF7,
+	0x72, 0xC0, 0x72, 0x6F, 0x24, 0xC6, 0xB8, 0x9E, 0x4E, 0xCD, 0xAC, 0x24, 0x35, 0x4B, 0x9E, 0x99,
+	0xCA, 0xA3, 0xF6, 0xD3, 0x76, 0x14, 0x02, 0xCD
+};
+
+static const unsigned char brainpoolP224r1_n[] = {
+	0xD7, 0xC1, 0x34, 0xAA, 0x26, 0x43, 0x66, 0x86, 0x2A, 0x18, 0x30, 0x25, 0x75, 0xD0, 0xFB, 0x98,
+	0xD1, 0x16, 0xBC, 0x4B, 0x6D, 0xDE, 0xBC, 0xA3, 0xA5, 0xA7, 0x93, 0x9F
+};
+
+
+/* brainpoolP256r1 */
+static const unsigned char brainpoolP256r1_oid[] = {
+	0x06, 0x09, 0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x07
+};
+
+static const unsigned char brainpoolP256r1_p[] = {
+	0xA9, 0xFB, 0x57, 0xDB, 0xA1, 0xEE, 0xA9, 0xBC, 0x3E, 0x66, 0x0A, 0x90, 0x9D, 0x83, 0x8D, 0x72,
+	0x6E, 0x3B, 0xF6, 0x23, 0xD5, 0x26, 0x20, 0x28, 0x20, 0x13, 0x48, 0x1D, 0x1F, 0x6E, 0x53, 0x77
+};
+
+static const unsigned char brainpoolP256r1_a[] = {
+	0x7D, 0x5A, 0x09, 0x75, 0xFC, 0x2C, 0x30, 0x57, 0xEE, 0xF6, 0x75, 0x30, 0x41, 0x7A, 0xFF, 0xE7,
+	0xFB, 0x80, 0x55, 0xC1, 0x26, 0xDC, 0x5C, 0x6C, 0xE9, 0x4A, 0x4B, 0x44, 0xF3, 0x30, 0xB5, 0xD9
+};
+
+static const unsigned char brainpoolP256r1_b[] = {
+	0x26, 0xDC, 0x5C, 0x6C, 0xE9, 0x4A, 0x4B, 0x44, 0xF3, 0x30, 0xB5, 0xD9, 0xBB, 0xD7, 0x7C, 0xBF,
+	0x95, 0x84, 0x16, 0x29, 0x5C, 0xF7, 0xE1, 0xCE, 0x6B, 0xCC, 0xDC, 0x18, 0xFF, 0x8C, 0x07, 0xB6
+};
+
+static const unsigned char brainpoolP256r1_g[] = {
+	0x8B, 0xD2, 0xAE, 0xB9, 0xCB, 0x7E, 0x57, 0xCB, 0x2C, 0x4B, 0x48, 0x2F, 0xFC, 0x81, 0xB7, 0xAF,
+	0xB9, 0xDE, 0x27, 0xE1, 0xE3, 0xBD, 0x23, 0xC2, 0x3A, 0x44, 0x53, 0xBD, 0x9A, 0xCE, 0x32, 0x62,
+	0x54, 0x7E, 0xF8, 0x35, 0xC3, 0xDA, 0xC4, 0xFD, 0x97, 0xF8, 0x46, 0x1A, 0x14, 0x61, 0x1D, 0xC9,
+	0xC2, 0x77, 0x45, 0x13, 0x2D, 0xED, 0x8E, 0x54, 0x5C, 0x1D, 0x54, 0xC7, 0x2F, 0x04, 0x69, 0x97
+};
+
+static const unsigned char brainpoolP256r1_n[] = {
+	0xA9, 0xFB, 0x57, 0xDB, 0xA1, 0xEE, 0xA9, 0xBC, 0x3E, 0x66, 0x0A, 0x90, 0x9D, 0x83, 0x8D, 0x71,
+	0x8C, 0x39, 0x7A, 0xA3, 0xB5, 0x61, 0xA6, 0xF7, 0x90, 0x1E, 0x0E, 0x82, 0x97, 0x48, 0x56, 0xA7
+};
+
+
+/* brainpoolP320r1 */
+static const unsigned char brainpoolP320r1_oid[] = {
+	0x06, 0x09, 0x2B, 0x24, 0x03, 0x03, 0x02, 0x08, 0x01, 0x01, 0x09
+};
+
+static const unsigned char brainpoolP320r1_p[] = {
+	0xD3, 0x5E, 0x47, 0x20, 0x36, 0xBC, 0x4F, 0xB7, 0xE1, 0x3C, 0x78, 0x5E, 0xD2, 0x01, 0xE0, 0x65,
+	0xF9, 0x8F, 0xCF, 0xA6, 0xF6, 0xF4, 0x0D, 0xEF, 0x4F, 0x92, 0xB9, 0xEC, 0x78, 0x93, 0xEC, 0x28,
+	0xFC, 0xD4, 0x12, 0xB1, 0xF1, 0xB3, 0x2E, 0x27
+};
+
+static const unsigned char brainpoolP320r1_a[] = {
+	0x3E, 0xE3, 0x0B, 0x56, 0x8F, 0xBA, 0xB0, 0xF8, 0x83, 0xCC, 0xEB, 0xD4, 0x6D, 0x3F, 0x3B, 0xB8,
+	0xA2, 0xA7, 0x35, 0x13, 0xF5, 0xEB, 0x79, 0xDA, 0x66, 0x19, 0x0E, 0xB0, 0x85, 0xFF, 0xA9, 0xF4,
+	0x92, 0xF3, 0x75, 0xA9, 0x7D, 0x86, 0x0E, 0xB4
+};
+
+static const unsigned char brainpoolP320r1_b[] = {
+	0x52, 0x08, 0x83, 0x94, 0x9D, 0xFD, 0xBC, 0x42, 0xD3, 0xAD, 0x19, 0x86, 0x40, 0x68, 0x8A, 0x6F,
+	0xE1, 0x3F, 0x41, 0x34, 0x95, 0x54, 0xB4, 0x9A, 0xCC, 0x31, 0xDC, 0xCD, 0x88, 0x45, 0x39, 0x81,
+	0x6F, 0x5E, 0xB4, 0xAC, 0x8F, 0xB1, 0xF1, 0xA6
+};
+
+static const unsigned char brainpoolP320r1_g[] = {
+	0x43, 0xBD, 0x7E, 0x9A, 0xFB, 0x53, 0xD8, 0xB8, 0x52, 0x89, 0xBC, 0xC4, 0x8E, 0xE5, 0xBF, 0xE6,
+	0xF2, 0x01, 0x37, 0xD1, 0x0A, 0x08, 0x7E, 0xB6, 0xE7, 0x87, 0x1E, 0x2A, 0x10, 0xA5, 0x99, 0xC7,
+	0x10, 0xAF, 0x8D, 0x0D, 0x39, 0xE2, 0x06, 0x11, 0x14, 0xFD, 0xD0, 0x55, 0x45, 0xEC, 0x1C, 0xC8,
+	0xAB, 0x40, 0x93, 0x24, 0x7F, 0x77, 0x27, 0x5E, 0x07, 0x43, 0xFF, 0xED, 0x11, 0x71, 0x82, 0xEA,
+	0xA9, 0xC7, 0x78, 0x77, 0xAA, 0xAC, 0x6A, 0xC7, 0xD3, 0x52, 0x45, 0xD1, 0x69, 0x2E, 0x8E, 0xE1
+};
+
+static const unsigned char brainpoolP320r1_n[] = {
+	0xD3, 0x5E, 0x47, 0x20, 0x36, 0xBC, 0x4F, 0xB7, 0xE1, 0x3C, 0x78, 0x5E, 0xD2, 0x01, 0xE0, 0x65,
+	0xF9, 0x8F, 0xCF, 0xA5, 0xB6, 0x8F, 0x12, 0xA3, 0x2D, 0x48, 0x2E, 0xC7, 0xEE, 0x86, 0x58, 0xE9,
+	0x86, 0x91, 0x55, 0x5B, 0x44, 0xC5, 0x93, 0x11
+};
+
+
+static const struct ecCurve_t ecCurves[] = {
+	{ secp192r1_oid, sizeof(secp192r1_oid), sizeof(secp192r1_p), secp192r1_p, secp192r1_a, secp192r1_b, secp192r1_g, secp192r1_n },
+	{ secp224r1_oid, sizeof(secp224r1_oid), sizeof(secp224r1_p), secp224r1_p, secp224r1_a, secp224r1_b, secp224r1_g, secp224r1_n },
+	{ secp256r1_oid, sizeof(secp256r1_oid), sizeof(secp256r1_p), secp256r1_p, secp256r1_a, secp256r1_b, secp256r1_g, secp256r1_n },
+	{ brainpoolP192r1_oid, sizeof(brainpoolP192r1_oid), sizeof(brainpoolP192r1_p), brainpoolP192r1_p, brainpoolP192r1_a, brainpoolP192r1_b, brainpoolP192r1_g, brainpoolP192r1_n },
+	{ brainpoolP224r1_oid, sizeof(brainpoolP224r1_oid), sizeof(brainpoolP224r1_p), brainpoolP224r1_p, brainpoolP224r1_a, brainpoolP224r1_b, brainpoolP224r1_g, brainpoolP224r1_n },
+	{ brainpoolP256r1_oid, sizeof(brainpoolP256r1_oid), sizeof(brainpoolP256r1_p), brainpoolP256r1_p, brainpoolP256r1_a, brainpoolP256r1_b, brainpoolP256r1_g, brainpoolP256r1_n },
+	{ brainpoolP320r1_oid, sizeof(brainpoolP320r1_oid), sizeof(brainpoolP320r1_p), brainpoolP320r1_p, brainpoolP320r1_a, brainpoolP320r1_b, brainpoolP320r1_g, brainpoolP320r1_n },
+};
+
+
+
+
+static int bnFromBytes(unsigned int *r, int words, const unsigned char *in, CK_ULONG len)
+{
+	int i;
+
+	while ((len > 0) && (*in == 0)) {
+		in++;
+		len--;
+	}
+
+	if (len > (CK_ULONG)words << 2) {
+		return -1;
+	}
+
+	memset(r, 0, words * sizeof(unsigned int));
+
+	for (i = 0; len > 0; i++) {
+		len--;
+		r[i >> 2] |= (unsigned int)in[len] << ((i & 3) << 3);
+	}
+	return 0;
+}
+
+
+
+static void bnToBytes(const unsigned int *a, int words, unsigned char *out, CK_ULONG len)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < len; i++) {
+		out[len - 1 - i] = (i >> 2) < (CK_ULONG)words ? (unsigned char)(a[i >> 2] >> ((i & 3) << 3)) : 0;
+	}
+}
+
+
+
+static int bnCmp(const unsigned int *a, const unsigned int *b, int words)
+{
+	while (words-- > 0) {
+		if (a[words] != b[words]) {
+			return a[words] > b[words] ? 1 : -1;
+		}
+	}
+	return 0;
+}
+
+
+
+static int bnIsZero(const unsigned int *a, int words)
+{
+	while (words-- > 0) {
+		if (a[words]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+static int bnBitLength(const unsigned int *a, int words)
+{
+	unsigned int w;
+	int bits;
+
+	while ((words > 0) && (a[words - 1] == 0)) {
+		words--;
+	}
+
+	if (words == 0) {
+		return 0;
+	}
+
+	bits = (words - 1) << 5;
+	for (w = a[words - 1]; w; w >>= 1) {
+		bits++;
+	}
+	return bits;
+}
+
+
+
+static int bnTestBit(const unsigned int *a, int bit)
+{
+	return (a[bit >> 5] >> (bit & 31)) & 1;
+}
+
+
+
+static unsigned int bnAdd(unsigned int *r, const unsigned int *a, const unsigned int *b, int words)
+{
+	unsigned long long t = 0;
+	int i;
+
+	for (i = 0; i < words; i++) {
+		t += (unsigned long long)a[i] + b[i];
+		r[i] = (unsigned int)t;
+		t >>= 32;
+	}
+	return (unsigned int)t;
+}
+
+
+
+static unsigned int bnSub(unsigned int *r, const unsigned int *a, const unsigned int *b, int words)
+{
+	unsigned long long t;
+	unsigned int borrow = 0;
+	int i;
+
+	for (i = 0; i < words; i++) {
+		t = (unsigned long long)a[i] - b[i] - borrow;
+		r[i] = (unsigned int)t;
+		borrow = (unsigned int)(t >> 63);
+	}
+	return borrow;
+}
+
+
+
+static void modAdd(unsigned int *r, const unsigned int *a, const unsigned int *b, const struct montContext_t *ctx)
+{
+	if (bnAdd(r, a, b, ctx->words) || (bnCmp(r, ctx->m, ctx->words) >= 0)) {
+		bnSub(r, r, ctx->m, ctx->words);
+	}
+}
+
+
+
+static void modSub(unsigned int *r, const unsigned int *a, const unsigned int *b, const struct montContext_t *ctx)
+{
+	if (bnSub(r, a, b, ctx->words)) {
+		bnAdd(r, r, ctx->m, ctx->words);
+	}
+}
+
+
+
+/**
+ * Montgomery multiplication r = a * b * R^-1 mod m, r may overlap a or b
+ */
+static void montMul(unsigned int *r, const unsigned int *a, const unsigned int *b, const struct montContext_t *ctx)
+{
+	unsigned int t[BN_MAX_WORDS + 2], q;
+	unsigned long long c;
+	int i, j, n = ctx->words;
+
+	memset(t, 0, (n + 2) * sizeof(unsigned int));
+
+	for (i = 0; i < n; i++) {
+		c = 0;
+		for (j = 0; j < n; j++) {
+			c += (unsigned long long)a[j] * b[i] + t[j];
+			t[j] = (unsigned int)c;
+			c >>= 32;
+		}
+		c += t[n];
+		t[n] = (unsigned int)c;
+		t[n + 1] = (unsigned int)(c >> 32);
+
+		q = t[0] * ctx->m0inv;
+		c = ((unsigned long long)q * ctx->m[0] + t[0]) >> 32;
+		for (j = 1; j < n; j++) {
+			c += (unsigned long long)q * ctx->m[j] + t[j];
+			t[j - 1] = (unsigned int)c;
+			c >>= 32;
+		}
+		c += t[n];
+		t[n - 1] = (unsigned int)c;
+		t[n] = t[n + 1] + (unsigned int)(c >> 32);
+	}
+
+	if (t[n] || (bnCmp(t, ctx->m, n) >= 0)) {
+		bnSub(t, t, ctx->m, n);
+	}
+
+	memcpy(r, t, n * sizeof(unsigned int));
+}
+
+
+
+/**
+ * Montgomery exponentiation r = a^e with a and r in Montgomery form
+ */
+static void montPow(unsigned int *r, const unsigned int *a, const unsigned int *e, int ewords, const struct montContext_t *ctx)
+{
+	unsigned int t[BN_MAX_WORDS];
+	int i;
+
+	memcpy(t, ctx->one, ctx->words * sizeof(unsigned int));
+
+	for (i = bnBitLength(e, ewords) - 1; i >= 0; i--) {
+		montMul(t, t, t, ctx);
+		if (bnTestBit(e, i)) {
+			montMul(t, t, a, ctx);
+		}
+	}
+
+	memcpy(r, t, ctx->words * sizeof(unsigned int));
+}
+
+
+
+static void toMont(unsigned int *r, const unsigned int *a, const struct montContext_t *ctx)
+{
+	montMul(r, a, ctx->rr, ctx);
+}
+
+
+
+static void fromMont(unsigned int *r, const unsigned int *a, const struct montContext_t *ctx)
+{
+	unsigned int one[BN_MAX_WORDS];
+
+	memset(one, 0, ctx->words * sizeof(unsigned int));
+	one[0] = 1;
+	montMul(r, a, one, ctx);
+}
+
+
+
+/**
+ * Prepare the Montgomery context for an odd modulus
+ *
+ * @param ctx       the context to initialize
+ * @param words     the number of words used for all operands
+ * @param mod       the big endian modulus
+ * @param len       the length of the modulus
+ * @return          0 or -1 if the modulus is even, too small or does not fit into words
+ */
+static int montInit(struct montContext_t *ctx, int words, const unsigned char *mod, CK_ULONG len)
+{
+	unsigned int x, e[1];
+	int i, bits;
+
+	if ((words <= 0) || (words > BN_MAX_WORDS) || (bnFromBytes(ctx->m, words, mod, len) < 0)) {
+		return -1;
+	}
+
+	bits = bnBitLength(ctx->m, words);
+	if (!(ctx->m[0] & 1) || (bits < 2)) {
+		return -1;
+	}
+
+	ctx->words = words;
+
+	/* Newton iteration doubles the number of correct low order bits in each step */
+	x = 1;
+	for (i = 0; i < 5; i++) {
+		x *= 2 - ctx->m[0] * x;
+	}
+	ctx->m0inv = (unsigned int)0 - x;
+
+	/* R mod m by doubling 2^(bits - 1) < m */
+	memset(ctx->one, 0, words * sizeof(unsigned int));
+	ctx->one[(bits - 1) >> 5] = 1U << ((bits - 1) & 31);
+	for (i = bits - 1; i < (words << 5); i++) {
+		modAdd(ctx->one, ctx->one, ctx->one, ctx);
+	}
+
+	/* R^2 mod m is 2^(32 * words) in Montgomery form, starting at 2 in Montgomery form */
+	modAdd(ctx->rr, ctx->one, ctx->one, ctx);
+	e[0] = (unsigned int)words << 5;
+	montPow(ctx->rr, ctx->rr, e, 1, ctx);
+	return 0;
+}
+
+
+
+/**
+ * Compute r = a^e mod m for the big endian values and return the result with the length of m
+ *
+ * @return          0 or -1 if a is not smaller than m
+ */
+static int modExp(const unsigned char *mod, CK_ULONG modLen, const unsigned char *exp, CK_ULONG expLen,
+				  const unsigned char *in, CK_ULONG inLen, unsigned char *out)
+{
+	struct montContext_t ctx;
+	unsigned int a[BN_MAX_WORDS], e[BN_MAX_WORDS];
+	int words = (int)((modLen + 3) >> 2);
+
+	if (montInit(&ctx, words, mod, modLen) < 0) {
+		return -1;
+	}
+
+	if ((bnFromBytes(a, words, in, inLen) < 0) || (bnCmp(a, ctx.m, words) >= 0)) {
+		return -1;
+	}
+
+	if (bnFromBytes(e, words, exp, expLen) < 0) {
+		return -1;
+	}
+
+	toMont(a, a, &ctx);
+	montPow(a, a, e, words, &ctx);
+	fromMont(a, a, &ctx);
+
+	bnToBytes(a, words, out, modLen);
+	return 0;
+}
+
+
+
+/**
+ * Strip leading zero bytes from an INTEGER value and check the size of the modulus
+ */
+static int getModulus(CK_ATTRIBUTE_PTR modulus, CK_BYTE_PTR *mod, CK_ULONG *modLen)
+{
+	*mod = (CK_BYTE_PTR)modulus->pValue;
+	*modLen = modulus->ulValueLen;
+
+	while ((*modLen > 0) && (**mod == 0)) {
+		(*mod)++;
+		(*modLen)--;
+	}
+
+	if ((*modLen < 64) || (*modLen > (BN_MAX_WORDS << 2))) {
+		return -1;
+	}
+	return 0;
+}
+
+
+
+static int getRandomBytes(unsigned char *buff, CK_ULONG len)
+{
+#ifdef _WIN32
+	unsigned int r;
+
+	while (len-- > 0) {
+		if (rand_s(&r) != 0) {
+			return -1;
+		}
+		*buff++ = (unsigned char)r;
+	}
+	return 0;
+#else
+	FILE *fp;
+	size_t rc;
+
+	fp = fopen("/dev/urandom", "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	rc = fread(buff, 1, len, fp);
+	fclose(fp);
+	return rc == len ? 0 : -1;
+#endif
+}
+
+
+
+static CK_MECHANISM_TYPE getHashForLength(CK_ULONG len)
+{
+	switch(len) {
+	case 20:
+		return CKM_SHA_1;
+	case 28:
+		return CKM_SHA224;
+	case 32:
+		return CKM_SHA256;
+	case 48:
+		return CKM_SHA384;
+	case 64:
+		return CKM_SHA512;
+	default:
+		return CKM_VENDOR_DEFINED;
+	}
+}
+
+
+
+/**
+ * Verify the EMSA-PSS encoding of mHash. The hash algorithm is derived from the length of mHash
+ * and the salt length is determined from the encoding.
+ */
+static int verifyPSSEncoding(unsigned char *em, CK_ULONG emLen, int emBits, CK_BYTE_PTR mHash, CK_ULONG hLen)
+{
+	struct p11DigestContext_t ctx;
+	CK_MECHANISM_TYPE hashMech;
+	unsigned char *db, *h, counter[4], mask[MAX_DIGEST_LENGTH], zeros[8];
+	CK_ULONG dbLen, i, j;
+
+	hashMech = getHashForLength(hLen);
+
+	if ((hashMech == CKM_VENDOR_DEFINED) || (emLen < hLen + 2) || (em[emLen - 1] != 0xBC)) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	dbLen = emLen - hLen - 1;
+	db = em;
+	h = em + dbLen;
+
+	if (em[0] & (0xFF00 >> ((emLen << 3) - emBits))) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	/* DB = maskedDB xor MGF1(H) */
+	for (i = 0; i < dbLen; i += hLen) {
+		counter[0] = (unsigned char)(i / hLen >> 24);
+		counter[1] = (unsigned char)(i / hLen >> 16);
+		counter[2] = (unsigned char)(i / hLen >> 8);
+		counter[3] = (unsigned char)(i / hLen);
+		digestInit(&ctx, hashMech);
+		digestUpdate(&ctx, h, hLen);
+		digestUpdate(&ctx, counter, 4);
+		digestFinal(&ctx, mask);
+		for (j = 0; (j < hLen) && (i + j < dbLen); j++) {
+			db[i + j] ^= mask[j];
+		}
+	}
+	db[0] &= 0xFF >> ((emLen << 3) - emBits);
+
+	for (i = 0; (i < dbLen) && (db[i] == 0); i++);
+
+	if ((i == dbLen) || (db[i] != 0x01)) {
+		return CKR_SIGNATURE_INVALID;
+	}
+	i++;
+
+	/* H' = Hash(00 00 00 00 00 00 00 00 || mHash || salt) */
+	memset(zeros, 0, sizeof(zeros));
+	digestInit(&ctx, hashMech);
+	digestUpdate(&ctx, zeros, sizeof(zeros));
+	digestUpdate(&ctx, mHash, hLen);
+	digestUpdate(&ctx, db + i, dbLen - i);
+	digestFinal(&ctx, mask);
+
+	return memcmp(mask, h, hLen) ? CKR_SIGNATURE_INVALID : CKR_OK;
+}
+
+
+
+/**
+ * Strip the PKCS#1 V1.5 signature padding 00 01 FF .. FF 00
+ *
+ * @return          the offset of the payload in em or -1 if the padding is invalid
+ */
+static int stripPKCS1SignaturePadding(unsigned char *em, CK_ULONG emLen)
+{
+	CK_ULONG i;
+
+	if ((emLen < 11) || (em[0] != 0x00) || (em[1] != 0x01)) {
+		return -1;
+	}
+
+	for (i = 2; (i < emLen) && (em[i] == 0xFF); i++);
+
+	if ((i < 10) || (i == emLen) || (em[i] != 0x00)) {
+		return -1;
+	}
+	return (int)i + 1;
+}
+
+
+
+/**
+ * Verify a RSA signature
+ *
+ * @param mech      one of CKM_RSA_X_509, CKM_RSA_PKCS or CKM_RSA_PKCS_PSS. For CKM_RSA_PKCS_PSS
+ *                  pData is the message hash, which also selects the hash used by MGF1
+ * @param modulus   the modulus
+ * @param exponent  the public exponent
+ * @return          CKR_OK, CKR_SIGNATURE_INVALID, CKR_SIGNATURE_LEN_RANGE or CKR_KEY_SIZE_RANGE
+ */
+int rsaVerify(CK_MECHANISM_TYPE mech, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	unsigned char em[BN_MAX_WORDS << 2];
+	CK_BYTE_PTR mod;
+	CK_ULONG modLen;
+	int rc, ofs, modBits, bit;
+
+	if (getModulus(modulus, &mod, &modLen) < 0) {
+		return CKR_KEY_SIZE_RANGE;
+	}
+
+	if (ulSignatureLen != modLen) {
+		return CKR_SIGNATURE_LEN_RANGE;
+	}
+
+	if (modExp(mod, modLen, exponent->pValue, exponent->ulValueLen, pSignature, ulSignatureLen, em) < 0) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	switch(mech) {
+	case CKM_RSA_X_509:
+		rc = CKR_SIGNATURE_INVALID;
+		if (ulDataLen <= modLen) {
+			/* Raw data is compared as integer, i.e. right aligned with leading zeros */
+			for (ofs = 0; (ofs < (int)(modLen - ulDataLen)) && (em[ofs] == 0); ofs++);
+			if ((ofs == (int)(modLen - ulDataLen)) && !memcmp(em + ofs, pData, ulDataLen)) {
+				rc = CKR_OK;
+			}
+		}
+		break;
+	case CKM_RSA_PKCS:
+		ofs = stripPKCS1SignaturePadding(em, modLen);
+		if ((ofs < 0) || (modLen - ofs != ulDataLen) || memcmp(em + ofs, pData, ulDataLen)) {
+			rc = CKR_SIGNATURE_INVALID;
+		} else {
+			rc = CKR_OK;
+		}
+		break;
+	case CKM_RSA_PKCS_PSS:
+		modBits = (int)(modLen << 3);
+		for (bit = 0x80; !(mod[0] & bit); bit >>= 1) {
+			modBits--;
+		}
+		/* emBits = modBits - 1, the encoding has one byte less if modBits - 1 is a multiple of 8 */
+		if (((modBits - 1) & 7) == 0) {
+			rc = em[0] ? CKR_SIGNATURE_INVALID : verifyPSSEncoding(em + 1, modLen - 1, modBits - 1, pData, ulDataLen);
+		} else {
+			rc = verifyPSSEncoding(em, modLen, modBits - 1, pData, ulDataLen);
+		}
+		break;
+	default:
+		rc = CKR_MECHANISM_INVALID;
+		break;
+	}
+
+	memset(em, 0, sizeof(em));
+	return rc;
+}
+
+
+
+/**
+ * Recover the data from a RSA signature
+ *
+ * @param mech      one of CKM_RSA_X_509 or CKM_RSA_PKCS
+ * @param modulus   the modulus
+ * @param exponent  the public exponent
+ * @param pData     the buffer receiving the data or NULL to query the maximum length
+ * @return          CKR_OK, CKR_SIGNATURE_INVALID, CKR_SIGNATURE_LEN_RANGE, CKR_BUFFER_TOO_SMALL or CKR_KEY_SIZE_RANGE
+ */
+int rsaVerifyRecover(CK_MECHANISM_TYPE mech, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	unsigned char em[BN_MAX_WORDS << 2];
+	CK_BYTE_PTR mod;
+	CK_ULONG modLen;
+	int rc, ofs;
+
+	if (getModulus(modulus, &mod, &modLen) < 0) {
+		return CKR_KEY_SIZE_RANGE;
+	}
+
+	if ((mech != CKM_RSA_X_509) && (mech != CKM_RSA_PKCS)) {
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (pData == NULL) {
+		*pulDataLen = modLen;
+		return CKR_OK;
+	}
+
+	if (ulSignatureLen != modLen) {
+		return CKR_SIGNATURE_LEN_RANGE;
+	}
+
+	if (modExp(mod, modLen, exponent->pValue, exponent->ulValueLen, pSignature, ulSignatureLen, em) < 0) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	ofs = 0;
+	if (mech == CKM_RSA_PKCS) {
+		ofs = stripPKCS1SignaturePadding(em, modLen);
+	}
+
+	if (ofs < 0) {
+		rc = CKR_SIGNATURE_INVALID;
+	} else if (*pulDataLen < modLen - ofs) {
+		*pulDataLen = modLen - ofs;
+		rc = CKR_BUFFER_TOO_SMALL;
+	} else {
+		*pulDataLen = modLen - ofs;
+		memcpy(pData, em + ofs, *pulDataLen);
+		rc = CKR_OK;
+	}
+
+	memset(em, 0, sizeof(em));
+	return rc;
+}
+
+
+
+/**
+ * Encrypt with the RSA public key
+ *
+ * @param mech      one of CKM_RSA_X_509 or CKM_RSA_PKCS
+ * @param modulus   the modulus
+ * @param exponent  the public exponent
+ * @param pEncryptedData the buffer receiving the cryptogram or NULL to query the length
+ * @return          CKR_OK, CKR_DATA_LEN_RANGE, CKR_DATA_INVALID, CKR_BUFFER_TOO_SMALL, CKR_KEY_SIZE_RANGE
+ *                  or CKR_FUNCTION_FAILED if no random numbers are available for the padding
+ */
+int rsaEncrypt(CK_MECHANISM_TYPE mech, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	unsigned char em[BN_MAX_WORDS << 2];
+	CK_BYTE_PTR mod;
+	CK_ULONG modLen, i;
+	int rc;
+
+	if (getModulus(modulus, &mod, &modLen) < 0) {
+		return CKR_KEY_SIZE_RANGE;
+	}
+
+	if ((mech != CKM_RSA_X_509) && (mech != CKM_RSA_PKCS)) {
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (pEncryptedData == NULL) {
+		*pulEncryptedDataLen = modLen;
+		return CKR_OK;
+	}
+
+	if (*pulEncryptedDataLen < modLen) {
+		*pulEncryptedDataLen = modLen;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	if (mech == CKM_RSA_PKCS) {
+		if (ulDataLen > modLen - 11) {
+			return CKR_DATA_LEN_RANGE;
+		}
+
+		/* 00 02 PS 00 M with at least 8 non-zero random bytes in PS */
+		em[0] = 0x00;
+		em[1] = 0x02;
+		if (getRandomBytes(em + 2, modLen - ulDataLen - 3) < 0) {
+			return CKR_FUNCTION_FAILED;
+		}
+		for (i = 2; i < modLen - ulDataLen - 1; i++) {
+			while (em[i] == 0) {
+				if (getRandomBytes(em + i, 1) < 0) {
+					return CKR_FUNCTION_FAILED;
+				}
+			}
+		}
+		em[modLen - ulDataLen - 1] = 0x00;
+	} else {
+		if (ulDataLen > modLen) {
+			return CKR_DATA_LEN_RANGE;
+		}
+		memset(em, 0, modLen - ulDataLen);
+	}
+	memcpy(em + modLen - ulDataLen, pData, ulDataLen);
+
+	if (modExp(mod, modLen, exponent->pValue, exponent->ulValueLen, em, modLen, pEncryptedData) < 0) {
+		rc = CKR_DATA_INVALID;
+	} else {
+		*pulEncryptedDataLen = modLen;
+		rc = CKR_OK;
+	}
+
+	memset(em, 0, sizeof(em));
+	return rc;
+}
+
+
+
+static int isInfinity(const struct ecPoint_t *p, const struct ecContext_t *ec)
+{
+	return bnIsZero(p->z, ec->p.words);
+}
+
+
+
+static void ecDouble(struct ecPoint_t *r, const struct ecPoint_t *p, const struct ecContext_t *ec)
+{
+	const struct montContext_t *f = &ec->p;
+	unsigned int xx[EC_MAX_WORDS], yy[EC_MAX_WORDS], zz[EC_MAX_WORDS], s[EC_MAX_WORDS], m[EC_MAX_WORDS], t[EC_MAX_WORDS];
+
+	if (isInfinity(p, ec) || bnIsZero(p->y, f->words)) {
+		memset(r->z, 0, sizeof(r->z));
+		return;
+	}
+
+	montMul(xx, p->x, p->x, f);
+	montMul(yy, p->y, p->y, f);
+	montMul(zz, p->z, p->z, f);
+
+	/* S = 4 * X * Y^2 */
+	montMul(s, p->x, yy, f);
+	modAdd(s, s, s, f);
+	modAdd(s, s, s, f);
+
+	/* M = 3 * X^2 + a * Z^4 */
+	montMul(t, zz, zz, f);
+	montMul(t, t, ec->a, f);
+	modAdd(m, xx, xx, f);
+	modAdd(m, m, xx, f);
+	modAdd(m, m, t, f);
+
+	/* Z3 = 2 * Y * Z */
+	montMul(r->z, p->y, p->z, f);
+	modAdd(r->z, r->z, r->z, f);
+
+	/* X3 = M^2 - 2 * S */
+	montMul(r->x, m, m, f);
+	modSub(r->x, r->x, s, f);
+	modSub(r->x, r->x, s, f);
+
+	/* Y3 = M * (S - X3) - 8 * Y^4 */
+	montMul(yy, yy, yy, f);
+	modAdd(yy, yy, yy, f);
+	modAdd(yy, yy, yy, f);
+	modAdd(yy, yy, yy, f);
+	modSub(s, s, r->x, f);
+	montMul(r->y, m, s, f);
+	modSub(r->y, r->y, yy, f);
+}
+
+
+
+static void ecAdd(struct ecPoint_t *r, const struct ecPoint_t *p, const struct ecPoint_t *q, const struct ecContext_t *ec)
+{
+	const struct montContext_t *f = &ec->p;
+	unsigned int u1[EC_MAX_WORDS], u2[EC_MAX_WORDS], s1[EC_MAX_WORDS], s2[EC_MAX_WORDS], t[EC_MAX_WORDS];
+	unsigned int h[EC_MAX_WORDS], hh[EC_MAX_WORDS], hhh[EC_MAX_WORDS], rr[EC_MAX_WORDS];
+
+	if (isInfinity(p, ec)) {
+		*r = *q;
+		return;
+	}
+	if (isInfinity(q, ec)) {
+		*r = *p;
+		return;
+	}
+
+	/* U1 = X1 * Z2^2, S1 = Y1 * Z2^3, U2 = X2 * Z1^2, S2 = Y2 * Z1^3 */
+	montMul(t, q->z, q->z, f);
+	montMul(u1, p->x, t, f);
+	montMul(t, t, q->z, f);
+	montMul(s1, p->y, t, f);
+	montMul(t, p->z, p->z, f);
+	montMul(u2, q->x, t, f);
+	montMul(t, t, p->z, f);
+	montMul(s2, q->y, t, f);
+
+	modSub(h, u2, u1, f);
+	modSub(rr, s2, s1, f);
+
+	if (bnIsZero(h, f->words)) {
+		if (bnIsZero(rr, f->words)) {
+			ecDouble(r, p, ec);
+		} else {
+			memset(r->z, 0, sizeof(r->z));
+		}
+		return;
+	}
+
+	montMul(hh, h, h, f);
+	montMul(hhh, hh, h, f);
+	montMul(u1, u1, hh, f);
+
+	/* Z3 = H * Z1 * Z2 */
+	montMul(t, p->z, q->z, f);
+	montMul(r->z, t, h, f);
+
+	/* X3 = R^2 - H^3 - 2 * U1 * H^2 */
+	montMul(t, rr, rr, f);
+	modSub(t, t, hhh, f);
+	modSub(t, t, u1, f);
+	modSub(t, t, u1, f);
+
+	/* Y3 = R * (U1 * H^2 - X3) - S1 * H^3 */
+	modSub(u1, u1, t, f);
+	montMul(u1, rr, u1, f);
+	montMul(s1, s1, hhh, f);
+	modSub(r->y, u1, s1, f);
+
+	memcpy(r->x, t, sizeof(t));
+}
+
+
+
+/**
+ * Load an affine point x || y into Jacobian coordinates and check that it is on the curve
+ */
+static int ecLoadPoint(struct ecPoint_t *r, const unsigned char *xy, const struct ecContext_t *ec, size_t size)
+{
+	const struct montContext_t *f = &ec->p;
+	unsigned int lhs[EC_MAX_WORDS], rhs[EC_MAX_WORDS];
+
+	if ((bnFromBytes(r->x, f->words, xy, size) < 0) || (bnCmp(r->x, f->m, f->words) >= 0) ||
+		(bnFromBytes(r->y, f->words, xy + size, size) < 0) || (bnCmp(r->y, f->m, f->words) >= 0)) {
+		return -1;
+	}
+
+	toMont(r->x, r->x, f);
+	toMont(r->y, r->y, f);
+	memcpy(r->z, f->one, sizeof(r->z));
+
+	/* y^2 = x^3 + a * x + b */
+	montMul(lhs, r->y, r->y, f);
+	montMul(rhs, r->x, r->x, f);
+	modAdd(rhs, rhs, ec->a, f);
+	montMul(rhs, rhs, r->x, f);
+	modAdd(rhs, rhs, ec->b, f);
+
+	return bnCmp(lhs, rhs, f->words) ? -1 : 0;
+}
+
+
+
+static int ecInit(struct ecContext_t *ec, const struct ecCurve_t *curve)
+{
+	int words = (int)((curve->size + 3) >> 2);
+
+	if ((words > EC_MAX_WORDS) ||
+		(montInit(&ec->p, words, curve->p, curve->size) < 0) ||
+		(montInit(&ec->n, words, curve->n, curve->size) < 0)) {
+		return -1;
+	}
+
+	bnFromBytes(ec->a, words, curve->a, curve->size);
+	toMont(ec->a, ec->a, &ec->p);
+	bnFromBytes(ec->b, words, curve->b, curve->size);
+	toMont(ec->b, ec->b, &ec->p);
+
+	return ecLoadPoint(&ec->g, curve->g, ec, curve->size);
+}
+
+
+
+/**
+ * Verify an ECDSA signature
+ *
+ * @param ecParams  the DER encoded curve OID
+ * @param ecPoint   the public point in uncompressed format 04 || x || y
+ * @param pHash     the hash of the message, truncated to the length of the order if longer
+ * @param pSignature the signature r || s
+ * @return          CKR_OK, CKR_SIGNATURE_INVALID, CKR_SIGNATURE_LEN_RANGE or CKR_DOMAIN_PARAMS_INVALID
+ */
+int ecdsaVerify(CK_ATTRIBUTE_PTR ecParams, CK_ATTRIBUTE_PTR ecPoint, CK_BYTE_PTR pHash, CK_ULONG ulHashLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	struct ecContext_t ec;
+	struct ecPoint_t q, gq, acc;
+	const struct ecCurve_t *curve = NULL;
+	unsigned int r[EC_MAX_WORDS], s[EC_MAX_WORDS], e[EC_MAX_WORDS], u1[EC_MAX_WORDS], u2[EC_MAX_WORDS], nm2[EC_MAX_WORDS];
+	CK_BYTE_PTR point = (CK_BYTE_PTR)ecPoint->pValue;
+	CK_ULONG hashLen;
+	size_t size, i;
+	int words, bits, nbits;
+
+	for (i = 0; i < sizeof(ecCurves) / sizeof(ecCurves[0]); i++) {
+		if ((ecParams->ulValueLen == ecCurves[i].oidLen) && !memcmp(ecParams->pValue, ecCurves[i].oid, ecCurves[i].oidLen)) {
+			curve = &ecCurves[i];
+			break;
+		}
+	}
+
+	if ((curve == NULL) || (ecInit(&ec, curve) < 0)) {
+		return CKR_DOMAIN_PARAMS_INVALID;
+	}
+
+	size = curve->size;
+	words = ec.p.words;
+
+	if (ulSignatureLen != size << 1) {
+		return CKR_SIGNATURE_LEN_RANGE;
+	}
+
+	if ((ecPoint->ulValueLen != (size << 1) + 1) || (point[0] != 0x04) || (ecLoadPoint(&q, point + 1, &ec, size) < 0)) {
+		return CKR_KEY_HANDLE_INVALID;
+	}
+
+	/* 0 < r, s < n */
+	bnFromBytes(r, words, pSignature, size);
+	bnFromBytes(s, words, pSignature + size, size);
+	if (bnIsZero(r, words) || bnIsZero(s, words) || (bnCmp(r, ec.n.m, words) >= 0) || (bnCmp(s, ec.n.m, words) >= 0)) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	/* e is the leftmost bits of the hash with the bit length of n */
+	nbits = bnBitLength(ec.n.m, words);
+	hashLen = ulHashLen;
+	if (hashLen > (CK_ULONG)((nbits + 7) >> 3)) {
+		hashLen = (nbits + 7) >> 3;
+	}
+	bnFromBytes(e, words, pHash, hashLen);
+	for (bits = (int)(hashLen << 3); bits > nbits; bits--) {
+		for (i = 0; i < (size_t)words; i++) {
+			e[i] = (e[i] >> 1) | (i + 1 < (size_t)words ? e[i + 1] << 31 : 0);
+		}
+	}
+	if (bnCmp(e, ec.n.m, words) >= 0) {
+		bnSub(e, e, ec.n.m, words);
+	}
+
+	/* w = s^(n - 2) mod n, u1 = e * w, u2 = r * w */
+	memset(nm2, 0, sizeof(nm2));
+	nm2[0] = 2;
+	bnSub(nm2, ec.n.m, nm2, words);
+	toMont(s, s, &ec.n);
+	montPow(s, s, nm2, words, &ec.n);
+	montMul(u1, e, s, &ec.n);
+	montMul(u2, r, s, &ec.n);
+
+	/* u1 * G + u2 * Q using a joint double and add ladder */
+	ecAdd(&gq, &ec.g, &q, &ec);
+	memset(&acc, 0, sizeof(acc));
+
+	bits = bnBitLength(u1, words);
+	if (bnBitLength(u2, words) > bits) {
+		bits = bnBitLength(u2, words);
+	}
+
+	while (bits-- > 0) {
+		ecDouble(&acc, &acc, &ec);
+		if (bnTestBit(u1, bits) && bnTestBit(u2, bits)) {
+			ecAdd(&acc, &acc, &gq, &ec);
+		} else if (bnTestBit(u1, bits)) {
+			ecAdd(&acc, &acc, &ec.g, &ec);
+		} else if (bnTestBit(u2, bits)) {
+			ecAdd(&acc, &acc, &q, &ec);
+		}
+	}
+
+	if (isInfinity(&acc, &ec)) {
+		return CKR_SIGNATURE_INVALID;
+	}
+
+	/* x = X / Z^2 mod p, reduced mod n */
+	memset(nm2, 0, sizeof(nm2));
+	nm2[0] = 2;
+	bnSub(nm2, ec.p.m, nm2, words);
+	montPow(acc.z, acc.z, nm2, words, &ec.p);
+	montMul(acc.z, acc.z, acc.z, &ec.p);
+	montMul(acc.x, acc.x, acc.z, &ec.p);
+	fromMont(acc.x, acc.x, &ec.p);
+
+	if (bnCmp(acc.x, ec.n.m, words) >= 0) {
+		bnSub(acc.x, acc.x, ec.n.m, words);
+	}
+
+	return bnCmp(acc.x, r, words) ? CKR_SIGNATURE_INVALID : CKR_OK;
+}
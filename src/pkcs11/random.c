@@ -0,0 +1,343 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    random.c
+ * @brief   Per-slot random number pool fed by the token
+ *
+ * GET CHALLENGE returns at most RANDOM_CHALLENGE_SIZE bytes per command, so every
+ * C_GenerateRandom call going straight to the token would cost at least one round trip.
+ * Random bytes are therefore buffered per slot and the pool is refilled in full chunks.
+ * With RANDOM_USE_DRBG the token output seeds a SHA-256 based generator on the host,
+ * which is reseeded from the token every RANDOM_RESEED_INTERVAL bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/random.h>
+#include <pkcs11/token.h>
+#include <pkcs11/digest.h>
+
+#ifdef DEBUG
+#include <pkcs11/debug.h>
+#endif
+
+#define DRBG_GENERATE	0x00
+#define DRBG_UPDATE		0x01
+#define DRBG_RESEED		0x02
+#define DRBG_SEED		0x03
+
+
+
+/**
+ * Fill a buffer with random bytes from the token, using as few GET CHALLENGE
+ * commands as possible
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param data      The buffer to fill
+ * @param length    The number of bytes required
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int fillFromToken(struct p11Slot_t *slot, unsigned char *data, int length)
+{
+	int chunk, rc;
+
+	while (length > 0) {
+		chunk = length > RANDOM_CHALLENGE_SIZE ? RANDOM_CHALLENGE_SIZE : length;
+		rc = getChallenge(slot, data, chunk);
+
+		if (rc != CKR_OK) {
+			return rc;
+		}
+		data += chunk;
+		length -= chunk;
+	}
+	return CKR_OK;
+}
+
+
+
+#if RANDOM_USE_DRBG
+
+/**
+ * Compute SHA-256(tag || key || counter || extra) and advance the counter
+ */
+static void drbgHash(struct p11RandomPool_t *rp, unsigned char tag, unsigned char *extra, int extralen, unsigned char *out)
+{
+	struct p11DigestContext_t ctx;
+	unsigned char ctr[8];
+	unsigned long c;
+	int i;
+
+	c = rp->counter++;
+	for (i = 7; i >= 0; i--) {
+		ctr[i] = (unsigned char)c;
+		c >>= 8;
+	}
+
+	digestInit(&ctx, CKM_SHA256);
+	digestUpdate(&ctx, &tag, 1);
+	digestUpdate(&ctx, rp->key, sizeof(rp->key));
+	digestUpdate(&ctx, ctr, sizeof(ctr));
+	if (extralen > 0) {
+		digestUpdate(&ctx, extra, extralen);
+	}
+	digestFinal(&ctx, out);
+}
+
+
+
+/**
+ * Mix new input into the DRBG state
+ */
+static void drbgMix(struct p11RandomPool_t *rp, unsigned char tag, unsigned char *input, int inputlen)
+{
+	unsigned char newkey[32];
+
+	drbgHash(rp, tag, input, inputlen, newkey);
+	memcpy(rp->key, newkey, sizeof(rp->key));
+	memset(newkey, 0, sizeof(newkey));
+}
+
+
+
+/**
+ * Reseed the DRBG with fresh entropy from the token
+ */
+static int drbgReseed(struct p11Slot_t *slot, struct p11RandomPool_t *rp)
+{
+	unsigned char entropy[RANDOM_SEED_SIZE];
+	int rc;
+
+	rc = fillFromToken(slot, entropy, sizeof(entropy));
+
+	if (rc == CKR_OK) {
+		drbgMix(rp, DRBG_RESEED, entropy, sizeof(entropy));
+		rp->generated = 0;
+		rp->seeded = TRUE;
+	}
+
+	memset(entropy, 0, sizeof(entropy));
+	return rc;
+}
+
+
+
+/**
+ * Produce output from the DRBG and update its state, so that earlier output can not be
+ * reconstructed from a later state
+ */
+static void drbgGenerate(struct p11RandomPool_t *rp, unsigned char *data, int length)
+{
+	unsigned char block[32];
+	int chunk;
+
+	rp->generated += length;
+
+	while (length > 0) {
+		drbgHash(rp, DRBG_GENERATE, NULL, 0, block);
+		chunk = length > (int)sizeof(block) ? (int)sizeof(block) : length;
+		memcpy(data, block, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+
+	memset(block, 0, sizeof(block));
+	drbgMix(rp, DRBG_UPDATE, NULL, 0);
+}
+
+#endif
+
+
+
+/**
+ * Refill the consumed part of the pool
+ *
+ * Consumed bytes are always at the beginning of the pool, so filling them keeps the
+ * unused bytes contiguous.
+ */
+static int refillPool(struct p11Slot_t *slot, struct p11RandomPool_t *rp)
+{
+	int consumed = RANDOM_POOL_SIZE - rp->avail;
+#if RANDOM_USE_DRBG
+	int rc;
+
+	if (!rp->seeded || (rp->generated >= RANDOM_RESEED_INTERVAL)) {
+		rc = drbgReseed(slot, rp);
+		if (rc != CKR_OK) {
+			return rc;
+		}
+	}
+
+	drbgGenerate(rp, rp->pool, consumed);
+#else
+	int rc;
+
+	rc = fillFromToken(slot, rp->pool, consumed);
+	if (rc != CKR_OK) {
+		return rc;
+	}
+#endif
+
+#ifdef DEBUG
+	debug("Refilled %d bytes of random pool\n", consumed);
+#endif
+	rp->avail = RANDOM_POOL_SIZE;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Return the random pool for the slot, allocating it on first use
+ */
+static struct p11RandomPool_t *getRandomPool(struct p11Slot_t *slot)
+{
+	if (slot->random == NULL) {
+		slot->random = (struct p11RandomPool_t *)calloc(1, sizeof(struct p11RandomPool_t));
+	}
+	return slot->random;
+}
+
+
+
+static int generateFromPool(struct p11Slot_t *slot, CK_BYTE_PTR data, CK_ULONG length)
+{
+	struct p11RandomPool_t *rp;
+	unsigned char *p;
+	CK_ULONG chunk;
+	int rc;
+
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	rp = getRandomPool(slot);
+	if (rp == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	while (length > 0) {
+		if (rp->avail == 0) {
+			rc = refillPool(slot, rp);
+			if (rc != CKR_OK) {
+				return rc;
+			}
+		}
+
+		chunk = length > (CK_ULONG)rp->avail ? (CK_ULONG)rp->avail : length;
+		p = rp->pool + RANDOM_POOL_SIZE - rp->avail;
+		memcpy(data, p, chunk);
+		memset(p, 0, chunk);		// Never hand out the same bytes twice
+		rp->avail -= (int)chunk;
+		data += chunk;
+		length -= chunk;
+	}
+
+	if (rp->avail < RANDOM_REFILL_THRESHOLD) {
+		// Failing to refill ahead of time is not an error for the current request
+		refillPool(slot, rp);
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Generate random data, serving from the slot's pool and refilling it as needed
+ *
+ * The caller must hold the slot lock, either shared or exclusive. The pool is
+ * protected by the card lock, which is acquired here.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param data      The buffer receiving the random data
+ * @param length    The number of bytes required
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int generateRandom(struct p11Slot_t *slot, CK_BYTE_PTR data, CK_ULONG length)
+{
+	int rc;
+
+	MUTEX_LOCK(&slot->mutex);
+	rc = generateFromPool(slot, data, length);
+	MUTEX_UNLOCK(&slot->mutex);
+
+	return rc;
+}
+
+
+
+/**
+ * Mix additional seed material into the host DRBG of the slot
+ *
+ * Buffered output is discarded, so that all later output depends on the seed.
+ * The caller must hold the slot lock, either shared or exclusive.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param seed      The seed material
+ * @param length    The length of the seed material
+ * @return          CKR_OK, CKR_RANDOM_SEED_NOT_SUPPORTED or any other Cryptoki error code
+ */
+int seedRandom(struct p11Slot_t *slot, CK_BYTE_PTR seed, CK_ULONG length)
+{
+#if RANDOM_USE_DRBG
+	struct p11RandomPool_t *rp;
+
+	MUTEX_LOCK(&slot->mutex);
+
+	rp = getRandomPool(slot);
+	if (rp == NULL) {
+		MUTEX_UNLOCK(&slot->mutex);
+		return CKR_HOST_MEMORY;
+	}
+
+	drbgMix(rp, DRBG_SEED, seed, (int)length);
+	memset(rp->pool, 0, sizeof(rp->pool));
+	rp->avail = 0;
+
+	MUTEX_UNLOCK(&slot->mutex);
+	return CKR_OK;
+#else
+	return CKR_RANDOM_SEED_NOT_SUPPORTED;
+#endif
+}
+
+
+
+/**
+ * Wipe and release the random pool of a slot, e.g. if the token is removed
+ *
+ * @param slot      The slot in which the token was inserted
+ */
+void releaseRandomPool(struct p11Slot_t *slot)
+{
+	if (slot->random != NULL) {
+		memset(slot->random, 0, sizeof(struct p11RandomPool_t));
+		free(slot->random);
+		slot->random = NULL;
+	}
+}
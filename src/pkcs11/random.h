@@ -0,0 +1,95 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    random.h
+ * @brief   Per-slot random number pool fed by the token
+ */
+
+#ifndef ___RANDOM_H_INC___
+#define ___RANDOM_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+/* Number of random bytes buffered per slot */
+#ifndef RANDOM_POOL_SIZE
+#define RANDOM_POOL_SIZE        1024
+#endif
+
+/* Number of bytes requested from the token with a single GET CHALLENGE */
+#ifndef RANDOM_CHALLENGE_SIZE
+#define RANDOM_CHALLENGE_SIZE   256
+#endif
+
+/*
+ * Refill the pool as soon as fewer bytes than this remain. A value of 0 refills only
+ * when a request can not be served from memory.
+ */
+#ifndef RANDOM_REFILL_THRESHOLD
+#define RANDOM_REFILL_THRESHOLD 0
+#endif
+
+/*
+ * Set to 1 to expand token entropy with a SHA-256 based DRBG on the host. The token
+ * is then only asked for RANDOM_SEED_SIZE bytes every RANDOM_RESEED_INTERVAL bytes
+ * of output. Set to 0 to fill the pool with token output only.
+ */
+#ifndef RANDOM_USE_DRBG
+#define RANDOM_USE_DRBG         1
+#endif
+
+/* Number of token bytes used to seed or reseed the DRBG */
+#ifndef RANDOM_SEED_SIZE
+#define RANDOM_SEED_SIZE        64
+#endif
+
+/* Number of bytes the DRBG may produce before it is reseeded from the token */
+#ifndef RANDOM_RESEED_INTERVAL
+#define RANDOM_RESEED_INTERVAL  65536
+#endif
+
+/**
+ * Random bytes buffered for a slot
+ */
+struct p11RandomPool_t
+{
+	unsigned char pool[RANDOM_POOL_SIZE]; /**< Random bytes not yet handed out          */
+	int avail;                            /**< Number of unused bytes at the end of pool */
+#if RANDOM_USE_DRBG
+	unsigned char key[32];                /**< DRBG state                               */
+	unsigned long counter;                /**< DRBG block counter                       */
+	unsigned long generated;              /**< Bytes produced since the last reseed     */
+	int seeded;                           /**< DRBG has been seeded from the token      */
+#endif
+};
+
+int generateRandom(struct p11Slot_t *slot, CK_BYTE_PTR data, CK_ULONG length);
+int seedRandom(struct p11Slot_t *slot, CK_BYTE_PTR seed, CK_ULONG length);
+void releaseRandomPool(struct p11Slot_t *slot);
+
+#endif /* ___RANDOM_H_INC___ */
@@ -0,0 +1,173 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    sc-hsm-pkcs11.h
+ * @brief   Vendor extensions of the SmartCard-HSM PKCS#11 module
+ *
+ * Applications obtain the extended function list by resolving C_GetVendorFunctionList
+ * from the module, e.g. with dlsym() or GetProcAddress(). The function list is versioned;
+ * new functions are only ever appended.
+ */
+
+#ifndef ___SC_HSM_PKCS11_H_INC___
+#define ___SC_HSM_PKCS11_H_INC___
+
+#include <pkcs11/cryptoki.h>
+
+#define SC_HSM_FUNCTION_LIST_VERSION_MAJOR	1
+#define SC_HSM_FUNCTION_LIST_VERSION_MINOR	3
+
+/*
+ * Priority of card operations of a session. Operations with the same priority are
+ * served in the order of arrival. Since 1.1
+ */
+#define SC_HSM_PRIORITY_NORMAL	0		/**< Default, e.g. for bulk jobs                     */
+#define SC_HSM_PRIORITY_HIGH	1		/**< Interactive requests, served before bulk jobs   */
+
+/**
+ * One input and output of a batch signature operation
+ */
+typedef struct CK_SIGN_BATCH_ITEM {
+	CK_BYTE_PTR pData;              /**< The data to be signed                                    */
+	CK_ULONG ulDataLen;             /**< The length of the data                                   */
+	CK_BYTE_PTR pSignature;         /**< Buffer receiving the signature or NULL to query the size */
+	CK_ULONG ulSignatureLen;        /**< In: size of pSignature. Out: length of the signature     */
+	CK_RV rv;                       /**< Result of signing this item                              */
+} CK_SIGN_BATCH_ITEM;
+
+typedef CK_SIGN_BATCH_ITEM CK_PTR CK_SIGN_BATCH_ITEM_PTR;
+
+/*
+ * Counters are 64 bit and never reset while the module is initialized. Applications
+ * poll them and compute differences. Times are in microseconds. Since 1.2
+ */
+typedef unsigned long long CK_SC_HSM_COUNTER;
+
+/**
+ * Counters of a slot
+ */
+typedef struct CK_SC_HSM_SLOT_STATISTICS {
+	CK_SLOT_ID slotID;              /**< The slot                                                 */
+	CK_ULONG ulSessionCount;        /**< Number of open sessions                                  */
+	CK_ULONG ulObjectCount;         /**< Number of token objects visible to the module            */
+	CK_SC_HSM_COUNTER operations;   /**< Completed cryptographic operations, including digests   */
+	CK_SC_HSM_COUNTER errors;       /**< Operations completed with an error                       */
+	CK_SC_HSM_COUNTER rejected;     /**< Operations rejected with CKR_FUNCTION_REJECTED           */
+	CK_SC_HSM_COUNTER apdus;        /**< Command APDUs sent to the card                           */
+	CK_SC_HSM_COUNTER bytesSent;    /**< Bytes sent to the card                                   */
+	CK_SC_HSM_COUNTER bytesReceived;/**< Bytes received from the card                             */
+	CK_SC_HSM_COUNTER lockWaitTime; /**< Time waiting for the slot lock                           */
+	CK_SC_HSM_COUNTER cardWaitTime; /**< Time waiting for the card while other sessions use it    */
+	CK_SC_HSM_COUNTER cardTime;     /**< Time exchanging APDUs with the card                      */
+} CK_SC_HSM_SLOT_STATISTICS;
+
+typedef CK_SC_HSM_SLOT_STATISTICS CK_PTR CK_SC_HSM_SLOT_STATISTICS_PTR;
+
+/**
+ * Counters of a mechanism, summed up over all slots
+ */
+typedef struct CK_SC_HSM_MECHANISM_STATISTICS {
+	CK_MECHANISM_TYPE mechanism;    /**< The mechanism                                            */
+	CK_SC_HSM_COUNTER operations;   /**< Completed operations                                     */
+	CK_SC_HSM_COUNTER errors;       /**< Operations completed with an error                       */
+	CK_SC_HSM_COUNTER time;         /**< Time spent in the call completing the operation          */
+} CK_SC_HSM_MECHANISM_STATISTICS;
+
+typedef CK_SC_HSM_MECHANISM_STATISTICS CK_PTR CK_SC_HSM_MECHANISM_STATISTICS_PTR;
+
+typedef struct CK_SC_HSM_FUNCTION_LIST CK_SC_HSM_FUNCTION_LIST;
+typedef CK_SC_HSM_FUNCTION_LIST CK_PTR CK_SC_HSM_FUNCTION_LIST_PTR;
+typedef CK_SC_HSM_FUNCTION_LIST_PTR CK_PTR CK_SC_HSM_FUNCTION_LIST_PTR_PTR;
+
+/**
+ * Vendor specific entry points
+ */
+struct CK_SC_HSM_FUNCTION_LIST {
+	CK_VERSION version;             /**< SC_HSM_FUNCTION_LIST_VERSION_MAJOR/MINOR of the module   */
+
+	CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SignBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey,
+		CK_SIGN_BATCH_ITEM_PTR pItems,
+		CK_ULONG ulCount
+	);
+
+	CK_DECLARE_FUNCTION_POINTER(CK_RV, C_SetSessionPriority)(
+		CK_SESSION_HANDLE hSession,
+		CK_ULONG ulPriority
+	);
+
+	CK_DECLARE_FUNCTION_POINTER(CK_RV, C_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics
+	);
+
+	CK_DECLARE_FUNCTION_POINTER(CK_RV, C_GetMechanismStatistics)(
+		CK_SC_HSM_MECHANISM_STATISTICS_PTR pStatistics,
+		CK_ULONG_PTR pulCount
+	);
+
+	/* Discard the cached objects of the token and read them again. Since 1.3 */
+	CK_DECLARE_FUNCTION_POINTER(CK_RV, C_InvalidateObjectCache)(
+		CK_SLOT_ID slotID
+	);
+};
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetVendorFunctionList)(
+	CK_SC_HSM_FUNCTION_LIST_PTR_PTR ppFunctionList
+);
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignBatch)(
+	CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey,
+	CK_SIGN_BATCH_ITEM_PTR pItems,
+	CK_ULONG ulCount
+);
+
+CK_DECLARE_FUNCTION(CK_RV, C_SetSessionPriority)(
+	CK_SESSION_HANDLE hSession,
+	CK_ULONG ulPriority
+);
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotStatistics)(
+	CK_SLOT_ID slotID,
+	CK_SC_HSM_SLOT_STATISTICS_PTR pStatistics
+);
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismStatistics)(
+	CK_SC_HSM_MECHANISM_STATISTICS_PTR pStatistics,
+	CK_ULONG_PTR pulCount
+);
+
+CK_DECLARE_FUNCTION(CK_RV, C_InvalidateObjectCache)(
+	CK_SLOT_ID slotID
+);
+
+#endif /* ___SC_HSM_PKCS11_H_INC___ */
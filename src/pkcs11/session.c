@@ -37,8 +37,17 @@
 #include <assert.h>
 
 #include <pkcs11/session.h>
+#include <pkcs11/slotpool.h>
 #include <common/mutex.h>
 
+#define SESSION_TABLE_SIZE  64             /* Initial number of buckets, must be a power of 2 */
+
+#define SESSION_BUCKET(pool, handle)  ((pool)->table[(handle) & ((pool)->tableSize - 1)])
+
+#define SEARCH_LIST_SIZE    32             /* Initial number of handles in the search results */
+
+
+
 /**
  * Initialize the session-pool structure
  *
@@ -46,12 +55,13 @@
  */
 void initSessionPool(struct p11SessionPool_t *sessionPool)
 {
-	sessionPool->list = NULL;
+	sessionPool->table = NULL;   /* Allocated with the first session */
+	sessionPool->tableSize = 0;
 	sessionPool->nextHandle = 1; /* Set initial value of session handles to 1 */
 	                             /* Valid handles have a non-zero value       */
 	sessionPool->count = 0;
 
-	MUTEX_INIT(&sessionPool->mutex);
+	RWLOCK_INIT(&sessionPool->lock);
 }
 
 
@@ -64,12 +74,72 @@ void initSessionPool(struct p11SessionPool_t *sessionPool)
 void terminateSessionPool(struct p11SessionPool_t *sessionPool)
 {
 	struct p11Session_t *session, *next;
-	
-	FOR_EACH_WITH_NEXT(session, next, sessionPool->list) {
-		freeSession(session);
+	CK_ULONG i;
+
+	for (i = 0; i < sessionPool->tableSize; i++) {
+		FOR_EACH_WITH_NEXT(session, next, sessionPool->table[i]) {
+			freeSession(session);
+		}
 	}
 
-	mutex_destroy(&sessionPool->mutex);
+	free(sessionPool->table);
+	sessionPool->table = NULL;
+	sessionPool->tableSize = 0;
+	sessionPool->count = 0;
+
+	RWLOCK_DESTROY(&sessionPool->lock);
+}
+
+
+
+/**
+ * Find a session in the hash table. The caller must hold the pool lock.
+ */
+static struct p11Session_t *lookupSession(struct p11SessionPool_t *sessionPool, CK_SESSION_HANDLE handle)
+{
+	struct p11Session_t *session;
+
+	if (sessionPool->table == NULL) {
+		return NULL;
+	}
+
+	FOR_EACH(session, SESSION_BUCKET(sessionPool, handle)) {
+		if (session->handle == handle) {
+			return session;
+		}
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Resize the hash table to the given number of buckets. The caller must hold the write lock.
+ *
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+static int resizeSessionTable(struct p11SessionPool_t *sessionPool, CK_ULONG newSize)
+{
+	struct p11Session_t **newTable, *session, *next;
+	CK_ULONG i;
+
+	newTable = (struct p11Session_t **)calloc(newSize, sizeof(struct p11Session_t *));
+
+	if (newTable == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	for (i = 0; i < sessionPool->tableSize; i++) {
+		FOR_EACH_WITH_NEXT(session, next, sessionPool->table[i]) {
+			session->next = newTable[session->handle & (newSize - 1)];
+			newTable[session->handle & (newSize - 1)] = session;
+		}
+	}
+
+	free(sessionPool->table);
+	sessionPool->table = newTable;
+	sessionPool->tableSize = newSize;
+	return CKR_OK;
 }
 
 
@@ -81,27 +151,85 @@ void terminateSessionPool(struct p11SessionPool_t *sessionPool)
  *
  * @param pool      Pointer to session-pool structure
  * @param session   Pointer to session structure
+ * @return CKR_OK or CKR_HOST_MEMORY
  */
-void safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *session)
+int safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *session)
 {
-	struct p11Session_t **ppSession;
+	struct p11Session_t **ppBucket;
+	int rc;
 
-	session->next = NULL;
-	
-	MUTEX_LOCK(&sessionPool->mutex);
+	RWLOCK_WRLOCK(&sessionPool->lock);
 
-	FOR_EACH_REF(ppSession, sessionPool->list) {
-		/* until points to the next field of the last element */
+	/* Keep the load factor below 1, so buckets stay short */
+	if (sessionPool->count >= sessionPool->tableSize) {
+		rc = resizeSessionTable(sessionPool, sessionPool->tableSize ? sessionPool->tableSize << 1 : SESSION_TABLE_SIZE);
+		if ((rc != CKR_OK) && (sessionPool->table == NULL)) {
+			RWLOCK_WRUNLOCK(&sessionPool->lock);
+			return rc;
+		}
+		/* A failed resize only makes buckets longer */
 	}
 
-	*ppSession = session;
+	/* Skip handles still in use after a wrap around */
+	do {
+		session->handle = sessionPool->nextHandle++;
+		if (sessionPool->nextHandle == 0)
+			sessionPool->nextHandle = 1;
+	} while (lookupSession(sessionPool, session->handle) != NULL);
 
-	session->handle = sessionPool->nextHandle++;
-	if (sessionPool->nextHandle == 0)
-		sessionPool->nextHandle = 1;
+	ppBucket = &SESSION_BUCKET(sessionPool, session->handle);
+	session->next = *ppBucket;
+	*ppBucket = session;
 	sessionPool->count++;
 
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	RWLOCK_WRUNLOCK(&sessionPool->lock);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Remove a session from the session-pool
+ *
+ * The caller must hold the write lock of the pool. On success the session is unlinked and
+ * the caller has exclusive access to it.
+ *
+ * @param pool      Pointer to session-pool structure
+ * @param handle    The handle of the session
+ * @param ppSession Pointer to a session structure pointer receiving the unlinked session
+ * @return CKR_OK, CKR_SESSION_HANDLE_INVALID or CKR_FUNCTION_FAILED if another thread uses the session
+ */
+int removeSession(struct p11SessionPool_t *sessionPool, CK_SESSION_HANDLE handle, struct p11Session_t **ppSession)
+{
+	struct p11Session_t **ppBucket;
+
+	*ppSession = NULL;
+
+	if ((handle == CK_INVALID_HANDLE) || (sessionPool->table == NULL)) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	FOR_EACH_REF(ppBucket, SESSION_BUCKET(sessionPool, handle)) {
+		if ((*ppBucket)->handle == handle) {
+			break;
+		}
+	}
+
+	if (*ppBucket == NULL) {
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	if ((*ppBucket)->queuing) {
+		/* another thread using this session is waiting for the slot mutex */
+		return CKR_FUNCTION_FAILED;
+	}
+
+	*ppSession = *ppBucket;
+	*ppBucket = (*ppSession)->next; /* unlink */
+	(*ppSession)->next = NULL;
+	sessionPool->count--;
+
+	return CKR_OK;
 }
 
 
@@ -109,19 +237,20 @@ void safeAddSession(struct p11SessionPool_t *sessionPool, struct p11Session_t *s
 /**
  * This thread safe function must be called before operating on a session.
  * Finds the session pointer for the passed session handle, acquires the session and
- * acquires the slot mutex. If the function succeeds the caller must release
- * the slot mutex. For convenience the function should be called via the
- * FUNC_FIND_SESSION_AND_LOCK_SLOT(handle, &session) and afterwards use strictly FUNC_RETURNS
- * or FUNC_FAILS instead of return.
+ * acquires the slot lock. If the function succeeds the caller must release
+ * the slot lock with unlockSlot(). For convenience the function should be called via the
+ * FUNC_FIND_SESSION_AND_LOCK_SLOT(handle, &session) or FUNC_FIND_SESSION_AND_SHARE_SLOT macro
+ * and afterwards use strictly FUNC_RETURNS or FUNC_FAILS instead of return.
  *
  * @param sessionPool  Pointer to session-pool structure.
  * @param handle       The handle of the session.
  * @param ppSession    Pointer to a session structure pointer.
  *                     If the session is found, it is returned in this pointer.
+ * @param exclusive    Acquire the object lock of the slot exclusively rather than shared
  * @return CKR_OK or CKR_SESSION_HANDLE_INVALID or CKR_OPERATION_ACTIVE
  */
 int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *slotPool,
-	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot)
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot, int exclusive)
 {
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
@@ -133,30 +262,20 @@ int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11S
 		return CKR_SESSION_HANDLE_INVALID;
 	}
 
-	/* lookup session */
-	MUTEX_LOCK(&sessionPool->mutex);
-	FOR_EACH(session, sessionPool->list) {
-		if (session->handle == handle) {
-			/* prevent deletion of session */
-			InterlockedIncrement(&session->queuing);
-			break;
-		}
+	/* lookup session, concurrent lookups only share the read lock */
+	RWLOCK_RDLOCK(&sessionPool->lock);
+	session = lookupSession(sessionPool, handle);
+	if (session != NULL) {
+		/* prevent deletion of session */
+		InterlockedIncrement(&session->queuing);
 	}
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	RWLOCK_RDUNLOCK(&sessionPool->lock);
 	if (session == NULL) {
 		return CKR_SESSION_HANDLE_INVALID;
 	}
 
 	/* lookup slot */
-	MUTEX_LOCK(&slotPool->mutex);
-	FOR_EACH(slot, slotPool->list) {
-		if (slot->id == session->slotID) {
-			/* prevent deletion of slot */
-			InterlockedIncrement(&slot->queuing);
-			break;
-		}
-	}
-	MUTEX_UNLOCK(&slotPool->mutex);
+	slot = safeFindAndQueueSlot(slotPool, session->slotID);
 	if (slot == NULL) {
 		InterlockedDecrement(&session->queuing);
 		return CKR_DEVICE_REMOVED;
@@ -169,21 +288,21 @@ int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11S
 
 	/* Unprotected area here. We must ensure that the session and slot pointer is still valid after
 	   obtaining the slot mutex. This is handled by incrementing session->queuing while
-	   holding the session pool mutex, and decrement after possessing the slot mutex.
-	   The deletion function must check session->queuing when holding the session pool mutex
+	   holding the session pool lock, and decrement after possessing the slot mutex.
+	   The deletion function must check session->queuing when holding the session pool write lock
 	   and unlink the session immediately. If session->queuing > 0 deletion must be cancelled.
 	   Otherwise another thread could get a session pointer which points to freed memory.
 	   Same applies to the slot.
 	   Acquire the slot mutex while owning the slot pool mutex is a performace killer. */
 
-	/* Acquire the slot mutex */
-	MUTEX_LOCK(&slot->mutex);
+	/* Acquire the slot lock */
+	lockSlot(slot, exclusive);
 
 	InterlockedDecrement(&slot->queuing);
 	InterlockedDecrement(&session->queuing);
 
 	if (slot->token == NULL) {
-		MUTEX_UNLOCK(&slot->mutex);
+		unlockSlot(slot);
 		return CKR_TOKEN_NOT_PRESENT;
 	}
 
@@ -219,18 +338,21 @@ int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11S
 int safeFindFirstSessionBySlotID(struct p11SessionPool_t *sessionPool, CK_SLOT_ID slotID, CK_SESSION_HANDLE *phSession)
 {
 	struct p11Session_t *session;
+	CK_ULONG i;
 
-	MUTEX_LOCK(&sessionPool->mutex);
+	RWLOCK_RDLOCK(&sessionPool->lock);
 
-	FOR_EACH(session, sessionPool->list) {
-		if (session->slotID == slotID) {
-			MUTEX_UNLOCK(&sessionPool->mutex);
-			*phSession = session->handle;
-			return CKR_OK;
+	for (i = 0; i < sessionPool->tableSize; i++) {
+		FOR_EACH(session, sessionPool->table[i]) {
+			if (session->slotID == slotID) {
+				*phSession = session->handle;
+				RWLOCK_RDUNLOCK(&sessionPool->lock);
+				return CKR_OK;
+			}
 		}
 	}
 
-	MUTEX_UNLOCK(&sessionPool->mutex);
+	RWLOCK_RDUNLOCK(&sessionPool->lock);
 
 	*phSession = CK_INVALID_HANDLE;
 	return CKR_FUNCTION_FAILED;
@@ -256,6 +378,18 @@ void freeSession(struct p11Session_t *session)
 		session->cryptoBufferSize = 0;
 	}
 
+	if (session->signDigest) {
+		memset(session->signDigest, 0, sizeof(*session->signDigest));
+		free(session->signDigest);
+	}
+
+	if (session->digest) {
+		memset(session->digest, 0, sizeof(*session->digest));
+		free(session->digest);
+	}
+
+	free(session->searchObj.searchList);
+	freeObjectIndex(&session->objectIndex);
 	free(session);
 }
 
@@ -295,9 +429,12 @@ CK_STATE getSessionState(struct p11Session_t *session, struct p11Slot_t *slot)
  *
  * @param session   the session
  * @param object    the object to add
+ * @return CKR_OK or CKR_HOST_MEMORY
  */
-void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
+int addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 {
+	int rc;
+
 	if (session->nextSessionObjHandle == 0) {
 		session->nextSessionObjHandle = 0xA000;
 	}
@@ -305,9 +442,15 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
 	object->handle = session->nextSessionObjHandle++;
 	object->dirtyFlag = 0;
 
+	rc = addObjectToIndex(&session->objectIndex, object);
+	if (rc != CKR_OK)
+		return rc;
+
 	addObjectToList(&session->objectList, object);
 
 	session->objectCount++;
+
+	return CKR_OK;
 }
 
 
@@ -317,20 +460,9 @@ void addSessionObject(struct p11Session_t *session, struct p11Object_t *object)
  */
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **ppObject)
 {
-	struct p11Object_t *object;
-	int pos;  /* remember the current position in the list */
-
-	pos = 0;
-	FOR_EACH(object, session->objectList) {
-		if (object->handle == handle) {
-			*ppObject = object;
-			return pos;
-		}
-		pos++;
-	}
+	*ppObject = findObjectInIndex(&session->objectIndex, handle);
 
-	*ppObject = NULL;
-	return -1;
+	return *ppObject ? 0 : -1;
 }
 
 
@@ -342,6 +474,11 @@ int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle)
 {
 	int rc;
 
+	rc = removeObjectFromIndex(&session->objectIndex, handle);
+
+	if (rc != CKR_OK)
+		return rc;
+
 	rc = removeObjectFromList(&session->objectList, handle);
 
 	if (rc != CKR_OK)
@@ -355,28 +492,27 @@ int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle)
 
 
 /**
- * Add an object to the search list by make a shallow copy of the object
+ * Add the handle of an object to the search results
  */
 int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object)
 {
-	struct p11Object_t **ppObject;
-	struct p11Object_t *pNewObject;
+	struct p11ObjectSearch_t *search = &session->searchObj;
+	CK_OBJECT_HANDLE_PTR list;
+	CK_ULONG max;
 
-	pNewObject = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+	if (search->objectCount == search->searchListMax) {
+		max = search->searchListMax ? search->searchListMax << 1 : SEARCH_LIST_SIZE;
+		list = (CK_OBJECT_HANDLE_PTR)realloc(search->searchList, max * sizeof(CK_OBJECT_HANDLE));
 
-	if (pNewObject == NULL) {
-		return CKR_HOST_MEMORY;
-	}
-
-	*pNewObject = *object;
-	pNewObject->next = NULL;
+		if (list == NULL) {
+			return CKR_HOST_MEMORY;
+		}
 
-	FOR_EACH_REF(ppObject, session->searchObj.searchList) {
-		/* until points to the next field of the last element */
+		search->searchList = list;
+		search->searchListMax = max;
 	}
 
-	*ppObject = pNewObject;
-	session->searchObj.objectCount++;
+	search->searchList[search->objectCount++] = object->handle;
 
 	return CKR_OK;
 }
@@ -384,21 +520,12 @@ int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *obje
 
 
 /**
- * Clear the search results list
+ * Clear the search results, keeping the allocated list for the next search
  */
 void clearSearchList(struct p11Session_t *session)
 {
-	struct p11Object_t *object, *pNext;
-
-	// Objects on the search list are not a deep copy of the actual object
-	// thats why we don't use removeAllObjectsFromList() here
-	FOR_EACH_WITH_NEXT(object, pNext, session->searchObj.searchList) {
-		free(object);
-	}
-
 	session->searchObj.objectCount = 0;
 	session->searchObj.objectCollected = 0;
-	session->searchObj.searchList = NULL;
 }
 
 
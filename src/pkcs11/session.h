@@ -37,13 +37,15 @@
 #include <pkcs11/p11generic.h>
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/object.h>
+#include <pkcs11/digest.h>
 
 
 struct p11ObjectSearch_t
 {
-	int objectCount;
-	int objectCollected; /* so far */
-	struct p11Object_t *searchList;
+	CK_ULONG objectCount;           /* Number of handles in searchList */
+	CK_ULONG objectCollected;       /* so far, cursor into searchList */
+	CK_ULONG searchListMax;         /* Allocated size of searchList */
+	CK_OBJECT_HANDLE_PTR searchList;
 };
 
 
@@ -63,11 +65,15 @@ struct p11Session_t
 	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results       */
 	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer          */
 	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer             */
+	struct p11DigestContext_t *signDigest; /**< Host side digest of a hash-and-sign or verify operation */
+	struct p11DigestContext_t *digest;  /**< Active C_Digest operation or NULL          */
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation    */
+	int priority;                       /**< CARD_PRIORITY_xxx when queuing for the card */
 	CK_LONG nextSessionObjHandle;       /**< Value of next assigned object handle      */
 	int objectCount;                    /**< The number of objects in this session     */
 	struct p11Object_t *objectList;     /**< Pointer to first object in pool           */
-	struct p11Session_t *next;          /**< Pointer to next active session, NULL else */
+	struct p11ObjectIndex_t objectIndex; /**< Session objects indexed by handle         */
+	struct p11Session_t *next;          /**< Next session in the same hash bucket      */
 };
 
 /* function prototypes */
@@ -75,12 +81,13 @@ struct p11Session_t
 void initSessionPool(struct p11SessionPool_t *pool);
 void terminateSessionPool(struct p11SessionPool_t *pool);
 void freeSession(struct p11Session_t *session);
-void safeAddSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
+int safeAddSession(struct p11SessionPool_t *pool, struct p11Session_t *session);
+int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, struct p11Session_t **ppSession);
 int safeFindSessionAndLockSlot(struct p11SessionPool_t *sessionPool, struct p11SlotPool_t *slotPool,
-	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot);
+	CK_SESSION_HANDLE handle, struct p11Session_t **ppSession, struct p11Slot_t **ppSlot, int exclusive);
 int safeFindFirstSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, CK_SESSION_HANDLE *phSession);
 CK_STATE getSessionState(struct p11Session_t *session, struct p11Slot_t *slot);
-void addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
+int addSessionObject(struct p11Session_t *session, struct p11Object_t *object);
 int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle);
 int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object);
@@ -39,6 +39,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
@@ -55,6 +56,12 @@
 
 extern struct p11Context_t *context;
 
+#define SLOT_EVENT_POLL_INTERVAL	500		/* Milliseconds between card presence checks */
+
+#define CARD_UNKNOWN				0		/* Values for slot->eventPresence */
+#define CARD_ABSENT					1
+#define CARD_PRESENT				2
+
 
 
 /*
@@ -90,17 +97,19 @@ int transmitAPDUwithCTAPI(struct p11Slot_t *slot, int todad,
 	if (rc < 0)
 		FUNC_FAILS(rc, "Encoding APDU failed");
 
+	MUTEX_LOCK(&slot->mutex);
 	rc = transmitAPDUviaCTAPI(slot, todad,
 			apdu, rc,
 			apdu, sizeof(apdu));
+	MUTEX_UNLOCK(&slot->mutex);
 
 	if (rc >= 2) {
 		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
 		rc -= 2;
 
 		if (InData && InSize) {
-			if (rc > InSize) {		// Never return more than caller allocated a buffer for
-				rc = InSize;
+			if (rc > InSize) {
+				FUNC_FAILS(-1, "Response larger than buffer");
 			}
 			memcpy(InData, apdu, rc);
 		}
@@ -256,6 +265,16 @@ static int checkForRemovedCTAPIToken(struct p11Slot_t *slot)
 
 	rc = transmitAPDUwithCTAPI(slot, 1, 0x20, 0x13, 0x01, 0x80, 0, NULL, 0, rsp, sizeof(rsp), &SW1SW2);
 
+	if (!slot->exclusive) {
+		/* Token and slot can only be released by the exclusive owner of the slot */
+		if (rc == ERR_CT) {
+			FUNC_RETURNS(CKR_DEVICE_REMOVED);
+		}
+		if ((rc >= 3) && (SW1SW2 == 0x9000) && (rsp[0] == 0x80) && !(rsp[2] & 0x01)) {
+			FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+		}
+	}
+
 	if (rc == ERR_CT) {					// Reader or USB-Device removed
 		removeToken(slot);
 		closeSlot(slot);
@@ -287,8 +306,10 @@ int getCTAPIToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 	if (slot->token) {
 		rc = checkForRemovedCTAPIToken(slot);
-	} else {
+	} else if (slot->exclusive) {
 		rc = checkForNewCTAPIToken(slot);
+	} else {
+		rc = CKR_TOKEN_NOT_PRESENT;
 	}
 
 	*token = slot->token;
@@ -323,7 +344,8 @@ int updateCTAPISlots(struct p11SlotPool_t *slotPool)
 		}
 	}
 
-	while (slotPool->count < MAX_SLOTS) {
+	/* Probe ports until the first one fails to initialize */
+	for (;;) {
 		ctn = (unsigned short)slotPool->nextID;
 
 		rc = CT_init(ctn, ctn);
@@ -338,6 +360,7 @@ int updateCTAPISlots(struct p11SlotPool_t *slotPool)
 		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
 
 		if (slot == NULL) {
+			CT_close(ctn);
 			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 		}
 
@@ -361,7 +384,12 @@ int updateCTAPISlots(struct p11SlotPool_t *slotPool)
 		slot->info.firmwareVersion.major = 0;
 
 		slot->info.flags = CKF_REMOVABLE_DEVICE | CKF_HW_SLOT;
-		addSlot(&context->slotPool, slot);
+
+		if (addSlot(&context->slotPool, slot) != CKR_OK) {
+			CT_close(ctn);
+			free(slot);
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -369,6 +397,121 @@ int updateCTAPISlots(struct p11SlotPool_t *slotPool)
 
 
 
+/**
+ * Query the card presence in a CT-API reader with the CT-BCS GET STATUS command
+ *
+ * @param slot       Pointer to slot structure.
+ *
+ * @return           CARD_PRESENT, CARD_ABSENT or -1 if the status could not be obtained
+ */
+static int getCTAPICardPresence(struct p11Slot_t *slot)
+{
+	unsigned char rsp[260];
+	int rc;
+	unsigned short SW1SW2;
+
+	FUNC_CALLED();
+
+	rc = transmitAPDUwithCTAPI(slot, 1, 0x20, 0x13, 0x01, 0x80, 0, NULL, 0, rsp, sizeof(rsp), &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(-1, "GET_STATUS failed");
+	}
+
+	if ((SW1SW2 != 0x9000) || (rc < 3) || (rsp[0] != 0x80) || (rsp[1] == 0) || (rsp[1] > rc - 2)) {
+		FUNC_FAILS(-1, "GET_STATUS returned invalid response");
+	}
+
+	FUNC_RETURNS(rsp[2] & 0x01 ? CARD_PRESENT : CARD_ABSENT);
+}
+
+
+
+/**
+ * Wait for the insertion or removal of a card in one of the CT-API readers
+ *
+ * CT-API has no event notification, so the card presence of all readers is polled with
+ * GET STATUS every SLOT_EVENT_POLL_INTERVAL milliseconds. Polling does not load tokens.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param dontBlock  Return CKR_NO_EVENT rather than blocking if no event is pending
+ * @param pSlotID    The slot in which the event occurred
+ *
+ * @return           CKR_OK, CKR_NO_EVENT, CKR_CRYPTOKI_NOT_INITIALIZED or any other Cryptoki error code
+ */
+int waitForCTAPISlotEvent(struct p11SlotPool_t *slotPool, int dontBlock, CK_SLOT_ID_PTR pSlotID)
+{
+	struct p11Slot_t *slot;
+	int rc, presence, found;
+
+	FUNC_CALLED();
+
+	for (;;) {
+		if (slotPool->eventCancelled) {
+			FUNC_RETURNS(CKR_CRYPTOKI_NOT_INITIALIZED);
+		}
+
+		rc = safeUpdateSlots(slotPool);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Updating the slot list failed");
+		}
+
+		MUTEX_LOCK(&slotPool->mutex);
+
+		found = FALSE;
+		FOR_EACH(slot, slotPool->list) {
+			if (slot->closed) {
+				continue;
+			}
+
+			MUTEX_LOCK(&slot->mutex);
+			presence = getCTAPICardPresence(slot);
+			MUTEX_UNLOCK(&slot->mutex);
+
+			if (presence < 0) {
+				continue;
+			}
+
+			/* The first state seen for a reader is only recorded */
+			if ((slot->eventPresence != CARD_UNKNOWN) && (slot->eventPresence != presence)) {
+				slot->eventPresence = presence;
+				*pSlotID = slot->id;
+				found = TRUE;
+				break;
+			}
+
+			slot->eventPresence = presence;
+		}
+
+		MUTEX_UNLOCK(&slotPool->mutex);
+
+		if (found) {
+			FUNC_RETURNS(CKR_OK);
+		}
+
+		if (dontBlock) {
+			FUNC_RETURNS(CKR_NO_EVENT);
+		}
+
+		usleep(SLOT_EVENT_POLL_INTERVAL * 1000);
+	}
+}
+
+
+
+/**
+ * Cancel a C_WaitForSlotEvent polling the CT-API readers
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ */
+void cancelCTAPISlotEvents(struct p11SlotPool_t *slotPool)
+{
+	slotPool->eventCancelled = TRUE;
+}
+
+
+
 int closeCTAPISlot(struct p11Slot_t *slot)
 {
 	int rc;
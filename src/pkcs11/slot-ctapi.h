@@ -43,5 +43,7 @@ int transmitAPDUviaCTAPI(struct p11Slot_t *slot, int todad,
 int getCTAPIToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int updateCTAPISlots(struct p11SlotPool_t *pool);
 int closeCTAPISlot(struct p11Slot_t *slot);
+int waitForCTAPISlotEvent(struct p11SlotPool_t *pool, int dontBlock, CK_SLOT_ID_PTR pSlotID);
+void cancelCTAPISlotEvents(struct p11SlotPool_t *pool);
 
 #endif /* ___SLOT_CTAPI_H_INC___ */
@@ -58,14 +58,18 @@
 
 extern struct p11Context_t *context;
 
+#define MONITOR_STOPPED		0			/* Values for slotPool->monitorState */
+#define MONITOR_RUNNING		1
+#define MONITOR_EXITED		2			/* Thread terminated, but must still be joined */
+
+#define MONITOR_TIMEOUT		1000		/* Milliseconds before the monitor checks for cancellation */
+
 static unsigned char ATR[] = { /* expected (A)nswer (T)o (R)equest */
 	0x3B, 0xFE, 0x18, 0x00, 0x00, 0x81, 0x31, 0xFE,
 	0x45, 0x80, 0x31, 0x81, 0x54, 0x48, 0x53, 0x4D,
 	0x31, 0x73, 0x80, 0x21, 0x40, 0x81, 0x07, 0xFA
 };
 
-#ifdef DEBUG
-
 #define _75 75
 
 char* pcsc_error_to_string(const LONG error, char strError[_75])
@@ -192,6 +196,7 @@ char* pcsc_error_to_string(const LONG error, char strError[_75])
 
 
 
+#ifdef DEBUG
 char* pcsc_feature_to_string(const WORD feature, char strFeature[_75])
 {
 	switch (feature) {
@@ -404,12 +409,17 @@ static int checkForNewPCSCToken(struct p11Slot_t *slot)
 	DWORD featurecode, lenr, atrlen, readernamelen, state, protocol;
 	unsigned char buf[256];
 	unsigned char atr[36];
-#ifdef DEBUG
 	char str75[_75];
-#endif
 
 	FUNC_CALLED();
 
+	slot->cardRemoved = FALSE;
+
+	/* Avoid connecting to an empty reader if the presence monitor knows better */
+	if ((slot->readerState != SCARD_STATE_UNAWARE) && !(slot->readerState & SCARD_STATE_PRESENT)) {
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
+	}
+
 	rv = SCardConnect(slot->context, slot->readerName, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &slot->card, &dwActiveProtocol);
 
 #ifdef DEBUG
@@ -514,7 +524,14 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
 	}
 
+	/* The presence monitor tracks the card, so there is no need to ask pcscd */
+	if ((slot->readerState & SCARD_STATE_PRESENT) && !slot->cardRemoved) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	MUTEX_LOCK(&slot->mutex);
 	rv = SCardStatus(slot->card, NULL, 0, 0, 0, 0, 0);
+	MUTEX_UNLOCK(&slot->mutex);
 
 #ifdef DEBUG
 	debug("SCardStatus: %s\n", pcsc_error_to_string(rv, str75));
@@ -524,6 +541,12 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 		FUNC_RETURNS(CKR_OK);
 	}
 
+	/* Token and slot can only be released by the exclusive owner of the slot */
+	if (!slot->exclusive) {
+		slot->cardRemoved = TRUE;
+		FUNC_RETURNS(rv == SCARD_W_REMOVED_CARD ? CKR_TOKEN_NOT_PRESENT : CKR_DEVICE_REMOVED);
+	}
+
 	removeToken(slot);
 
 	switch (rv) {
@@ -541,14 +564,231 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 
 
 
+/**
+ * Update the state of all readers with the result of SCardGetStatusChange
+ *
+ * The caller must hold the slot pool mutex.
+ */
+static void updateMonitoredReaders(struct p11SlotPool_t *slotPool, SCARD_READERSTATE *states, CK_SLOT_ID *ids, int cnt)
+{
+	struct p11Slot_t *slot;
+	DWORD previous, current;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		previous = states[i].dwCurrentState;
+		current = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+		states[i].dwCurrentState = current;
+
+		FOR_EACH(slot, slotPool->list) {
+			if (slot->id == ids[i]) {
+				break;
+			}
+		}
+
+		if (!slot) {
+			continue;
+		}
+
+		/* The upper 16 bits count card insertions and removals, so a fast swap is noticed as well */
+		if ((previous & SCARD_STATE_PRESENT) &&
+			(!(current & SCARD_STATE_PRESENT) || ((previous ^ current) & 0xFFFF0000))) {
+			slot->cardRemoved = TRUE;
+		}
+
+		slot->readerState = current;
+	}
+
+	previous = states[cnt].dwCurrentState;
+	current = states[cnt].dwEventState & ~SCARD_STATE_CHANGED;
+
+	if (current & SCARD_STATE_UNKNOWN) {
+		slotPool->pnpUnsupported = TRUE;
+		states[cnt].dwCurrentState = SCARD_STATE_IGNORE;
+	} else if (previous != SCARD_STATE_IGNORE) {
+		if ((previous ^ current) & 0xFFFF0000) {
+			slotPool->readersChanged = TRUE;
+		}
+		states[cnt].dwCurrentState = current;
+	}
+}
+
+
+
+/**
+ * Presence monitor thread
+ *
+ * Watches all readers and the PnP pseudo reader with a context of its own and records
+ * the reader state in each slot. getPCSCToken() can then check the card presence without
+ * asking pcscd and updatePCSCSlots() only lists the readers if PnP reported a change.
+ *
+ * The thread terminates if C_Finalize is called or if pcscd reports an error, e.g. because
+ * it was restarted. The reader states are then reset, so that all checks are again
+ * performed with pcscd until updatePCSCSlots() started a new monitor.
+ */
+static void monitorPCSCReaders(void *arg)
+{
+	struct p11SlotPool_t *slotPool = (struct p11SlotPool_t *)arg;
+	struct p11Slot_t *slot;
+	SCARD_READERSTATE *states;
+	SCARDCONTEXT hContext;
+	CK_SLOT_ID *ids;
+	char *names;
+	DWORD pnpState;
+	LONG rc;
+	int i, cnt;
+
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+
+	if (rc != SCARD_S_SUCCESS) {
+		MUTEX_LOCK(&slotPool->mutex);
+		slotPool->monitorState = MONITOR_EXITED;
+		MUTEX_UNLOCK(&slotPool->mutex);
+		return;
+	}
+
+	MUTEX_LOCK(&slotPool->mutex);
+	slotPool->monitorContext = hContext;
+	MUTEX_UNLOCK(&slotPool->mutex);
+
+	pnpState = SCARD_STATE_UNAWARE;
+	rc = SCARD_S_SUCCESS;
+	while ((rc == SCARD_S_SUCCESS) && !slotPool->eventCancelled) {
+		MUTEX_LOCK(&slotPool->mutex);
+
+		slotPool->monitorRebuild = FALSE;
+
+		cnt = 0;
+		FOR_EACH(slot, slotPool->list) {
+			if (!slot->closed) {
+				cnt++;
+			}
+		}
+
+		/* Slots may be removed while waiting, so work on a copy of the reader names */
+		states = (SCARD_READERSTATE *)calloc(cnt + 1, sizeof(SCARD_READERSTATE));
+		ids = (CK_SLOT_ID *)calloc(cnt + 1, sizeof(CK_SLOT_ID));
+		names = (char *)calloc(cnt + 1, MAX_READERNAME);
+
+		if (!states || !ids || !names) {
+			MUTEX_UNLOCK(&slotPool->mutex);
+			free(states);
+			free(ids);
+			free(names);
+			break;
+		}
+
+		i = 0;
+		FOR_EACH(slot, slotPool->list) {
+			if (!slot->closed) {
+				strcpy(names + i * MAX_READERNAME, slot->readerName);
+				states[i].szReader = names + i * MAX_READERNAME;
+				states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+				ids[i] = slot->id;
+				i++;
+			}
+		}
+
+		states[cnt].szReader = "\\\\?PnP?\\Notification";
+		/* The upper 16 bits of the PnP state contain the number of readers */
+		if (slotPool->pnpUnsupported) {
+			states[cnt].dwCurrentState = SCARD_STATE_IGNORE;
+		} else {
+			states[cnt].dwCurrentState = pnpState != SCARD_STATE_UNAWARE ? pnpState : (DWORD)cnt << 16;
+		}
+
+		MUTEX_UNLOCK(&slotPool->mutex);
+
+		while (!slotPool->eventCancelled && !slotPool->monitorRebuild) {
+			/* The timeout only limits the time a lost cancel request remains unnoticed */
+			rc = SCardGetStatusChange(hContext, MONITOR_TIMEOUT, states, cnt + 1);
+
+			if ((rc == SCARD_E_TIMEOUT) || (rc == SCARD_E_CANCELLED)) {
+				rc = SCARD_S_SUCCESS;
+				continue;
+			}
+
+			if (rc != SCARD_S_SUCCESS) {
+				break;
+			}
+
+			MUTEX_LOCK(&slotPool->mutex);
+			updateMonitoredReaders(slotPool, states, ids, cnt);
+			MUTEX_UNLOCK(&slotPool->mutex);
+		}
+
+		pnpState = states[cnt].dwCurrentState;
+
+		free(states);
+		free(ids);
+		free(names);
+	}
+
+#ifdef DEBUG
+	debug("Presence monitor terminates with rc=%lx\n", (unsigned long)rc);
+#endif
+
+	MUTEX_LOCK(&slotPool->mutex);
+
+	FOR_EACH(slot, slotPool->list) {
+		slot->readerState = SCARD_STATE_UNAWARE;
+	}
+	slotPool->readersChanged = TRUE;
+	slotPool->monitorContext = 0;
+	slotPool->monitorState = MONITOR_EXITED;
+
+	MUTEX_UNLOCK(&slotPool->mutex);
+
+	SCardReleaseContext(hContext);
+}
+
+
+
+/**
+ * Start the presence monitor or make it reread the list of slots
+ *
+ * The caller must hold the slot pool mutex.
+ */
+static void startPCSCMonitor(struct p11SlotPool_t *slotPool)
+{
+	VERIFY_MUTEXOWNER(&slotPool->mutex);
+
+	if (context->noThreads || slotPool->eventCancelled) {
+		return;
+	}
+
+	if (slotPool->monitorState == MONITOR_EXITED) {
+		thread_join(&slotPool->monitorThread);
+		slotPool->monitorState = MONITOR_STOPPED;
+	}
+
+	if (slotPool->monitorState == MONITOR_STOPPED) {
+		slotPool->monitorState = MONITOR_RUNNING;
+		if (thread_create(&slotPool->monitorThread, monitorPCSCReaders, slotPool)) {
+			slotPool->monitorState = MONITOR_STOPPED;
+		}
+		return;
+	}
+
+	slotPool->monitorRebuild = TRUE;
+	if (slotPool->monitorContext) {
+		SCardCancel(slotPool->monitorContext);
+	}
+}
+
+
+
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 {
 	int rc;
 
 	if (slot->token) {
 		rc = checkForRemovedPCSCToken(slot);
-	} else {
+	} else if (slot->exclusive) {
 		rc = checkForNewPCSCToken(slot);
+	} else {
+		/* Sessions are closed with the token, so a shared owner never gets here */
+		rc = CKR_TOKEN_NOT_PRESENT;
 	}
 
 	*ppToken = slot->token;
@@ -571,6 +811,18 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 
 	FUNC_CALLED();
 
+	/* Unless the presence monitor saw a reader being attached or detached, the list is current */
+	if ((slotPool->monitorState == MONITOR_RUNNING) && !slotPool->readersChanged && !slotPool->pnpUnsupported) {
+		FOR_EACH(slot, slotPool->list) {
+			if (!slot->closed) {
+				slot->present = TRUE;
+			}
+		}
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	slotPool->readersChanged = FALSE;
+
 	/*
 	 * Keeping a global context causes problems if pcscd is restarted
 	 */
@@ -658,7 +910,13 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 
 		slot->info.flags = CKF_REMOVABLE_DEVICE | CKF_HW_SLOT;
 		
-		addSlot(&context->slotPool, slot);
+		if (addSlot(&context->slotPool, slot) != CKR_OK) {
+			SCardReleaseContext(slot->context);
+			free(slot);
+			SCardFreeMemory(hContext, readers);
+			SCardReleaseContext(hContext);
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
 
 #ifdef DEBUG
 		debug("Added slot (%lu, %s) - slot counter is %i\n", slot->id, slot->readerName, context->slotPool.count);
@@ -685,11 +943,255 @@ int updatePCSCSlots(struct p11SlotPool_t *slotPool)
 	debug("SCardReleaseContext: %s\n", pcsc_error_to_string(rc, str75));
 #endif
 
+	startPCSCMonitor(slotPool);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
+/**
+ * Wait for the insertion or removal of a card in one of the PC/SC readers
+ *
+ * The reader states are obtained with SCardGetStatusChange from a context kept in the slot
+ * pool, so blocking calls only return when pcscd reports a change. The PnP pseudo reader is
+ * included to notice attached or detached readers, which are then added to or removed from
+ * the slot pool. A change of the card presence is reported only once for each slot, further
+ * changes to other slots are reported by subsequent calls.
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ * @param dontBlock  Return CKR_NO_EVENT rather than blocking if no event is pending
+ * @param pSlotID    The slot in which the event occurred
+ *
+ * @return
+ *                   <P><TABLE>
+ *                   <TR><TD>Code</TD><TD>Meaning</TD></TR>
+ *                   <TR>
+ *                   <TD>CKR_OK                                 </TD>
+ *                   <TD>Success                                </TD>
+ *                   </TR>
+ *                   <TR>
+ *                   <TD>CKR_NO_EVENT                           </TD>
+ *                   <TD>No event pending and dontBlock set     </TD>
+ *                   </TR>
+ *                   <TR>
+ *                   <TD>CKR_CRYPTOKI_NOT_INITIALIZED           </TD>
+ *                   <TD>C_Finalize was called while waiting    </TD>
+ *                   </TR>
+ *                   <TR>
+ *                   <TD>CKR_HOST_MEMORY                        </TD>
+ *                   <TD>Error getting memory (malloc)          </TD>
+ *                   </TR>
+ *                   <TR>
+ *                   <TD>CKR_DEVICE_ERROR                       </TD>
+ *                   <TD>Error obtaining the reader states      </TD>
+ *                   </TR>
+ *                   </TABLE></P>
+ */
+int waitForPCSCSlotEvent(struct p11SlotPool_t *slotPool, int dontBlock, CK_SLOT_ID_PTR pSlotID)
+{
+	struct p11Slot_t *slot;
+	SCARD_READERSTATE *states;
+	SCARDCONTEXT hContext;
+	CK_SLOT_ID *ids;
+	char *names;
+	DWORD previous;
+	LONG rc;
+	int i, cnt, found, changed;
+#ifdef DEBUG
+	char str75[_75];
+#endif
+
+	FUNC_CALLED();
+
+	MUTEX_LOCK(&slotPool->mutex);
+
+	if (!slotPool->eventContext) {
+		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &slotPool->eventContext);
+
+#ifdef DEBUG
+		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc, str75));
+#endif
+
+		if (rc != SCARD_S_SUCCESS) {
+			slotPool->eventContext = 0;
+			MUTEX_UNLOCK(&slotPool->mutex);
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
+		}
+	}
+	hContext = slotPool->eventContext;
+
+	MUTEX_UNLOCK(&slotPool->mutex);
+
+	for (;;) {
+		rc = safeUpdateSlots(slotPool);
+
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Updating the slot list failed");
+		}
+
+		MUTEX_LOCK(&slotPool->mutex);
+
+		cnt = 0;
+		FOR_EACH(slot, slotPool->list) {
+			if (!slot->closed) {
+				cnt++;
+			}
+		}
+
+		/* Slots may be removed while waiting, so work on a copy of the reader names */
+		states = (SCARD_READERSTATE *)calloc(cnt + 1, sizeof(SCARD_READERSTATE));
+		ids = (CK_SLOT_ID *)calloc(cnt + 1, sizeof(CK_SLOT_ID));
+		names = (char *)calloc(cnt + 1, MAX_READERNAME);
+
+		if (!states || !ids || !names) {
+			MUTEX_UNLOCK(&slotPool->mutex);
+			free(states);
+			free(ids);
+			free(names);
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+
+		i = 0;
+		FOR_EACH(slot, slotPool->list) {
+			if (!slot->closed) {
+				strcpy(names + i * MAX_READERNAME, slot->readerName);
+				states[i].szReader = names + i * MAX_READERNAME;
+				states[i].dwCurrentState = slot->eventState;
+				ids[i] = slot->id;
+				i++;
+			}
+		}
+
+		states[cnt].szReader = "\\\\?PnP?\\Notification";
+		states[cnt].dwCurrentState = slotPool->eventReaders ? slotPool->eventReaders : (DWORD)cnt << 16;
+
+		MUTEX_UNLOCK(&slotPool->mutex);
+
+		rc = SCardGetStatusChange(hContext, dontBlock ? 0 : INFINITE, states, cnt + 1);
+
+#ifdef DEBUG
+		debug("SCardGetStatusChange: %s\n", pcsc_error_to_string(rc, str75));
+#endif
+
+		if ((rc == SCARD_E_CANCELLED) || slotPool->eventCancelled) {
+			free(states);
+			free(ids);
+			free(names);
+			FUNC_RETURNS(CKR_CRYPTOKI_NOT_INITIALIZED);
+		}
+
+		if (rc == SCARD_E_TIMEOUT) {
+			free(states);
+			free(ids);
+			free(names);
+			FUNC_RETURNS(CKR_NO_EVENT);
+		}
+
+		if ((rc != SCARD_S_SUCCESS) && (rc != SCARD_E_UNKNOWN_READER)) {
+			free(states);
+			free(ids);
+			free(names);
+
+			/* The context becomes invalid if pcscd is restarted */
+			MUTEX_LOCK(&slotPool->mutex);
+			if (slotPool->eventContext == hContext) {
+				SCardReleaseContext(hContext);
+				slotPool->eventContext = 0;
+				slotPool->eventReaders = 0;
+			}
+			MUTEX_UNLOCK(&slotPool->mutex);
+
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Error waiting for PC/SC card terminal status change");
+		}
+
+		MUTEX_LOCK(&slotPool->mutex);
+
+		found = FALSE;
+		for (i = 0; i < cnt; i++) {
+			FOR_EACH(slot, slotPool->list) {
+				if (slot->id == ids[i]) {
+					break;
+				}
+			}
+
+			if (!slot) {
+				continue;
+			}
+
+			previous = slot->eventState;
+
+			/* The first state seen for a reader is only recorded */
+			changed = (previous != SCARD_STATE_UNAWARE) &&
+					((previous ^ states[i].dwEventState) & SCARD_STATE_PRESENT);
+
+			if (changed) {
+				/* Keep further changes pending for the next call */
+				if (found) {
+					continue;
+				}
+				found = TRUE;
+				*pSlotID = slot->id;
+			}
+
+			slot->eventState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+		}
+
+		if (rc == SCARD_S_SUCCESS) {
+			slotPool->eventReaders = states[cnt].dwEventState & ~SCARD_STATE_CHANGED;
+		}
+
+		MUTEX_UNLOCK(&slotPool->mutex);
+
+		free(states);
+		free(ids);
+		free(names);
+
+		if (found) {
+#ifdef DEBUG
+			debug("Slot event in slot %lu\n", *pSlotID);
+#endif
+			FUNC_RETURNS(CKR_OK);
+		}
+		/* Otherwise only the reader list or states not of interest have changed */
+	}
+}
+
+
+
+/**
+ * Cancel a C_WaitForSlotEvent blocked in SCardGetStatusChange, release the event context
+ * and stop the presence monitor
+ *
+ * @param slotPool   Pointer to slot-pool structure.
+ */
+void cancelPCSCSlotEvents(struct p11SlotPool_t *slotPool)
+{
+	int state;
+
+	slotPool->eventCancelled = TRUE;
+
+	if (slotPool->eventContext) {
+		SCardCancel(slotPool->eventContext);
+		SCardReleaseContext(slotPool->eventContext);
+		slotPool->eventContext = 0;
+	}
+
+	MUTEX_LOCK(&slotPool->mutex);
+	if (slotPool->monitorContext) {
+		SCardCancel(slotPool->monitorContext);
+	}
+	state = slotPool->monitorState;
+	MUTEX_UNLOCK(&slotPool->mutex);
+
+	if (state != MONITOR_STOPPED) {
+		thread_join(&slotPool->monitorThread);
+		slotPool->monitorState = MONITOR_STOPPED;
+	}
+}
+
+
+
 int closePCSCSlot(struct p11Slot_t *slot)
 {
 	LONG rc;
@@ -113,6 +113,8 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int updatePCSCSlots(struct p11SlotPool_t *pool);
 int closePCSCSlot(struct p11Slot_t *slot);
+int waitForPCSCSlotEvent(struct p11SlotPool_t *pool, int dontBlock, CK_SLOT_ID_PTR pSlotID);
+void cancelPCSCSlotEvents(struct p11SlotPool_t *pool);
 
 #endif
 
@@ -31,16 +31,17 @@
  * @brief   Slot implementation dispatching for PC/SC or CT-API reader
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/cardqueue.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/stats.h>
 
-#ifdef DEBUG
 #include <pkcs11/debug.h>
-#endif
 
 #ifdef CTAPI
 #include "slot-ctapi.h"
@@ -48,6 +49,8 @@
 #include "slot-pcsc.h"
 #endif
 
+extern struct p11Context_t *context;
+
 /**
  * addToken adds a token to the specified slot.
  *
@@ -188,111 +191,120 @@ int encodeCommandAPDU(
 
 
 
-/*
- *  Process an ISO 7816 APDU with the underlying terminal hardware.
+/**
+ * Exchange an ISO 7816 APDU with the token in the slot
  *
- *  CLA     : Class byte of instruction
- *  INS     : Instruction byte
- *  P1      : Parameter P1
- *  P2      : Parameter P2
- *  OutLen  : Length of outgoing data (Lc)
- *  OutData : Outgoing data or NULL if none
- *  InLen   : Length of incoming data (Le)
- *  InData  : Input buffer for incoming data
- *  InSize  : buffer size
- *  SW1SW2  : Address of short integer to receive SW1SW2
+ * The command data is transmitted from and the response received into the buffers of the
+ * caller. The command header is encoded in the APDU_HEADER_SPACE bytes before the command
+ * data and Le in the APDU_TRAILER_SPACE bytes after it. The response data is followed by
+ * SW1 and SW2, so the response buffer must have APDU_SW_SPACE bytes more than the largest
+ * expected response. A response that does not fit is an error and never truncated.
  *
- *  Returns : < 0 Error > 0 Bytes read
+ * @param slot the slot
+ * @param CLA the instruction class
+ * @param INS the instruction code
+ * @param P1 the first parameter
+ * @param P2 the second parameter
+ * @param cmd buffer of APDU_COMMAND_SIZE(Nc) bytes with the command data at cmd + APDU_HEADER_SPACE
+ *            or NULL if Nc is 0
+ * @param Nc number of bytes of command data
+ * @param Ne number of bytes expected from card, see encodeCommandAPDU()
+ * @param rsp buffer receiving the response data and the status word or NULL if Ne is -1
+ * @param rspSize size of the response buffer, including APDU_SW_SPACE
+ * @param SW1SW2 receives the status word
+ * @return -1 for error or the number of bytes of response data in rsp
  */
 int transmitAPDU(struct p11Slot_t *slot,
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
-		int OutLen, unsigned char *OutData,
-		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
+		unsigned char *cmd, int Nc, int Ne,
+		unsigned char *rsp, int rspSize, unsigned short *SW1SW2)
 {
-	int rc;
-	unsigned char apdu[4098];
-#ifdef DEBUG
-	char scr[4196], *po;
-#endif
+	int rc, len, extended;
+	long long start, acquired;
+	unsigned char header[APDU_COMMAND_SIZE(0)];
+	unsigned char sw[APDU_SW_SPACE];
+	unsigned char *capdu, *po;
 
 	FUNC_CALLED();
 
-	VERIFY_MUTEXOWNER(&slot->mutex);
+	if (traceAPDUs)
+		traceCommandAPDU(CLA, INS, P1, P2, Nc, cmd ? cmd + APDU_HEADER_SPACE : NULL, Ne);
 
-#ifdef DEBUG
+	if (cmd == NULL) {
+		if (Nc)
+			FUNC_FAILS(-1, "Command data not defined for Nc > 0");
+		cmd = header;
+	}
 
-	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
-	po = strchr(scr, '\0');
+	if (rsp == NULL) {
+		rsp = sw;
+		rspSize = sizeof(sw);
+	}
+
+	if ((Nc < 0) || (Nc > 65535) || (rspSize < APDU_SW_SPACE))
+		FUNC_FAILS(-1, "Invalid command or response length");
+
+	extended = (Nc > 255) || (Ne > 255);
 
-	if (INS != 0x20 && OutLen && OutData) {
-		sprintf(po, "Lc=%02X(%d) ", OutLen, OutLen);
-		po = strchr(scr, '\0');
-		if (OutLen > 2048) {
-			decodeBCDString(OutData, 2048, po);
-			strcat(po, "..");
+	// Encode the header backwards from the command data
+	po = cmd + APDU_HEADER_SPACE;
+	if (Nc) {
+		if (extended) {
+			*--po = (unsigned char)(Nc & 0xFF);
+			*--po = (unsigned char)(Nc >> 8);
+			*--po = 0;
 		} else {
-			decodeBCDString(OutData, OutLen, po);
+			*--po = (unsigned char)Nc;
 		}
-		po = strchr(scr, '\0');
-		strcpy(po, " ");
-		po++;
 	}
+	*--po = P2;
+	*--po = P1;
+	*--po = INS;
+	*--po = CLA;
+	capdu = po;
 
-	if (InData && InSize)
-		sprintf(po, "Le=%02X(%d)", InLen, InLen);
-
-	debug("%s\n", scr);
-#endif
+	po = cmd + APDU_HEADER_SPACE + Nc;
+	if (Ne >= 0) {								// Case 2 or 4
+		if (!extended) {
+			*po++ = (unsigned char)Ne;
+		} else {
+			if (Ne >= 65536)					// Request all for extended APDU
+				Ne = 0;
 
-	rc = encodeCommandAPDU(CLA, INS, P1, P2,
-			OutLen, OutData, InData ? InLen : -1,
-			apdu, sizeof(apdu));
+			if (!Nc)							// Case 2e
+				*po++ = 0;
 
-	if (rc < 0)
-		FUNC_FAILS(rc, "Encoding APDU failed");
+			*po++ = (unsigned char)(Ne >> 8);
+			*po++ = (unsigned char)(Ne & 0xFF);
+		}
+	}
+	len = (int)(po - capdu);
 
+	/* Only the exchange with the card is serialized, encoding and decoding is not */
+	start = statsClock();
+	MUTEX_LOCK(&slot->mutex);
+	acquired = statsClock();
 #ifdef CTAPI
 	rc = transmitAPDUviaCTAPI(slot, 0,
-			apdu, rc,
-			apdu, sizeof(apdu));
+			capdu, len,
+			rsp, rspSize);
 #else
 	rc = transmitAPDUviaPCSC(slot,
-			apdu, rc,
-			apdu, sizeof(apdu));
+			capdu, len,
+			rsp, rspSize);
 #endif
+	countAPDU(slot, len, rc, start, acquired);
+	MUTEX_UNLOCK(&slot->mutex);
 
 	if (rc >= 2) {
-		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
+		*SW1SW2 = (rsp[rc - 2] << 8) | rsp[rc - 1];
 		rc -= 2;
-
-		if (InData && InSize) {
-			if (rc > InSize) {		// Never return more than caller allocated a buffer for
-				rc = InSize;
-			}
-			memcpy(InData, apdu, rc);
-		}
 	} else {
 		rc = -1;
 	}
 
-#ifdef DEBUG
-	if (rc > 0) {
-		sprintf(scr, "R-APDU: Lr=%02X(%d) ", rc, rc);
-		po = strchr(scr, '\0');
-		if (rc > 2048) {
-			decodeBCDString(InData, 2048, po);
-			strcat(scr, "..");
-		} else if (InData) {
-			decodeBCDString(InData, rc, po);
-		}
-
-		po = strchr(scr, '\0');
-		sprintf(po, " SW1/SW2=%04X", *SW1SW2);
-	} else
-		sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, *SW1SW2);
-
-	debug("%s\n", scr);
-#endif
+	if (traceAPDUs)
+		traceResponseAPDU(rc, rsp, rc >= 0 ? *SW1SW2 : 0);
 	return rc;
 }
 
@@ -304,22 +316,16 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		unsigned char pinblockstring, unsigned char pinlengthformat)
 {
 	int rc;
-	unsigned char apdu[4098];
-#ifdef DEBUG
-	char scr[4196], *po;
+#ifndef CTAPI
+	int len;
+	long long start, acquired;
 #endif
+	unsigned char apdu[16];					// The PIN is entered at the reader, the response is just SW1/SW2
 
 	FUNC_CALLED();
 
-	VERIFY_MUTEXOWNER(&slot->mutex);
-
-#ifdef DEBUG
-
-	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
-	po = strchr(scr, '\0');
-
-	debug("%s\n", scr);
-#endif
+	if (traceAPDUs)
+		traceCommandAPDU(CLA, INS, P1, P2, 0, NULL, -1);
 
 	rc = encodeCommandAPDU(CLA, INS, P1, P2,
 			0, NULL, -1,
@@ -335,11 +341,18 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 	rc = -1;
 
 #else
+	len = rc;
+
+	start = statsClock();
+	MUTEX_LOCK(&slot->mutex);
+	acquired = statsClock();
 	rc = transmitVerifyPinAPDUviaPCSC(slot,
 			pinformat, minpinsize, maxpinsize,
 			pinblockstring, pinlengthformat,
-			apdu, rc,
+			apdu, len,
 			apdu, sizeof(apdu));
+	countAPDU(slot, len, rc, start, acquired);
+	MUTEX_UNLOCK(&slot->mutex);
 #endif
 
 	if (rc >= 2) {
@@ -347,15 +360,61 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		rc -= 2;
 	}
 
-#ifdef DEBUG
-	sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, *SW1SW2);
-	debug("%s\n", scr);
-#endif
+	if (traceAPDUs)
+		traceResponseAPDU(rc, NULL, rc >= 0 ? *SW1SW2 : 0);
 	return rc;
 }
 
 
 
+/**
+ * Acquire the slot for the calling thread.
+ *
+ * Functions that only read the token state or work on the state of their own session
+ * share the slot, so that host-side work like hashing or padding can run concurrently.
+ * Exchanges with the card are still serialized on the card lock in transmitAPDU().
+ * Functions that change the token, the object list or the login state must lock the
+ * slot exclusively. The exclusive owner also owns the card lock for the whole call.
+ *
+ * @param slot       The slot to acquire
+ * @param exclusive  TRUE to lock the slot exclusively, FALSE to share the slot
+ */
+void lockSlot(struct p11Slot_t *slot, int exclusive)
+{
+	long long start = statsClock();
+
+	if (exclusive) {
+		RWLOCK_WRLOCK(&slot->objectLock);
+		MUTEX_LOCK(&slot->mutex);
+		slot->exclusive = TRUE;
+	} else {
+		RWLOCK_RDLOCK(&slot->objectLock);
+	}
+
+	InterlockedAdd64(&slot->stats.lockWaitTime, statsClock() - start);
+}
+
+
+
+/**
+ * Release the slot acquired with lockSlot()
+ *
+ * @param slot       The slot to release
+ */
+void unlockSlot(struct p11Slot_t *slot)
+{
+	/* Only the exclusive owner can see the flag set, shared owners are blocked while it is */
+	if (slot->exclusive) {
+		slot->exclusive = FALSE;
+		MUTEX_UNLOCK(&slot->mutex);
+		RWLOCK_WRUNLOCK(&slot->objectLock);
+	} else {
+		RWLOCK_RDUNLOCK(&slot->objectLock);
+	}
+}
+
+
+
 /**
  * safeFindAndLockSlot finds a slot in the slot-pool.
  * The slot is specified by its slotID.
@@ -364,6 +423,7 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
  * @param slotID     The id of the slot.
  * @param slot       Pointer to pointer to slot structure.
  *                   If the slot is found, this pointer holds the specific slot structure - otherwise NULL.
+ * @param exclusive  TRUE to lock the slot exclusively, FALSE to share the slot
  *
  * @return
  *                   <P><TABLE>
@@ -378,43 +438,39 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
  *                   </TR>
  *                   </TABLE></P>
  */
-int safeFindAndLockSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID, struct p11Slot_t **ppSlot)
+int safeFindAndLockSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID, struct p11Slot_t **ppSlot, int exclusive)
 {
-	int rc = CKR_SLOT_ID_INVALID;
 	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
 
-	MUTEX_LOCK(&slotPool->mutex);
+	*ppSlot = NULL;
 
-	FOR_EACH(slot, slotPool->list) {
-		VERIFY_NOT_MUTEXOWNER(&slot->mutex);
-		if (slot->id == slotID) {
-			if (slot->closed) {
-				rc = CKR_DEVICE_ERROR;
-				break;
-			}
-			*ppSlot = slot;
-			/* prevent deletion of slot */
-			InterlockedIncrement(&slot->queuing);
-			MUTEX_UNLOCK(&slotPool->mutex);
-			/* Unprotected area here. We must ensure that the slot pointer is still valid after
-			   obtaining the slot mutex. This is handled by incrementing slot->queuing while
-			   holding the slot pool mutex, and decrement after possessing the slot mutex.
-			   The delete function must check slot->queuing when holding the slot pool mutex
-			   and unlink the slot immediately. If slot->queuing > 0 deletion must be cancelled.
-			   Otherwise another thread could get a slot pointer which points to freed memory.
-			   Acquire the slot mutex while owning the slot pool mutex is a performace killer. */
-			MUTEX_LOCK(&slot->mutex);
-			InterlockedDecrement(&slot->queuing);
-			FUNC_RETURNS(CKR_OK);
-		}
+	slot = safeFindAndQueueSlot(slotPool, slotID);
+
+	if (slot == NULL) {
+		FUNC_RETURNS(CKR_SLOT_ID_INVALID);
 	}
 
-	MUTEX_UNLOCK(&slotPool->mutex);
+	VERIFY_NOT_MUTEXOWNER(&slot->mutex);
 
-	*ppSlot = NULL;
-	FUNC_RETURNS(rc);
+	if (slot->closed) {
+		InterlockedDecrement(&slot->queuing);
+		FUNC_RETURNS(CKR_DEVICE_ERROR);
+	}
+
+	/* Unprotected area here. We must ensure that the slot pointer is still valid after
+	   obtaining the slot mutex. This is handled by incrementing slot->queuing while
+	   holding the slot pool lock, and decrement after possessing the slot mutex.
+	   The delete function must check slot->queuing when holding the slot pool write lock
+	   and unlink the slot immediately. If slot->queuing > 0 deletion must be cancelled.
+	   Otherwise another thread could get a slot pointer which points to freed memory.
+	   Acquire the slot mutex while owning the slot pool lock is a performace killer. */
+	lockSlot(slot, exclusive);
+	InterlockedDecrement(&slot->queuing);
+
+	*ppSlot = slot;
+	FUNC_RETURNS(CKR_OK);
 }
 
 
@@ -428,8 +484,6 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 		return CKR_DEVICE_REMOVED;
 	}
 
-	VERIFY_MUTEXOWNER(&slot->mutex);
-
 #ifdef CTAPI
 	rc = getCTAPIToken(slot, ppToken);
 #else
@@ -441,14 +495,12 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **ppToken)
 
 
 
-/* caller must own slot->mutex */
+/* caller must hold the slot lock, either shared or exclusive */
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **ppObject, int publicObject)
 {
 	int rc;
 	struct p11Token_t *token;
 
-	VERIFY_MUTEXOWNER(&slot->mutex);
-
 	rc = getToken(slot, &token);
 	if (rc != CKR_OK) {
 		return rc;
@@ -469,7 +521,7 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 	static int BUSY;
 	int wasBusy;
 	int rc = CKR_OK;
-	struct p11Slot_t *slot, **ppSlot;
+	struct p11Slot_t *slot, *prev, *next;
 
 	FUNC_CALLED();
 
@@ -491,25 +543,27 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 		rc = updatePCSCSlots(slotPool);
 #endif
 		/* check for slot removal, can't use FOR_EACH here */
-		for (ppSlot = &slotPool->list; *ppSlot; ) {
-			slot = *ppSlot; /* for convenience */
+		prev = NULL;
+		FOR_EACH_WITH_NEXT(slot, next, slotPool->list) {
 			if (!slot->present) {
 				slot->closed = TRUE;
-				MUTEX_LOCK(&slot->mutex);
-				if (slot->queuing) {
-					/* at least one thread is queued on the slot mutex */
-					MUTEX_UNLOCK(&slot->mutex);
+				/* wait for the thread owning the slot */
+				lockSlot(slot, TRUE);
+				if (unlinkSlot(slotPool, slot, prev) != CKR_OK) {
+					/* at least one thread is queued on the slot lock */
+					unlockSlot(slot);
+					prev = slot;
 					continue;
 				}
 				freeToken(slot);
-				MUTEX_UNLOCK(&slot->mutex);
+				unlockSlot(slot);
+				terminateCardQueue(slot);
 				MUTEX_DESTROY(&slot->mutex);
-				*ppSlot = slot->next; /* unlink */
-				slotPool->count--;
+				RWLOCK_DESTROY(&slot->objectLock);
 				free(slot);
 				continue;
 			}
-			ppSlot = &slot->next;
+			prev = slot;
 		}
 		BUSY = 0;
 	}
@@ -521,6 +575,147 @@ int safeUpdateSlots(struct p11SlotPool_t *slotPool)
 
 
 
+/**
+ * Wait for the insertion or removal of a token
+ *
+ * @param slotPool  The slot pool
+ * @param dontBlock Return CKR_NO_EVENT rather than blocking if no event is pending
+ * @param pSlotID   The slot in which the event occurred
+ * @return          CKR_OK, CKR_NO_EVENT, CKR_CRYPTOKI_NOT_INITIALIZED or any other Cryptoki error code
+ */
+int waitForSlotEvent(struct p11SlotPool_t *slotPool, int dontBlock, CK_SLOT_ID_PTR pSlotID)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+#ifdef CTAPI
+	rc = waitForCTAPISlotEvent(slotPool, dontBlock, pSlotID);
+#else
+	rc = waitForPCSCSlotEvent(slotPool, dontBlock, pSlotID);
+#endif
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Make threads waiting in waitForSlotEvent() return CKR_CRYPTOKI_NOT_INITIALIZED and stop
+ * all threads watching the readers
+ *
+ * @param slotPool  The slot pool
+ */
+void cancelSlotEvents(struct p11SlotPool_t *slotPool)
+{
+#ifdef CTAPI
+	cancelCTAPISlotEvents(slotPool);
+#else
+	cancelPCSCSlotEvents(slotPool);
+#endif
+}
+
+
+
+/**
+ * State of a worker loading the token in one slot
+ */
+struct p11TokenDetection_t {
+	struct p11Slot_t *slot;                /**< The slot to check for a new token            */
+	THREAD thread;                         /**< The worker thread                            */
+	int started;                           /**< The worker thread was started                */
+};
+
+
+
+static void detectToken(void *arg)
+{
+	struct p11TokenDetection_t *detection = (struct p11TokenDetection_t *)arg;
+	struct p11Token_t *token;
+
+	lockSlot(detection->slot, TRUE);
+	getToken(detection->slot, &token);
+	unlockSlot(detection->slot);
+}
+
+
+
+/**
+ * Check all slots without a token for a newly inserted token.
+ *
+ * Loading a token takes a considerable number of APDUs, so each slot is processed by a
+ * worker thread of its own and the total time is that of the slowest token. A token
+ * becomes visible to other threads as soon as the worker for its slot has finished.
+ * Slots are processed in the calling thread if the application did not allow the
+ * creation of threads or if a thread can not be started.
+ *
+ * The caller must hold the slot pool mutex, which prevents the deletion of slots.
+ *
+ * @param slotPool  The slot pool
+ * @return          CKR_OK
+ */
+int detectTokens(struct p11SlotPool_t *slotPool)
+{
+	struct p11TokenDetection_t *detections;
+	struct p11Slot_t *slot;
+	int i, cnt;
+
+	FUNC_CALLED();
+
+	VERIFY_MUTEXOWNER(&slotPool->mutex);
+
+	cnt = 0;
+	FOR_EACH(slot, slotPool->list) {
+		if (!slot->closed && !slot->token) {
+			cnt++;
+		}
+	}
+
+	if (cnt == 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	detections = NULL;
+	if ((cnt > 1) && !context->noThreads) {
+		detections = (struct p11TokenDetection_t *)calloc(cnt, sizeof(struct p11TokenDetection_t));
+	}
+
+	i = 0;
+	FOR_EACH(slot, slotPool->list) {
+		if (slot->closed || slot->token) {
+			continue;
+		}
+
+		// A slot may have lost its token since counting, so never use more entries than allocated
+		if (detections && (i < cnt)) {
+			detections[i].slot = slot;
+			detections[i].started = !thread_create(&detections[i].thread, detectToken, &detections[i]);
+			if (!detections[i].started) {
+				detectToken(&detections[i]);
+			}
+			i++;
+		} else {
+			struct p11TokenDetection_t detection;
+
+			detection.slot = slot;
+			detectToken(&detection);
+		}
+	}
+
+	if (detections) {
+		for (i = 0; i < cnt; i++) {
+			if (detections[i].started) {
+				thread_join(&detections[i].thread);
+			}
+		}
+		free(detections);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 int closeSlot(struct p11Slot_t *slot)
 {
 	int rc;
@@ -37,6 +37,17 @@
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/p11generic.h>
 
+/*
+ * Buffers passed to transmitAPDU() reserve space around the data, so that the APDU
+ * is encoded and received in place
+ */
+#define APDU_HEADER_SPACE       7       /* CLA, INS, P1, P2 and an extended Lc before the command data */
+#define APDU_TRAILER_SPACE      3       /* An extended Le after the command data                      */
+#define APDU_SW_SPACE           2       /* SW1 and SW2 after the response data                        */
+
+/* Size of a command buffer for Nc bytes of command data */
+#define APDU_COMMAND_SIZE(Nc)   (APDU_HEADER_SPACE + (Nc) + APDU_TRAILER_SPACE)
+
 void addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 
 int removeToken(struct p11Slot_t *slot);
@@ -48,8 +59,8 @@ int encodeCommandAPDU(
 
 int transmitAPDU(struct p11Slot_t *slot,
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
-		int OutLen, unsigned char *OutData,
-		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2);
+		unsigned char *cmd, int Nc, int Ne,
+		unsigned char *rsp, int rspSize, unsigned short *SW1SW2);
 
 int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2, unsigned short *SW1SW2,
@@ -58,7 +69,10 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 int getToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int safeUpdateSlots(struct p11SlotPool_t *pool);
-int safeFindAndLockSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **slot);
+int detectTokens(struct p11SlotPool_t *pool);
+int waitForSlotEvent(struct p11SlotPool_t *pool, int dontBlock, CK_SLOT_ID_PTR pSlotID);
+void cancelSlotEvents(struct p11SlotPool_t *pool);
+int safeFindAndLockSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **slot, int exclusive);
 int closeSlot(struct p11Slot_t *slot);
 void addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
@@ -38,11 +38,14 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/cardqueue.h>
 #include <pkcs11/debug.h>
 #include <assert.h>
 
 extern struct p11Context_t *context;
 
+#define SLOT_TABLE_SIZE  16                /* Initial number of buckets, must be a power of 2 */
+
 
 
 /**
@@ -82,9 +85,13 @@ extern struct p11Context_t *context;
 void initSlotPool(struct p11SlotPool_t *slotPool)
 {
 	slotPool->list = NULL;
+	slotPool->last = NULL;
+	slotPool->table = NULL;     /* Allocated with the first slot */
+	slotPool->tableSize = 0;
 	slotPool->count = 0;
 	slotPool->nextID = 0;
 	MUTEX_INIT(&slotPool->mutex);
+	RWLOCK_INIT(&slotPool->lock);
 }
 
 
@@ -96,43 +103,197 @@ void terminateSlotPool(struct p11SlotPool_t *slotPool)
 	/* clear the slot slotPool */
 	FOR_EACH_WITH_NEXT(slot, next, slotPool->list) {
 		/* otherwise asserions in freeToken and closeSlot */
-		MUTEX_LOCK(&slot->mutex);
+		lockSlot(slot, TRUE);
 		freeToken(slot);
 		closeSlot(slot);
-		MUTEX_UNLOCK(&slot->mutex);
+		unlockSlot(slot);
+		terminateCardQueue(slot);
 		MUTEX_DESTROY(&slot->mutex);
+		RWLOCK_DESTROY(&slot->objectLock);
 		free(slot);
 	}
 
+	free(slotPool->table);
+	slotPool->table = NULL;
+	slotPool->tableSize = 0;
+	slotPool->list = NULL;
+	slotPool->last = NULL;
+	slotPool->count = 0;
+
+	RWLOCK_DESTROY(&slotPool->lock);
 	MUTEX_DESTROY(&slotPool->mutex);
 }
 
 
 
+/**
+ * Resize the hash table to the given number of buckets. The caller must hold the write lock.
+ *
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+static int resizeSlotTable(struct p11SlotPool_t *slotPool, CK_ULONG newSize)
+{
+	struct p11Slot_t **newTable, *slot, *next;
+	CK_ULONG i;
+
+	newTable = (struct p11Slot_t **)calloc(newSize, sizeof(struct p11Slot_t *));
+
+	if (newTable == NULL) {
+		return CKR_HOST_MEMORY;
+	}
+
+	for (i = 0; i < slotPool->tableSize; i++) {
+		for (slot = slotPool->table[i]; slot; slot = next) {
+			next = slot->hashNext;
+			slot->hashNext = newTable[slot->id & (newSize - 1)];
+			newTable[slot->id & (newSize - 1)] = slot;
+		}
+	}
+
+	free(slotPool->table);
+	slotPool->table = newTable;
+	slotPool->tableSize = newSize;
+	return CKR_OK;
+}
+
+
+
 /**
  * addSlot adds a slot to the slot-pool.
  *
+ * The caller must hold the slot pool mutex.
+ *
  * @param pool       Pointer to slot-pool structure.
  * @param slot       Pointer to slot structure.
- *
+ * @return CKR_OK or CKR_HOST_MEMORY
  */
-void addSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot)
+int addSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot)
 {
-	struct p11Slot_t **ppSlot;
+	struct p11Slot_t **ppBucket;
+	int rc;
 
 	VERIFY_MUTEXOWNER(&slotPool->mutex);
 
+	RWLOCK_WRLOCK(&slotPool->lock);
+
+	/* Keep the load factor below 1, so buckets stay short */
+	if (slotPool->count >= slotPool->tableSize) {
+		rc = resizeSlotTable(slotPool, slotPool->tableSize ? slotPool->tableSize << 1 : SLOT_TABLE_SIZE);
+		if ((rc != CKR_OK) && (slotPool->table == NULL)) {
+			RWLOCK_WRUNLOCK(&slotPool->lock);
+			return rc;
+		}
+		/* A failed resize only makes buckets longer */
+	}
+
 	slot->next = NULL;
 
 	MUTEX_INIT(&slot->mutex);
+	RWLOCK_INIT_WRITER(&slot->objectLock);
+	initCardQueue(slot);
 
-	FOR_EACH_REF(ppSlot, slotPool->list) {
-		/* until points to the next field of the last element */
-	}
+	slot->id = slotPool->nextID++;
 
-	*ppSlot = slot;
+	ppBucket = &slotPool->table[slot->id & (slotPool->tableSize - 1)];
+	slot->hashNext = *ppBucket;
+	*ppBucket = slot;
 
-	slot->id = slotPool->nextID++;
+	RWLOCK_WRUNLOCK(&slotPool->lock);
+
+	if (slotPool->last) {
+		slotPool->last->next = slot;
+	} else {
+		slotPool->list = slot;
+	}
+	slotPool->last = slot;
 
 	slotPool->count++;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * unlinkSlot removes a slot from the slot-pool.
+ *
+ * The caller must hold the slot pool mutex and the exclusive slot lock. The slot is only
+ * removed if no other thread is queued on the slot lock.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param slot       Pointer to slot structure.
+ * @param prev       The slot preceding slot in the list or NULL if slot is the first
+ * @return CKR_OK or CKR_FUNCTION_FAILED if another thread is queued on the slot
+ */
+int unlinkSlot(struct p11SlotPool_t *slotPool, struct p11Slot_t *slot, struct p11Slot_t *prev)
+{
+	struct p11Slot_t **ppBucket;
+
+	VERIFY_MUTEXOWNER(&slotPool->mutex);
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	RWLOCK_WRLOCK(&slotPool->lock);
+
+	if (slot->queuing) {
+		/* at least one thread is queued on the slot mutex */
+		RWLOCK_WRUNLOCK(&slotPool->lock);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	for (ppBucket = &slotPool->table[slot->id & (slotPool->tableSize - 1)]; *ppBucket; ppBucket = &(*ppBucket)->hashNext) {
+		if (*ppBucket == slot) {
+			*ppBucket = slot->hashNext;
+			break;
+		}
+	}
+
+	RWLOCK_WRUNLOCK(&slotPool->lock);
+
+	if (prev) {
+		prev->next = slot->next;
+	} else {
+		slotPool->list = slot->next;
+	}
+	if (slotPool->last == slot) {
+		slotPool->last = prev;
+	}
+
+	slotPool->count--;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Find a slot by it's id and protect it against deletion.
+ *
+ * The function increments slot->queuing while holding the read lock. The caller must decrement
+ * slot->queuing once it owns the slot mutex or if it decides not to lock the slot.
+ * Lookups only share the read lock, so they do not block each other nor wait for
+ * slot updates in progress.
+ *
+ * @param pool       Pointer to slot-pool structure.
+ * @param slotID     The slot identifier
+ * @return The slot or NULL if not found
+ */
+struct p11Slot_t *safeFindAndQueueSlot(struct p11SlotPool_t *slotPool, CK_SLOT_ID slotID)
+{
+	struct p11Slot_t *slot = NULL;
+
+	RWLOCK_RDLOCK(&slotPool->lock);
+
+	if (slotPool->table != NULL) {
+		for (slot = slotPool->table[slotID & (slotPool->tableSize - 1)]; slot; slot = slot->hashNext) {
+			if (slot->id == slotID) {
+				/* prevent deletion of slot */
+				InterlockedIncrement(&slot->queuing);
+				break;
+			}
+		}
+	}
+
+	RWLOCK_RDUNLOCK(&slotPool->lock);
+
+	return slot;
 }
@@ -34,13 +34,13 @@
 #ifndef ___SLOTPOOL_H_INC___
 #define ___SLOTPOOL_H_INC___
 
-#define MAX_SLOTS 8
-
 #include <pkcs11/p11generic.h>
 #include <pkcs11/cryptoki.h>
 
 void initSlotPool(struct p11SlotPool_t *pool);
 void terminateSlotPool(struct p11SlotPool_t *pool);
-void addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
+int addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot);
+int unlinkSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot, struct p11Slot_t *prev);
+struct p11Slot_t *safeFindAndQueueSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID);
 
 #endif /* ___SLOTPOOL_H_INC___ */
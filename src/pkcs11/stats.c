@@ -0,0 +1,219 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    stats.c
+ * @brief   Low overhead counters for slots and mechanisms
+ *
+ * Counters are updated with atomic additions and without taking a lock, so that they
+ * can remain enabled in production. Readers see each counter consistently, but not
+ * necessarily a consistent snapshot across counters.
+ *
+ * Slot counters are kept in the slot and go away with the slot. Mechanism counters are
+ * kept in the context for the mechanisms listed by C_GetMechanismList and are summed up
+ * over all slots.
+ */
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <pkcs11/stats.h>
+
+extern const CK_MECHANISM_TYPE p11MechanismList[];
+extern const CK_ULONG p11MechanismCount;
+
+extern struct p11Context_t *context;
+
+#define COUNTER_READ(ptr) InterlockedAdd64((ptr), 0)
+
+
+
+/**
+ * Return a monotonic time stamp in microseconds
+ *
+ * @return the time stamp, only meaningful as difference of two time stamps
+ */
+long long statsClock(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+	return (long long)(counter.QuadPart / frequency.QuadPart * 1000000 +
+			counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+
+/**
+ * Prepare the mechanism counters for all supported mechanisms
+ *
+ * @param context   The context of the cryptoki
+ */
+void initMechanismStatistics(struct p11Context_t *context)
+{
+	CK_ULONG i;
+
+	memset(context->mechanismStats, 0, sizeof(context->mechanismStats));
+
+	context->mechanismCount = p11MechanismCount;
+	if (context->mechanismCount > MECHANISM_STATISTICS) {
+		context->mechanismCount = MECHANISM_STATISTICS;
+	}
+
+	for (i = 0; i < context->mechanismCount; i++) {
+		context->mechanismStats[i].mechanism = p11MechanismList[i];
+	}
+}
+
+
+
+/**
+ * Count a completed cryptographic operation
+ *
+ * A result of CKR_BUFFER_TOO_SMALL is not counted as error, because the operation
+ * remains active and is completed by the next call.
+ *
+ * @param slot      The slot that performed the operation
+ * @param mech      The mechanism of the operation
+ * @param rv        The result of the operation
+ * @param start     The value of statsClock() when the operation started
+ */
+void countOperation(struct p11Slot_t *slot, CK_MECHANISM_TYPE mech, CK_RV rv, long long start)
+{
+	struct p11MechanismStatistics_t *ms;
+	long long elapsed;
+	int failed;
+	CK_ULONG i;
+
+	if (rv == CKR_BUFFER_TOO_SMALL) {
+		return;
+	}
+
+	elapsed = statsClock() - start;
+	failed = rv != CKR_OK;
+
+	InterlockedAdd64(&slot->stats.operations, 1);
+	if (failed) {
+		InterlockedAdd64(&slot->stats.errors, 1);
+	}
+
+	for (i = 0, ms = context->mechanismStats; i < context->mechanismCount; i++, ms++) {
+		if (ms->mechanism == mech) {
+			InterlockedAdd64(&ms->operations, 1);
+			if (failed) {
+				InterlockedAdd64(&ms->errors, 1);
+			}
+			InterlockedAdd64(&ms->time, elapsed);
+			break;
+		}
+	}
+}
+
+
+
+/**
+ * Count an APDU exchanged with the card
+ *
+ * @param slot      The slot
+ * @param sent      The number of bytes sent
+ * @param received  The number of bytes received
+ * @param start     The value of statsClock() before waiting for the card lock
+ * @param acquired  The value of statsClock() after obtaining the card lock
+ */
+void countAPDU(struct p11Slot_t *slot, int sent, int received, long long start, long long acquired)
+{
+	InterlockedAdd64(&slot->stats.apdus, 1);
+	InterlockedAdd64(&slot->stats.bytesSent, sent);
+	if (received > 0) {
+		InterlockedAdd64(&slot->stats.bytesReceived, received);
+	}
+	InterlockedAdd64(&slot->stats.cardWaitTime, acquired - start);
+	InterlockedAdd64(&slot->stats.cardTime, statsClock() - acquired);
+}
+
+
+
+/**
+ * Copy the counters of a slot to the caller
+ *
+ * The caller holds the object lock of the slot, at least shared.
+ *
+ * @param slot      The slot
+ * @param pStats    The structure receiving the counters
+ */
+void getSlotStatistics(struct p11Slot_t *slot, CK_SC_HSM_SLOT_STATISTICS_PTR pStats)
+{
+	memset(pStats, 0, sizeof(*pStats));
+
+	pStats->slotID = slot->id;
+	pStats->ulSessionCount = slot->sessionCount;
+	if (slot->token != NULL) {
+		pStats->ulObjectCount = slot->token->pubObjectCount + slot->token->privObjectCount;
+	}
+
+	pStats->operations = COUNTER_READ(&slot->stats.operations);
+	pStats->errors = COUNTER_READ(&slot->stats.errors);
+	pStats->rejected = COUNTER_READ(&slot->stats.rejected);
+	pStats->apdus = COUNTER_READ(&slot->stats.apdus);
+	pStats->bytesSent = COUNTER_READ(&slot->stats.bytesSent);
+	pStats->bytesReceived = COUNTER_READ(&slot->stats.bytesReceived);
+	pStats->lockWaitTime = COUNTER_READ(&slot->stats.lockWaitTime);
+	pStats->cardWaitTime = COUNTER_READ(&slot->stats.cardWaitTime);
+	pStats->cardTime = COUNTER_READ(&slot->stats.cardTime);
+}
+
+
+
+/**
+ * Copy the counters of a mechanism to the caller
+ *
+ * @param stats     The counters of the mechanism
+ * @param pStats    The structure receiving the counters
+ */
+void getMechanismStatistics(struct p11MechanismStatistics_t *stats, CK_SC_HSM_MECHANISM_STATISTICS_PTR pStats)
+{
+	pStats->mechanism = stats->mechanism;
+	pStats->operations = COUNTER_READ(&stats->operations);
+	pStats->errors = COUNTER_READ(&stats->errors);
+	pStats->time = COUNTER_READ(&stats->time);
+}
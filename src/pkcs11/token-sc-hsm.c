@@ -43,11 +43,20 @@
 #include <pkcs11/strbpcpy.h>
 #include <pkcs11/asn1.h>
 #include <pkcs11/pkcs15.h>
+#include <pkcs11/digest.h>
+#include <pkcs11/pubkey.h>
 #include <pkcs11/debug.h>
 
 
 static unsigned char aid[] = { 0xE8,0x2B,0x06,0x01,0x04,0x01,0x81,0xC3,0x1F,0x02,0x01 };
 
+/* Private key attributes derived from the public key in the certificate */
+static CK_ATTRIBUTE publicKeyAttributes[] = {
+		{ CKA_MODULUS, NULL, 0 },
+		{ CKA_PUBLIC_EXPONENT, NULL, 0 },
+		{ CKA_EC_PARAMS, NULL, 0 }
+};
+
 
 
 static token_sc_hsm_t *getPrivateData(struct p11Token_t *token)
@@ -64,8 +73,8 @@ static int checkPINStatus(struct p11Slot_t *slot)
 	FUNC_CALLED();
 
 	rc = transmitAPDU(slot, 0x00, 0x20, 0x00, 0x81,
-			0, NULL,
-			0, NULL, 0, &SW1SW2);
+			NULL, 0, -1,
+			NULL, 0, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
@@ -80,11 +89,14 @@ static int selectApplet(struct p11Slot_t *slot)
 {
 	int rc;
 	unsigned short SW1SW2;
+	unsigned char cmd[APDU_COMMAND_SIZE(sizeof(aid))];
 	FUNC_CALLED();
 
+	memcpy(cmd + APDU_HEADER_SPACE, aid, sizeof(aid));
+
 	rc = transmitAPDU(slot, 0x00, 0xA4, 0x04, 0x0C,
-			sizeof(aid), aid,
-			0, NULL, 0, &SW1SW2);
+			cmd, sizeof(aid), -1,
+			NULL, 0, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
@@ -99,6 +111,7 @@ static int selectApplet(struct p11Slot_t *slot)
 
 
 
+/* The buffers of enumerateObjects() and readEF() receive the status word, see transmitAPDU() */
 static int enumerateObjects(struct p11Slot_t *slot, unsigned char *filelist, size_t len)
 {
 	int rc;
@@ -106,8 +119,8 @@ static int enumerateObjects(struct p11Slot_t *slot, unsigned char *filelist, siz
 	FUNC_CALLED();
 
 	rc = transmitAPDU(slot, 0x80, 0x58, 0x00, 0x00,
-			0, NULL,
-			65536, filelist, len, &SW1SW2);
+			NULL, 0, 65536,
+			filelist, len, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
@@ -126,11 +139,14 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 {
 	int rc;
 	unsigned short SW1SW2;
+	unsigned char cmd[APDU_COMMAND_SIZE(4)];
 	FUNC_CALLED();
 
+	memcpy(cmd + APDU_HEADER_SPACE, "\x54\x02\x00\x00", 4);
+
 	rc = transmitAPDU(slot, 0x00, 0xB1, fid >> 8, fid & 0xFF,
-			4, (unsigned char*)"\x54\x02\x00\x00",
-			65536, content, len, &SW1SW2);
+			cmd, 4, 65536,
+			content, len, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
@@ -145,6 +161,147 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 
 
 
+/**
+ * Determine the serial number from the holder reference of the device certificate
+ *
+ * The holder reference is composed of country code, mnemonic and serial number,
+ * followed by a 5 character sequence number which is not part of the serial number.
+ */
+static int readSerialNumber(struct p11Token_t *token)
+{
+	unsigned char cert[MAX_CERTIFICATE_SIZE + APDU_SW_SPACE], *po;
+	token_sc_hsm_t *sc;
+	int rc, len;
+
+	FUNC_CALLED();
+
+	rc = readEF(token->slot, DEVICE_CERTIFICATE_FID, cert, sizeof(cert));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading device certificate");
+	}
+
+	if (asn1Validate(cert, rc)) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Device certificate is not a valid TLV structure");
+	}
+
+	po = asn1Find(cert, (unsigned char *)"\x7F\x21\x7F\x4E\x5F\x20", 3);
+
+	if (po == NULL) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "No holder reference in device certificate");
+	}
+
+	asn1Tag(&po);
+	len = asn1Length(&po) - 5;
+
+	if (len <= 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Holder reference too short");
+	}
+
+	sc = getPrivateData(token);
+
+	if (len >= sizeof(sc->serialno)) {
+		len = sizeof(sc->serialno) - 1;
+	}
+
+	memcpy(sc->serialno, po, len);
+	sc->serialno[len] = 0;
+
+	strbpcpy(token->info.serialNumber, sc->serialno, sizeof(token->info.serialNumber));
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Keep a copy of the subject public key info of a certificate for the key with the same identifier
+ *
+ * The copy is owned by the token, so that it remains valid if the certificate object is removed.
+ * The caller must hold the exclusive slot lock.
+ *
+ * @param cert      The certificate object with a loaded CKA_VALUE
+ */
+static void setPublicKey(struct p11Object_t *cert)
+{
+	token_sc_hsm_t *sc;
+	unsigned char *spk, *po, *copy;
+	int len;
+
+	if (getSubjectPublicKeyInfo(cert, &spk) != CKR_OK) {
+		return;
+	}
+
+	po = spk;
+	asn1Tag(&po);
+	len = asn1Length(&po) + (int)(po - spk);
+
+	copy = malloc(len);
+	if (copy == NULL) {
+		return;
+	}
+	memcpy(copy, spk, len);
+
+	sc = getPrivateData(cert->token);
+	free(sc->publickeys[cert->tokenid]);
+	sc->publickeys[cert->tokenid] = copy;
+}
+
+
+
+/**
+ * Fetch the certificate value deferred by addEECertificateObject() and derive
+ * CKA_ISSUER, CKA_SUBJECT and CKA_SERIAL_NUMBER from it
+ */
+static int sc_hsm_loadCertificate(struct p11Object_t *object)
+{
+	CK_BYTE certValue[MAX_CERTIFICATE_SIZE + APDU_SW_SPACE];
+	CK_ATTRIBUTE attr = { CKA_VALUE, certValue, 0 };
+	token_sc_hsm_t *sc;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = readEF(object->token->slot, (EE_CERTIFICATE_PREFIX << 8) | object->tokenid, certValue, sizeof(certValue));
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
+	}
+	attr.ulValueLen = rc;
+
+	if (certValue[0] != ASN1_SEQUENCE) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error not a certificate");
+	}
+
+	if (addAttribute(object, &attr) != CKR_OK) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rc = populateIssuerSubjectSerial(object);
+
+	if (rc != CKR_OK) {
+#ifdef DEBUG
+		debug("populateIssuerSubjectSerial() failed\n");
+#endif
+	}
+
+	setPublicKey(object);
+
+	/* The cache is updated once when the token is released, so other processes need not read the certificate again */
+	object->loadAttributes = NULL;
+	sc = getPrivateData(object->token);
+	sc->cacheDirty = TRUE;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Create a certificate object from the private key description
+ *
+ * The certificate itself is only read when one of its attributes is requested.
+ */
 static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 {
 	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
@@ -152,7 +309,6 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 	CK_UTF8CHAR label[10];
 	CK_BBOOL true = CK_TRUE;
 	CK_BBOOL false = CK_FALSE;
-	CK_BYTE certValue[MAX_CERTIFICATE_SIZE];
 	CK_ATTRIBUTE template[] = {
 			{ CKA_CLASS, &class, sizeof(class) },
 			{ CKA_CERTIFICATE_TYPE, &certType, sizeof(certType) },
@@ -160,12 +316,11 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 			{ CKA_PRIVATE, &false, sizeof(false) },
 			{ CKA_LABEL, label, sizeof(label) - 1 },
 			{ CKA_ID, &id, sizeof(id) },
-			{ CKA_VALUE, certValue, sizeof(certValue) }
+			{ CKA_VALUE, NULL, 0 }
 	};
 	struct p11Object_t *object;
-	token_sc_hsm_t *sc;
 	struct p15PrivateKeyDescription *p15 = NULL;
-	unsigned char prkd[MAX_P15_SIZE], *spk;
+	unsigned char prkd[MAX_P15_SIZE + APDU_SW_SPACE];
 	int rc;
 
 	FUNC_CALLED();
@@ -182,17 +337,6 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
 	}
 
-	rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
-
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
-	}
-	template[6].ulValueLen = rc;
-
-	if (certValue[0] != ASN1_SEQUENCE) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error not a certificate");
-	}
-
 	object = calloc(sizeof(struct p11Object_t), 1);
 
 	if (object == NULL) {
@@ -220,24 +364,22 @@ static int addEECertificateObject(struct p11Token_t *token, unsigned char id)
 		FUNC_FAILS(rc, "Could not create certificate key object");
 	}
 
-	rc = populateIssuerSubjectSerial(object);
-
-	if (rc != CKR_OK) {
-#ifdef DEBUG
-		debug("populateIssuerSubjectSerial() failed\n");
-#endif
-	}
-
-	if (getSubjectPublicKeyInfo(object, &spk) == CKR_OK) {
-		sc = getPrivateData(token);
-		sc->publickeys[id] = spk;
-	}
+	/* The empty value is replaced by sc_hsm_loadCertificate() */
+	removeAttribute(object, &template[6]);
+	object->loadAttributes = sc_hsm_loadCertificate;
 
 	object->tokenid = (int)id;
 	object->keysize = p15->keysize;
 
-	addTokenObject(token, object, TRUE);
+	rc = addTokenObject(token, object, TRUE);
 	freePrivateKeyDescription(&p15);
+
+	if (rc != CKR_OK) {
+		removeAllAttributes(object);
+		free(object);
+		FUNC_FAILS(rc, "Could not add certificate object");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -248,6 +390,7 @@ static int getSignatureSize(CK_MECHANISM_TYPE mech, struct p11Object_t *object)
 	switch(mech) {
 	case CKM_RSA_X_509:
 	case CKM_RSA_PKCS:
+	case CKM_RSA_PKCS_PSS:
 	case CKM_SHA1_RSA_PKCS:
 	case CKM_SHA256_RSA_PKCS:
 	case CKM_SHA1_RSA_PKCS_PSS:
@@ -273,6 +416,8 @@ static int getAlgorithmIdForSigning(CK_MECHANISM_TYPE mech)
 		return ALGO_RSA_PKCS1_SHA1;
 	case CKM_SHA256_RSA_PKCS:
 		return ALGO_RSA_PKCS1_SHA256;
+	case CKM_RSA_PKCS_PSS:
+		return ALGO_RSA_PSS;
 	case CKM_SHA1_RSA_PKCS_PSS:
 		return ALGO_RSA_PSS_SHA1;
 	case CKM_SHA256_RSA_PKCS_PSS:
@@ -373,11 +518,17 @@ static int decodeECDSASignature(unsigned char *data, int datalen,
 
 static int sc_hsm_C_SignInit(struct p11Object_t *object, CK_MECHANISM_PTR mech)
 {
+	CK_MECHANISM_TYPE hashMech, signMech;
 	int algo;
 
 	FUNC_CALLED();
 
-	algo = getAlgorithmIdForSigning(mech->mechanism);
+	// Hash-and-sign mechanisms are hashed on the host and passed to sc_hsm_C_Sign() as raw signature mechanism
+	if (getHashAndSignMechanisms(mech->mechanism, &hashMech, &signMech) == CKR_OK) {
+		algo = getAlgorithmIdForSigning(signMech);
+	} else {
+		algo = getAlgorithmIdForSigning(mech->mechanism);
+	}
 	if (algo < 0) {
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
@@ -409,9 +560,10 @@ static void applyPKCSPadding(unsigned char *di, int dilen, unsigned char *buff,
 
 static int sc_hsm_C_Sign(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int rc, algo, len;
+	int rc, algo, len, siglen;
 	unsigned short SW1SW2;
-	unsigned char scr[256];
+	unsigned char cmd[APDU_COMMAND_SIZE(MAX_CRYPTOGRAM_SIZE)];
+	unsigned char rsp[MAX_CRYPTOGRAM_SIZE + APDU_SW_SPACE], *prsp;
 	FUNC_CALLED();
 
 	if (pSignature == NULL) {
@@ -424,25 +576,51 @@ static int sc_hsm_C_Sign(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
+	prsp = rsp;
+
 	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1)) {
+		// Use the leftmost bits of a hash longer than the order of the curve
+		len = (object->keysize + 7) >> 3;
+		if ((algo == ALGO_EC_RAW) && (ulDataLen > (CK_ULONG)len)) {
+			ulDataLen = len;
+		}
+		if (ulDataLen > MAX_CRYPTOGRAM_SIZE) {
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data larger than buffer");
+		}
+		memcpy(cmd + APDU_HEADER_SPACE, pData, ulDataLen);
 		rc = transmitAPDU(object->token->slot, 0x80, 0x68, (unsigned char)object->tokenid, (unsigned char)algo,
-				ulDataLen, pData,
-				0, scr, sizeof(scr), &SW1SW2);
+				cmd, ulDataLen, 0,
+				rsp, sizeof(rsp), &SW1SW2);
 	} else {
+		siglen = getSignatureSize(mech, object);
+		if (*pulSignatureLen < (CK_ULONG)siglen) {
+			*pulSignatureLen = siglen;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+
 		if (mech == CKM_RSA_PKCS) {
-			len = getSignatureSize(mech, object);
-			if (len > sizeof(scr)) {
-				FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+			if (siglen > MAX_CRYPTOGRAM_SIZE) {
+				FUNC_FAILS(CKR_KEY_SIZE_RANGE, "Signature length is larger than buffer");
 			}
-			applyPKCSPadding(pData, ulDataLen, scr, len);
-			rc = transmitAPDU(object->token->slot, 0x80, 0x68, (unsigned char)object->tokenid, (unsigned char)algo,
-				len, scr,
-				0, pSignature, *pulSignatureLen, &SW1SW2);
+			// Pad in place, so that the block is sent without a copy
+			applyPKCSPadding(pData, ulDataLen, cmd + APDU_HEADER_SPACE, siglen);
+			len = siglen;
 		} else {
-			rc = transmitAPDU(object->token->slot, 0x80, 0x68, (unsigned char)object->tokenid, (unsigned char)algo,
-				ulDataLen, pData,
-				0, pSignature, *pulSignatureLen, &SW1SW2);
+			if (ulDataLen > MAX_CRYPTOGRAM_SIZE) {
+				FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data larger than buffer");
+			}
+			memcpy(cmd + APDU_HEADER_SPACE, pData, ulDataLen);
+			len = ulDataLen;
+		}
+
+		// Receive the signature in place if the buffer has room for the status word
+		if (*pulSignatureLen >= (CK_ULONG)siglen + APDU_SW_SPACE) {
+			prsp = pSignature;
 		}
+
+		rc = transmitAPDU(object->token->slot, 0x80, 0x68, (unsigned char)object->tokenid, (unsigned char)algo,
+				cmd, len, 0,
+				prsp, prsp == rsp ? sizeof(rsp) : *pulSignatureLen, &SW1SW2);
 	}
 
 	if (rc < 0) {
@@ -454,10 +632,15 @@ static int sc_hsm_C_Sign(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_
 	}
 
 	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1)) {
-		rc = decodeECDSASignature(scr, rc, pSignature, *pulSignatureLen);
+		rc = decodeECDSASignature(rsp, rc, pSignature, *pulSignatureLen);
 		if (rc < 0) {
 			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
 		}
+	} else if (prsp == rsp) {
+		if ((CK_ULONG)rc > *pulSignatureLen) {
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+		memcpy(pSignature, rsp, rc);
 	}
 
 	*pulSignatureLen = rc;
@@ -518,7 +701,8 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech,
 {
 	int rc, algo;
 	unsigned short SW1SW2;
-	unsigned char scr[256];
+	unsigned char cmd[APDU_COMMAND_SIZE(MAX_CRYPTOGRAM_SIZE)];
+	unsigned char rsp[MAX_CRYPTOGRAM_SIZE + APDU_SW_SPACE], *prsp;
 
 	FUNC_CALLED();
 
@@ -532,9 +716,21 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech,
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
+	if (ulEncryptedDataLen > MAX_CRYPTOGRAM_SIZE) {
+		FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Cryptogram larger than buffer");
+	}
+
+	memcpy(cmd + APDU_HEADER_SPACE, pEncryptedData, ulEncryptedDataLen);
+
+	// A plain RSA block is received in place if the buffer has room for the status word
+	prsp = rsp;
+	if ((mech == CKM_RSA_X_509) && (*pulDataLen >= (CK_ULONG)(object->keysize >> 3) + APDU_SW_SPACE)) {
+		prsp = pData;
+	}
+
 	rc = transmitAPDU(object->token->slot, 0x80, 0x62, (unsigned char)object->tokenid, (unsigned char)algo,
-			ulEncryptedDataLen, pEncryptedData,
-			0, scr, sizeof(scr), &SW1SW2);
+			cmd, ulEncryptedDataLen, 0,
+			prsp, prsp == rsp ? sizeof(rsp) : *pulDataLen, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
@@ -549,9 +745,11 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech,
 			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
 		}
 		*pulDataLen = rc;
-		memcpy(pData, scr, rc);
+		if (prsp == rsp) {
+			memcpy(pData, rsp, rc);
+		}
 	} else {
-		rc = stripPKCS15Padding(scr, rc, pData, pulDataLen);
+		rc = stripPKCS15Padding(rsp, rc, pData, pulDataLen);
 		if (rc < 0) {
 			FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Invalid PKCS#1 padding");
 		}
@@ -562,6 +760,242 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech,
 
 
 
+/**
+ * Return the subject public key info for a private key
+ *
+ * The *Init functions resolve the public key under the exclusive slot lock, so that the
+ * operation itself, running under the shared slot lock, never loads a certificate.
+ *
+ * @param object    the private key
+ * @param mayLoad   load the matching certificate if required, which needs the exclusive slot lock
+ * @return          the public key from the matching certificate or NULL if there is none
+ */
+static unsigned char *getPublicKey(struct p11Object_t *object, int mayLoad)
+{
+	struct p11Object_t *cert;
+	token_sc_hsm_t *sc;
+
+	sc = getPrivateData(object->token);
+
+	if (mayLoad) {
+		/* The public key is taken from the certificate, which may not be loaded yet or read again */
+		FOR_EACH(cert, object->token->pubObjectList) {
+			if ((cert->tokenid == object->tokenid) && (cert->loadAttributes == sc_hsm_loadCertificate)) {
+				loadDeferredAttributes(cert);
+				break;
+			}
+		}
+	}
+
+	return sc->publickeys[object->tokenid];
+}
+
+
+
+static CK_KEY_TYPE getKeyType(struct p11Object_t *object)
+{
+	CK_ATTRIBUTE attr = { CKA_KEY_TYPE, NULL, 0 };
+	struct p11Attribute_t *pattr;
+
+	if (findAttribute(object, &attr, &pattr) < 0) {
+		return CKK_VENDOR_DEFINED;
+	}
+	return *(CK_KEY_TYPE *)pattr->attrData.pValue;
+}
+
+
+
+static int sc_hsm_C_EncryptInit(struct p11Object_t *object, CK_MECHANISM_PTR mech)
+{
+	FUNC_CALLED();
+
+	if (getKeyType(object) != CKK_RSA) {
+		FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Encryption requires a RSA key");
+	}
+
+	if ((mech->mechanism != CKM_RSA_X_509) && (mech->mechanism != CKM_RSA_PKCS)) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	if (getPublicKey(object, TRUE) == NULL) {
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "No public key available for private key");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Encrypt with the public key on the host
+ */
+static int sc_hsm_C_Encrypt(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	CK_ATTRIBUTE modulus, exponent;
+	unsigned char *spk;
+	int rc;
+
+	FUNC_CALLED();
+
+	spk = getPublicKey(object, FALSE);
+
+	if ((spk == NULL) || (decodeModulusExponentFromSPKI(spk, &modulus, &exponent) < 0)) {
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "No public key available for private key");
+	}
+
+	rc = rsaEncrypt(mech, &modulus, &exponent, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	FUNC_RETURNS(rc);
+}
+
+
+
+static int sc_hsm_C_VerifyInit(struct p11Object_t *object, CK_MECHANISM_PTR mech)
+{
+	CK_MECHANISM_TYPE hashMech, signMech;
+
+	FUNC_CALLED();
+
+	// Hash-and-sign mechanisms are hashed on the host and passed to sc_hsm_C_Verify() as raw signature mechanism
+	if (getHashAndSignMechanisms(mech->mechanism, &hashMech, &signMech) != CKR_OK) {
+		signMech = mech->mechanism;
+	}
+
+	switch(getKeyType(object)) {
+	case CKK_RSA:
+		if ((signMech != CKM_RSA_X_509) && (signMech != CKM_RSA_PKCS) && (signMech != CKM_RSA_PKCS_PSS)) {
+			FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+		}
+		break;
+	case CKK_ECDSA:
+		if (signMech != CKM_ECDSA) {
+			FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+		}
+		break;
+	default:
+		FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Unsupported key type");
+	}
+
+	if (getPublicKey(object, TRUE) == NULL) {
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "No public key available for private key");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Verify a signature with the public key on the host
+ */
+static int sc_hsm_C_Verify(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+	CK_ATTRIBUTE attr[2];
+	unsigned char *spk;
+	int rc;
+
+	FUNC_CALLED();
+
+	spk = getPublicKey(object, FALSE);
+
+	if (spk == NULL) {
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "No public key available for private key");
+	}
+
+	if (mech == CKM_ECDSA) {
+		if ((decodeECParamsFromSPKI(spk, &attr[0]) < 0) || (decodeECPointFromSPKI(spk, &attr[1]) < 0)) {
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Invalid EC public key");
+		}
+		rc = ecdsaVerify(&attr[0], &attr[1], pData, ulDataLen, pSignature, ulSignatureLen);
+	} else {
+		if (decodeModulusExponentFromSPKI(spk, &attr[0], &attr[1]) < 0) {
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Invalid RSA public key");
+		}
+		rc = rsaVerify(mech, &attr[0], &attr[1], pData, ulDataLen, pSignature, ulSignatureLen);
+	}
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Recover the data from a RSA signature with the public key on the host
+ */
+static int sc_hsm_C_VerifyRecover(struct p11Object_t *object, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	CK_ATTRIBUTE modulus, exponent;
+	unsigned char *spk;
+	int rc;
+
+	FUNC_CALLED();
+
+	spk = getPublicKey(object, FALSE);
+
+	if ((spk == NULL) || (decodeModulusExponentFromSPKI(spk, &modulus, &exponent) < 0)) {
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "No public key available for private key");
+	}
+
+	rc = rsaVerifyRecover(mech, &modulus, &exponent, pSignature, ulSignatureLen, pData, pulDataLen);
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Derive CKA_MODULUS and CKA_PUBLIC_EXPONENT or CKA_EC_PARAMS for a private key
+ * from the public key in the matching certificate
+ */
+static int sc_hsm_loadPublicKeyAttributes(struct p11Object_t *object)
+{
+	CK_ATTRIBUTE attr = { CKA_KEY_TYPE, NULL, 0 };
+	CK_ATTRIBUTE derived[2];
+	struct p11Attribute_t *pattr;
+	unsigned char *spk;
+	int i, count;
+
+	FUNC_CALLED();
+
+	spk = getPublicKey(object, TRUE);
+	count = 0;
+
+	if ((spk != NULL) && (findAttribute(object, &attr, &pattr) >= 0)) {
+		switch(*(CK_KEY_TYPE *)pattr->attrData.pValue) {
+		case CKK_RSA:
+			if (decodeModulusExponentFromSPKI(spk, &derived[0], &derived[1]) == 0) {
+				count = 2;
+			}
+			break;
+		case CKK_ECDSA:
+			if (decodeECParamsFromSPKI(spk, &derived[0]) == 0) {
+				count = 1;
+			}
+			break;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (addAttribute(object, &derived[i]) != CKR_OK) {
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+	}
+
+	/* Values not available from a certificate remain empty, as set by createPrivateKeyObject() */
+	for (i = 0; i < sizeof(publicKeyAttributes) / sizeof(CK_ATTRIBUTE); i++) {
+		if (addAttribute(object, &publicKeyAttributes[i]) != CKR_OK) {
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Create a private key object from the private key description
+ *
+ * Attributes derived from the public key are only decoded when requested.
+ */
 static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 {
 	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
@@ -586,15 +1020,12 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 			{ CKA_UNWRAP, &false, sizeof(false) },
 			{ CKA_EXTRACTABLE, &false, sizeof(false) },
 			{ CKA_ALWAYS_SENSITIVE, &true, sizeof(true) },
-			{ CKA_NEVER_EXTRACTABLE, &true, sizeof(true) },
-			{ 0, NULL, 0 },
-			{ 0, NULL, 0 }
+			{ CKA_NEVER_EXTRACTABLE, &true, sizeof(true) }
 	};
-	token_sc_hsm_t *sc;
 	struct p11Object_t *object;
 	struct p15PrivateKeyDescription *p15 = NULL;
-	unsigned char prkd[MAX_P15_SIZE];
-	int rc,attributes;
+	unsigned char prkd[MAX_P15_SIZE + APDU_SW_SPACE];
+	int rc,i;
 
 	FUNC_CALLED();
 
@@ -633,24 +1064,12 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 		template[11].pValue = p15->usage & P15_SIGNRECOVER ? &true : &false;
 	}
 
-	attributes = sizeof(template) / sizeof(CK_ATTRIBUTE) - 2;
-
 	switch(p15->keytype) {
 	case P15_KEYTYPE_RSA:
 		keyType = CKK_RSA;
-		sc = getPrivateData(token);
-		if (sc->publickeys[id]) {
-			decodeModulusExponentFromSPKI(sc->publickeys[id], &template[attributes], &template[attributes + 1]);
-			attributes += 2;
-		}
 		break;
 	case P15_KEYTYPE_ECC:
 		keyType = CKK_ECDSA;
-		sc = getPrivateData(token);
-		if (sc->publickeys[id]) {
-			decodeECParamsFromSPKI(sc->publickeys[id], &template[attributes]);
-			attributes += 1;
-		}
 		break;
 	default:
 		freePrivateKeyDescription(&p15);
@@ -660,7 +1079,7 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 
 	// ToDo: Set CKA_EXTRACTABLE based on KCV
 
-	rc = createPrivateKeyObject(template, attributes, object);
+	rc = createPrivateKeyObject(template, sizeof(template) / sizeof(CK_ATTRIBUTE), object);
 
 	if (rc != CKR_OK) {
 		freePrivateKeyDescription(&p15);
@@ -668,16 +1087,34 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 		FUNC_FAILS(rc, "Could not create private key object");
 	}
 
+	/* The empty defaults are replaced by sc_hsm_loadPublicKeyAttributes() */
+	for (i = 0; i < sizeof(publicKeyAttributes) / sizeof(CK_ATTRIBUTE); i++) {
+		removeAttribute(object, &publicKeyAttributes[i]);
+	}
+	object->loadAttributes = sc_hsm_loadPublicKeyAttributes;
+
 	object->C_SignInit = sc_hsm_C_SignInit;
 	object->C_Sign = sc_hsm_C_Sign;
+	object->C_VerifyInit = sc_hsm_C_VerifyInit;
+	object->C_Verify = sc_hsm_C_Verify;
+	object->C_VerifyRecover = sc_hsm_C_VerifyRecover;
+	object->C_EncryptInit = sc_hsm_C_EncryptInit;
+	object->C_Encrypt = sc_hsm_C_Encrypt;
 	object->C_DecryptInit = sc_hsm_C_DecryptInit;
 	object->C_Decrypt = sc_hsm_C_Decrypt;
 
 	object->tokenid = (int)id;
 	object->keysize = p15->keysize;
-	addTokenObject(token, object, FALSE);
+	rc = addTokenObject(token, object, FALSE);
 
 	freePrivateKeyDescription(&p15);
+
+	if (rc != CKR_OK) {
+		removeAllAttributes(object);
+		free(object);
+		FUNC_FAILS(rc, "Could not add private key object");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -685,18 +1122,49 @@ static int addPrivateKeyObject(struct p11Token_t *token, unsigned char id)
 
 static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 {
-	unsigned char filelist[MAX_FILES * 2];
+	unsigned char *filelist;
+	unsigned char certs[256];
 	struct p11Slot_t *slot = token->slot;
+	struct p11Object_t *object;
+	token_sc_hsm_t *sc;
 	int rc,listlen,i,id,prefix;
 
 	FUNC_CALLED();
 
-	rc = enumerateObjects(slot, filelist, sizeof(filelist));
+	sc = getPrivateData(token);
+	filelist = sc->filelist;
+
+	rc = enumerateObjects(slot, filelist, sizeof(sc->filelist));
 	if (rc < 0) {
+		sc->filelistlen = 0;
 		FUNC_FAILS(rc, "enumerateObjects failed");
 	}
 
 	listlen = rc;
+	sc->filelistlen = listlen;
+
+	/* The list of files changes whenever a key or certificate is added or removed */
+	if (publicObjects && *sc->serialno &&
+		(loadTokenObjectCache(token, sc->serialno, filelist, listlen, sc_hsm_loadCertificate) == CKR_OK)) {
+		FOR_EACH(object, token->pubObjectList) {
+			if (object->loadAttributes == NULL) {
+				setPublicKey(object);
+			}
+		}
+#ifdef DEBUG
+		debug("Public objects restored from cache\n");
+#endif
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	/* Only create certificate objects for keys with a certificate file */
+	memset(certs, 0, sizeof(certs));
+	for (i = 0; i < listlen; i += 2) {
+		if (filelist[i] == EE_CERTIFICATE_PREFIX) {
+			certs[filelist[i + 1]] = 1;
+		}
+	}
+
 	for (i = 0; i < listlen; i += 2) {
 		prefix = filelist[i];
 		id = filelist[i + 1];
@@ -704,7 +1172,7 @@ static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 		if (publicObjects) {
 			switch(prefix) {
 			case KEY_PREFIX:
-				if (id != 0) {				// Skip Device Authentication Key
+				if ((id != 0) && certs[id]) {	// Skip Device Authentication Key
 					rc = addEECertificateObject(token, id);
 					if (rc != CKR_OK) {
 #ifdef DEBUG
@@ -729,6 +1197,12 @@ static int sc_hsm_loadObjects(struct p11Token_t *token, int publicObjects)
 			}
 		}
 	}
+
+	if (publicObjects && *sc->serialno) {
+		saveTokenObjectCache(token, sc->serialno, filelist, listlen);
+		sc->cacheDirty = FALSE;
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -788,6 +1262,7 @@ int sc_hsm_login(struct p11Slot_t *slot, int userType, unsigned char *pin, int p
 {
 	int rc = CKR_OK;
 	unsigned short SW1SW2;
+	unsigned char cmd[APDU_COMMAND_SIZE(MAX_PIN_SIZE)];
 	FUNC_CALLED();
 
 	if (userType == CKU_SO) {
@@ -806,9 +1281,14 @@ int sc_hsm_login(struct p11Slot_t *slot, int userType, unsigned char *pin, int p
 #ifdef DEBUG
 			debug("Verify PIN using provided PIN value\n");
 #endif
+			if ((pinlen < 0) || (pinlen > MAX_PIN_SIZE)) {
+				FUNC_FAILS(CKR_PIN_LEN_RANGE, "PIN too long");
+			}
+			memcpy(cmd + APDU_HEADER_SPACE, pin, pinlen);
 			rc = transmitAPDU(slot, 0x00, 0x20, 0x00, 0x81,
-				pinlen, pin,
-				0, NULL, 0, &SW1SW2);
+				cmd, pinlen, -1,
+				NULL, 0, &SW1SW2);
+			memset(cmd, 0, sizeof(cmd));
 		}
 
 		if (rc < 0) {
@@ -857,6 +1337,100 @@ int sc_hsm_logout(struct p11Slot_t *slot)
 
 
 
+/**
+ * Remove the cache file of the token and read the public objects again
+ *
+ * The caller must have removed the public objects before.
+ *
+ * @param token     The token whose objects shall be read
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int sc_hsm_reloadPublicObjects(struct p11Token_t *token)
+{
+	token_sc_hsm_t *sc;
+
+	sc = getPrivateData(token);
+
+	/*
+	 * The copies of the public keys are kept for operations already initialized. They are
+	 * replaced when the certificates are loaded again by the next *Init function.
+	 */
+	if (*sc->serialno) {
+		removeTokenObjectCache(sc->serialno);
+	}
+
+	return sc_hsm_loadObjects(token, TRUE);
+}
+
+
+
+/**
+ * Write certificates loaded since the cache was saved to the object cache and release the
+ * memory held in the private data of the token
+ *
+ * The caller must call this before the public objects are removed.
+ *
+ * @param token     The token to be freed
+ */
+void sc_hsm_freeToken(struct p11Token_t *token)
+{
+	token_sc_hsm_t *sc;
+	int i;
+
+	sc = getPrivateData(token);
+
+	if (sc->cacheDirty && *sc->serialno) {
+		saveTokenObjectCache(token, sc->serialno, sc->filelist, sc->filelistlen);
+		sc->cacheDirty = FALSE;
+	}
+
+	for (i = 0; i < sizeof(sc->publickeys) / sizeof(sc->publickeys[0]); i++) {
+		free(sc->publickeys[i]);
+		sc->publickeys[i] = NULL;
+	}
+}
+
+
+
+/**
+ * Obtain random bytes from the token using GET CHALLENGE
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param buffer    The buffer receiving the random bytes
+ * @param len       The number of bytes required, at most MAX_EXT_APDU_LENGTH
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int sc_hsm_getChallenge(struct p11Slot_t *slot, unsigned char *buffer, int len)
+{
+	int rc;
+	unsigned short SW1SW2;
+	unsigned char rsp[MAX_EXT_APDU_LENGTH + APDU_SW_SPACE];
+	FUNC_CALLED();
+
+	if ((len < 0) || (len > MAX_EXT_APDU_LENGTH)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Too many random bytes requested");
+	}
+
+	rc = transmitAPDU(slot, 0x00, 0x84, 0x00, 0x00,
+		NULL, 0, len,
+		rsp, len + APDU_SW_SPACE, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if ((SW1SW2 != 0x9000) || (rc != len)) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "GET CHALLENGE failed");
+	}
+
+	// The buffer of the caller has no room for the status word
+	memcpy(buffer, rsp, len);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /**
  * Create a new SmartCard-HSM token if token detection and initialization is successful
  *
@@ -918,6 +1492,13 @@ int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **pptoken)
 
 //	sc = getPrivateData(token);
 
+	/* The serial number names the cache file, so the device certificate is only read if the cache is used */
+	if (isObjectCacheEnabled() && (readSerialNumber(token) != CKR_OK)) {
+#ifdef DEBUG
+		debug("readSerialNumber() failed, object cache disabled\n");
+#endif
+	}
+
 	sc_hsm_loadObjects(token, TRUE);
 
 	*pptoken = token;
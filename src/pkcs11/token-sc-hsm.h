@@ -36,12 +36,15 @@
 
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/p11generic.h>
+#include <pkcs11/slot.h>
 
 #define MAX_ATR					40
 #define MAX_EXT_APDU_LENGTH		1014
 #define MAX_FILES				128
 #define MAX_CERTIFICATE_SIZE	4096
 #define MAX_P15_SIZE			1024
+#define MAX_CRYPTOGRAM_SIZE		512			/* Largest block sent to the token for signing or decryption */
+#define MAX_PIN_SIZE			16
 
 #define PRKD_PREFIX				0xC4		/* Hi byte in file identifier for PKCS#15 PRKD objects */
 #define CD_PREFIX				0xC8		/* Hi byte in file identifier for PKCS#15 CD objects */
@@ -58,6 +61,7 @@
 #define ALGO_RSA_PKCS1_SHA1		0x31		/* RSA signature with SHA-1 hash and PKCS#1 V1.5 padding */
 #define ALGO_RSA_PKCS1_SHA256	0x33		/* RSA signature with SHA-256 hash and PKCS#1 V1.5 padding */
 
+#define ALGO_RSA_PSS			0x40		/* RSA signature with external hash and PKCS#1 PSS padding */
 #define ALGO_RSA_PSS_SHA1		0x41		/* RSA signature with SHA-1 hash and PKCS#1 PSS padding */
 #define ALGO_RSA_PSS_SHA256		0x43		/* RSA signature with SHA-256 hash and PKCS#1 PSS padding */
 
@@ -67,15 +71,24 @@
 #define ALGO_EC_SHA256			0x73		/* ECDSA signature with SHA-256 hash */
 #define ALGO_EC_DH				0x80		/* ECDH key derivation */
 
+#define DEVICE_CERTIFICATE_FID	0x2F02		/* Device authentication certificate C_DevAut */
+
 #define ID_USER_PIN				0x81		/* User PIN identifier */
 #define ID_SO_PIN				0x88		/* Security officer PIN identifier */
 
 typedef struct token_sc_hsm {
-	unsigned char *publickeys[256];
+	unsigned char *publickeys[256];			/* Copies of the public keys from the certificates */
+	char serialno[17];						/* Serial number from the device certificate or empty */
+	unsigned char filelist[MAX_FILES * 2 + APDU_SW_SPACE];	/* Result of the last ENUMERATE OBJECTS */
+	int filelistlen;
+	int cacheDirty;							/* Certificates were loaded after the cache was saved */
 } token_sc_hsm_t;
 
 int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int sc_hsm_login(struct p11Slot_t *slot, int userType, unsigned char *pin, int pinlen);
 int sc_hsm_logout(struct p11Slot_t *slot);
+int sc_hsm_getChallenge(struct p11Slot_t *slot, unsigned char *buffer, int len);
+int sc_hsm_reloadPublicObjects(struct p11Token_t *token);
+void sc_hsm_freeToken(struct p11Token_t *token);
 
 #endif /* ___TOKEN_SC_HSM_H_INC___ */
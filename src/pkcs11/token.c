@@ -33,10 +33,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#include <direct.h>
+#include <windows.h>
+#include <aclapi.h>
+#endif
+
 #include <pkcs11/strbpcpy.h>
 
 #include <pkcs11/token.h>
@@ -44,11 +54,28 @@
 #include <pkcs11/dataobject.h>
 
 #include <pkcs11/token-sc-hsm.h>
+#include <pkcs11/random.h>
 
 #ifdef DEBUG
 #include <pkcs11/debug.h>
 #endif
 
+/*
+ * Public token objects are cached in a directory of the user if enabled with SC_HSM_OBJECT_CACHE=1.
+ * The directory is SC_HSM_OBJECT_CACHE_DIR or OBJECT_CACHE_SUBDIR below $XDG_CACHE_HOME, $HOME/.cache
+ * or %LOCALAPPDATA%. The cache is shared by all processes of the same user and avoids reading
+ * descriptors and certificates from the token. It is only validated against the list of files on
+ * the token, so it must be invalidated with C_InvalidateObjectCache() after the content of an
+ * existing key or certificate was changed by another application.
+ */
+#define OBJECT_CACHE_SUBDIR     "sc-hsm-embedded"
+#define OBJECT_CACHE_MAGIC      "SCHC"
+#define OBJECT_CACHE_VERSION    1
+#define OBJECT_CACHE_MAX_SIZE   (1024 * 1024)
+
+#define OBJECT_CACHE_SENSITIVE  0x01     /* Object has sensitiveObj set */
+#define OBJECT_CACHE_DEFERRED   0x02     /* Object was stored before deferred attributes were loaded */
+
 
 
 /**
@@ -58,10 +85,12 @@
  * @param object   The object
  * @param publicObject true to add as public object, false to add as private object
  *
- * @return          0 or -1 if error
+ * @return          CKR_OK or CKR_HOST_MEMORY
  */
 int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject)
 {
+	int rc;
+
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
 	object->token = token;
@@ -72,6 +101,16 @@ int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int pub
 			token->nextObjectHandle = 1;
 	}
 
+	rc = addObjectToIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, object);
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = addObjectToAttributeIndex(publicObject ? &token->pubAttributeIndex : &token->privAttributeIndex, object);
+	if (rc != CKR_OK) {
+		removeObjectFromIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, object->handle);
+		return rc;
+	}
+
 	if (publicObject) {
 		addObjectToList(&token->pubObjectList, object);
 		token->pubObjectCount++;
@@ -90,27 +129,20 @@ int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int pub
 /**
  * Find public or private object in list of token objects
  *
- * @param token     The token whose object shall be removed
+ * @param token     The token whose object shall be found
  * @param handle    The objects handle
+ * @param ppObject  Pointer to pointer updated with the object or NULL if not found
+ * @param publicObject true to search public objects, false to search private objects
+ *
+ * The caller must hold the slot lock, either shared or exclusive.
+ *
+ * @return          0 or -1 if not found
  */
 int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **ppObject, int publicObject)
 {
-	struct p11Object_t *object;
-	int pos;
-
-	VERIFY_MUTEXOWNER(&token->slot->mutex);
-
-	pos = 0;
-	FOR_EACH(object, publicObject ? token->pubObjectList : token->privObjectList) {
-		if (object->handle == handle) {
-			*ppObject = object;
-			return pos;
-		}
-		pos++;
-	}
+	*ppObject = findObjectInIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, handle);
 
-	*ppObject = NULL;
-	return -1;
+	return *ppObject ? 0 : -1;
 }
 
 
@@ -126,8 +158,17 @@ int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p1
  */
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject)
 {
+	struct p11Object_t *object;
+
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
+	object = findObjectInIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, handle);
+	if (object == NULL)
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	removeObjectFromIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, handle);
+	removeObjectFromAttributeIndex(object);
+
 	if (publicObject) {
 		int rc = removeObjectFromList(&token->pubObjectList, handle);
 		if (rc != CKR_OK)
@@ -156,6 +197,8 @@ static void removePrivateObjects(struct p11Token_t *token)
 {
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
+	clearObjectIndex(&token->privObjectIndex);
+	clearAttributeIndex(&token->privAttributeIndex);
 	removeAllObjectsFromList(&token->privObjectList);
 	token->privObjectCount = 0;
 }
@@ -173,6 +216,8 @@ static void removePublicObjects(struct p11Token_t *token)
 {
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
+	clearObjectIndex(&token->pubObjectIndex);
+	clearAttributeIndex(&token->pubAttributeIndex);
 	removeAllObjectsFromList(&token->pubObjectList);
 	token->pubObjectCount = 0;
 }
@@ -189,12 +234,23 @@ int removeTokenObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDL
 
 	VERIFY_MUTEXOWNER(&token->slot->mutex);
 
+	object = findObjectInIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, handle);
+	if (object == NULL)
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	removeObjectFromIndex(publicObject ? &token->pubObjectIndex : &token->privObjectIndex, handle);
+	removeObjectFromAttributeIndex(object);
+
 	FOR_EACH_REF(ppObject, *(publicObject ? &token->pubObjectList : &token->privObjectList)) {
 		if ((*ppObject)->handle == handle) {
 			object = *ppObject;
 			*ppObject = object->next;
 			free(object);
-			token->pubObjectCount--;
+			if (publicObject) {
+				token->pubObjectCount--;
+			} else {
+				token->privObjectCount--;
+			}
 			return CKR_OK;
 		}
 	}
@@ -238,6 +294,507 @@ int synchronizeToken(struct p11Slot_t *slot)
 
 
 
+static void putUInt32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+
+
+static unsigned long getUInt32(unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+
+
+#ifdef _WIN32
+/**
+ * Check that a file or directory is owned by the user of the process and that neither
+ * everyone, authenticated users nor the users group may write to it
+ */
+static int isPrivateHandle(HANDLE handle)
+{
+	static const WELL_KNOWN_SID_TYPE others[] = { WinWorldSid, WinAuthenticatedUserSid, WinBuiltinUsersSid };
+	PSECURITY_DESCRIPTOR sd = NULL;
+	PSID owner = NULL;
+	PACL dacl = NULL;
+	TOKEN_USER *user;
+	HANDLE processToken;
+	BYTE sid[SECURITY_MAX_SID_SIZE];
+	TRUSTEE_A trustee;
+	ACCESS_MASK mask;
+	DWORD len;
+	int i, ok = FALSE;
+
+	if (GetSecurityInfo(handle, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION,
+			&owner, NULL, &dacl, NULL, &sd) != ERROR_SUCCESS) {
+		return FALSE;
+	}
+
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &processToken)) {
+		len = 0;
+		GetTokenInformation(processToken, TokenUser, NULL, 0, &len);
+		user = (TOKEN_USER *)malloc(len);
+		if ((user != NULL) && GetTokenInformation(processToken, TokenUser, user, len, &len)) {
+			ok = EqualSid(owner, user->User.Sid);
+		}
+		free(user);
+		CloseHandle(processToken);
+	}
+
+	if (dacl == NULL) {			// A NULL DACL grants full access to everyone
+		ok = FALSE;
+	}
+
+	for (i = 0; ok && (i < sizeof(others) / sizeof(*others)); i++) {
+		len = sizeof(sid);
+		if (!CreateWellKnownSid(others[i], NULL, sid, &len)) {
+			ok = FALSE;
+			break;
+		}
+		BuildTrusteeWithSidA(&trustee, sid);
+		if ((GetEffectiveRightsFromAclA(dacl, &trustee, &mask) != ERROR_SUCCESS) ||
+			(mask & (FILE_WRITE_DATA | FILE_APPEND_DATA | WRITE_DAC | WRITE_OWNER))) {
+			ok = FALSE;
+		}
+	}
+
+	LocalFree(sd);
+	return ok;
+}
+#endif
+
+
+
+/**
+ * Return TRUE if the object cache was enabled with SC_HSM_OBJECT_CACHE=1
+ */
+int isObjectCacheEnabled(void)
+{
+	char *str = getenv("SC_HSM_OBJECT_CACHE");
+
+	return (str != NULL) && !strcmp(str, "1");
+}
+
+
+
+/**
+ * Append a path component and a separator to the path in dir
+ *
+ * @return 0 or -1 if the buffer is too small
+ */
+static int appendPath(char *dir, size_t dirlen, char *component)
+{
+	size_t len = strlen(dir);
+
+	if (len + strlen(component) + 2 > dirlen) {
+		return -1;
+	}
+
+#ifndef _WIN32
+	if ((len > 0) && (dir[len - 1] != '/')) {
+		dir[len++] = '/';
+	}
+#else
+	if ((len > 0) && (dir[len - 1] != '\\') && (dir[len - 1] != '/')) {
+		dir[len++] = '\\';
+	}
+#endif
+	strcpy(dir + len, component);
+	return 0;
+}
+
+
+
+/**
+ * Determine the cache directory of the user, ending with a separator
+ *
+ * The default directory is created if missing, accessible only to the user.
+ *
+ * @return 0 or -1 if no directory can be determined
+ */
+static int getObjectCacheDirectory(char *dir, size_t dirlen)
+{
+	char *str;
+
+	*dir = 0;
+	str = getenv("SC_HSM_OBJECT_CACHE_DIR");
+
+	if ((str != NULL) && *str) {
+		return appendPath(dir, dirlen, str) || appendPath(dir, dirlen, "") ? -1 : 0;
+	}
+
+#ifndef _WIN32
+	str = getenv("XDG_CACHE_HOME");
+
+	if ((str != NULL) && *str) {
+		if (appendPath(dir, dirlen, str)) {
+			return -1;
+		}
+	} else {
+		str = getenv("HOME");
+		if ((str == NULL) || !*str || appendPath(dir, dirlen, str) || appendPath(dir, dirlen, ".cache")) {
+			return -1;
+		}
+	}
+
+	mkdir(dir, S_IRWXU);
+
+	if (appendPath(dir, dirlen, OBJECT_CACHE_SUBDIR)) {
+		return -1;
+	}
+
+	mkdir(dir, S_IRWXU);
+#else
+	str = getenv("LOCALAPPDATA");
+
+	if ((str == NULL) || !*str || appendPath(dir, dirlen, str) || appendPath(dir, dirlen, OBJECT_CACHE_SUBDIR)) {
+		return -1;
+	}
+
+	_mkdir(dir);				// Inherits the ACL of the profile, which is private to the user
+#endif
+
+	return appendPath(dir, dirlen, "");
+}
+
+
+
+/**
+ * Check that the cache directory exists and that no one but the user of the process could
+ * have placed or replaced files in it
+ */
+static int isPrivateCacheDirectory(char *dir)
+{
+#ifndef _WIN32
+	struct stat st;
+
+	return (stat(dir, &st) == 0) && S_ISDIR(st.st_mode) &&
+		(st.st_uid == geteuid()) && !(st.st_mode & (S_IWGRP | S_IWOTH));
+#else
+	HANDLE handle;
+	int ok;
+
+	handle = CreateFileA(dir, READ_CONTROL, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+	if (handle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	ok = isPrivateHandle(handle);
+	CloseHandle(handle);
+	return ok;
+#endif
+}
+
+
+
+/**
+ * Build the path of the cache file for a token
+ *
+ * Only letters and digits from the name are used, so the name can not escape the cache directory.
+ * The call fails if the cache is not enabled or the cache directory does not exist or is not
+ * private to the user.
+ *
+ * @return 0 or -1 if the cache can not be used or the name contains no usable character
+ */
+static int getObjectCachePath(char *name, char *path, size_t pathlen)
+{
+	size_t i, len, dirlen;
+
+	if (!isObjectCacheEnabled() || getObjectCacheDirectory(path, pathlen) || !isPrivateCacheDirectory(path)) {
+		return -1;
+	}
+
+	len = dirlen = strlen(path);
+
+	for (i = 0; name[i] && (len + 7 < pathlen); i++) {
+		if (((name[i] >= '0') && (name[i] <= '9')) ||
+			((name[i] >= 'A') && (name[i] <= 'Z')) ||
+			((name[i] >= 'a') && (name[i] <= 'z'))) {
+			path[len++] = name[i];
+		}
+	}
+
+	if ((len == dirlen) || (len + 7 >= pathlen)) {
+		return -1;
+	}
+
+	strcpy(path + len, ".cache");
+	return 0;
+}
+
+
+
+/**
+ * Write all public objects of the token to the object cache
+ *
+ * The cache file is written under a temporary name and then renamed, so concurrent
+ * processes never see a partially written file. The call fails silently if the cache
+ * is not enabled or the cache directory does not exist or is not private to the user.
+ *
+ * @param token         The token whose objects shall be stored
+ * @param name          Unique name of the token, usually the serial number
+ * @param indicator     Data that changes when the objects on the token change
+ * @param indicatorlen  Length of indicator
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+int saveTokenObjectCache(struct p11Token_t *token, char *name, unsigned char *indicator, int indicatorlen)
+{
+	char path[FILENAME_MAX], tmppath[FILENAME_MAX + 16];
+	unsigned char header[16], *data;
+	unsigned int datalen;
+	struct p11Object_t *object;
+	FILE *fp;
+	int rc, fd;
+
+	VERIFY_MUTEXOWNER(&token->slot->mutex);
+
+	if ((indicatorlen < 0) || (indicatorlen > 0xFFFF)) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	if (getObjectCachePath(name, path, sizeof(path))) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	/* The temporary file gets an unpredictable name and is created exclusively, so it can not be a planted link */
+	sprintf(tmppath, "%s.XXXXXX", path);
+
+#ifndef _WIN32
+	fd = mkstemp(tmppath);
+	fp = fd < 0 ? NULL : fdopen(fd, "wb");
+	if ((fp == NULL) && (fd >= 0)) {
+		close(fd);
+		remove(tmppath);
+	}
+#else
+	fd = _mktemp_s(tmppath, strlen(tmppath) + 1) ? -1 : _open(tmppath, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+	fp = fd < 0 ? NULL : _fdopen(fd, "wb");
+	if ((fp == NULL) && (fd >= 0)) {
+		_close(fd);
+		remove(tmppath);
+	}
+#endif
+
+	if (fp == NULL) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	memcpy(header, OBJECT_CACHE_MAGIC, 4);
+	header[4] = OBJECT_CACHE_VERSION;
+	header[5] = (unsigned char)sizeof(CK_ATTRIBUTE);
+	header[6] = (unsigned char)(indicatorlen >> 8);
+	header[7] = (unsigned char)indicatorlen;
+	putUInt32(header + 8, token->pubObjectCount);
+
+	rc = CKR_OK;
+	if ((fwrite(header, 12, 1, fp) != 1) || (fwrite(indicator, 1, indicatorlen, fp) != indicatorlen)) {
+		rc = CKR_FUNCTION_FAILED;
+	}
+
+	FOR_EACH(object, token->pubObjectList) {
+		if (rc != CKR_OK) {
+			break;
+		}
+
+		if (serializeObject(object, &data, &datalen) < 0) {
+			rc = CKR_HOST_MEMORY;
+			break;
+		}
+
+		putUInt32(header, object->tokenid);
+		putUInt32(header + 4, object->keysize);
+		header[8] = (object->sensitiveObj ? OBJECT_CACHE_SENSITIVE : 0) |
+				(object->loadAttributes ? OBJECT_CACHE_DEFERRED : 0);
+		putUInt32(header + 9, datalen);
+
+		if ((fwrite(header, 13, 1, fp) != 1) || (fwrite(data, 1, datalen, fp) != datalen)) {
+			rc = CKR_FUNCTION_FAILED;
+		}
+		free(data);
+	}
+
+	if (fclose(fp) != 0) {
+		rc = CKR_FUNCTION_FAILED;
+	}
+
+	if (rc == CKR_OK) {
+#ifdef _WIN32
+		remove(path);
+#endif
+		if (rename(tmppath, path) != 0) {
+			rc = CKR_FUNCTION_FAILED;
+		}
+	}
+
+	if (rc != CKR_OK) {
+		remove(tmppath);
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Restore the public objects of the token from the object cache
+ *
+ * The cache is only used if it was written with the same change indicator. Objects that were
+ * stored before their deferred attributes were loaded get loadAttributes set again.
+ *
+ * @param token         The token to which the objects shall be added
+ * @param name          Unique name of the token, usually the serial number
+ * @param indicator     Data that changes when the objects on the token change
+ * @param indicatorlen  Length of indicator
+ * @param loadAttributes Function used to load deferred attributes
+ * @return              CKR_OK or any other Cryptoki error code if the cache can not be used
+ */
+int loadTokenObjectCache(struct p11Token_t *token, char *name, unsigned char *indicator, int indicatorlen, int (*loadAttributes)(struct p11Object_t *))
+{
+	char path[FILENAME_MAX];
+	unsigned char *buffer, *po;
+	unsigned long count, datalen;
+	struct p11Object_t *object;
+	struct stat st;
+	size_t len;
+	FILE *fp;
+	int rc;
+
+	VERIFY_MUTEXOWNER(&token->slot->mutex);
+
+	if (getObjectCachePath(name, path, sizeof(path))) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	fp = fopen(path, "rb");
+
+	if (fp == NULL) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	/* Only trust a cache file that no one else could have written */
+	if ((fstat(fileno(fp), &st) != 0) ||
+#ifndef _WIN32
+		(st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+#else
+		!isPrivateHandle((HANDLE)_get_osfhandle(fileno(fp))) ||
+#endif
+		(st.st_size < 12) || (st.st_size > OBJECT_CACHE_MAX_SIZE)) {
+		fclose(fp);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	len = (size_t)st.st_size;
+	buffer = (unsigned char *)malloc(len);
+
+	if (buffer == NULL) {
+		fclose(fp);
+		return CKR_HOST_MEMORY;
+	}
+
+	rc = fread(buffer, 1, len, fp) == len ? CKR_OK : CKR_FUNCTION_FAILED;
+	fclose(fp);
+
+	if ((rc != CKR_OK) ||
+		memcmp(buffer, OBJECT_CACHE_MAGIC, 4) ||
+		(buffer[4] != OBJECT_CACHE_VERSION) ||
+		(buffer[5] != sizeof(CK_ATTRIBUTE)) ||
+		((buffer[6] << 8 | buffer[7]) != indicatorlen) ||
+		(len - 12 < indicatorlen) ||
+		memcmp(buffer + 12, indicator, indicatorlen)) {
+		free(buffer);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	count = getUInt32(buffer + 8);
+	po = buffer + 12 + indicatorlen;
+	len -= 12 + indicatorlen;
+
+	while (count--) {
+		if (len < 13) {
+			rc = CKR_FUNCTION_FAILED;
+			break;
+		}
+
+		datalen = getUInt32(po + 9);
+
+		if (datalen > len - 13) {
+			rc = CKR_FUNCTION_FAILED;
+			break;
+		}
+
+		object = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+
+		if (object == NULL) {
+			rc = CKR_HOST_MEMORY;
+			break;
+		}
+
+		if (deserializeObject(object, po + 13, datalen) < 0) {
+			free(object);
+			rc = CKR_FUNCTION_FAILED;
+			break;
+		}
+
+		object->tokenid = (int)getUInt32(po);
+		object->keysize = (int)getUInt32(po + 4);
+		object->sensitiveObj = po[8] & OBJECT_CACHE_SENSITIVE ? TRUE : FALSE;
+		object->publicObj = TRUE;
+		object->tokenObj = TRUE;
+
+		if (po[8] & OBJECT_CACHE_DEFERRED) {
+			object->loadAttributes = loadAttributes;
+		}
+
+		rc = addTokenObject(token, object, TRUE);
+
+		if (rc != CKR_OK) {
+			removeAllAttributes(object);
+			free(object);
+			break;
+		}
+
+		po += 13 + datalen;
+		len -= 13 + datalen;
+	}
+
+	free(buffer);
+
+	if (rc != CKR_OK) {
+		removePublicObjects(token);
+	}
+
+	return rc;
+}
+
+
+
+/**
+ * Remove the cache file of a token
+ *
+ * @param name          Unique name of the token, usually the serial number
+ * @return              CKR_OK or CKR_FUNCTION_FAILED if the cache is not used
+ */
+int removeTokenObjectCache(char *name)
+{
+	char path[FILENAME_MAX];
+
+	if (getObjectCachePath(name, path, sizeof(path))) {
+		return CKR_FUNCTION_FAILED;
+	}
+
+	remove(path);
+	return CKR_OK;
+}
+
+
+
 /**
  * Log into token
  *
@@ -278,6 +835,44 @@ int logOut(struct p11Slot_t *slot)
 
 
 
+/**
+ * Obtain random bytes from the token's random number generator
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param buffer    The buffer receiving the random bytes
+ * @param len       The number of bytes required
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int getChallenge(struct p11Slot_t *slot, unsigned char *buffer, int len)
+{
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	return sc_hsm_getChallenge(slot, buffer, len);
+}
+
+
+
+/**
+ * Discard the cached public objects of the token and read them again
+ *
+ * This token method is called from the C_InvalidateObjectCache vendor function. Handles of
+ * public objects obtained before become invalid.
+ *
+ * @param slot      The slot in which the token is inserted
+ *
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int invalidateObjectCache(struct p11Slot_t *slot)
+{
+	VERIFY_MUTEXOWNER(&slot->mutex);
+
+	removePublicObjects(slot->token);
+	return sc_hsm_reloadPublicObjects(slot->token);
+}
+
+
+
 /**
  * Detect a newly inserted token in the designated slot
  *
@@ -303,9 +898,16 @@ void freeToken(struct p11Slot_t *slot)
 {
 	VERIFY_MUTEXOWNER(&slot->mutex);
 
+	releaseRandomPool(slot);
+
 	if (slot->token) {
+		sc_hsm_freeToken(slot->token);
 		removePrivateObjects(slot->token);
 		removePublicObjects(slot->token);
+		freeObjectIndex(&slot->token->privObjectIndex);
+		freeObjectIndex(&slot->token->pubObjectIndex);
+		freeAttributeIndex(&slot->token->privAttributeIndex);
+		freeAttributeIndex(&slot->token->pubAttributeIndex);
 		free(slot->token);
 		slot->token = NULL;
 	}
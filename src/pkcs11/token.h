@@ -45,11 +45,17 @@ int newToken(struct p11Slot_t *slot, struct p11Token_t **token);
 void freeToken(struct p11Slot_t *slot);
 int logIn(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
 int logOut(struct p11Slot_t *slot);
+int getChallenge(struct p11Slot_t *slot, unsigned char *buffer, int len);
+int invalidateObjectCache(struct p11Slot_t *slot);
 int addTokenObject(struct p11Token_t *token, struct p11Object_t *object, int publicObject);
 int findTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int removeTokenObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
 int removeTokenObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE handle, int publicObject);
 int destroyObject(struct p11Slot_t *slot, struct p11Object_t *object);
 int synchronizeToken(struct p11Slot_t *slot);
+int saveTokenObjectCache(struct p11Token_t *token, char *name, unsigned char *indicator, int indicatorlen);
+int loadTokenObjectCache(struct p11Token_t *token, char *name, unsigned char *indicator, int indicatorlen, int (*loadAttributes)(struct p11Object_t *));
+int removeTokenObjectCache(char *name);
+int isObjectCacheEnabled(void);
 
 #endif /* ___TOKEN_H_INC___ */
@@ -0,0 +1,207 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * @file random-test.c
+ * @brief Unit test for the random number pool
+ *
+ * The pool is tested without a token, GET CHALLENGE is replaced by a deterministic
+ * source. Build with -DRANDOM_USE_DRBG=0 to test the pool without host DRBG.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/random.h>
+
+
+
+static int challenges = 0;          /* Number of GET CHALLENGE commands */
+static unsigned long state = 1;     /* State of the fake token generator */
+static int testsCompleted = 0;
+static int testsFailed = 0;
+
+
+
+/*
+ * Replaces the token, returning a reproducible sequence
+ */
+int getChallenge(struct p11Slot_t *slot, unsigned char *buffer, int len)
+{
+	challenges++;
+	while (len--) {
+		state = (state * 1103515245 + 12345) & 0xFFFFFFFF;
+		*buffer++ = (unsigned char)(state >> 16);
+	}
+	return CKR_OK;
+}
+
+
+
+void debug(char *format, ...)
+{
+}
+
+
+
+static char *verdict(int condition)
+{
+	testsCompleted++;
+	if (!condition) {
+		testsFailed++;
+		return "Failed";
+	}
+	return "Passed";
+}
+
+
+
+static void initSlot(struct p11Slot_t *slot)
+{
+	memset(slot, 0, sizeof(*slot));
+	mutex_init(&slot->mutex);
+}
+
+
+
+static void freeSlot(struct p11Slot_t *slot)
+{
+	releaseRandomPool(slot);
+	mutex_destroy(&slot->mutex);
+}
+
+
+
+static int isZero(unsigned char *data, int len)
+{
+	while (len--) {
+		if (*data++) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+void testSmallRequests()
+{
+	struct p11Slot_t slot;
+	unsigned char a[16], b[16];
+	int i, rc, before, ok;
+
+	initSlot(&slot);
+
+	printf("Calling generateRandom() on empty pool ");
+	rc = generateRandom(&slot, a, sizeof(a));
+	printf("- %d : %s\n", rc, verdict((rc == CKR_OK) && (challenges > 0)));
+
+	before = challenges;
+	ok = 1;
+	for (i = 0; i < (RANDOM_POOL_SIZE - (int)sizeof(a)) / (int)sizeof(b); i++) {
+		rc = generateRandom(&slot, b, sizeof(b));
+		ok = ok && (rc == CKR_OK) && memcmp(a, b, sizeof(a)) && !isZero(b, sizeof(b));
+		memcpy(a, b, sizeof(a));
+	}
+	printf("Serving %d small requests from the pool ", i);
+	printf("- %d GET CHALLENGE : %s\n", challenges - before, verdict(ok && (challenges == before)));
+
+	freeSlot(&slot);
+}
+
+
+
+void testLargeRequest()
+{
+	struct p11Slot_t slot;
+	unsigned char data[2 * RANDOM_POOL_SIZE + 17];
+	int rc;
+
+	initSlot(&slot);
+
+	printf("Calling generateRandom() with more than RANDOM_POOL_SIZE bytes ");
+	memset(data, 0, sizeof(data));
+	rc = generateRandom(&slot, data, sizeof(data));
+	printf("- %d : %s\n", rc, verdict((rc == CKR_OK) &&
+			!isZero(data + RANDOM_POOL_SIZE, RANDOM_POOL_SIZE) &&
+			!isZero(data + 2 * RANDOM_POOL_SIZE, 17) &&
+			memcmp(data, data + RANDOM_POOL_SIZE, RANDOM_POOL_SIZE)));
+
+	freeSlot(&slot);
+}
+
+
+
+void testSeed()
+{
+	struct p11Slot_t seeded, unseeded;
+	unsigned char a[16], b[16];
+	int rc;
+
+	initSlot(&seeded);
+	initSlot(&unseeded);
+
+	/* Both pools receive the same token output and hold the same bytes */
+	state = 1;
+	generateRandom(&seeded, a, sizeof(a));
+	state = 1;
+	generateRandom(&unseeded, b, sizeof(b));
+
+	printf("Calling seedRandom() ");
+	rc = seedRandom(&seeded, (CK_BYTE_PTR)"Seed", 4);
+#if RANDOM_USE_DRBG
+	printf("- %d : %s\n", rc, verdict(rc == CKR_OK));
+
+	generateRandom(&seeded, a, sizeof(a));
+	generateRandom(&unseeded, b, sizeof(b));
+
+	printf("Buffered bytes discarded after seeding ");
+	printf("- %s\n", verdict(memcmp(a, b, sizeof(a))));
+#else
+	printf("- %d : %s\n", rc, verdict(rc == CKR_RANDOM_SEED_NOT_SUPPORTED));
+#endif
+
+	freeSlot(&seeded);
+	freeSlot(&unseeded);
+}
+
+
+
+int main(int argc, char **argv)
+{
+	printf("Random pool test with RANDOM_POOL_SIZE=%d and RANDOM_USE_DRBG=%d\n", RANDOM_POOL_SIZE, RANDOM_USE_DRBG);
+
+	testSmallRequests();
+	testLargeRequest();
+	testSeed();
+
+	printf("Unit test finished.\n");
+	printf("%d tests performed.\n", testsCompleted);
+	printf("%d tests failed.\n", testsFailed);
+
+	return testsFailed ? 1 : 0;
+}
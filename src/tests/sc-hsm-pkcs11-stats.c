@@ -0,0 +1,388 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file sc-hsm-pkcs11-stats.c
+ * @brief Poll and print the counters of the PKCS#11 module
+ *
+ * The tool loads the module, which then runs in the process of the tool. It shows the
+ * counters of the work done through this instance, e.g. while the tool signs with
+ * --sign. Applications that use the module in their own process call the same
+ * vendor functions to export the counters to their monitoring.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+
+#define LIB_HANDLE void*
+#define P11LIBNAME "libsc-hsm-pkcs11.so"
+
+#else /* _WIN32 */
+
+#include <windows.h>
+
+#define LIB_HANDLE HMODULE
+#define P11LIBNAME "sc-hsm-pkcs11.dll"
+
+#define sleep(s) Sleep((s) * 1000)
+
+#define dlopen(fn, flag) LoadLibrary(fn)
+#define dlclose(h) FreeLibrary(h)
+#define dlsym(h, n) GetProcAddress(h, n)
+
+char* dlerror()
+{
+	char* msg = "UNKNOWN";
+	FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, 0, GetLastError(), 0, (char*)&msg, 0, 0);
+	return msg;
+}
+
+#endif /* _WIN32 */
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
+
+#define MAX_SLOTS       16
+#define MAX_MECHANISMS  64
+
+struct id2name_t {
+	unsigned long       id;
+	char                *name;
+};
+
+static struct id2name_t p11CKMName[] = {
+		{ CKM_RSA_X_509                         , "CKM_RSA_X_509" },
+		{ CKM_RSA_PKCS                          , "CKM_RSA_PKCS" },
+		{ CKM_RSA_PKCS_PSS                      , "CKM_RSA_PKCS_PSS" },
+		{ CKM_SHA1_RSA_PKCS                     , "CKM_SHA1_RSA_PKCS" },
+		{ CKM_SHA224_RSA_PKCS                   , "CKM_SHA224_RSA_PKCS" },
+		{ CKM_SHA256_RSA_PKCS                   , "CKM_SHA256_RSA_PKCS" },
+		{ CKM_SHA384_RSA_PKCS                   , "CKM_SHA384_RSA_PKCS" },
+		{ CKM_SHA512_RSA_PKCS                   , "CKM_SHA512_RSA_PKCS" },
+		{ CKM_SHA1_RSA_PKCS_PSS                 , "CKM_SHA1_RSA_PKCS_PSS" },
+		{ CKM_SHA224_RSA_PKCS_PSS               , "CKM_SHA224_RSA_PKCS_PSS" },
+		{ CKM_SHA256_RSA_PKCS_PSS               , "CKM_SHA256_RSA_PKCS_PSS" },
+		{ CKM_SHA384_RSA_PKCS_PSS               , "CKM_SHA384_RSA_PKCS_PSS" },
+		{ CKM_SHA512_RSA_PKCS_PSS               , "CKM_SHA512_RSA_PKCS_PSS" },
+		{ CKM_ECDSA                             , "CKM_ECDSA" },
+		{ CKM_ECDSA_SHA1                        , "CKM_ECDSA_SHA1" },
+		{ CKM_ECDSA_SHA224                      , "CKM_ECDSA_SHA224" },
+		{ CKM_ECDSA_SHA256                      , "CKM_ECDSA_SHA256" },
+		{ CKM_ECDSA_SHA384                      , "CKM_ECDSA_SHA384" },
+		{ CKM_ECDSA_SHA512                      , "CKM_ECDSA_SHA512" },
+		{ CKM_SHA_1                             , "CKM_SHA_1" },
+		{ CKM_SHA224                            , "CKM_SHA224" },
+		{ CKM_SHA256                            , "CKM_SHA256" },
+		{ CKM_SHA384                            , "CKM_SHA384" },
+		{ CKM_SHA512                            , "CKM_SHA512" },
+		{ 0, NULL }
+};
+
+static char *p11libname = P11LIBNAME;
+static CK_UTF8CHAR_PTR pin = NULL;
+static int optInterval = 5;
+static int optCount = 0;
+static int optSign = 0;
+
+static CK_FUNCTION_LIST_PTR p11;
+static CK_SC_HSM_FUNCTION_LIST_PTR vendor;
+
+static CK_SC_HSM_SLOT_STATISTICS lastSlot[MAX_SLOTS];
+static CK_SC_HSM_MECHANISM_STATISTICS lastMech[MAX_MECHANISMS];
+
+
+
+static char *mechName(CK_MECHANISM_TYPE mech)
+{
+	static char scr[20];
+	struct id2name_t *p;
+
+	for (p = p11CKMName; p->name; p++) {
+		if (p->id == mech) {
+			return p->name;
+		}
+	}
+	sprintf(scr, "0x%08lX", mech);
+	return scr;
+}
+
+
+
+/**
+ * Sign with the first private key of the slot to create some load
+ */
+static void signLoad(CK_SLOT_ID slotID, int count)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) }
+	};
+	CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, 0, 0 };
+	CK_KEY_TYPE keyType;
+	CK_ATTRIBUTE keyTypeAttr = { CKA_KEY_TYPE, &keyType, sizeof(keyType) };
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE hnd;
+	CK_ULONG cnt, len;
+	CK_BYTE signature[512];
+	CK_RV rc;
+	int i;
+
+	if (p11->C_OpenSession(slotID, CKF_SERIAL_SESSION, NULL, NULL, &session) != CKR_OK) {
+		return;
+	}
+
+	rc = p11->C_Login(session, CKU_USER, pin, strlen((char *)pin));
+
+	if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+		printf("C_Login on slot %lu failed with 0x%08lX\n", slotID, rc);
+		p11->C_CloseSession(session);
+		return;
+	}
+
+	p11->C_FindObjectsInit(session, template, 1);
+	rc = p11->C_FindObjects(session, &hnd, 1, &cnt);
+	p11->C_FindObjectsFinal(session);
+
+	if ((rc == CKR_OK) && (cnt == 1)) {
+		if ((p11->C_GetAttributeValue(session, hnd, &keyTypeAttr, 1) == CKR_OK) && (keyType == CKK_EC)) {
+			mech.mechanism = CKM_ECDSA_SHA256;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (p11->C_SignInit(session, &mech, hnd) != CKR_OK) {
+				break;
+			}
+			len = sizeof(signature);
+			if (p11->C_Sign(session, (CK_BYTE_PTR)"Hello World", 11, signature, &len) != CKR_OK) {
+				break;
+			}
+		}
+	}
+
+	p11->C_CloseSession(session);
+}
+
+
+
+/**
+ * Print the counters of all slots and mechanisms and the change since the last call
+ */
+static void printStatistics(void)
+{
+	CK_SLOT_ID slotlist[MAX_SLOTS];
+	CK_SC_HSM_SLOT_STATISTICS s, *l;
+	CK_SC_HSM_MECHANISM_STATISTICS mechs[MAX_MECHANISMS], *m, *lm;
+	CK_ULONG slots, cnt, i, avg;
+	CK_RV rc;
+
+	slots = MAX_SLOTS;
+	rc = p11->C_GetSlotList(FALSE, slotlist, &slots);
+
+	if (rc != CKR_OK) {
+		printf("C_GetSlotList failed with 0x%08lX\n", rc);
+		return;
+	}
+
+	printf("%-6s %5s %5s %9s %7s %7s %8s %10s %10s %9s %9s %9s\n",
+			"Slot", "Sess", "Objs", "Ops", "Errors", "Reject", "APDUs", "Sent", "Received",
+			"Lock ms", "Queue ms", "Card ms");
+
+	for (i = 0; i < slots; i++) {
+		rc = vendor->C_GetSlotStatistics(slotlist[i], &s);
+
+		if (rc != CKR_OK) {
+			continue;
+		}
+
+		l = &lastSlot[slotlist[i] % MAX_SLOTS];
+		if (l->slotID != s.slotID) {
+			memset(l, 0, sizeof(*l));
+		}
+
+		printf("%-6lu %5lu %5lu %9llu %7llu %7llu %8llu %10llu %10llu %9llu %9llu %9llu\n",
+				s.slotID, s.ulSessionCount, s.ulObjectCount,
+				s.operations - l->operations,
+				s.errors - l->errors,
+				s.rejected - l->rejected,
+				s.apdus - l->apdus,
+				s.bytesSent - l->bytesSent,
+				s.bytesReceived - l->bytesReceived,
+				(s.lockWaitTime - l->lockWaitTime) / 1000,
+				(s.cardWaitTime - l->cardWaitTime) / 1000,
+				(s.cardTime - l->cardTime) / 1000);
+
+		*l = s;
+	}
+
+	cnt = MAX_MECHANISMS;
+	rc = vendor->C_GetMechanismStatistics(mechs, &cnt);
+
+	if (rc != CKR_OK) {
+		printf("C_GetMechanismStatistics failed with 0x%08lX\n", rc);
+		return;
+	}
+
+	printf("%-26s %9s %7s %9s\n", "Mechanism", "Ops", "Errors", "Avg us");
+
+	for (i = 0; i < cnt; i++) {
+		m = &mechs[i];
+		lm = &lastMech[i];
+
+		if (m->operations != lm->operations) {
+			avg = (CK_ULONG)((m->time - lm->time) / (m->operations - lm->operations));
+			printf("%-26s %9llu %7llu %9lu\n", mechName(m->mechanism),
+					m->operations - lm->operations,
+					m->errors - lm->errors,
+					avg);
+		}
+		*lm = *m;
+	}
+	printf("\n");
+}
+
+
+
+static void usage()
+{
+	printf("sc-hsm-pkcs11-stats [--module <p11-file>] [--interval <s>] [--count <n>] [--pin <user-pin> --sign <n>]\n");
+	printf("  --interval    Seconds between two polls (default 5)\n");
+	printf("  --count       Number of polls, 0 to poll until interrupted (default 0)\n");
+	printf("  --sign        Number of signatures per slot to create load before each poll, replaces the interval\n");
+	exit(1);
+}
+
+
+
+static void decodeArgs(int argc, char **argv)
+{
+	argv++;
+	argc--;
+
+	for ( ; argc--; argv++) {
+		if (!strcmp(*argv, "--module")) {
+			if (argc-- == 0)
+				usage();
+			p11libname = *++argv;
+		} else if (!strcmp(*argv, "--pin")) {
+			if (argc-- == 0)
+				usage();
+			pin = (CK_UTF8CHAR_PTR)*++argv;
+		} else if (!strcmp(*argv, "--interval")) {
+			if (argc-- == 0)
+				usage();
+			optInterval = atoi(*++argv);
+		} else if (!strcmp(*argv, "--count")) {
+			if (argc-- == 0)
+				usage();
+			optCount = atoi(*++argv);
+		} else if (!strcmp(*argv, "--sign")) {
+			if (argc-- == 0)
+				usage();
+			optSign = atoi(*++argv);
+		} else {
+			printf("Unknown argument %s\n", *argv);
+			usage();
+		}
+	}
+
+	if ((optInterval < 1) || ((optSign > 0) && (pin == NULL))) {
+		usage();
+	}
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	CK_RV (*C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR);
+	CK_RV (*C_GetVendorFunctionList)(CK_SC_HSM_FUNCTION_LIST_PTR_PTR);
+	CK_C_INITIALIZE_ARGS initArgs;
+	CK_SLOT_ID slotlist[MAX_SLOTS];
+	CK_ULONG slots, i;
+	LIB_HANDLE dlhandle;
+	CK_RV rc;
+	int polls;
+
+	decodeArgs(argc, argv);
+
+	dlhandle = dlopen(p11libname, RTLD_NOW);
+
+	if (!dlhandle) {
+		printf("dlopen failed with %s\n", dlerror());
+		exit(1);
+	}
+
+	C_GetFunctionList = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetFunctionList");
+	C_GetVendorFunctionList = (CK_RV (*)(CK_SC_HSM_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetVendorFunctionList");
+
+	if (!C_GetFunctionList || !C_GetVendorFunctionList) {
+		printf("%s is not a SmartCard-HSM PKCS#11 module\n", p11libname);
+		exit(1);
+	}
+
+	(*C_GetFunctionList)(&p11);
+
+	if (((*C_GetVendorFunctionList)(&vendor) != CKR_OK) ||
+		(vendor->version.major != 1) || (vendor->version.minor < 2)) {
+		printf("Module does not support statistics\n");
+		exit(1);
+	}
+
+	memset(&initArgs, 0, sizeof(initArgs));
+	initArgs.flags = CKF_OS_LOCKING_OK;
+
+	rc = p11->C_Initialize(&initArgs);
+
+	if (rc != CKR_OK) {
+		printf("C_Initialize failed with 0x%08lX\n", rc);
+		exit(1);
+	}
+
+	for (polls = 0; (optCount == 0) || (polls < optCount); polls++) {
+		if (optSign > 0) {
+			slots = MAX_SLOTS;
+			if (p11->C_GetSlotList(TRUE, slotlist, &slots) == CKR_OK) {
+				for (i = 0; i < slots; i++) {
+					signLoad(slotlist[i], optSign);
+				}
+			}
+		} else {
+			sleep(optInterval);
+		}
+		printStatistics();
+	}
+
+	p11->C_Finalize(NULL);
+	dlclose(dlhandle);
+
+	return 0;
+}
@@ -47,6 +47,14 @@
 /* Default PIN unless --pin is defined */
 #define PIN "123456"
 
+/* Must match the settings in pkcs11/random.h of the module under test */
+#ifndef RANDOM_POOL_SIZE
+#define RANDOM_POOL_SIZE 1024
+#endif
+#ifndef RANDOM_USE_DRBG
+#define RANDOM_USE_DRBG 1
+#endif
+
 
 #ifndef _WIN32
 #include <dlfcn.h>
@@ -116,6 +124,7 @@ char* dlerror()
 
 
 #include <pkcs11/cryptoki.h>
+#include <pkcs11/sc-hsm-pkcs11.h>
 
 struct id2name_t {
 	unsigned long       id;
@@ -670,6 +679,20 @@ int testSigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, CK_KEY_TYPE keytype
 		bin2str(scr, sizeof(scr), signature, len);
 		printf("[%2d] Signature:\n%s\n", threadno, scr);
 #endif
+		if (rc == CKR_OK) {
+			printf("[%2d] Calling C_VerifyInit(Session %ld, Slot=%ld)\n", threadno, session, slotid);
+			rc = p11->C_VerifyInit(session, &mech, hnd);
+			printf("[%2d] - %s : %s\n", threadno, CKR_Name(rc), verdict(rc == CKR_OK));
+			if (rc || requestClose)
+				break;
+
+			printf("[%2d] Calling C_Verify(Session %ld, Slot=%ld)\n", threadno, session, slotid);
+			rc = p11->C_Verify(session, text, textlen, signature, len);
+			printf("[%2d] - %s : %s\n", threadno, CKR_Name(rc), verdict(rc == CKR_OK));
+			if (rc || requestClose)
+				break;
+		}
+
 		printf("[%2d] Calling C_SignInit(Session %ld, Slot=%ld - Multipart)\n", threadno, session, slotid);
 		rc = p11->C_SignInit(session, &mech, hnd);
 		printf("[%2d] - %s : %s\n", threadno, CKR_Name(rc), verdict(rc == CKR_OK));
@@ -708,6 +731,20 @@ int testSigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, CK_KEY_TYPE keytype
 		bin2str(scr, sizeof(scr), signature, len);
 		printf("[%2d] Signature:\n%s\n", threadno, scr);
 #endif
+		if (rc == CKR_OK) {
+			printf("[%2d] Calling C_VerifyInit(Session %ld, Slot=%ld)\n", threadno, session, slotid);
+			rc = p11->C_VerifyInit(session, &mech, hnd);
+			printf("[%2d] - %s : %s\n", threadno, CKR_Name(rc), verdict(rc == CKR_OK));
+			if (rc || requestClose)
+				break;
+
+			printf("[%2d] Calling C_Verify(Session %ld, Slot=%ld)\n", threadno, session, slotid);
+			rc = p11->C_Verify(session, text, textlen, signature, len);
+			printf("[%2d] - %s : %s\n", threadno, CKR_Name(rc), verdict(rc == CKR_OK));
+			if (rc || requestClose)
+				break;
+		}
+
 	}
 
 	printf("[%2d] Calling C_CloseSession(Session %ld, Slot=%ld)\n", threadno, session, slotid);
@@ -923,6 +960,341 @@ void testRSADecryption(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 
 
 
+void testEncryption(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS privKey = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keytype = CKK_RSA;
+	CK_ATTRIBUTE _template[] = {
+			{ CKA_CLASS, &privKey, sizeof(privKey) },
+			{ CKA_KEY_TYPE, &keytype, sizeof(keytype) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, 0, 0 };
+	CK_BYTE_PTR text = (CK_BYTE_PTR)"Hello World";
+	CK_BYTE cryptogram[512], plain[512];
+	CK_ULONG len, plainlen;
+	int rc;
+
+	rc = findObjectAtOffset(p11, session, (CK_ATTRIBUTE_PTR)&_template, sizeof(_template) / sizeof(CK_ATTRIBUTE), 0, &hnd, 0);
+
+	if (rc != CKR_OK) {
+		printf("No RSA key found\n");
+		return;
+	}
+
+	printf("Calling C_EncryptInit() ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_Encrypt() ");
+	len = 0;
+	rc = p11->C_Encrypt(session, text, 11, NULL, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (len > 0) && (len <= sizeof(cryptogram))));
+
+	printf("Calling C_Encrypt() ");
+	len = sizeof(cryptogram);
+	rc = p11->C_Encrypt(session, text, 11, cryptogram, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_Encrypt() after operation completed ");
+	rc = p11->C_Encrypt(session, text, 11, cryptogram, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OPERATION_NOT_INITIALIZED));
+
+	printf("Calling C_DecryptInit() ");
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_Decrypt() ");
+	plainlen = sizeof(plain);
+	rc = p11->C_Decrypt(session, cryptogram, len, plain, &plainlen);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (plainlen == 11) && !memcmp(plain, text, 11)));
+
+	printf("Calling C_EncryptInit() again ");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_Encrypt() ");
+	len = sizeof(cryptogram);
+	rc = p11->C_Encrypt(session, text, 11, cryptogram, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+}
+
+
+
+void testDigest(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_MECHANISM mech = { CKM_SHA256, 0, 0 };
+	CK_BYTE_PTR text = (CK_BYTE_PTR)"abc";
+	CK_BYTE expected[] = { 0xBA, 0x78, 0x16, 0xBF, 0x8F, 0x01, 0xCF, 0xEA, 0x41, 0x41, 0x40, 0xDE, 0x5D, 0xAE, 0x22, 0x23,
+						   0xB0, 0x03, 0x61, 0xA3, 0x96, 0x17, 0x7A, 0x9C, 0xB4, 0x10, 0xFF, 0x61, 0xF2, 0x00, 0x15, 0xAD };
+	CK_BYTE digest[64];
+	CK_ULONG len;
+	int rc;
+
+	printf("Calling C_DigestInit() ");
+	rc = p11->C_DigestInit(session, &mech);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_Digest() ");
+	len = 0;
+	rc = p11->C_Digest(session, text, 3, NULL, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (len == sizeof(expected))));
+
+	printf("Calling C_Digest() ");
+	len = sizeof(digest);
+	rc = p11->C_Digest(session, text, 3, digest, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (len == sizeof(expected)) && !memcmp(digest, expected, len)));
+
+	printf("Calling C_DigestInit() ");
+	rc = p11->C_DigestInit(session, &mech);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_DigestUpdate() ");
+	rc = p11->C_DigestUpdate(session, text, 1);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_DigestUpdate() ");
+	rc = p11->C_DigestUpdate(session, text + 1, 2);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_DigestFinal() ");
+	len = sizeof(digest);
+	rc = p11->C_DigestFinal(session, digest, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (len == sizeof(expected)) && !memcmp(digest, expected, len)));
+
+	printf("Calling C_DigestFinal() without C_DigestInit() ");
+	len = sizeof(digest);
+	rc = p11->C_DigestFinal(session, digest, &len);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OPERATION_NOT_INITIALIZED));
+}
+
+
+
+void testRandom(CK_FUNCTION_LIST_PTR p11, CK_SC_HSM_FUNCTION_LIST_PTR vendor, CK_SLOT_ID slotid, CK_SESSION_HANDLE session)
+{
+	CK_SC_HSM_SLOT_STATISTICS before, after;
+	CK_BYTE a[16], b[16], large[2 * RANDOM_POOL_SIZE + 17];
+	int rc, stats;
+
+	printf("Calling C_GenerateRandom() ");
+	rc = p11->C_GenerateRandom(session, a, sizeof(a));
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	stats = vendor && ((vendor->version.major > 1) || (vendor->version.minor >= 2)) &&
+			(vendor->C_GetSlotStatistics(slotid, &before) == CKR_OK);
+
+	printf("Calling C_GenerateRandom() served from pool ");
+	rc = p11->C_GenerateRandom(session, b, sizeof(b));
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && memcmp(a, b, sizeof(a))));
+
+	if (stats) {
+		vendor->C_GetSlotStatistics(slotid, &after);
+		printf("%llu APDUs for C_GenerateRandom() served from pool - %s\n",
+				after.apdus - before.apdus, verdict(after.apdus == before.apdus));
+	}
+
+	printf("Calling C_GenerateRandom() with more than RANDOM_POOL_SIZE bytes ");
+	memset(large, 0, sizeof(large));
+	rc = p11->C_GenerateRandom(session, large, sizeof(large));
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) &&
+			memcmp(large, large + RANDOM_POOL_SIZE, RANDOM_POOL_SIZE) &&
+			memcmp(large + RANDOM_POOL_SIZE, large + 2 * RANDOM_POOL_SIZE, 17)));
+
+	printf("Calling C_SeedRandom() ");
+	rc = p11->C_SeedRandom(session, (CK_BYTE_PTR)"Seed", 4);
+#if RANDOM_USE_DRBG
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+#else
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_RANDOM_SEED_NOT_SUPPORTED));
+#endif
+
+	printf("Calling C_GenerateRandom() after C_SeedRandom() ");
+	rc = p11->C_GenerateRandom(session, a, sizeof(a));
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && memcmp(a, b, sizeof(a))));
+}
+
+
+
+void testSignBatch(CK_FUNCTION_LIST_PTR p11, CK_SC_HSM_FUNCTION_LIST_PTR vendor, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS _class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keytype = CKK_ECDSA;
+	CK_ATTRIBUTE _template[] = {
+			{ CKA_CLASS, &_class, sizeof(_class) },
+			{ CKA_KEY_TYPE, &keytype, sizeof(keytype) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_MECHANISM mech = { CKM_ECDSA_SHA256, 0, 0 };
+	CK_SIGN_BATCH_ITEM items[4];
+	CK_BYTE signatures[3][132];
+	char *texts[] = { "Hello World", "Hello Batch", "" };
+	int rc, i, ok;
+
+	rc = findObjectAtOffset(p11, session, (CK_ATTRIBUTE_PTR)&_template, sizeof(_template) / sizeof(CK_ATTRIBUTE), 0, &hnd, 0);
+
+	if (rc != CKR_OK) {
+		printf("No ECDSA key found for batch signing\n");
+		return;
+	}
+
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < 3; i++) {
+		items[i].pData = (CK_BYTE_PTR)texts[i];
+		items[i].ulDataLen = strlen(texts[i]);
+		items[i].pSignature = signatures[i];
+		items[i].ulSignatureLen = sizeof(signatures[i]);
+	}
+
+	// The last item has a buffer too small for the signature
+	items[3].pData = (CK_BYTE_PTR)texts[0];
+	items[3].ulDataLen = strlen(texts[0]);
+	items[3].pSignature = signatures[0];
+	items[3].ulSignatureLen = 1;
+
+	printf("Calling C_SignBatch() ");
+	rc = vendor->C_SignBatch(session, &mech, hnd, items, 4);
+	ok = (rc == CKR_BUFFER_TOO_SMALL) && (items[3].rv == CKR_BUFFER_TOO_SMALL);
+	for (i = 0; i < 3; i++) {
+		ok = ok && (items[i].rv == CKR_OK);
+	}
+	printf("- %s : %s\n", CKR_Name(rc), verdict(ok));
+
+	for (i = 0; (i < 3) && (items[i].rv == CKR_OK); i++) {
+		printf("Calling C_VerifyInit() ");
+		rc = p11->C_VerifyInit(session, &mech, hnd);
+		printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+		printf("Calling C_Verify() for batch item %d ", i);
+		rc = p11->C_Verify(session, items[i].pData, items[i].ulDataLen, items[i].pSignature, items[i].ulSignatureLen);
+		printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+	}
+}
+
+
+
+void testSessionPriority(CK_FUNCTION_LIST_PTR p11, CK_SC_HSM_FUNCTION_LIST_PTR vendor, CK_SESSION_HANDLE session)
+{
+	int rc;
+
+	if ((vendor->version.major == 1) && (vendor->version.minor < 1)) {
+		printf("C_SetSessionPriority not supported by module\n");
+		return;
+	}
+
+	printf("Calling C_SetSessionPriority with invalid priority ");
+	rc = vendor->C_SetSessionPriority(session, 42);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_ARGUMENTS_BAD));
+
+	printf("Calling C_SetSessionPriority(SC_HSM_PRIORITY_HIGH) ");
+	rc = vendor->C_SetSessionPriority(session, SC_HSM_PRIORITY_HIGH);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	testSignBatch(p11, vendor, session);
+
+	printf("Calling C_SetSessionPriority(SC_HSM_PRIORITY_NORMAL) ");
+	rc = vendor->C_SetSessionPriority(session, SC_HSM_PRIORITY_NORMAL);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+}
+
+
+
+void testStatistics(CK_FUNCTION_LIST_PTR p11, CK_SC_HSM_FUNCTION_LIST_PTR vendor, CK_SLOT_ID slotid)
+{
+	CK_SC_HSM_SLOT_STATISTICS stats;
+	CK_SC_HSM_MECHANISM_STATISTICS mechs[64];
+	CK_ULONG cnt, i;
+	CK_SC_HSM_COUNTER ops;
+	int rc;
+
+	if ((vendor->version.major == 1) && (vendor->version.minor < 2)) {
+		printf("C_GetSlotStatistics not supported by module\n");
+		return;
+	}
+
+	printf("Calling C_GetSlotStatistics ");
+	rc = vendor->C_GetSlotStatistics(slotid, &stats);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+	printf("Slot %lu: %lu sessions, %llu operations, %llu APDUs, %llu ms on card - %s\n",
+			stats.slotID, stats.ulSessionCount, stats.operations, stats.apdus, stats.cardTime / 1000,
+			verdict((stats.slotID == slotid) && (stats.operations > 0) && (stats.apdus > 0)));
+
+	printf("Calling C_GetMechanismStatistics with NULL ");
+	rc = vendor->C_GetMechanismStatistics(NULL, &cnt);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	printf("Calling C_GetMechanismStatistics with small buffer ");
+	i = 1;
+	rc = vendor->C_GetMechanismStatistics(mechs, &i);
+	printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_BUFFER_TOO_SMALL) && (i == cnt)));
+
+	printf("Calling C_GetMechanismStatistics ");
+	cnt = sizeof(mechs) / sizeof(*mechs);
+	rc = vendor->C_GetMechanismStatistics(mechs, &cnt);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	ops = 0;
+	for (i = 0; i < cnt; i++) {
+		ops += mechs[i].operations;
+	}
+	printf("%llu operations over all mechanisms - %s\n", ops, verdict(ops >= stats.operations));
+
+	printf("Calling C_GetSlotStatistics with invalid slot ");
+	rc = vendor->C_GetSlotStatistics(0xFFFFFFFF, &stats);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_SLOT_ID_INVALID));
+}
+
+
+
+int countObjects(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_HANDLE hnd[16];
+	CK_ULONG cnt;
+	int total = 0;
+
+	if (p11->C_FindObjectsInit(session, NULL, 0) != CKR_OK) {
+		return -1;
+	}
+
+	do {
+		cnt = 0;
+		if (p11->C_FindObjects(session, hnd, sizeof(hnd) / sizeof(*hnd), &cnt) != CKR_OK) {
+			total = -1;
+			break;
+		}
+		total += (int)cnt;
+	} while (cnt > 0);
+
+	p11->C_FindObjectsFinal(session);
+	return total;
+}
+
+
+
+void testInvalidateObjectCache(CK_FUNCTION_LIST_PTR p11, CK_SC_HSM_FUNCTION_LIST_PTR vendor, CK_SLOT_ID slotid, CK_SESSION_HANDLE session)
+{
+	int rc, before, after;
+
+	if ((vendor->version.major == 1) && (vendor->version.minor < 3)) {
+		printf("C_InvalidateObjectCache not supported by module\n");
+		return;
+	}
+
+	before = countObjects(p11, session);
+
+	printf("Calling C_InvalidateObjectCache ");
+	rc = vendor->C_InvalidateObjectCache(slotid);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+
+	after = countObjects(p11, session);
+	printf("%d objects before and %d after reading them again - %s\n", before, after, verdict((before > 0) && (before == after)));
+
+	printf("Calling C_InvalidateObjectCache with invalid slot ");
+	rc = vendor->C_InvalidateObjectCache(0xFFFFFFFF);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_SLOT_ID_INVALID));
+}
+
+
+
 void testSessions(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
 {
 	int rc;
@@ -1177,14 +1549,23 @@ void testInsertRemove(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
 	CK_RV rc;
 	CK_SLOT_INFO slotinfo;
 	CK_TOKEN_INFO tokeninfo;
+	CK_SLOT_ID eventslot;
 	char *inp = NULL;
 	size_t inplen;
 	int loop;
 
+	printf("Calling C_WaitForSlotEvent (CKF_DONT_BLOCK) ");
+	rc = p11->C_WaitForSlotEvent(CKF_DONT_BLOCK, &eventslot, NULL);
+	printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_NO_EVENT));
+
 	for (loop = 0; loop < 2; loop++) {
 		printf("Please remove card from slot %lu and press <ENTER>\n", slotid);
 		getchar();
 
+		printf("Calling C_WaitForSlotEvent (CKF_DONT_BLOCK) ");
+		rc = p11->C_WaitForSlotEvent(CKF_DONT_BLOCK, &eventslot, NULL);
+		printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (eventslot == slotid)));
+
 		printf("Calling C_GetSlotInfo for slot %lu ", slotid);
 		rc = p11->C_GetSlotInfo(slotid, &slotinfo);
 		printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
@@ -1197,8 +1578,11 @@ void testInsertRemove(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
 		rc = p11->C_GetTokenInfo(slotid, &tokeninfo);
 		printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_TOKEN_NOT_PRESENT));
 
-		printf("Please insert card in slot %lu and press <ENTER>\n", slotid);
-		getchar();
+		printf("Please insert card in slot %lu\n", slotid);
+
+		printf("Calling C_WaitForSlotEvent ");
+		rc = p11->C_WaitForSlotEvent(0, &eventslot, NULL);
+		printf("- %s : %s\n", CKR_Name(rc), verdict((rc == CKR_OK) && (eventslot == slotid)));
 
 		printf("Calling C_GetSlotInfo for slot %lu ", slotid);
 		rc = p11->C_GetSlotInfo(slotid, &slotinfo);
@@ -1304,6 +1688,8 @@ int main(int argc, char *argv[])
 	CK_FUNCTION_LIST_PTR p11;
 	LIB_HANDLE dlhandle;
 	CK_RV (*C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR);
+	CK_RV (*C_GetVendorFunctionList)(CK_SC_HSM_FUNCTION_LIST_PTR_PTR);
+	CK_SC_HSM_FUNCTION_LIST_PTR vendor = NULL;
 	CK_C_INITIALIZE_ARGS initArgs;
 
 	unsigned RSASignCount = 0;
@@ -1336,6 +1722,14 @@ int main(int argc, char *argv[])
 
 	(*C_GetFunctionList)(&p11);
 
+	C_GetVendorFunctionList = (CK_RV (*)(CK_SC_HSM_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetVendorFunctionList");
+
+	if (C_GetVendorFunctionList) {
+		printf("Calling C_GetVendorFunctionList ");
+		rc = (*C_GetVendorFunctionList)(&vendor);
+		printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
+	}
+
 	memset(&initArgs, 0, sizeof(initArgs));
 	initArgs.flags = CKF_OS_LOCKING_OK;
 
@@ -1429,6 +1823,10 @@ int main(int argc, char *argv[])
 
 			testLogin(p11, session);
 
+			testDigest(p11, session);
+
+			testRandom(p11, vendor, slotid, session);
+
 			// List all objects
 			memset(attr, 0, sizeof(attr));
 			listObjects(p11, session, attr, 0);
@@ -1439,8 +1837,17 @@ int main(int argc, char *argv[])
 			if (optTestRSADecryption)
 				testRSADecryption(p11, session);
 
+			testEncryption(p11, session);
+
 			testSigning(p11, slotid, CKK_ECDSA, 0);
 
+			if (vendor) {
+				testSignBatch(p11, vendor, session);
+				testSessionPriority(p11, vendor, session);
+				testStatistics(p11, vendor, slotid);
+				testInvalidateObjectCache(p11, vendor, slotid, session);
+			}
+
 			printf("Calling C_CloseSession\n");
 			rc = p11->C_CloseSession(session);
 			printf("- %s : %s\n", CKR_Name(rc), verdict(rc == CKR_OK));
@@ -12,20 +12,55 @@
  * @author Keith Morgan
  */
 
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ultralite/log.h>
 
 /* WARNING: These functions are NOT thread-safe. */
 
+/*
+ * Info records are collected in log_buffer and written with a single call
+ * when the buffer is full or the oldest record is LOG_FLUSH_INTERVAL old.
+ * Errors and warnings are written immediately, together with all records
+ * before them. The application calls log_flush() before it blocks, as the
+ * age is only checked when a record is added, and log_init() to write the
+ * buffer at exit and on termination signals. Records for stdout and stderr are never mixed in the buffer,
+ * so the order is kept if both streams are redirected to the same file.
+ */
+#define LOG_BUFFER_SIZE    8192 /* Bytes buffered before writing */
+#define LOG_RECORD_SIZE    1024 /* Maximum length of a single record */
+#define LOG_FLUSH_INTERVAL 1000 /* Maximum age of a buffered record in ms */
+
 #define ERR_TIMESTAMP "0000-00-00T00:00:00.000000000+00:00"
 static char timestamp[64];
+static char strf[20]; /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
+static long long strf_seconds = -1; /* Seconds strf and gmtoff were computed for */
+static long long now_ms; /* Time of the last timestamp in ms */
+
+static char log_buffer[LOG_BUFFER_SIZE];
+static int log_length;
+static FILE* log_stream; /* Stream the buffered records are written to */
+static int log_fd; /* Descriptor of log_stream, for use in a signal handler */
+static long long log_first_ms; /* Time of the oldest buffered record */
+
+int log_level = LOG_LEVEL_INF;
 
 #ifdef _WIN32
 #include <stdlib.h>
 #include <time.h>
 #include <windows.h>
+#include <io.h>
 #define getpid GetCurrentThreadId
+#define write _write
+#define fileno _fileno
+#define snprintf _snprintf
+#define vsnprintf _vsnprintf
 long long unix_base;
+static long gmtoff;
 static void init_unix_base()
 {
 	SYSTEMTIME st;
@@ -41,26 +76,30 @@ const char* GetTimestamp()
 	long long nowft;
 	struct tm lt;
 	time_t t64;
-	int seconds, nanos;
-	long gmtoff;
-	char strf[20]; /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
+	long long seconds;
+	int nanos;
 	GetSystemTimeAsFileTime((FILETIME*)&nowft);
 	if (unix_base == 0)
 		init_unix_base();
-	seconds = (int)((nowft - unix_base) / 10000000);
+	seconds = (nowft - unix_base) / 10000000;
 	nanos = (int)(nowft % 10000000 * 100);
-	t64 = seconds;
-	err = _localtime64_s(&lt, &t64);
-	if (err)
-		return ERR_TIMESTAMP;
-	err = _get_timezone(&gmtoff);
-	if (err)
-		return ERR_TIMESTAMP;
-	if (lt.tm_isdst)
-		gmtoff -= 3600;
-	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
-	if (n == 0)
-		return ERR_TIMESTAMP;
+	now_ms = seconds * 1000 + nanos / 1000000;
+	if (seconds != strf_seconds) { /* Only convert to local time once per second */
+		strf_seconds = -1;
+		t64 = (time_t)seconds;
+		err = _localtime64_s(&lt, &t64);
+		if (err)
+			return ERR_TIMESTAMP;
+		err = _get_timezone(&gmtoff);
+		if (err)
+			return ERR_TIMESTAMP;
+		if (lt.tm_isdst)
+			gmtoff -= 3600;
+		n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
+		if (n == 0)
+			return ERR_TIMESTAMP;
+		strf_seconds = seconds;
+	}
 	n = _snprintf(timestamp, sizeof(timestamp), "%s.%09d%+03d:%02d", strf, nanos, -gmtoff / 3600, abs(gmtoff) % 3600 / 60);
 	if (n < 0 || n >= sizeof(timestamp))
 		return ERR_TIMESTAMP;
@@ -69,23 +108,28 @@ const char* GetTimestamp()
 #elif defined __linux__
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+static int gmtoff;
 const char* GetTimestamp()
 {
-	time_t now;
 	struct timeval tv;
-	int n, err, gmtoff;
+	int n, err;
 	struct tm lt;
-	char strf[20]; /* 20 => length of yyyy-mm-ddThh:mm:ss + null term */
 	err = gettimeofday(&tv, 0);
 	if (err)
 		return ERR_TIMESTAMP;
-	localtime_r(&tv.tv_sec, &lt);
-	gmtoff = lt.tm_gmtoff;
-	if (lt.tm_isdst)
-		gmtoff -= 3600;
-	n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
-	if (n == 0)
-		return ERR_TIMESTAMP;
+	now_ms = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	if (tv.tv_sec != strf_seconds) { /* Only convert to local time once per second */
+		strf_seconds = -1;
+		localtime_r(&tv.tv_sec, &lt);
+		gmtoff = lt.tm_gmtoff;
+		if (lt.tm_isdst)
+			gmtoff -= 3600;
+		n = strftime(strf, sizeof(strf), "%Y-%m-%dT%H:%M:%S", &lt);
+		if (n == 0)
+			return ERR_TIMESTAMP;
+		strf_seconds = tv.tv_sec;
+	}
 	n = snprintf(timestamp, sizeof(timestamp), "%s.%06d%+03d:%02d", strf, (int)tv.tv_usec, gmtoff / 3600, gmtoff % 3600 / 60);
 	if (n < 0 || n >= sizeof(timestamp))
 		return ERR_TIMESTAMP;
@@ -103,12 +147,81 @@ int GetPid()
 	return pid;
 }
 
+void log_flush(void)
+{
+	int len = log_length;
+
+	if (len > 0) {
+		log_length = 0; /* Before writing, so a signal handler does not write the records again */
+		fwrite(log_buffer, 1, len, log_stream);
+		fflush(log_stream);
+	}
+}
+
+/**
+ * Write the buffered records if the process is terminated by a signal and
+ * then terminate with the default action. Only write() is used, as stdio
+ * is not async-signal-safe.
+ */
+static void log_signal(int sig)
+{
+	if (log_length > 0)
+		(void)write(log_fd, log_buffer, log_length);
+	log_length = 0;
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void log_init(void)
+{
+	atexit(log_flush);
+	signal(SIGINT, log_signal);
+	signal(SIGTERM, log_signal);
+#ifdef SIGHUP
+	signal(SIGHUP, log_signal);
+#endif
+}
+
+/**
+ * Format a record with prefix "@<level> <timestamp> [<pid>]: " into the
+ * buffer and write the buffer if required.
+ */
+static void log_record(FILE* stream, char level, int immediate, const char* fmt, va_list args)
+{
+	int n, len;
+	char* rec;
+	const char* ts = GetTimestamp();
+
+	/* Write pending records first if switching streams or running out of space */
+	if (stream != log_stream || log_length + LOG_RECORD_SIZE > LOG_BUFFER_SIZE)
+		log_flush();
+	log_stream = stream;
+	log_fd = fileno(stream);
+	if (log_length == 0)
+		log_first_ms = now_ms;
+
+	rec = log_buffer + log_length;
+	len = snprintf(rec, LOG_RECORD_SIZE, "@%c %s [%d]: ", level, ts, GetPid());
+	if (len < 0 || len >= LOG_RECORD_SIZE)
+		len = 0;
+	n = vsnprintf(rec + len, LOG_RECORD_SIZE - len, fmt, args);
+	if (n < 0 || n >= LOG_RECORD_SIZE - len) { /* Truncated, keep the line terminated */
+		len = LOG_RECORD_SIZE - 1;
+		rec[len - 1] = '\n';
+	} else {
+		len += n;
+	}
+	log_length += len;
+
+	if (immediate || now_ms - log_first_ms >= LOG_FLUSH_INTERVAL)
+		log_flush();
+}
+
 void _log_err(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@E %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_record(stderr, 'E', 1, fmt, args);
 	va_end(args);
 }
 
@@ -116,8 +229,7 @@ void _log_wrn(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "@W %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stderr, fmt, args);
+	log_record(stderr, 'W', 1, fmt, args);
 	va_end(args);
 }
 
@@ -125,7 +237,6 @@ void _log_inf(const char* fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stdout, "@I %s [%d]: ", GetTimestamp(), GetPid());
-	vfprintf(stdout, fmt, args);
+	log_record(stdout, 'I', 0, fmt, args);
 	va_end(args);
 }
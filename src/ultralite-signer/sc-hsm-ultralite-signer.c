@@ -17,6 +17,7 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -124,6 +125,34 @@ void release_lock(void* _fd)
 #endif
 #endif
 
+/**
+ * Escape single quotes in the value of a key='value' log record by doubling
+ * them, so that file names containing a quote keep the record parsable.
+ * The result is in one of two static buffers which are used alternately,
+ * so at most two escaped values can be passed to one log call. Values too
+ * long for the buffer are truncated.
+ */
+static const char* esc(const char* s)
+{
+	static char buf[2][2 * MAX_PATH + 1];
+	static int next;
+	char* r = buf[next];
+	char* d = r;
+	char* end = r + sizeof(buf[0]) - 1;
+
+	next ^= 1;
+	while (*s && d < end) {
+		if (*s == '\'') {
+			if (d + 1 >= end)
+				break;
+			*d++ = '\'';
+		}
+		*d++ = *s++;
+	}
+	*d = 0;
+	return r;
+}
+
 /**
  * Sign the file at the specified path using the private
  * key with the specified label on a token with the specified pin
@@ -141,6 +170,9 @@ static void sign(const char* path, const char* pin, const char* label,
 	char sig_path[MAX_PATH] = "";
 	FILE * fpi = 0, * fpo = 0;
 
+	/* Write buffered records before hashing the file and waiting for the token */
+	log_flush();
+
 	/* Open the data file for reading */
 	fpi = fopen(path, "rb");
 	if (!fpi) {
@@ -250,7 +282,7 @@ static void sign(const char* path, const char* pin, const char* label,
 	fpo = 0;
 
 	/* Success */
-	log_inf("'%s' created", sig_path);
+	log_inf("file='%s' state=signed sig='%s'", esc(path), esc(sig_path));
 	return;
 
 sign_error:
@@ -306,7 +338,7 @@ void sign_file(const char* path, const char* pin, const char* label)
 
 	/* Skip empty files */
 	if (entry_info.st_size <= 0) {
-		log_inf("'%s' empty", path);
+		log_inf("file='%s' state=empty", esc(path));
 		return;
 	}
 
@@ -331,18 +363,18 @@ void sign_file(const char* path, const char* pin, const char* label)
 		offset_t hcl = sizeof(hcl) == 4 ? md.cll : (offset_t)md.clh << 32 | md.cll;
 			if (entry_info.st_size == hcl) {
 				/* Unmodified so skip */
-				log_inf("'%s' unmodified", path);
+				log_inf("file='%s' state=unmodified", esc(path));
 				return;
 			}
 			/* Modified so re-sign the file, using the hash state saved in the metatdata */
-			log_inf("'%s' modified", path);
+			log_inf("file='%s' state=modified", esc(path));
 		}
 		/* Create/re-create sig file */
 		sign(path, pin, label, err ? 0 : &md);
 	} else { /* No sig file found (or err reading it) => create/re-create */
 		int e = errno;
 		if (e == ENOENT) /* A sig file doesn't yet exist, assume file is new */
-			log_inf("'%s' not yet signed", path);
+			log_inf("file='%s' state=new", esc(path));
 		else /* Error accessing an existing sig file */
 			log_err("error accessing sig file '%s': %s; will be re-created", sig_path, strerror(e));
 		/* Create/re-create sig file */
@@ -407,6 +439,30 @@ void sign_files(const char* path, const char* pin, const char* label)
 
 }
 
+/**
+ * Get the log level from SC_HSM_SIGNER_LOG_LEVEL, which is either a number
+ * from 0 (none) to 3 (info) or one of the names none, error, warning, info.
+ * The PKCS#11 module uses SC_HSM_LOG_LEVEL with a different scale, so the
+ * signer has its own variable.
+ */
+static int get_log_level(int default_level)
+{
+	static const char* names[] = { "none", "error", "warning", "info" };
+	const char* str = getenv("SC_HSM_SIGNER_LOG_LEVEL");
+	int i;
+
+	if (!str || !*str)
+		return default_level;
+	if (*str >= '0' && *str <= '9') {
+		i = atoi(str);
+		return i > LOG_LEVEL_INF ? LOG_LEVEL_INF : i;
+	}
+	for (i = LOG_LEVEL_NONE; i <= LOG_LEVEL_INF; i++)
+		if (!strcmp(str, names[i]))
+			return i;
+	return default_level;
+}
+
 int main(int argc, char** argv)
 {
 	int i;
@@ -424,13 +480,19 @@ int main(int argc, char** argv)
 	pin = argv[1];
 	label = argv[2];
 
-	/* Disable buffering on stdout/stderr to prevent mixing the order of
-	   messages to stdout/stderr when redirected to the same log file */
+	/* The log collects info records and writes them in batches (see log.c).
+	   Disable buffering on stdout/stderr so that each batch is written at
+	   once and messages to stdout/stderr keep their order when redirected
+	   to the same log file */
 	setvbuf(stdout, NULL, _IONBF, 0);
 	setvbuf(stderr, NULL, _IONBF, 0);
+	log_init();
+
+	/* Log level 0 (none) to 3 (info, default) */
+	log_level = get_log_level(log_level);
 
 	/* Log the args */
-	log_inf("pin=****; label='%s'", label);
+	log_inf("pin=**** label='%s'", esc(label));
 
 #ifdef CTAPI
 	/* Create a mutex/sem/lock for controlling access to token.
@@ -456,7 +518,7 @@ int main(int argc, char** argv)
 			path[j] = 0;
 
 		/* Log the path */
-		log_inf("path='%s'", path);
+		log_inf("path='%s'", esc(path));
 
 		/* Verify the specified path exists */
 		err = stat(path, &info);
@@ -0,0 +1,474 @@
+/**
+ * SmartCard-HSM Ultra-Light Library Benchmark
+ *
+ * Copyright (c) 2013. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD 3-Clause License. You should have
+ * received a copy of the BSD 3-Clause License along with this program.
+ * If not, see <http://opensource.org/licenses/>
+ *
+ * @file sc-hsm-ultralite-bench.c
+ * @brief Micro- and end-to-end benchmarks for the ultralite hot paths
+ */
+
+/*
+	The benchmark includes the library source directly to reach the static
+	template functions (PatchSignedAttributes, PatchECDSATemplate) and replaces
+	the card access functions from utils.c with a simulated SmartCard-HSM.
+	The simulated token holds one key and one template with the label "bench"
+	and answers ENUMERATE OBJECTS, READ BINARY and the sign commands. An
+	optional per-APDU delay models the transport latency of a real reader.
+
+	No reader and no PC/SC or USB library is needed, so the numbers only
+	reflect host side processing (plus the configured delay).
+
+	All results are written to stdout as CSV with a single header line:
+	bench,param,iterations,total_ns,ns_per_op,mb_per_s,p50_ns,p90_ns,p99_ns,max_ns
+	Columns not applicable to a benchmark are left empty.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <ultralite/sc-hsm-ultralite.c>
+#include <ultralite-signer/metadata.h>
+
+#define BENCH_LABEL "bench"
+#define BENCH_KEY_FID 0x01
+#define BENCH_TEMPLATE_FID 0x01
+
+#define BENCH_SA_OFF 1000
+#define BENCH_SA_LEN 200
+#define BENCH_CMS_LEN 1600
+
+typedef long long nsec_t;
+
+static int apduDelay = 0;   /* simulated transport delay per APDU in microseconds */
+static uint8 simTemplate[TEMPLATE_HEADER_LENGTH + BENCH_CMS_LEN];
+static int simTemplateLen;
+
+
+
+static nsec_t now_ns()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER c;
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&c);
+	return (nsec_t)(c.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (nsec_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+
+static void simulate_transport()
+{
+	if (apduDelay > 0) {
+#ifdef _WIN32
+		Sleep(apduDelay / 1000);
+#else
+		usleep(apduDelay);
+#endif
+	}
+}
+
+
+
+/*******************************************************************************
+ ************************** Simulated SmartCard-HSM ****************************
+ ******************************************************************************/
+
+static int put_descriptor(uint8 *buf, uint8 outerTag)
+{
+	int len = sizeof(BENCH_LABEL) - 1;
+	buf[0] = outerTag;
+	buf[1] = (uint8)(len + 4);
+	buf[2] = 0x30;
+	buf[3] = (uint8)(len + 2);
+	buf[4] = 0x0c;
+	buf[5] = (uint8)len;
+	memcpy(buf + 6, BENCH_LABEL, len);
+	return len + 6;
+}
+
+
+
+static void build_template(int signatureSize)
+{
+	Template_t *t = (Template_t *)simTemplate;
+	uint8 *cms = simTemplate + TEMPLATE_HEADER_LENGTH;
+	int i;
+
+	memset(simTemplate, 0, sizeof(simTemplate));
+	t->Version = TEMPLATE_VERSION;
+	t->HeaderLength = TEMPLATE_HEADER_LENGTH;
+	t->HashLen = 32;
+	t->CertIdOff = 64;
+	t->SignedAttributesOff = BENCH_SA_OFF;
+	t->SignedAttributesLen = BENCH_SA_LEN;
+	t->SigningTimeOff = BENCH_SA_OFF + 40;
+	t->MessageDigestOff = BENCH_SA_OFF + 100;
+	t->SignatureOff = BENCH_CMS_LEN - 256;
+	t->SignatureSize = (uint16)signatureSize;
+	t->CMSLen = (uint16)(t->SignatureOff + signatureSize);
+	simTemplateLen = TEMPLATE_HEADER_LENGTH + t->CMSLen;
+
+	for (i = 0; i < t->CMSLen; i++)
+		cms[i] = (uint8)(i * 31 + 7);
+	cms[BENCH_SA_OFF] = 0xa0;
+
+#ifdef LITTLE_ENDIAN
+#define swap16(field) t->field = t->field >> 8 | t->field << 8;
+	swap16(HashLen)
+	swap16(CertIdOff)
+	swap16(SignedAttributesOff)
+	swap16(SignedAttributesLen)
+	swap16(SigningTimeOff)
+	swap16(MessageDigestOff)
+	swap16(SignatureOff)
+	swap16(SignatureSize)
+	swap16(CMSLen)
+#undef swap16
+#endif
+}
+
+
+
+int SC_Open(const char *pin, const char *reader)
+{
+	simulate_transport();
+	return 0;
+}
+
+
+
+int SC_Close()
+{
+	return 0;
+}
+
+
+
+int SC_Logon(const char *pin)
+{
+	simulate_transport();
+	return 0;
+}
+
+
+
+int SC_ReadFile(uint16 fid, int off, uint8 *data, int dataLen)
+{
+	uint8 desc[64];
+	const uint8 *src;
+	int len;
+
+	simulate_transport();
+	switch (fid) {
+	case 0xC400 | BENCH_KEY_FID:
+		len = put_descriptor(desc, 0xa0);
+		src = desc;
+		break;
+	case 0xC900 | BENCH_TEMPLATE_FID:
+		len = put_descriptor(desc, 0x30);
+		src = desc;
+		break;
+	case 0xCD00 | BENCH_TEMPLATE_FID:
+		len = simTemplateLen;
+		src = simTemplate;
+		break;
+	default:
+		return ERR_APDU;
+	}
+	if (off >= len)
+		return 0;
+	len -= off;
+	if (len > dataLen)
+		len = dataLen;
+	memcpy(data, src + off, len);
+	return len;
+}
+
+
+
+int SC_WriteFile(uint16 fid, int off, uint8 *data, int dataLen)
+{
+	simulate_transport();
+	return ERR_APDU;
+}
+
+
+
+int SC_Sign(uint8 op, uint8 keyFid,
+	uint8 *outBuf, int outLen,
+	uint8 *inBuf, int inSize)
+{
+	static int round;
+	int rl, sl, i;
+
+	simulate_transport();
+	if (op == 0x20) {               /* raw RSA, echo the padded block */
+		if (inSize < outLen)
+			return ERR_INVALID;
+		if (inBuf != outBuf)
+			memcpy(inBuf, outBuf, outLen);
+		return outLen;
+	}
+	if (inSize < 72)
+		return ERR_INVALID;
+	/* ECDSA: vary the length of r and s like a real token does */
+	round++;
+	rl = (round & 1) ? 33 : 32;
+	sl = (round & 2) ? 33 : 31;
+	inBuf[0] = 0x30;
+	inBuf[1] = (uint8)(4 + rl + sl);
+	inBuf[2] = 0x02;
+	inBuf[3] = (uint8)rl;
+	for (i = 0; i < rl; i++)
+		inBuf[4 + i] = (uint8)(i == 0 && rl == 33 ? 0x00 : outBuf[i % outLen] | 0x01);
+	inBuf[4 + rl] = 0x02;
+	inBuf[5 + rl] = (uint8)sl;
+	for (i = 0; i < sl; i++)
+		inBuf[6 + rl + i] = (uint8)(i == 0 && sl == 33 ? 0x00 : outBuf[(i + 7) % outLen] & 0x7f);
+	return 6 + rl + sl;
+}
+
+
+
+int SC_ProcessAPDU(
+	int todad,
+	uint8 cla, uint8 ins, uint8 p1, uint8 p2,
+	uint8 *outData, int outLen,
+	uint8 *inData, int inLen,
+	uint16 *sw1sw2)
+{
+	static const uint8 objects[] = {
+		0xCC, BENCH_KEY_FID, 0xC4, BENCH_KEY_FID,
+		0xCD, BENCH_TEMPLATE_FID, 0xC9, BENCH_TEMPLATE_FID
+	};
+
+	simulate_transport();
+	if (cla == 0x00 && ins == 0x58 && inLen >= (int)sizeof(objects)) {
+		memcpy(inData, objects, sizeof(objects));
+		*sw1sw2 = 0x9000;
+		return sizeof(objects);
+	}
+	*sw1sw2 = 0x6D00;
+	return 0;
+}
+
+
+
+/*******************************************************************************
+ ******************************** Benchmarks ***********************************
+ ******************************************************************************/
+
+static void report(const char *bench, const char *param, long iterations, nsec_t total, long bytesPerOp)
+{
+	double nsPerOp = (double)total / iterations;
+	printf("%s,%s,%ld,%lld,%.1f,", bench, param, iterations, total, nsPerOp);
+	if (bytesPerOp > 0)
+		printf("%.2f", (double)bytesPerOp * iterations / (total / 1e9) / (1024.0 * 1024.0));
+	printf(",,,,\n");
+}
+
+
+
+static int cmp_nsec(const void *a, const void *b)
+{
+	nsec_t x = *(const nsec_t *)a, y = *(const nsec_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+
+static void report_latency(const char *bench, const char *param, nsec_t *samples, long n, nsec_t total)
+{
+	qsort(samples, n, sizeof(*samples), cmp_nsec);
+	printf("%s,%s,%ld,%lld,%.1f,,%lld,%lld,%lld,%lld\n",
+		bench, param, n, total, (double)total / n,
+		samples[n * 50 / 100], samples[n * 90 / 100], samples[n * 99 / 100], samples[n - 1]);
+}
+
+
+
+static void bench_sha256(long budget)
+{
+	static const int sizes[] = { 16, 64, 256, 1024, 8192, 65536 };
+	static uint8 buf[65536];
+	sha256_context ctx;
+	uint8 digest[32];
+	char param[16];
+	nsec_t start;
+	long i, n;
+	int s;
+
+	for (i = 0; i < (long)sizeof(buf); i++)
+		buf[i] = (uint8)i;
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(*sizes)); s++) {
+		n = budget / sizes[s];
+		if (n < 16)
+			n = 16;
+		sha256_starts(&ctx);
+		start = now_ns();
+		for (i = 0; i < n; i++)
+			sha256_update(&ctx, buf, sizes[s]);
+		sha256_finish(&ctx, digest);
+		sprintf(param, "%d", sizes[s]);
+		report("sha256_update", param, n, now_ns() - start, sizes[s]);
+	}
+}
+
+
+
+static int load_bench_template(int signatureSize)
+{
+	release_template();
+	build_template(signatureSize);
+	return LoadTemplate(BENCH_LABEL);
+}
+
+
+
+static void bench_patch(long n)
+{
+	uint8 hash[32], hashToSign[32];
+	nsec_t start;
+	long i;
+	int rc;
+
+	memset(hash, 0x5a, sizeof(hash));
+	if ((rc = load_bench_template(256)) < 0) {
+		fprintf(stderr, "LoadTemplate failed: %d\n", rc);
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		PatchSignedAttributes(hash, sizeof(hash), hashToSign, sizeof(hashToSign));
+	report("PatchSignedAttributes", "", n, now_ns() - start, 0);
+
+	if ((rc = load_bench_template(72)) < 0) {
+		fprintf(stderr, "LoadTemplate failed: %d\n", rc);
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (PatchECDSATemplate(hash, sizeof(hash)) != 72) {
+			fprintf(stderr, "PatchECDSATemplate failed\n");
+			return;
+		}
+	}
+	report("PatchECDSATemplate", "", n, now_ns() - start, 0);
+	release_template();
+}
+
+
+
+static void bench_metadata(long n, const char *path)
+{
+	sha256_context ctx;
+	metadata_t md;
+	nsec_t start;
+	FILE *fp;
+	long i;
+
+	sha256_starts(&ctx);
+	sha256_update(&ctx, (uint8 *)"metadata", 8);
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		fp = fopen(path, "wb");
+		if (!fp || write_metadata(fp, &ctx)) {
+			fprintf(stderr, "error writing '%s'\n", path);
+			if (fp)
+				fclose(fp);
+			return;
+		}
+		fclose(fp);
+	}
+	report("write_metadata", "", n, now_ns() - start, sizeof(metadata_t));
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (read_metadata(path, &md)) {
+			fprintf(stderr, "error reading '%s'\n", path);
+			break;
+		}
+	}
+	report("read_metadata", "", n, now_ns() - start, sizeof(metadata_t));
+	remove(path);
+}
+
+
+
+static void bench_sign_hash2(long n, int signatureSize)
+{
+	const uint8 *pCms;
+	uint8 hash[32];
+	nsec_t *samples, start, t0;
+	char param[32];
+	long i;
+	int rc;
+
+	samples = (nsec_t *)calloc(n, sizeof(*samples));
+	if (samples == 0)
+		return;
+	release_template();
+	build_template(signatureSize);
+	memset(hash, 0xa5, sizeof(hash));
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		hash[i & 31]++;
+		t0 = now_ns();
+		rc = sign_hash2(0, "648219", BENCH_LABEL, hash, sizeof(hash), &pCms);
+		samples[i] = now_ns() - t0;
+		if (rc <= 0) {
+			fprintf(stderr, "sign_hash2 returned %d\n", rc);
+			free(samples);
+			return;
+		}
+	}
+	sprintf(param, "%s/delay=%dus", signatureSize == 256 ? "rsa" : "ecdsa", apduDelay);
+	report_latency("sign_hash2", param, samples, n, now_ns() - start);
+	release_template();
+	free(samples);
+}
+
+
+
+int main(int argc, char **argv)
+{
+	long iterations = argc >= 2 ? atol(argv[1]) : 10000;
+	long signs = argc >= 3 ? atol(argv[2]) : 1000;
+	const char *mdpath = "sc-hsm-ultralite-bench.md";
+
+	if (argc >= 4)
+		apduDelay = atoi(argv[3]);
+	if (iterations <= 0 || signs <= 0) {
+		printf("Usage: [iterations [sign-iterations [apdu-delay-in-microseconds]]]\n");
+		return 1;
+	}
+
+	printf("bench,param,iterations,total_ns,ns_per_op,mb_per_s,p50_ns,p90_ns,p99_ns,max_ns\n");
+	bench_sha256(iterations * 1024);
+	bench_patch(iterations);
+	bench_metadata(iterations / 10 > 0 ? iterations / 10 : 1, mdpath);
+	bench_sign_hash2(signs, 256);
+	bench_sign_hash2(signs, 72);
+	return 0;
+}
@@ -12,17 +12,25 @@
  * @author Keith Morgan
  */
 
+#include "log.h"
+
 #if defined(NO_LOG) /* No Logging */
 
+int log_level = LOG_LEVEL_NONE;
+
 void _log_err(const char* fmt, ...) {}
 void _log_wrn(const char* fmt, ...) {}
 void _log_inf(const char* fmt, ...) {}
+void log_flush(void) {}
+void log_init(void) {}
 
 #else /* Basic Logging */
 
 #include <stdarg.h>
 #include <stdio.h>
 
+int log_level = LOG_LEVEL_INF;
+
 void _log_err(const char* fmt, ...)
 {
 	va_list args;
@@ -47,4 +55,14 @@ void _log_inf(const char* fmt, ...)
 	va_end(args);
 }
 
+void log_flush(void)
+{
+	fflush(stdout);
+	fflush(stderr);
+}
+
+void log_init(void)
+{
+}
+
 #endif
@@ -19,17 +19,26 @@
 extern "C" {
 #endif
 
+/* Log levels; records above log_level are skipped before any formatting */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERR  1
+#define LOG_LEVEL_WRN  2
+#define LOG_LEVEL_INF  3
+
 /* WARNING: These functions are NOT thread-safe. */
+extern int log_level;
 void _log_err(const char* fmt, ...);
 void _log_wrn(const char* fmt, ...);
 void _log_inf(const char* fmt, ...);
+void log_flush(void); /* Write any records still buffered by the log implementation */
+void log_init(void); /* Flush the buffered records at exit and on termination signals */
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define BT " (at '" __FILE__ "':" TOSTRING(__LINE__) ")"
-#define log_err(fmt, ...) _log_err(fmt "%s\n", ##__VA_ARGS__, BT)
-#define log_wrn(fmt, ...) _log_wrn(fmt   "\n", ##__VA_ARGS__)
-#define log_inf(fmt, ...) _log_inf(fmt   "\n", ##__VA_ARGS__) 
+#define log_err(fmt, ...) do { if (log_level >= LOG_LEVEL_ERR) _log_err(fmt "%s\n", ##__VA_ARGS__, BT); } while (0)
+#define log_wrn(fmt, ...) do { if (log_level >= LOG_LEVEL_WRN) _log_wrn(fmt   "\n", ##__VA_ARGS__); } while (0)
+#define log_inf(fmt, ...) do { if (log_level >= LOG_LEVEL_INF) _log_inf(fmt   "\n", ##__VA_ARGS__); } while (0)
 
 #ifdef __cplusplus
 }